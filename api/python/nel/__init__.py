@@ -4,6 +4,7 @@ from . import environment
 from . import environments
 from . import item
 from . import simulator
+from . import trajectory
 from . import visualizer
 
 from .agent import *
@@ -11,12 +12,14 @@ from .direction import *
 from .environment import *
 from .item import *
 from .simulator import *
+from .trajectory import *
 from .visualizer import *
 
-__all__ = ['agent', 'direction', 'environment', 'item', 'simulator']
+__all__ = ['agent', 'direction', 'environment', 'item', 'simulator', 'trajectory']
 __all__.extend(agent.__all__)
 __all__.extend(direction.__all__)
 __all__.extend(environment.__all__)
 __all__.extend(item.__all__)
 __all__.extend(simulator.__all__)
+__all__.extend(trajectory.__all__)
 __all__.extend(visualizer.__all__)
@@ -14,14 +14,14 @@ import numpy as np
 
 from .agent import Agent
 from .direction import RelativeDirection
-from .simulator import Simulator
+from .simulator import Simulator, SimulatorBatch
 from .visualizer import MapVisualizer
 
 
 if not modules_loaded:
   __all__ = []
 else:
-  __all__ = ['NELEnv']
+  __all__ = ['NELEnv', 'NELVectorEnv']
 
   class NELEnv(gym.Env):
     """NEL environment for OpenAI gym.
@@ -216,6 +216,111 @@ else:
         'initialized.', self)
       return
 
+  class NELVectorEnv(object):
+    """Vectorized NEL environment, which steps `num_envs`
+    copies of `NELEnv` together in native threads, using a
+    `SimulatorBatch`.
+
+    The actions and observations are those of `NELEnv`,
+    stacked along a new first dimension of size 
+    `num_envs`. Rendering is not supported.
+
+    ```
+    env = nel.NELVectorEnv(sim_config, reward_fn, num_envs=16)
+    observation = env.reset()
+    for t in range(10000):
+      actions = env.action_space.sample()
+      observation, rewards, _, _ = env.step(actions)
+    ```
+    """
+
+    def __init__(self, sim_config, reward_fn, num_envs):
+      """Creates a new vectorized NEL environment.
+
+      Arguments:
+        sim_config(SimulatorConfig) Simulator configuration
+                                    to use. Environment `i`
+                                    is seeded with
+                                    `sim_config.seed + i`.
+        reward_fn(callable)         As in `NELEnv`.
+        num_envs(int)               Number of environments.
+      """
+      self.sim_config = sim_config
+      self.num_envs = num_envs
+      self._reward_fn = reward_fn
+      self._batch = SimulatorBatch(sim_config, num_envs)
+
+      scent_shape = [len(self.sim_config.items[0].scent)]
+      vision_dim = len(self.sim_config.items[0].color)
+      vision_range = self.sim_config.vision_range
+      vision_shape = [
+        2 * vision_range + 1, 
+        2 * vision_range + 1, 
+        vision_dim]
+      min_float = np.finfo(np.float32).min
+      max_float = np.finfo(np.float32).max
+      self.single_observation_space = spaces.Dict({
+        'scent': spaces.Box(
+          low=min_float * np.ones(scent_shape),
+          high=max_float * np.ones(scent_shape)),
+        'vision': spaces.Box(
+          low=min_float * np.ones(vision_shape),
+          high=max_float * np.ones(vision_shape)),
+        'moved': spaces.Discrete(2)})
+      self.single_action_space = spaces.Discrete(3)
+      self.action_space = spaces.MultiDiscrete(
+        [3] * num_envs)
+
+    def step(self, actions):
+      """Runs a simulation step in every environment.
+
+      Arguments:
+        actions(array) Integer array with shape 
+                       `[num_envs]` containing the action
+                       of each environment (see `NELEnv`).
+
+      Returns:
+        observation (dictionary): The observations of 
+            `NELEnv`, each with a leading dimension of 
+            size `num_envs`.
+        rewards (array): Reward of each environment.
+        dones (array): Always `False` for every 
+            environment.
+        infos (list): An empty dictionary per environment.
+      """
+      prev_items = self._batch.observations()[4][:, 0].copy()
+      self._batch.step(
+        np.asarray(actions).reshape(self.num_envs, 1))
+      observation = self._observation()
+      items = self._batch.observations()[4][:, 0]
+      rewards = np.array([
+        self._reward_fn(prev_items[i], items[i])
+        for i in range(self.num_envs)])
+      dones = np.zeros(self.num_envs, dtype=np.bool_)
+      return observation, rewards, dones, [{}] * self.num_envs
+
+    def reset(self):
+      """Resets every environment, each with a new 
+      seed."""
+      for i in range(self.num_envs):
+        self._batch.reset(i)
+      return self._observation()
+
+    def close(self):
+      """Deletes the underlying simulators."""
+      del self._batch
+      return
+
+    def _observation(self):
+      # The arrays of the batch are overwritten by the
+      # next step, so the observations are copied.
+      (_, _, scent, vision, _, moved) = \
+        self._batch.observations()
+      return {
+        'scent': scent[:, 0].copy(),
+        'vision': vision[:, 0].copy(),
+        'moved': moved[:, 0].copy()}
+
 
 class _NELEnvAgent(Agent):
   """Helper class for the NEL environment, that represents
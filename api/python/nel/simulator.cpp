@@ -7,6 +7,7 @@
 #include "nel/gibbs_field.h"
 #include "nel/mpi.h"
 #include "nel/simulator.h"
+#include "nel/simulator_batch.h"
 
 namespace nel {
 
@@ -25,6 +26,293 @@ static PyObject* add_agent_error;
 static PyObject* mpi_error;
 
 
+/* the suffixes of the base snapshot and the delta file of the checkpoints in a save directory */
+static const char* CHECKPOINT_BASE_SUFFIX = "checkpoint";
+static const char* CHECKPOINT_DELTA_SUFFIX = "checkpoint.delta";
+
+/**
+ * Returns a new null-terminated string, allocated with `malloc`, containing
+ * the first `prefix_length` characters of `prefix` followed by `suffix`, or
+ * NULL if there is insufficient memory.
+ */
+static char* concat_filepath(const char* prefix, unsigned int prefix_length, const char* suffix)
+{
+    size_t suffix_length = strlen(suffix);
+    char* filepath = (char*) malloc(sizeof(char) * (prefix_length + suffix_length + 1));
+    if (filepath == NULL) return NULL;
+    memcpy(filepath, prefix, sizeof(char) * prefix_length);
+    memcpy(filepath + prefix_length, suffix, sizeof(char) * (suffix_length + 1));
+    return filepath;
+}
+
+/**
+ * A copy of the state of the agents owned by a simulator after a completed
+ * step, from which the Python objects for the step callback are constructed
+ * once the simulator is unlocked (see `step_notifier`). The scent, vision,
+ * and collected items of the agent at index `i` of `agent_ids` begin at
+ * `i*config.scent_dimension`, `i*vision_size`, and
+ * `i*config.item_types.length` of the respective arrays.
+ */
+struct step_snapshot
+{
+    uint64_t time;
+    bool saved;
+    array<uint64_t> agent_ids;
+    array<position> positions;
+    array<direction> directions;
+    array<float> scent;
+    array<float> vision;
+    array<unsigned int> collected_items;
+
+    static inline void free(step_snapshot& snapshot) {
+        core::free(snapshot.agent_ids);
+        core::free(snapshot.positions);
+        core::free(snapshot.directions);
+        core::free(snapshot.scent);
+        core::free(snapshot.vision);
+        core::free(snapshot.collected_items);
+    }
+};
+
+inline bool init(step_snapshot& snapshot) {
+    if (!array_init(snapshot.agent_ids, 16)) {
+        return false;
+    } else if (!array_init(snapshot.positions, 16)) {
+        free(snapshot.agent_ids); return false;
+    } else if (!array_init(snapshot.directions, 16)) {
+        free(snapshot.agent_ids); free(snapshot.positions); return false;
+    } else if (!array_init(snapshot.scent, 16)) {
+        free(snapshot.agent_ids); free(snapshot.positions);
+        free(snapshot.directions); return false;
+    } else if (!array_init(snapshot.vision, 16)) {
+        free(snapshot.agent_ids); free(snapshot.positions);
+        free(snapshot.directions); free(snapshot.scent); return false;
+    } else if (!array_init(snapshot.collected_items, 16)) {
+        free(snapshot.agent_ids); free(snapshot.positions); free(snapshot.directions);
+        free(snapshot.scent); free(snapshot.vision); return false;
+    }
+    return true;
+}
+
+/**
+ * Copies the state of the agents with the given `agent_ids` into `snapshot`.
+ *
+ * \returns `true` if successful; `false` if there is insufficient memory.
+ */
+bool copy(step_snapshot& snapshot,
+        const array<agent_state*>& agents,
+        const array<uint64_t>& agent_ids,
+        const simulator_config& config,
+        uint64_t time, bool saved)
+{
+    size_t agent_count = agent_ids.length;
+    size_t vision_size = (2*config.vision_range + 1) * (2*config.vision_range + 1) * config.color_dimension;
+    if (!snapshot.agent_ids.ensure_capacity(agent_count)
+     || !snapshot.positions.ensure_capacity(agent_count)
+     || !snapshot.directions.ensure_capacity(agent_count)
+     || !snapshot.scent.ensure_capacity(agent_count * config.scent_dimension)
+     || !snapshot.vision.ensure_capacity(agent_count * vision_size)
+     || !snapshot.collected_items.ensure_capacity(agent_count * config.item_types.length))
+    {
+        fprintf(stderr, "copy ERROR: Insufficient memory for step_snapshot.\n");
+        return false;
+    }
+
+    snapshot.time = time;
+    snapshot.saved = saved;
+    for (size_t i = 0; i < agent_count; i++) {
+        const agent_state& agent = *agents[(size_t) agent_ids[i]];
+        snapshot.agent_ids[i] = agent_ids[i];
+        snapshot.positions[i] = agent.current_position;
+        snapshot.directions[i] = agent.current_direction;
+        memcpy(snapshot.scent.data + i * config.scent_dimension,
+                agent.current_scent, sizeof(float) * config.scent_dimension);
+        memcpy(snapshot.vision.data + i * vision_size,
+                agent.current_vision, sizeof(float) * vision_size);
+        memcpy(snapshot.collected_items.data + i * config.item_types.length,
+                agent.collected_items, sizeof(unsigned int) * config.item_types.length);
+    }
+    snapshot.agent_ids.length = agent_count;
+    snapshot.positions.length = agent_count;
+    snapshot.directions.length = agent_count;
+    snapshot.scent.length = agent_count * config.scent_dimension;
+    snapshot.vision.length = agent_count * vision_size;
+    snapshot.collected_items.length = agent_count * config.item_types.length;
+    return true;
+}
+
+/* defined below, along with the other functions that construct agent tuples */
+static PyObject* build_py_agent(const step_snapshot& snapshot, size_t index, const simulator_config& config);
+
+/**
+ * Invokes the Python step callback on a dedicated thread, so that neither
+ * the construction of the Python objects nor the callback itself (which may
+ * save the agents to file) is done while the simulator is locked. `on_step`
+ * copies the completed step into one of the two `buffers` and returns,
+ * while the notifier thread constructs the Python objects from the other
+ * buffer. The steps are delivered in order, and if the callback falls two
+ * steps behind, `on_step` waits for it to catch up, so that no step is
+ * dropped.
+ */
+struct step_notifier
+{
+    step_snapshot buffers[2];
+
+    /* the buffer that the next step is copied into, protected by `lock` */
+    unsigned int next;
+
+    /* the number of buffers whose steps were not yet delivered, protected by `lock` */
+    unsigned int pending;
+
+    /* whether the callback is being invoked, protected by `lock` */
+    bool delivering;
+
+    bool running;
+    const simulator_config* config;
+    PyObject* callback;
+
+    std::thread thread;
+    std::mutex lock;
+    std::condition_variable pending_cv;
+    std::condition_variable done_cv;
+
+    /**
+     * Copies the completed step into the next buffer and wakes the notifier
+     * thread. This is called by `on_step` while the simulator is locked.
+     */
+    bool publish(const array<agent_state*>& agents,
+            const array<uint64_t>& agent_ids, uint64_t time, bool saved)
+    {
+        std::unique_lock<std::mutex> lck(lock);
+        while (pending == 2)
+            done_cv.wait(lck);
+        step_snapshot& snapshot = buffers[next];
+        lck.unlock();
+
+        /* the notifier thread only reads the other buffer while `pending < 2` */
+        if (!copy(snapshot, agents, agent_ids, *config, time, saved))
+            return false;
+
+        lck.lock();
+        next ^= 1;
+        pending++;
+        pending_cv.notify_one();
+        return true;
+    }
+
+    /* waits until every published step was delivered to the callback */
+    void flush() {
+        std::unique_lock<std::mutex> lck(lock);
+        while (pending > 0 || delivering)
+            done_cv.wait(lck);
+    }
+
+    /**
+     * Delivers the remaining steps and stops the notifier thread. The caller
+     * must not hold the global interpreter lock.
+     */
+    static inline void free(step_notifier& notifier) {
+        std::unique_lock<std::mutex> lck(notifier.lock);
+        notifier.running = false;
+        notifier.pending_cv.notify_one();
+        lck.unlock();
+        if (notifier.thread.joinable()) {
+            try {
+                notifier.thread.join();
+            } catch (...) { }
+        }
+
+        core::free(notifier.buffers[0]);
+        core::free(notifier.buffers[1]);
+        notifier.thread.~thread();
+        notifier.lock.~mutex();
+        notifier.pending_cv.~condition_variable();
+        notifier.done_cv.~condition_variable();
+    }
+
+private:
+    void run() {
+        while (true) {
+            std::unique_lock<std::mutex> lck(lock);
+            while (running && pending == 0)
+                pending_cv.wait(lck);
+            if (pending == 0) return;
+            const step_snapshot& snapshot = buffers[(next + 2 - pending) % 2];
+            delivering = true;
+            lck.unlock();
+
+            PyGILState_STATE gstate;
+            gstate = PyGILState_Ensure(); /* acquire global interpreter lock */
+            PyObject* py_states = PyList_New(snapshot.agent_ids.length);
+            if (py_states == NULL) {
+                fprintf(stderr, "step_notifier.run ERROR: PyList_New returned NULL.\n");
+            } else {
+                for (size_t i = 0; i < snapshot.agent_ids.length; i++)
+                    PyList_SetItem(py_states, i, build_py_agent(snapshot, i, *config));
+            }
+            PyObject* py_saved = snapshot.saved ? Py_True : Py_False;
+
+            /* the buffer is no longer needed, so let `on_step` reuse it while the callback runs */
+            lck.lock();
+            pending--;
+            done_cv.notify_all();
+            lck.unlock();
+
+            if (py_states != NULL) {
+                Py_INCREF(py_saved);
+                PyObject* args = Py_BuildValue("(NO)", py_states, py_saved);
+                PyObject* result = PyEval_CallObject(callback, args);
+                Py_DECREF(args);
+                if (result != NULL)
+                    Py_DECREF(result);
+            }
+            PyGILState_Release(gstate); /* release global interpreter lock */
+
+            lck.lock();
+            delivering = false;
+            done_cv.notify_all();
+        }
+    }
+
+    friend bool init(step_notifier&, const simulator_config&, PyObject*);
+};
+
+/**
+ * Initializes `notifier` and starts its thread, which invokes `callback`
+ * with the agent states of each published step of a simulator with the
+ * given `config`. Both `config` and `callback` must outlive `notifier`.
+ *
+ * \returns `true` if successful; `false` otherwise.
+ */
+bool init(step_notifier& notifier, const simulator_config& config, PyObject* callback)
+{
+    if (!init(notifier.buffers[0])) {
+        return false;
+    } else if (!init(notifier.buffers[1])) {
+        free(notifier.buffers[0]); return false;
+    }
+    notifier.next = 0;
+    notifier.pending = 0;
+    notifier.delivering = false;
+    notifier.running = true;
+    notifier.config = &config;
+    notifier.callback = callback;
+    new (&notifier.lock) std::mutex();
+    new (&notifier.pending_cv) std::condition_variable();
+    new (&notifier.done_cv) std::condition_variable();
+    try {
+        new (&notifier.thread) std::thread(&step_notifier::run, &notifier);
+    } catch (...) {
+        fprintf(stderr, "init ERROR: Unable to start the step_notifier thread.\n");
+        free(notifier.buffers[0]); free(notifier.buffers[1]);
+        notifier.lock.~mutex();
+        notifier.pending_cv.~condition_variable();
+        notifier.done_cv.~condition_variable();
+        return false;
+    }
+    return true;
+}
+
 /**
  * A struct containing additional state information for the simulator. This
  * information includes a pointer to the `async_server` object, if the
@@ -40,16 +328,50 @@ struct py_simulator_data
     async_server* server;
     PyObject* callback;
 
+    /**
+     * If `true`, the step callback receives the positions and directions of
+     * the agents as arrays, and their scent, vision, and collected items are
+     * read from the simulator's observation buffers (see
+     * `simulator_observations`) rather than copied for every agent.
+     */
+    bool batched_observations;
+
+    /**
+     * The capacity of the observation buffers when views of them were last
+     * passed to the step callback in batched mode (see
+     * `build_py_agent_batch`), or 0 if they never were. This is only
+     * accessed by the step callback, under the lock of the simulator.
+     */
+    mutable size_t published_capacity;
+
     /* agents owned by the simulator */
     array<uint64_t> agent_ids;
 
+    /**
+     * Writes the checkpoints of the simulator to `save_directory` (see
+     * `save`). This is only created for the `py_simulator_data` owned by a
+     * simulator, and is NULL if `save_directory` is NULL.
+     */
+    checkpointer* checkpoints;
+
+    /**
+     * If not NULL, the step callback is invoked asynchronously by this
+     * notifier (see `simulator_set_asynchronous_callbacks`). This is only
+     * created for the `py_simulator_data` owned by a simulator.
+     */
+    step_notifier* notifier;
+
+    /* the number of deltas after which the checkpoint is compacted into a new base */
+    static constexpr unsigned int COMPACTION_FREQUENCY = 16;
+
     py_simulator_data(const char* save_filepath,
             unsigned int save_filepath_length,
             unsigned int save_frequency,
             async_server* server,
             PyObject* callback) :
         save_frequency(save_frequency), server(server),
-        callback(callback), agent_ids(16)
+        callback(callback), batched_observations(false), published_capacity(0), agent_ids(16),
+        checkpoints(NULL), notifier(NULL)
     {
         if (save_filepath == NULL) {
             save_directory = NULL;
@@ -75,6 +397,16 @@ struct py_simulator_data
 
 private:
     inline void free_helper() {
+        if (notifier != NULL) {
+            /* this delivers the remaining steps to the callback */
+            core::free(*notifier);
+            core::free(notifier);
+        }
+        if (checkpoints != NULL) {
+            /* this waits for the pending checkpoints to be written */
+            core::free(*checkpoints);
+            core::free(checkpoints);
+        }
         if (save_directory != NULL)
             core::free(save_directory);
         if (callback != NULL)
@@ -108,9 +440,34 @@ inline bool init(py_simulator_data& data, const py_simulator_data& src)
     } else {
         data.save_directory = NULL;
     }
+
+    data.checkpoints = NULL;
+    data.notifier = NULL;
+    if (src.save_directory != NULL) {
+        char* base_filepath = concat_filepath(src.save_directory, src.save_directory_length, CHECKPOINT_BASE_SUFFIX);
+        char* delta_filepath = concat_filepath(src.save_directory, src.save_directory_length, CHECKPOINT_DELTA_SUFFIX);
+        data.checkpoints = (checkpointer*) malloc(sizeof(checkpointer));
+        if (base_filepath == NULL || delta_filepath == NULL || data.checkpoints == NULL) {
+            fprintf(stderr, "init ERROR: Insufficient memory for py_simulator_data.checkpoints.\n");
+            if (base_filepath != NULL) free(base_filepath);
+            if (delta_filepath != NULL) free(delta_filepath);
+            if (data.checkpoints != NULL) free(data.checkpoints);
+            free(data.save_directory); free(data.agent_ids);
+            return false;
+        }
+        bool success = init<item>(*data.checkpoints, base_filepath,
+                delta_filepath, py_simulator_data::COMPACTION_FREQUENCY);
+        free(base_filepath); free(delta_filepath);
+        if (!success) {
+            free(data.checkpoints); free(data.save_directory);
+            free(data.agent_ids); return false;
+        }
+    }
     data.save_frequency = src.save_frequency;
     data.server = src.server;
     data.callback = src.callback;
+    data.batched_observations = src.batched_observations;
+    data.published_capacity = 0;
     Py_INCREF(data.callback);
     return true;
 }
@@ -125,8 +482,10 @@ struct py_client_data {
     /* storing the server responses */
     union response {
         bool action_result;
+        bool* action_results;
         PyObject* agent_states;
         hash_map<position, patch_state>* map;
+        stats_snapshot* stats;
     } response;
 
     /* for synchronization */
@@ -181,52 +540,44 @@ static pair<float*, Py_ssize_t> PyArg_ParseFloatList(PyObject* arg, Py_ssize_t s
 }
 
 /**
- * Saves the simulator given by the specified pointer `sim` to the filepath
- * specified by the `py_simulator_data` structure inside `sim`.
+ * Writes the IDs of the agents owned by the simulator into the state section
+ * of its snapshots and checkpoints.
+ */
+struct agent_id_writer {
+    const array<uint64_t>& agent_ids;
+
+    template<typename Stream>
+    inline bool operator () (Stream& out) const {
+        return write(agent_ids.length, out)
+            && write(agent_ids.data, out, agent_ids.length);
+    }
+};
+
+/**
+ * Writes a checkpoint of the simulator given by the specified pointer `sim`
+ * to the directory specified by the `py_simulator_data` structure inside
+ * `sim` (see `checkpoint`). The first checkpoint writes the full simulator
+ * as a snapshot to `CHECKPOINT_BASE_SUFFIX` in that directory. Later ones
+ * only copy the patches that changed, which a background thread appends to
+ * `CHECKPOINT_DELTA_SUFFIX`, so this function returns before the changes
+ * are written. `simulator_load` restores the simulator from both files.
  *
  * \param   sim     The simulator to save.
- * \param   time    The simulation time of `sim`.
  * \returns `true` if successful; and `false` otherwise.
  */
-bool save(const simulator<py_simulator_data>* sim, uint64_t time)
+bool save(const simulator<py_simulator_data>* sim)
 {
-    int length = snprintf(NULL, 0, "%" PRIu64, time);
-    if (length < 0) {
-        fprintf(stderr, "on_step ERROR: Error computing filepath to save simulation.\n");
-        return false;
-    }
-
     const py_simulator_data& data = sim->get_data();
-    char* filepath = (char*) malloc(sizeof(char) * (data.save_directory_length + length + 1));
-    if (filepath == NULL) {
-        fprintf(stderr, "on_step ERROR: Insufficient memory for filepath.\n");
-        return false;
-    }
-
-    for (unsigned int i = 0; i < data.save_directory_length; i++)
-        filepath[i] = data.save_directory[i];
-    snprintf(filepath + data.save_directory_length, length + 1, "%" PRIu64, time);
-
-    FILE* file = open_file(filepath, "wb");
-    if (file == NULL) {
-        fprintf(stderr, "on_step: Unable to open '%s' for writing. ", filepath);
-        perror(""); return false;
-    }
-
-    fixed_width_stream<FILE*> out(file);
-    bool result = write(*sim, out)
-               && write(data.agent_ids.length, out)
-               && write(data.agent_ids.data, out, data.agent_ids.length);
-    fclose(file);
-    return result;
+    agent_id_writer write_agent_ids = {data.agent_ids};
+    return checkpoint(*data.checkpoints, *sim, write_agent_ids);
 }
 
 /**
  * Constructs the Python objects `py_position`, `py_scent`, `py_vision`, and
- * `py_items` and stores the state of the given `agent`.
+ * `py_items` and stores the state of an agent, given by its `current_position`,
+ * `current_direction`, `current_scent`, `current_vision`, and
+ * `collected_items` (see the fields of `agent_state` with the same names).
  *
- * \param   agent       The agent whose state is copied into the Python
- *                      objects.
  * \param   config      The configuration of the simulator containing `agent`.
  * \param   py_position An output numpy array of type int64 that will contain
  *                      the position of `agent`.
@@ -245,7 +596,11 @@ bool save(const simulator<py_simulator_data>* sim, uint64_t time)
  *          uninitialized.
  */
 static inline bool build_py_agent(
-        const agent_state& agent,
+        const position& current_position,
+        direction current_direction,
+        const float* current_scent,
+        const float* current_vision,
+        const unsigned int* collected_items,
         const simulator_config& config,
         PyObject*& py_position,
         PyObject*& py_direction,
@@ -253,7 +608,7 @@ static inline bool build_py_agent(
         PyObject*& py_vision,
         PyObject*& py_items)
 {
-    /* first copy all arrays in 'agent' */
+    /* first copy all arrays of the agent */
     int64_t* positions = (int64_t*) malloc(sizeof(int64_t) * 2);
     if (positions == NULL) {
         PyErr_NoMemory();
@@ -276,14 +631,14 @@ static inline bool build_py_agent(
         return false;
     }
 
-    positions[0] = agent.current_position.x;
-    positions[1] = agent.current_position.y;
+    positions[0] = current_position.x;
+    positions[1] = current_position.y;
     for (unsigned int i = 0; i < config.scent_dimension; i++)
-        scent[i] = agent.current_scent[i];
+        scent[i] = current_scent[i];
     for (unsigned int i = 0; i < vision_size; i++)
-        vision[i] = agent.current_vision[i];
+        vision[i] = current_vision[i];
     for (unsigned int i = 0; i < config.item_types.length; i++)
-        items[i] = agent.collected_items[i];
+        items[i] = collected_items[i];
 
     npy_intp pos_dim[] = {2};
     npy_intp scent_dim[] = {(npy_intp) config.scent_dimension};
@@ -293,7 +648,7 @@ static inline bool build_py_agent(
             (npy_intp) config.color_dimension};
     npy_intp items_dim[] = {(npy_intp) config.item_types.length};
     py_position = PyArray_SimpleNewFromData(1, pos_dim, NPY_INT64, positions);
-    py_direction = PyLong_FromSize_t((size_t) agent.current_direction);
+    py_direction = PyLong_FromSize_t((size_t) current_direction);
     py_scent = PyArray_SimpleNewFromData(1, scent_dim, NPY_FLOAT, scent);
     py_vision = PyArray_SimpleNewFromData(3, vision_dim, NPY_FLOAT, vision);
     py_items = PyArray_SimpleNewFromData(1, items_dim, NPY_UINT64, items);
@@ -318,7 +673,8 @@ static PyObject* build_py_agent(
 {
     PyObject* py_position; PyObject* py_direction;
     PyObject* py_scent; PyObject* py_vision; PyObject* py_items;
-    if (!build_py_agent(agent, config, py_position, py_direction, py_scent, py_vision, py_items))
+    if (!build_py_agent(agent.current_position, agent.current_direction, agent.current_scent,
+            agent.current_vision, agent.collected_items, config, py_position, py_direction, py_scent, py_vision, py_items))
         return NULL;
     return Py_BuildValue("(OOOOOO)", py_position, py_direction, py_scent, py_vision, py_items, PyLong_FromUnsignedLongLong(agent_id));
 }
@@ -339,18 +695,166 @@ static PyObject* build_py_agent(
 {
     PyObject* py_position; PyObject* py_direction;
     PyObject* py_scent; PyObject* py_vision; PyObject* py_items;
-    if (!build_py_agent(agent, config, py_position, py_direction, py_scent, py_vision, py_items))
+    if (!build_py_agent(agent.current_position, agent.current_direction, agent.current_scent,
+            agent.current_vision, agent.collected_items, config, py_position, py_direction, py_scent, py_vision, py_items))
         return NULL;
     return Py_BuildValue("(OOOOO)", py_position, py_direction, py_scent, py_vision, py_items);
 }
 
+/**
+ * Constructs a Python tuple containing the position, current scent perception,
+ * current visual perception, the collected item counts, and the ID of the
+ * agent at the given `index` of `snapshot`, in the same format as
+ * `build_py_agent(const agent_state&, const simulator_config&, uint64_t)`.
+ */
+static PyObject* build_py_agent(
+        const step_snapshot& snapshot, size_t index,
+        const simulator_config& config)
+{
+    size_t vision_size = (2*config.vision_range + 1) * (2*config.vision_range + 1) * config.color_dimension;
+    PyObject* py_position; PyObject* py_direction;
+    PyObject* py_scent; PyObject* py_vision; PyObject* py_items;
+    if (!build_py_agent(snapshot.positions[index], snapshot.directions[index],
+            snapshot.scent.data + index * config.scent_dimension,
+            snapshot.vision.data + index * vision_size,
+            snapshot.collected_items.data + index * config.item_types.length,
+            config, py_position, py_direction, py_scent, py_vision, py_items))
+        return NULL;
+    return Py_BuildValue("(OOOOOO)", py_position, py_direction, py_scent, py_vision, py_items,
+            PyLong_FromUnsignedLongLong(snapshot.agent_ids[index]));
+}
+
+/* releases the reference to a shared_block held by the capsule `py_capsule` */
+static void release_shared_block(PyObject* py_capsule) {
+    release((shared_block*) PyCapsule_GetPointer(py_capsule, "nel.shared_block"));
+}
+
+/**
+ * Creates a NumPy array that views `data`, which lies within the given
+ * `block`. The array holds its own reference to `block` (through a capsule
+ * set as its base object), so the data remains readable for the lifetime of
+ * the array, even after the owner of `block` releases it.
+ */
+static PyObject* new_shared_array(int nd, npy_intp* dims,
+        int type, void* data, shared_block* block)
+{
+    PyObject* py_array = PyArray_SimpleNewFromData(nd, dims, type, data);
+    if (py_array == NULL) return NULL;
+    PyObject* py_base = PyCapsule_New(block, "nel.shared_block", release_shared_block);
+    if (py_base == NULL) {
+        Py_DECREF(py_array); return NULL;
+    }
+    retain(block);
+    /* this steals the reference to `py_base`, even if it fails */
+    if (PyArray_SetBaseObject((PyArrayObject*) py_array, py_base) != 0) {
+        Py_DECREF(py_array); return NULL;
+    }
+    return py_array;
+}
+
+/**
+ * Constructs the views `(scent, vision, items)` of the observation buffers
+ * `scent`, `vision`, and `items`, contained in `block`, of the `agent_count`
+ * agents of a simulator with the given `config` (see
+ * `simulator_observations`). Each view retains `block`.
+ *
+ * \returns A Python tuple of the three arrays, or `NULL` upon failure.
+ */
+static PyObject* build_py_observations(float* scent, float* vision,
+        unsigned int* items, shared_block* block, size_t agent_count,
+        const simulator_config& config)
+{
+    npy_intp scent_dim[] = {(npy_intp) agent_count, (npy_intp) config.scent_dimension};
+    npy_intp vision_dim[] = {(npy_intp) agent_count,
+            2 * (npy_intp) config.vision_range + 1,
+            2 * (npy_intp) config.vision_range + 1,
+            (npy_intp) config.color_dimension};
+    npy_intp items_dim[] = {(npy_intp) agent_count, (npy_intp) config.item_types.length};
+    PyObject* py_scent = new_shared_array(2, scent_dim, NPY_FLOAT, scent, block);
+    PyObject* py_vision = new_shared_array(4, vision_dim, NPY_FLOAT, vision, block);
+    PyObject* py_items = new_shared_array(2, items_dim, NPY_UINT32, items, block);
+    if (py_scent == NULL || py_vision == NULL || py_items == NULL) {
+        Py_XDECREF(py_scent); Py_XDECREF(py_vision); Py_XDECREF(py_items);
+        return NULL;
+    }
+    return Py_BuildValue("(NNN)", py_scent, py_vision, py_items);
+}
+
+/**
+ * Constructs NumPy arrays containing the IDs, positions, and directions of
+ * the agents with the given `agent_ids`, along with the current capacity of
+ * the observation buffers of `sim`, for the step callback in batched mode.
+ * If the buffers were reallocated since views of them were last passed to
+ * the callback, new views are included, since the callback cannot retrieve
+ * them with `simulator_observations` while the simulator is locked.
+ *
+ * \returns A Python tuple `(ids, positions, directions, capacity,
+ *          observations)`, where `ids` has shape `(len(agent_ids),)` and type
+ *          uint64, `positions` has shape `(len(agent_ids), 2)` and type
+ *          int64, `directions` has shape `(len(agent_ids),)` and type int64,
+ *          and `observations` is either `None` or a tuple `(scent, vision,
+ *          items)` as returned by `simulator_observations`. `NULL` is
+ *          returned upon failure.
+ */
+static PyObject* build_py_agent_batch(
+        const simulator<py_simulator_data>* sim,
+        const array<agent_state*>& agents,
+        const array<uint64_t>& agent_ids)
+{
+    npy_intp pos_dim[] = {(npy_intp) agent_ids.length, 2};
+    npy_intp dir_dim[] = {(npy_intp) agent_ids.length};
+    PyObject* py_positions = PyArray_SimpleNew(2, pos_dim, NPY_INT64);
+    if (py_positions == NULL) return NULL;
+    PyObject* py_directions = PyArray_SimpleNew(1, dir_dim, NPY_INT64);
+    if (py_directions == NULL) {
+        Py_DECREF(py_positions); return NULL;
+    }
+    PyObject* py_ids = PyArray_SimpleNew(1, dir_dim, NPY_UINT64);
+    if (py_ids == NULL) {
+        Py_DECREF(py_positions); Py_DECREF(py_directions);
+        return NULL;
+    }
+
+    uint64_t* ids = (uint64_t*) PyArray_DATA((PyArrayObject*) py_ids);
+    int64_t* positions = (int64_t*) PyArray_DATA((PyArrayObject*) py_positions);
+    int64_t* directions = (int64_t*) PyArray_DATA((PyArrayObject*) py_directions);
+    for (size_t i = 0; i < agent_ids.length; i++) {
+        const agent_state& agent = *agents[(size_t) agent_ids[i]];
+        positions[2*i] = agent.current_position.x;
+        positions[2*i + 1] = agent.current_position.y;
+        directions[i] = (int64_t) agent.current_direction;
+        ids[i] = agent_ids[i];
+    }
+    /* this is called from the step callback, so the simulator is already locked */
+    const agent_observation_buffers& observations = sim->get_observations();
+    const py_simulator_data& data = sim->get_data();
+    PyObject* py_observations;
+    if (observations.capacity == data.published_capacity) {
+        py_observations = Py_None;
+        Py_INCREF(py_observations);
+    } else {
+        py_observations = build_py_observations(observations.scent, observations.vision,
+                observations.items, observations.block, agents.length, sim->get_config());
+        if (py_observations == NULL) {
+            Py_DECREF(py_ids); Py_DECREF(py_positions); Py_DECREF(py_directions);
+            return NULL;
+        }
+        data.published_capacity = observations.capacity;
+    }
+    PyObject* py_batch = Py_BuildValue("(NNNKN)", py_ids, py_positions, py_directions,
+            (unsigned long long) observations.capacity, py_observations);
+    return py_batch;
+}
+
 /**
  * The callback function invoked by the simulator when time is advanced. This
  * function is only called if the simulator is run in locally or as a server.
  * This function first checks if the simulator should be saved to file. Next,
  * in server mode, the simulator sends a step response message to all connected
  * clients. Finally, it constructs a Python list of agent states and invokes
- * the Python callback in `data.callback`.
+ * the Python callback in `data.callback`. If `data.notifier` is not NULL,
+ * the agent states are instead copied into the notifier, which invokes the
+ * callback on its own thread, so that the simulator can be unlocked first.
  *
  * \param   sim     The simulator invoking this function.
  * \param   agents  The underlying array of all agents in `sim`.
@@ -363,29 +867,46 @@ void on_step(const simulator<py_simulator_data>* sim,
     const py_simulator_data& data = sim->get_data();
     if (data.save_directory != NULL && time % data.save_frequency == 0) {
         /* save the simulator to a local file */
-        saved = save(sim, time);
+        saved = save(sim);
     } if (data.server != NULL) {
         /* this simulator is a server, so send a step response to every client */
         if (!send_step_response(*data.server, agents, sim->get_config(), saved))
             fprintf(stderr, "on_step ERROR: send_step_response failed.\n");
     }
 
+    if (data.notifier != NULL) {
+        /* the Python callback is invoked by the notifier thread, once the simulator is unlocked */
+        if (!data.notifier->publish(agents, data.agent_ids, time, saved))
+            fprintf(stderr, "on_step ERROR: step_notifier.publish failed.\n");
+        return;
+    }
+
     PyGILState_STATE gstate;
     gstate = PyGILState_Ensure(); /* acquire global interpreter lock */
-    PyObject* py_states = PyList_New(data.agent_ids.length);
-    if (py_states == NULL) {
-        fprintf(stderr, "on_step ERROR: PyList_New returned NULL.\n");
-        PyGILState_Release(gstate); /* release global interpreter lock */
-        return;
+    PyObject* py_states;
+    if (data.batched_observations) {
+        py_states = build_py_agent_batch(sim, agents, data.agent_ids);
+        if (py_states == NULL) {
+            fprintf(stderr, "on_step ERROR: build_py_agent_batch returned NULL.\n");
+            PyGILState_Release(gstate); /* release global interpreter lock */
+            return;
+        }
+    } else {
+        py_states = PyList_New(data.agent_ids.length);
+        if (py_states == NULL) {
+            fprintf(stderr, "on_step ERROR: PyList_New returned NULL.\n");
+            PyGILState_Release(gstate); /* release global interpreter lock */
+            return;
+        }
+        const simulator_config& config = sim->get_config();
+        for (size_t i = 0; i < data.agent_ids.length; i++)
+            PyList_SetItem(py_states, i, build_py_agent(*agents[(size_t) data.agent_ids[i]], config, data.agent_ids[i]));
     }
-    const simulator_config& config = sim->get_config();
-    for (size_t i = 0; i < data.agent_ids.length; i++)
-        PyList_SetItem(py_states, i, build_py_agent(*agents[(size_t) data.agent_ids[i]], config, data.agent_ids[i]));
 
     /* call python callback */
     PyObject* py_saved = saved ? Py_True : Py_False;
     Py_INCREF(py_saved);
-    PyObject* args = Py_BuildValue("(OO)", py_states, py_saved);
+    PyObject* args = Py_BuildValue("(NO)", py_states, py_saved);
     PyObject* result = PyEval_CallObject(data.callback, args);
     Py_DECREF(args);
     if (result != NULL)
@@ -462,6 +983,32 @@ void on_turn(client<py_client_data>& c, uint64_t agent_id, bool request_success)
     c.data.cv.notify_one();
 }
 
+/**
+ * The callback invoked when the client receives a batch_actions response from
+ * the server. This function copies the results into
+ * `c.data.response.action_results` (which is NULL if there is insufficient
+ * memory) and wakes up the Python thread (which should be waiting in the
+ * `simulator_act` function) so that it can return the response back to
+ * Python.
+ *
+ * \param   c               The client that received the response.
+ * \param   agent_ids       The IDs of the agents that requested the actions.
+ * \param   request_success Indicates whether each action was successfully
+ *                          enqueued by the simulator server.
+ * \param   action_count    The length of `agent_ids` and `request_success`.
+ */
+void on_batch_actions(client<py_client_data>& c, const uint64_t* agent_ids,
+        const bool* request_success, unsigned int action_count)
+{
+    bool* results = (bool*) malloc(sizeof(bool) * max(1u, action_count));
+    if (results != NULL)
+        memcpy(results, request_success, sizeof(bool) * action_count);
+    std::unique_lock<std::mutex> lck(c.data.lock);
+    c.data.waiting_for_server = false;
+    c.data.response.action_results = results;
+    c.data.cv.notify_one();
+}
+
 /**
  * The callback invoked when the client receives a get_map response from the
  * server. This function moves the result into `c.data.response.map` and wakes
@@ -481,6 +1028,24 @@ void on_get_map(client<py_client_data>& c,
     c.data.cv.notify_one();
 }
 
+/**
+ * The callback invoked when the client receives a get_stats response from the
+ * server. This function moves the result into `c.data.response.stats` (which
+ * is NULL upon error) and wakes up the Python thread (which should be waiting
+ * in the `simulator_stats` function) so that it can return the response back
+ * to Python.
+ *
+ * \param   c       The client that received the response.
+ * \param   stats   The counters of the instrumented hot paths of the server.
+ */
+void on_get_stats(client<py_client_data>& c, stats_snapshot* stats)
+{
+    std::unique_lock<std::mutex> lck(c.data.lock);
+    c.data.waiting_for_server = false;
+    c.data.response.stats = stats;
+    c.data.cv.notify_one();
+}
+
 /**
  * The callback invoked when the client receives a step response from the
  * server. This function constructs a Python list of agent states governed by
@@ -497,7 +1062,7 @@ void on_step(client<py_client_data>& c,
         const agent_state* agent_states)
 {
     bool saved;
-    if (!read(saved, c.connection)) return;
+    if (!read_step_data(c, saved)) return;
 
     PyGILState_STATE gstate;
     gstate = PyGILState_Ensure(); /* acquire global interpreter lock */
@@ -578,93 +1143,34 @@ static inline void import_errors() {
 }
 
 /**
- * Creates a new simulator and returns a handle to it.
- *
- * \param   self    Pointer to the Python object calling this method.
- * \param   args    A Python tuple containing the arguments to this function:
- *                  - (int) The seed for the pseudorandom number generator.
- *                  - (int) The maximum movement distance per turn for all
- *                  agents.
- *                  - (int) The scent dimension.
- *                  - (int) The color dimension for visual perception.
- *                  - (int) The range of vision for all agents.
- *                  - (int) The patch size.
- *                  - (int) The number of Gibbs sampling iterations when
- *                    initializing items in new patches.
- *                  - (list) A list of the item types.
- *                  - (list of floats) The color of all agents.
- *                  - (int) The movement conflict resolution policy.
- *                  - (float) The scent decay parameter.
- *                  - (float) The scent diffusion parameter.
- *                  - (int) The duration of time for which removed items are
- *                    remembered by the simulation in order to compute their
- *                    scent contribution.
- *                  - (function) The function to invoke when the simulator
- *                    advances time.
- *                  - (int) The frequency by which the simulator is saved to
- *                    file.
- *                  - (string) The filepath to save the simulator (the
- *                    simulator time will be appended to this filepath when
- *                    saving).
+ * Parses the item types, allowed actions, agent color, and collision policy
+ * of a simulator configuration from the arguments of `simulator_c.new` or
+ * `simulator_c.batch_new` into `config`.
  *
- *                  The list of item types must contain tuples containing:
- *                  - (string) The name.
- *                  - (list of floats) The item scent.
- *                  - (list of floats) The item color.
- *                  - (list of ints) The number of items of each type that is
- *                    required to automatically collect items of this type.
- *                  - (list of ints) The number of items of each type that is
- *                    removed from the agent's inventory whenever an item of
- *                    this type is collected.
- *                  - (bool) Whether this item type blocks agent movement.
- *                  - (int) The ID of the intensity function.
- *                  - (list of floats) The arguments to the intensity function.
- *                  - (list of list of floats) The list of interaction
- *                    functions, where the first element in each sublist is the
- *                    ID of the interaction function, and the remaining
- *                    elements are its arguments.
- * \returns Pointer to the new simulator.
+ * \returns `true` if successful; `false` otherwise, in which case a Python
+ *          exception may have been set.
  */
-static PyObject* simulator_new(PyObject *self, PyObject *args)
+static bool PyArg_ParseConfig(simulator_config& config,
+        PyObject* py_allowed_movement_directions,
+        PyObject* py_allowed_turn_directions,
+        PyObject* py_items, PyObject* py_agent_color,
+        unsigned int collision_policy)
 {
-    simulator_config config;
-    PyObject* py_allowed_movement_directions;
-    PyObject* py_allowed_turn_directions;
-    PyObject* py_items;
-    PyObject* py_agent_color;
-    unsigned int seed;
-    unsigned int collision_policy;
-    PyObject* py_callback;
-    unsigned int save_frequency;
-    char* save_filepath;
-    if (!PyArg_ParseTuple(
-      args, "IIOOIIIIIOOIffIOIz", &seed, &config.max_steps_per_movement,
-      &py_allowed_movement_directions, &py_allowed_turn_directions, &config.scent_dimension,
-      &config.color_dimension, &config.vision_range, &config.patch_size, &config.gibbs_iterations,
-      &py_items, &py_agent_color, &collision_policy, &config.decay_param, &config.diffusion_param,
-      &config.deleted_item_lifetime, &py_callback, &save_frequency, &save_filepath)) {
-        fprintf(stderr, "Invalid argument types in the call to 'simulator_c.new'.\n");
-        return NULL;
-    }
-
-    if (!PyCallable_Check(py_callback)) {
-        PyErr_SetString(PyExc_TypeError, "Callback must be callable.\n");
-        return NULL;
-    } else if (!PyList_Check(py_items)) {
+    if (!PyList_Check(py_items)) {
         PyErr_SetString(PyExc_TypeError, "'items' must be a list.\n");
-        return NULL;
+        return false;
     } else if (!PyList_Check(py_allowed_movement_directions)) {
         PyErr_SetString(PyExc_TypeError, "'allowed_movement_directions' must be a list.\n");
-        return NULL;
+        return false;
     } else if (!PyList_Check(py_allowed_turn_directions)) {
         PyErr_SetString(PyExc_TypeError, "'allowed_turn_directions' must be a list.\n");
-        return NULL;
+        return false;
     }
 
     PyObject *py_items_iter = PyObject_GetIter(py_items);
     if (!py_items_iter) {
-        PyErr_SetString(PyExc_ValueError, "Invalid argument types in the call to 'simulator_c.new'.");
-        return NULL;
+        PyErr_SetString(PyExc_ValueError, "Invalid argument types in the simulator configuration.");
+        return false;
     }
     Py_ssize_t item_type_count = PyList_Size(py_items);
     while (true) {
@@ -682,13 +1188,13 @@ static PyObject* simulator_new(PyObject *self, PyObject *args)
         PyObject* py_interaction_fn_args;
         if (!PyArg_ParseTuple(next_py_item, "sOOOOOIOO", &name, &py_scent, &py_color, &py_required_item_counts,
           &py_required_item_costs, &blocks_movement, &py_intensity_fn, &py_intensity_fn_args, &py_interaction_fn_args)) {
-            fprintf(stderr, "Invalid argument types for item property in call to 'simulator_c.new'.\n");
-            return NULL;
+            fprintf(stderr, "Invalid argument types for item property in the simulator configuration.\n");
+            return false;
         }
 
         if (!PyList_Check(py_intensity_fn_args) || !PyList_Check(py_interaction_fn_args)) {
             PyErr_SetString(PyExc_TypeError, "'intensity_fn_args' and 'interaction_fn_args' must be lists.\n");
-            return NULL;
+            return false;
         }
 
         item_properties& new_item = config.item_types[config.item_types.length];
@@ -708,8 +1214,8 @@ static PyObject* simulator_new(PyObject *self, PyObject *args)
                 intensity_fn_args.key, (unsigned int) intensity_fn_args.value);
         if (new_item.intensity_fn == NULL) {
             PyErr_SetString(PyExc_ValueError, "Invalid intensity"
-                    " function arguments in the call to 'simulator_c.new'.");
-            return NULL;
+                    " function arguments in the simulator configuration.");
+            return false;
         }
         new_item.intensity_fn_args = intensity_fn_args.key;
         new_item.intensity_fn_arg_count = (unsigned int) intensity_fn_args.value;
@@ -727,8 +1233,8 @@ static PyObject* simulator_new(PyObject *self, PyObject *args)
             new_item.interaction_fn_arg_counts[i] = (unsigned int) interaction_fn_args.value;
             if (new_item.interaction_fns[i] == NULL) {
                 PyErr_SetString(PyExc_ValueError, "Invalid interaction"
-                        " function arguments in the call to 'simulator_c.new'.");
-                return NULL;
+                        " function arguments in the simulator configuration.");
+                return false;
             }
         }
         config.item_types.length += 1;
@@ -745,6 +1251,93 @@ static PyObject* simulator_new(PyObject *self, PyObject *args)
 
     config.agent_color = PyArg_ParseFloatList(py_agent_color).key;
     config.collision_policy = (movement_conflict_policy) collision_policy;
+    return true;
+}
+
+/**
+ * Creates a new simulator and returns a handle to it.
+ *
+ * \param   self    Pointer to the Python object calling this method.
+ * \param   args    A Python tuple containing the arguments to this function:
+ *                  - (int) The seed for the pseudorandom number generator.
+ *                  - (int) The maximum movement distance per turn for all
+ *                  agents.
+ *                  - (int) The scent dimension.
+ *                  - (int) The color dimension for visual perception.
+ *                  - (int) The range of vision for all agents.
+ *                  - (int) The patch size.
+ *                  - (int) The number of Gibbs sampling iterations when
+ *                    initializing items in new patches.
+ *                  - (list) A list of the item types.
+ *                  - (list of floats) The color of all agents.
+ *                  - (int) The movement conflict resolution policy.
+ *                  - (float) The scent decay parameter.
+ *                  - (float) The scent diffusion parameter.
+ *                  - (int) The duration of time for which removed items are
+ *                    remembered by the simulation in order to compute their
+ *                    scent contribution.
+ *                  - (bool) Whether agent observations are updated
+ *                    incrementally.
+ *                  - (int) The number of threads used to compute agent
+ *                    observations and to generate the world.
+ *                  - (function) The function to invoke when the simulator
+ *                    advances time.
+ *                  - (int) The frequency by which the simulator is saved to
+ *                    file.
+ *                  - (string) The filepath to save the simulator (the
+ *                    checkpoint files are written to this filepath followed
+ *                    by `CHECKPOINT_BASE_SUFFIX` and `CHECKPOINT_DELTA_SUFFIX`;
+ *                    see `save`).
+ *
+ *                  The list of item types must contain tuples containing:
+ *                  - (string) The name.
+ *                  - (list of floats) The item scent.
+ *                  - (list of floats) The item color.
+ *                  - (list of ints) The number of items of each type that is
+ *                    required to automatically collect items of this type.
+ *                  - (list of ints) The number of items of each type that is
+ *                    removed from the agent's inventory whenever an item of
+ *                    this type is collected.
+ *                  - (bool) Whether this item type blocks agent movement.
+ *                  - (int) The ID of the intensity function.
+ *                  - (list of floats) The arguments to the intensity function.
+ *                  - (list of list of floats) The list of interaction
+ *                    functions, where the first element in each sublist is the
+ *                    ID of the interaction function, and the remaining
+ *                    elements are its arguments.
+ * \returns Pointer to the new simulator.
+ */
+static PyObject* simulator_new(PyObject *self, PyObject *args)
+{
+    simulator_config config;
+    PyObject* py_allowed_movement_directions;
+    PyObject* py_allowed_turn_directions;
+    PyObject* py_items;
+    PyObject* py_agent_color;
+    unsigned int seed;
+    unsigned int collision_policy;
+    PyObject* py_callback;
+    unsigned int save_frequency;
+    char* save_filepath;
+    PyObject* py_incremental_observations;
+    if (!PyArg_ParseTuple(
+      args, "IIOOIIIIIOOIffIOIOIz", &seed, &config.max_steps_per_movement,
+      &py_allowed_movement_directions, &py_allowed_turn_directions, &config.scent_dimension,
+      &config.color_dimension, &config.vision_range, &config.patch_size, &config.gibbs_iterations,
+      &py_items, &py_agent_color, &collision_policy, &config.decay_param, &config.diffusion_param,
+      &config.deleted_item_lifetime, &py_incremental_observations, &config.thread_count, &py_callback, &save_frequency, &save_filepath)) {
+        fprintf(stderr, "Invalid argument types in the call to 'simulator_c.new'.\n");
+        return NULL;
+    }
+    config.incremental_observations = PyObject_IsTrue(py_incremental_observations);
+
+    if (!PyCallable_Check(py_callback)) {
+        PyErr_SetString(PyExc_TypeError, "Callback must be callable.\n");
+        return NULL;
+    } else if (!PyArg_ParseConfig(config, py_allowed_movement_directions,
+            py_allowed_turn_directions, py_items, py_agent_color, collision_policy)) {
+        return NULL;
+    }
 
     py_simulator_data data(save_filepath,
             (save_filepath == NULL) ? 0 : strlen(save_filepath),
@@ -764,19 +1357,29 @@ static PyObject* simulator_new(PyObject *self, PyObject *args)
 }
 
 /**
- * Loads a simulator from file.
+ * Loads a simulator from file. If the file at the load path followed by the
+ * simulation time does not exist, the simulator is restored from the
+ * checkpoint written by `save` to the load path instead, and the restored
+ * simulation time must match the requested one.
  *
  * \param   self    Pointer to the Python object calling this method.
  * \param   args    A Python tuple containing the arguments to this function:
- *                  - (string) The full path to the file from which to load the
- *                    simulator.
+ *                  - (string) The path from which to load the simulator,
+ *                    excluding the simulation time.
+ *                  - (int) The simulation time to load.
  *                  - (function) The callback to invoke whenever the simulator
  *                    advances time.
  *                  - (int) The frequency by which the simulator is saved to
  *                    file.
  *                  - (string) The filepath to save the simulator (the
- *                    simulator time will be appended to this filepath when
- *                    saving).
+ *                    checkpoint files are written to this filepath followed
+ *                    by `CHECKPOINT_BASE_SUFFIX` and `CHECKPOINT_DELTA_SUFFIX`;
+ *                    see `save`).
+ *                  - (int, optional) The number of threads used by the loaded
+ *                    simulator, which is not saved with it. Defaults to 1.
+ *                  - (bool, optional) Whether the loaded simulator updates the
+ *                    agent observations incrementally, which is not saved
+ *                    with it. Defaults to False.
  * \returns A Python tuple containing:
  *          - The simulation time.
  *          - A pointer to the loaded simulator.
@@ -786,14 +1389,18 @@ static PyObject* simulator_new(PyObject *self, PyObject *args)
  */
 static PyObject* simulator_load(PyObject *self, PyObject *args)
 {
-    char* load_filepath;
+    char* load_directory;
+    unsigned long long load_time;
     PyObject* py_callback;
     unsigned int save_frequency;
     char* save_filepath;
-    if (!PyArg_ParseTuple(args, "sOIz", &load_filepath, &py_callback, &save_frequency, &save_filepath)) {
+    unsigned int thread_count = 1;
+    PyObject* py_incremental_observations = Py_False;
+    if (!PyArg_ParseTuple(args, "sKOIz|IO", &load_directory, &load_time, &py_callback, &save_frequency, &save_filepath, &thread_count, &py_incremental_observations)) {
         fprintf(stderr, "Invalid argument types in the call to 'simulator_c.load'.\n");
         return NULL;
     }
+    bool incremental_observations = PyObject_IsTrue(py_incremental_observations);
 
     if (!PyCallable_Check(py_callback)) {
         PyErr_SetString(PyExc_TypeError, "Callback must be callable.\n");
@@ -810,33 +1417,76 @@ static PyObject* simulator_load(PyObject *self, PyObject *args)
             (save_filepath == NULL) ? 0 : strlen(save_filepath),
             save_frequency, NULL, py_callback);
 
-    FILE* file = open_file(load_filepath, "rb");
-    if (file == NULL) {
-        PyErr_SetFromErrno(PyExc_OSError);
+    unsigned int load_directory_length = (unsigned int) strlen(load_directory);
+    int time_length = snprintf(NULL, 0, "%llu", load_time);
+    char* load_filepath = (char*) malloc(sizeof(char) * (load_directory_length + time_length + 1));
+    if (load_filepath == NULL) {
+        PyErr_NoMemory();
         free(sim); return NULL;
     }
+    memcpy(load_filepath, load_directory, sizeof(char) * load_directory_length);
+    snprintf(load_filepath + load_directory_length, time_length + 1, "%llu", load_time);
+
     size_t agent_id_count;
-    fixed_width_stream<FILE*> in(file);
-    if (!read(*sim, in, data)) {
-        PyErr_SetString(PyExc_RuntimeError, "Failed to load simulator.");
-        free(sim); fclose(file); return NULL;
+    auto read_agent_ids = [&](fixed_width_stream<FILE*>& in) {
+        py_simulator_data& sim_data = sim->get_data();
+        if (!read(agent_id_count, in)
+                || !sim_data.agent_ids.ensure_capacity(agent_id_count)
+                || !read(sim_data.agent_ids.data, in, agent_id_count))
+            return false;
+        sim_data.agent_ids.length = agent_id_count;
+        return true;
+    };
+
+    FILE* file = open_file(load_filepath, "rb");
+    if (file == NULL) {
+        /* the simulator was saved as a checkpoint, which holds the latest saved times */
+        char* base_filepath = concat_filepath(load_directory, load_directory_length, CHECKPOINT_BASE_SUFFIX);
+        char* delta_filepath = concat_filepath(load_directory, load_directory_length, CHECKPOINT_DELTA_SUFFIX);
+        free(load_filepath);
+        if (base_filepath == NULL || delta_filepath == NULL) {
+            if (base_filepath != NULL) free(base_filepath);
+            if (delta_filepath != NULL) free(delta_filepath);
+            PyErr_NoMemory(); free(sim); return NULL;
+        }
+        bool success = read_checkpoint(*sim, base_filepath, delta_filepath, load_time, data, read_agent_ids, thread_count, incremental_observations);
+        free(base_filepath); free(delta_filepath);
+        if (!success) {
+            PyErr_SetString(PyExc_RuntimeError, "Failed to load simulator.");
+            free(sim); return NULL;
+        } else if (sim->time != load_time) {
+            PyErr_Format(PyExc_RuntimeError, "The checkpoint does not contain the simulation time %llu.", load_time);
+            free(*sim); free(sim); return NULL;
+        }
+    } else if (is_snapshot(load_filepath)) {
+        /* the patches of a snapshot are loaded when they are first accessed */
+        fclose(file);
+        bool success = read_snapshot(*sim, load_filepath, data, read_agent_ids, thread_count, incremental_observations);
+        free(load_filepath);
+        if (!success) {
+            PyErr_SetString(PyExc_RuntimeError, "Failed to load simulator.");
+            free(sim); return NULL;
+        }
+    } else {
+        /* the file was saved in the stream format of earlier versions */
+        free(load_filepath);
+        fixed_width_stream<FILE*> in(file);
+        if (!read(*sim, in, data, thread_count, incremental_observations)) {
+            PyErr_SetString(PyExc_RuntimeError, "Failed to load simulator.");
+            free(sim); fclose(file); return NULL;
+        } else if (!read_agent_ids(in)) {
+            PyErr_SetString(PyExc_RuntimeError, "Failed to load agent IDs.");
+            free(*sim); free(sim); fclose(file); return NULL;
+        }
+        fclose(file);
     }
     py_simulator_data& sim_data = sim->get_data();
-    if (!read(agent_id_count, in)
-            || !sim_data.agent_ids.ensure_capacity(agent_id_count)
-            || !read(sim_data.agent_ids.data, in, agent_id_count))
-    {
-        PyErr_SetString(PyExc_RuntimeError, "Failed to load agent IDs.");
-        free(*sim); free(sim); fclose(file); return NULL;
-    }
-    sim_data.agent_ids.length = agent_id_count;
-    fclose(file);
 
     /* parse the list of agent IDs from Python */
     agent_state** agent_states = (agent_state**) malloc(sizeof(agent_state*) * agent_id_count);
     if (agent_states == NULL) {
         PyErr_NoMemory();
-        free(*sim); free(sim); fclose(file); return NULL;
+        free(*sim); free(sim); return NULL;
     }
 
     sim->get_agent_states(agent_states, sim_data.agent_ids.data, (unsigned int) agent_id_count);
@@ -845,7 +1495,7 @@ static PyObject* simulator_load(PyObject *self, PyObject *args)
     PyObject* py_states = PyList_New((Py_ssize_t) agent_id_count);
     if (py_states == NULL) {
         free(agent_states); free(*sim);
-        free(sim); fclose(file); return NULL;
+        free(sim); return NULL;
     }
     for (size_t i = 0; i < agent_id_count; i++)
         PyList_SetItem(py_states, (Py_ssize_t) i, build_py_agent(*agent_states[i], config, sim_data.agent_ids[i]));
@@ -871,7 +1521,11 @@ static PyObject* simulator_delete(PyObject *self, PyObject *args) {
     }
     simulator<py_simulator_data>* sim_handle =
             (simulator<py_simulator_data>*) PyLong_AsVoidPtr(py_sim_handle);
-    free(*sim_handle); free(sim_handle);
+    /* the stepper thread may be waiting for the GIL in the step callback */
+    Py_BEGIN_ALLOW_THREADS
+    free(*sim_handle);
+    Py_END_ALLOW_THREADS
+    free(sim_handle);
     Py_INCREF(Py_None);
     return Py_None;
 }
@@ -885,6 +1539,8 @@ static PyObject* simulator_delete(PyObject *self, PyObject *args) {
  *                  - (int) Server port.
  *                  - (int) Maximum number of new simultaneous connections.
  *                  - (int) Number of threads to process server messages.
+ *                  - (bool, optional) Whether the threads should read
+ *                    messages without blocking (see `server_io_mode`).
  * \returns Handle to the simulator server.
  */
 static PyObject* simulator_start_server(PyObject *self, PyObject *args)
@@ -893,7 +1549,8 @@ static PyObject* simulator_start_server(PyObject *self, PyObject *args)
     unsigned int port;
     unsigned int connection_queue_capacity;
     unsigned int num_workers;
-    if (!PyArg_ParseTuple(args, "OIII", &py_sim_handle, &port, &connection_queue_capacity, &num_workers)) {
+    PyObject* py_nonblocking = NULL;
+    if (!PyArg_ParseTuple(args, "OIII|O", &py_sim_handle, &port, &connection_queue_capacity, &num_workers, &py_nonblocking)) {
         fprintf(stderr, "Invalid argument types in the call to 'simulator_c.start_server'.\n");
         return NULL;
     }
@@ -907,7 +1564,8 @@ static PyObject* simulator_start_server(PyObject *self, PyObject *args)
     } else if (!init(*server)) {
         PyErr_NoMemory();
         free(server); return NULL;
-    } else if (!init_server(*server, *sim_handle, (uint16_t) port, connection_queue_capacity, num_workers)) {
+    } else if (!init_server(*server, *sim_handle, (uint16_t) port, connection_queue_capacity, num_workers,
+            (py_nonblocking != NULL && PyObject_IsTrue(py_nonblocking)) ? server_io_mode::NONBLOCKING : server_io_mode::BLOCKING)) {
         PyErr_SetString(PyExc_RuntimeError, "Unable to initialize MPI server.");
         free(*server); free(server); return NULL;
     }
@@ -951,6 +1609,15 @@ static PyObject* simulator_stop_server(PyObject *self, PyObject *args)
  *                  - (list of ints) The IDs of the agents governed by this
  *                    client (this should be an empty list if the client
  *                    hasn't added agents yet).
+ *                  - (bool, optional) Whether the server should send compact
+ *                    step responses.
+ *                  - (int, optional) The `vision_format` of the vision in
+ *                    compact step responses.
+ *                  - (bool, optional) Whether compact step responses should
+ *                    be compressed.
+ *                  - (int, optional) The number of agents for which to
+ *                    request a shared-memory region, or 0 to use only the
+ *                    socket.
  * \returns A Python tuple containing:
  *          - The simulation time.
  *          - A handle to the client.
@@ -965,10 +1632,22 @@ static PyObject* simulator_start_client(PyObject *self, PyObject *args)
     PyObject* py_step_callback;
     PyObject* py_lost_connection_callback;
     PyObject* py_agent_ids;
-    if (!PyArg_ParseTuple(args, "sIOOO", &server_address, &port, &py_step_callback, &py_lost_connection_callback, &py_agent_ids)) {
+    PyObject* py_compact_steps = NULL;
+    PyObject* py_compress_steps = NULL;
+    unsigned int vision = (unsigned int) vision_format::FLOAT32;
+    unsigned int shared_memory_capacity = 0;
+    if (!PyArg_ParseTuple(args, "sIOOO|OIOI", &server_address, &port, &py_step_callback,
+            &py_lost_connection_callback, &py_agent_ids, &py_compact_steps, &vision, &py_compress_steps,
+            &shared_memory_capacity)) {
         fprintf(stderr, "Invalid argument types in the call to 'simulator_c.start_client'.\n");
         return NULL;
+    } else if (vision > (unsigned int) vision_format::UINT8) {
+        PyErr_SetString(PyExc_ValueError, "Unrecognized vision format.");
+        return NULL;
     }
+    bool compact_steps = (py_compact_steps != NULL && PyObject_IsTrue(py_compact_steps));
+    bool compress_steps = (py_compress_steps != NULL && PyObject_IsTrue(py_compress_steps));
+    step_encoding encoding = {compact_steps, (vision_format) vision, compress_steps};
 
     if (!PyCallable_Check(py_step_callback) || !PyCallable_Check(py_lost_connection_callback)) {
         PyErr_SetString(PyExc_TypeError, "Callbacks must be callable.\n");
@@ -999,7 +1678,8 @@ static PyObject* simulator_start_client(PyObject *self, PyObject *args)
     }
 
     uint64_t simulator_time = init_client(*new_client, server_address,
-            (uint16_t) port, agent_ids, agent_states, (unsigned int) agent_count);
+            (uint16_t) port, agent_ids, agent_states, (unsigned int) agent_count, encoding,
+            shared_memory_capacity);
     if (simulator_time == UINT64_MAX) {
         PyErr_SetString(PyExc_RuntimeError, "Unable to initialize MPI client.");
         free(*new_client); free(new_client); return NULL;
@@ -1069,7 +1749,10 @@ static PyObject* simulator_add_agent(PyObject *self, PyObject *args) {
         /* the simulation is local, so call add_agent directly */
         simulator<py_simulator_data>* sim_handle =
                 (simulator<py_simulator_data>*) PyLong_AsVoidPtr(py_sim_handle);
-        pair<uint64_t, agent_state*> new_agent = sim_handle->add_agent();
+        pair<uint64_t, agent_state*> new_agent(UINT64_MAX, NULL);
+        Py_BEGIN_ALLOW_THREADS
+        new_agent = sim_handle->add_agent();
+        Py_END_ALLOW_THREADS
         if (new_agent.key == UINT64_MAX) {
             PyErr_SetString(add_agent_error, "Failed to add new agent.");
             return NULL;
@@ -1235,6 +1918,121 @@ static PyObject* simulator_turn(PyObject *self, PyObject *args) {
     }
 }
 
+/**
+ * Requests several actions at once. In client mode, the actions are sent to
+ * the server in a single message.
+ *
+ * \param   self    Pointer to the Python object calling this method.
+ * \param   args    Arguments:
+ *                  - Handle to the native simulator object as a PyLong.
+ *                  - Handle to the native client object as a PyLong. If this
+ *                    is None, the actions are directly requested from the
+ *                    simulator object. Otherwise, the client sends a
+ *                    batch_actions message to the server and waits for its
+ *                    response.
+ *                  - (list of tuples) The actions, each of which is a tuple
+ *                    `(agent_id, action_type, direction, num_steps)`, where
+ *                    `action_type` is 0 to move and 1 to turn, and
+ *                    `direction` is encoded as in `simulator_move` and
+ *                    `simulator_turn`. `num_steps` is ignored for turns.
+ * \returns A list of booleans, where each element is `True` if the
+ *          corresponding action was successfully queued.
+ */
+static PyObject* simulator_act(PyObject *self, PyObject *args) {
+    PyObject* py_sim_handle;
+    PyObject* py_client_handle;
+    PyObject* py_actions;
+    if (!PyArg_ParseTuple(args, "OOO", &py_sim_handle, &py_client_handle, &py_actions))
+        return NULL;
+    if (!PyList_Check(py_actions)) {
+        PyErr_SetString(PyExc_TypeError, "'actions' must be a list.\n");
+        return NULL;
+    }
+
+    unsigned int action_count = (unsigned int) PyList_Size(py_actions);
+    agent_action* actions = (agent_action*) malloc(sizeof(agent_action) * max(1u, action_count));
+    if (actions == NULL) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    for (unsigned int i = 0; i < action_count; i++) {
+        unsigned long long agent_id;
+        unsigned int type, dir, num_steps;
+        if (!PyArg_ParseTuple(PyList_GetItem(py_actions, i), "KIII", &agent_id, &type, &dir, &num_steps)) {
+            free(actions);
+            return NULL;
+        } else if (type > (unsigned int) action_type::TURN || dir >= (unsigned int) direction::COUNT) {
+            PyErr_SetString(PyExc_ValueError, "Invalid action type or direction in the call to 'simulator_c.act'.");
+            free(actions);
+            return NULL;
+        }
+        actions[i] = {agent_id, (action_type) type, (direction) dir, num_steps};
+    }
+
+    bool* results;
+    if (py_client_handle == Py_None) {
+        /* the simulation is local, so request the actions directly */
+        simulator<py_simulator_data>* sim_handle =
+                (simulator<py_simulator_data>*) PyLong_AsVoidPtr(py_sim_handle);
+        results = (bool*) malloc(sizeof(bool) * max(1u, action_count));
+        if (results == NULL) {
+            free(actions);
+            PyErr_NoMemory();
+            return NULL;
+        }
+
+        /* release the global interpreter lock */
+        PyThreadState* python_thread = PyEval_SaveThread();
+        for (unsigned int i = 0; i < action_count; i++) {
+            if (actions[i].type == action_type::MOVE)
+                results[i] = sim_handle->move(actions[i].agent_id, actions[i].dir, actions[i].num_steps);
+            else results[i] = sim_handle->turn(actions[i].agent_id, actions[i].dir);
+        }
+        PyEval_RestoreThread(python_thread);
+    } else {
+        /* this is a client, so send a batch_actions message to the server */
+        client<py_client_data>* client_handle =
+                (client<py_client_data>*) PyLong_AsVoidPtr(py_client_handle);
+        if (!client_handle->client_running) {
+            free(actions);
+            PyErr_SetString(mpi_error, "Connection to the server was lost.");
+            return NULL;
+        }
+
+        client_handle->data.waiting_for_server = true;
+        client_handle->data.response.action_results = NULL;
+        if (!send_batch_actions(*client_handle, actions, action_count)) {
+            free(actions);
+            PyErr_SetString(PyExc_RuntimeError, "Unable to send batch_actions request.");
+            return NULL;
+        }
+
+        /* wait for response from server */
+        wait_for_server(*client_handle);
+
+        results = client_handle->data.response.action_results;
+        if (results == NULL) {
+            free(actions);
+            PyErr_SetString(mpi_error, "Failed to receive the results of the batch_actions request.");
+            return NULL;
+        }
+    }
+    free(actions);
+
+    PyObject* py_results = PyList_New(action_count);
+    if (py_results == NULL) {
+        free(results);
+        return NULL;
+    }
+    for (unsigned int i = 0; i < action_count; i++) {
+        PyObject* py_result = (results[i] ? Py_True : Py_False);
+        Py_INCREF(py_result);
+        PyList_SetItem(py_results, i, py_result);
+    }
+    free(results);
+    return py_results;
+}
+
 /**
  * Constructs a Python list containing tuples, where each tuple contains the
  * state information of a patch in the given hash_map of patches.
@@ -1314,6 +2112,8 @@ static PyObject* build_py_map(
  *                    box containing the patches to retrieve.
  *                  - (tuple of 2 ints) The top-right corner of the bounding
  *                    box containing the patches to retrieve.
+ *                  - (int, optional) If nonzero, only the patches that
+ *                    changed at or after this simulation time are retrieved.
  * \returns A Python list of tuples, where each tuple contains the state
  *          information of a patch within the bounding box. See `build_py_map`
  *          for details on the contents of each tuple.
@@ -1323,8 +2123,9 @@ static PyObject* simulator_map(PyObject *self, PyObject *args) {
     PyObject* py_client_handle;
     int64_t py_bottom_left_x, py_bottom_left_y;
     int64_t py_top_right_x, py_top_right_y;
-    if (!PyArg_ParseTuple(args, "OO(LL)(LL)", &py_sim_handle, &py_client_handle,
-            &py_bottom_left_x, &py_bottom_left_y, &py_top_right_x, &py_top_right_y))
+    unsigned long long modified_since = 0;
+    if (!PyArg_ParseTuple(args, "OO(LL)(LL)|K", &py_sim_handle, &py_client_handle,
+            &py_bottom_left_x, &py_bottom_left_y, &py_top_right_x, &py_top_right_y, &modified_since))
         return NULL;
     position bottom_left = position(py_bottom_left_x, py_bottom_left_y);
     position top_right = position(py_top_right_x, py_top_right_y);
@@ -1334,7 +2135,11 @@ static PyObject* simulator_map(PyObject *self, PyObject *args) {
         simulator<py_simulator_data>* sim_handle =
                 (simulator<py_simulator_data>*) PyLong_AsVoidPtr(py_sim_handle);
         hash_map<position, patch_state> patches(16, alloc_position_keys);
-        if (!sim_handle->get_map(bottom_left, top_right, patches)) {
+        bool success;
+        Py_BEGIN_ALLOW_THREADS
+        success = sim_handle->get_map(bottom_left, top_right, patches, (uint64_t) modified_since);
+        Py_END_ALLOW_THREADS
+        if (!success) {
             PyErr_SetString(PyExc_RuntimeError, "simulator.get_map failed.");
             return NULL;
         }
@@ -1352,7 +2157,7 @@ static PyObject* simulator_map(PyObject *self, PyObject *args) {
         }
 
         client_handle->data.waiting_for_server = true;
-        if (!send_get_map(*client_handle, bottom_left, top_right)) {
+        if (!send_get_map(*client_handle, bottom_left, top_right, (uint64_t) modified_since)) {
             PyErr_SetString(PyExc_RuntimeError, "Unable to send get_map request.");
             return NULL;
         }
@@ -1368,6 +2173,715 @@ static PyObject* simulator_map(PyObject *self, PyObject *args) {
     }
 }
 
+static PyObject* build_py_histogram(const histogram_snapshot& histogram)
+{
+    PyObject* py_buckets = PyList_New(HISTOGRAM_BUCKET_COUNT);
+    for (unsigned int i = 0; i < HISTOGRAM_BUCKET_COUNT; i++)
+        PyList_SetItem(py_buckets, i, Py_BuildValue("(KK)",
+                (unsigned long long) histogram_bucket_bound(i),
+                (unsigned long long) histogram.buckets[i]));
+    PyObject* py_histogram = Py_BuildValue("{s:K,s:K,s:K,s:O}",
+            "count", (unsigned long long) histogram.count,
+            "total_ns", (unsigned long long) histogram.total_ns,
+            "max_ns", (unsigned long long) histogram.max_ns,
+            "buckets", py_buckets);
+    Py_DECREF(py_buckets);
+    return py_histogram;
+}
+
+static PyObject* build_py_stats(const stats_snapshot& stats)
+{
+    PyObject* py_phases = PyDict_New();
+    for (unsigned int i = 0; i < (size_t) step_phase::TOTAL; i++) {
+        PyObject* py_histogram = build_py_histogram(stats.step_phases[i]);
+        PyDict_SetItemString(py_phases, step_phase_name((step_phase) i), py_histogram);
+        Py_DECREF(py_histogram);
+    }
+
+    PyObject* py_messages = PyDict_New();
+    for (unsigned int i = 0; i <= (size_t) message_type::RESYNC_STEPS; i++) {
+        if (stats.messages_sent[i] == 0) continue;
+        memory_stream name(32);
+        if (!print((message_type) i, name)) continue;
+        PyObject* py_message = Py_BuildValue("{s:K,s:K}",
+                "count", (unsigned long long) stats.messages_sent[i],
+                "bytes", (unsigned long long) stats.bytes_sent[i]);
+        PyObject* py_name = PyUnicode_FromStringAndSize(name.buffer, name.position);
+        PyDict_SetItem(py_messages, py_name, py_message);
+        Py_DECREF(py_name); Py_DECREF(py_message);
+    }
+
+    PyObject* py_step = build_py_histogram(stats.step_phases[(size_t) step_phase::TOTAL]);
+    PyObject* py_fix_patches = build_py_histogram(stats.fix_patches);
+    PyObject* py_stats = Py_BuildValue("{s:O,s:O,s:O,s:O,s:K,s:K,s:O,s:K,s:K}",
+            "enabled", stats.enabled ? Py_True : Py_False,
+            "step", py_step,
+            "step_phases", py_phases,
+            "fix_patches", py_fix_patches,
+            "patches_generated", (unsigned long long) stats.patches_generated,
+            "gibbs_iterations", (unsigned long long) stats.gibbs_iterations,
+            "messages_sent", py_messages,
+            "event_queue_depth", (unsigned long long) stats.event_queue_depth,
+            "max_event_queue_depth", (unsigned long long) stats.max_event_queue_depth);
+    Py_DECREF(py_step); Py_DECREF(py_phases);
+    Py_DECREF(py_fix_patches); Py_DECREF(py_messages);
+    return py_stats;
+}
+
+/**
+ * Returns the counters of the instrumented hot paths of the simulator (see
+ * `stats.h`), which are only collected if the module was compiled with
+ * `NEL_ENABLE_STATS`. In client mode, the counters of the server are
+ * requested with a `get_stats` message.
+ *
+ * \param   self    Pointer to the Python object calling this method.
+ * \param   args    Arguments:
+ *                  - Handle to the native simulator object as a PyLong.
+ *                  - Handle to the native client object as a PyLong, or None
+ *                    if the simulator is local.
+ * \returns A dictionary containing the latency histograms of each phase of
+ *          the step function and of patch generation, the number of
+ *          generated patches and Gibbs iterations, the number of messages
+ *          and bytes sent for each message type, and the depth of the
+ *          server's event queue.
+ */
+static PyObject* simulator_stats(PyObject *self, PyObject *args) {
+    PyObject* py_sim_handle;
+    PyObject* py_client_handle;
+    if (!PyArg_ParseTuple(args, "OO", &py_sim_handle, &py_client_handle))
+        return NULL;
+
+    if (py_client_handle == Py_None) {
+        stats_snapshot& stats = *((stats_snapshot*) alloca(sizeof(stats_snapshot)));
+        get_stats(stats);
+        return build_py_stats(stats);
+    } else {
+        client<py_client_data>* client_handle =
+                (client<py_client_data>*) PyLong_AsVoidPtr(py_client_handle);
+        if (!client_handle->client_running) {
+            PyErr_SetString(mpi_error, "Connection to the server was lost.");
+            return NULL;
+        }
+
+        client_handle->data.waiting_for_server = true;
+        client_handle->data.response.stats = NULL;
+        if (!send_get_stats(*client_handle)) {
+            PyErr_SetString(PyExc_RuntimeError, "Unable to send get_stats request.");
+            return NULL;
+        }
+
+        /* wait for response from server */
+        wait_for_server(*client_handle);
+        if (client_handle->data.response.stats == NULL) {
+            PyErr_SetString(mpi_error, "The server returned failure for the get_stats request.");
+            return NULL;
+        }
+        PyObject* py_stats = build_py_stats(*client_handle->data.response.stats);
+        free(client_handle->data.response.stats);
+        return py_stats;
+    }
+}
+
+/**
+ * Returns NumPy arrays that are backed by the observation buffers of the
+ * simulator, without copying them. Row `i` of each array belongs to the agent
+ * with ID `i`, and the simulator updates the arrays in place on every step.
+ * When agents are added, the simulator may move its buffers to a larger
+ * allocation (this is indicated by a change in the returned capacity), after
+ * which previously returned arrays are no longer updated. The arrays keep
+ * their allocation alive, so they remain readable after such a reallocation
+ * and after the simulator is deleted, but they then hold stale observations.
+ *
+ * \param   self    Pointer to the Python object calling this method.
+ * \param   args    Arguments:
+ *                  - Handle to the native simulator object as a PyLong.
+ * \returns A tuple `(scent, vision, items, capacity)`, where `scent` has shape
+ *          `(num_agents, scent_dimension)`, `vision` has shape
+ *          `(num_agents, 2*vision_range + 1, 2*vision_range + 1, color_dimension)`,
+ *          both of type float32, and `items` has shape
+ *          `(num_agents, num_item_types)` and type uint32.
+ */
+static PyObject* simulator_observations(PyObject *self, PyObject *args) {
+    PyObject* py_sim_handle;
+    if (!PyArg_ParseTuple(args, "O", &py_sim_handle)) {
+        fprintf(stderr, "Invalid simulator handle argument in the call to 'simulator_c.observations'.\n");
+        return NULL;
+    }
+    simulator<py_simulator_data>* sim_handle =
+            (simulator<py_simulator_data>*) PyLong_AsVoidPtr(py_sim_handle);
+
+    float* scent; float* vision; unsigned int* items;
+    size_t agent_count, capacity;
+    shared_block* block;
+    Py_BEGIN_ALLOW_THREADS
+    sim_handle->get_observations(scent, vision, items, agent_count, capacity, block);
+    Py_END_ALLOW_THREADS
+
+    PyObject* py_views = build_py_observations(scent, vision, items, block, agent_count, sim_handle->get_config());
+    release(block);
+    if (py_views == NULL) return NULL;
+    PyObject* py_observations = Py_BuildValue("(OOOK)",
+            PyTuple_GET_ITEM(py_views, 0), PyTuple_GET_ITEM(py_views, 1),
+            PyTuple_GET_ITEM(py_views, 2), (unsigned long long) capacity);
+    Py_DECREF(py_views);
+    return py_observations;
+}
+
+/**
+ * Enables or disables batched observations in the step callback (see
+ * `py_simulator_data::batched_observations`).
+ *
+ * \param   self    Pointer to the Python object calling this method.
+ * \param   args    Arguments:
+ *                  - Handle to the native simulator object as a PyLong.
+ *                  - (bool) Whether to enable batched observations.
+ * \returns None.
+ */
+static PyObject* simulator_set_batched_observations(PyObject *self, PyObject *args) {
+    PyObject* py_sim_handle;
+    PyObject* py_batched;
+    if (!PyArg_ParseTuple(args, "OO", &py_sim_handle, &py_batched)) {
+        fprintf(stderr, "Invalid argument types in the call to 'simulator_c.set_batched_observations'.\n");
+        return NULL;
+    }
+    simulator<py_simulator_data>* sim_handle =
+            (simulator<py_simulator_data>*) PyLong_AsVoidPtr(py_sim_handle);
+    sim_handle->get_data().batched_observations = PyObject_IsTrue(py_batched);
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+/**
+ * Enables or disables asynchronous step callbacks. When enabled, the step
+ * callback is invoked by a dedicated thread after the simulator is unlocked
+ * (see `step_notifier`), so `move` and `turn` may return before the callback
+ * for the step they completed is invoked. This is not supported together
+ * with batched observations, since the observation buffers are overwritten
+ * by the next step while the callback may still be reading them.
+ *
+ * \param   self    Pointer to the Python object calling this method.
+ * \param   args    Arguments:
+ *                  - Handle to the native simulator object as a PyLong.
+ *                  - (bool) Whether to enable asynchronous step callbacks.
+ * \returns None.
+ */
+static PyObject* simulator_set_asynchronous_callbacks(PyObject *self, PyObject *args) {
+    PyObject* py_sim_handle;
+    PyObject* py_asynchronous;
+    if (!PyArg_ParseTuple(args, "OO", &py_sim_handle, &py_asynchronous)) {
+        fprintf(stderr, "Invalid argument types in the call to 'simulator_c.set_asynchronous_callbacks'.\n");
+        return NULL;
+    }
+    simulator<py_simulator_data>* sim_handle =
+            (simulator<py_simulator_data>*) PyLong_AsVoidPtr(py_sim_handle);
+    bool asynchronous = PyObject_IsTrue(py_asynchronous);
+    const py_simulator_data& data = sim_handle->get_data();
+    if (asynchronous && data.batched_observations) {
+        PyErr_SetString(PyExc_ValueError, "Asynchronous step callbacks are not supported with batched observations.");
+        return NULL;
+    }
+
+    step_notifier* notifier = NULL;
+    if (asynchronous) {
+        notifier = (step_notifier*) malloc(sizeof(step_notifier));
+        if (notifier == NULL || !init(*notifier, sim_handle->get_config(), data.callback)) {
+            if (notifier != NULL) free(notifier);
+            PyErr_SetString(PyExc_RuntimeError, "Unable to start the step notifier thread.");
+            return NULL;
+        }
+    }
+
+    /* release the GIL, since a step in progress may need it to invoke the callback */
+    Py_BEGIN_ALLOW_THREADS
+    /* swap in the new notifier between steps, but stop the old one outside the
+       lock, since its callback may need the lock to complete (e.g. by moving an agent) */
+    sim_handle->modify_data([&](py_simulator_data& sim_data) {
+        if (asynchronous && sim_data.notifier != NULL) return;
+        step_notifier* old_notifier = sim_data.notifier;
+        sim_data.notifier = notifier;
+        notifier = old_notifier;
+    });
+    if (notifier != NULL) {
+        free(*notifier);
+        free(notifier);
+    }
+    Py_END_ALLOW_THREADS
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+/**
+ * Waits until the step callback was invoked for every completed step. This
+ * returns immediately unless asynchronous step callbacks are enabled (see
+ * `simulator_set_asynchronous_callbacks`). It must not be called from within
+ * the step callback.
+ *
+ * \param   self    Pointer to the Python object calling this method.
+ * \param   args    Arguments:
+ *                  - Handle to the native simulator object as a PyLong.
+ * \returns None.
+ */
+static PyObject* simulator_flush_callbacks(PyObject *self, PyObject *args) {
+    PyObject* py_sim_handle;
+    if (!PyArg_ParseTuple(args, "O", &py_sim_handle)) {
+        fprintf(stderr, "Invalid simulator handle argument in the call to 'simulator_c.flush_callbacks'.\n");
+        return NULL;
+    }
+    simulator<py_simulator_data>* sim_handle =
+            (simulator<py_simulator_data>*) PyLong_AsVoidPtr(py_sim_handle);
+    step_notifier* notifier = sim_handle->get_data().notifier;
+    if (notifier != NULL) {
+        /* release the GIL, since the notifier thread needs it to invoke the callback */
+        Py_BEGIN_ALLOW_THREADS
+        notifier->flush();
+        Py_END_ALLOW_THREADS
+    }
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+/**
+ * Generates and fixes every patch of the world that intersects the given
+ * bounding box, so that agents moving within this region never wait for the
+ * map generator.
+ *
+ * \param   self    Pointer to the Python object calling this method.
+ * \param   args    Arguments:
+ *                  - Handle to the native simulator object as a PyLong.
+ *                  - (tuple of 2 ints) The bottom-left corner of the bounding
+ *                    box containing the patches to generate.
+ *                  - (tuple of 2 ints) The top-right corner of the bounding
+ *                    box containing the patches to generate.
+ * \returns None.
+ */
+static PyObject* simulator_pregenerate(PyObject *self, PyObject *args) {
+    PyObject* py_sim_handle;
+    int64_t py_bottom_left_x, py_bottom_left_y;
+    int64_t py_top_right_x, py_top_right_y;
+    if (!PyArg_ParseTuple(args, "O(LL)(LL)", &py_sim_handle,
+            &py_bottom_left_x, &py_bottom_left_y, &py_top_right_x, &py_top_right_y))
+        return NULL;
+    simulator<py_simulator_data>* sim_handle =
+            (simulator<py_simulator_data>*) PyLong_AsVoidPtr(py_sim_handle);
+
+    /* release the GIL, since the step callback may need it while we wait for the simulator */
+    bool success;
+    Py_BEGIN_ALLOW_THREADS
+    success = sim_handle->pregenerate(position(py_bottom_left_x, py_bottom_left_y),
+            position(py_top_right_x, py_top_right_y));
+    Py_END_ALLOW_THREADS
+    if (!success) {
+        PyErr_SetString(PyExc_RuntimeError, "Failed to generate the patches.");
+        return NULL;
+    }
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+/**
+ * Starts a background thread that fixes the patches that the agents could
+ * reach within a given number of time steps.
+ *
+ * \param   self    Pointer to the Python object calling this method.
+ * \param   args    Arguments:
+ *                  - Handle to the native simulator object as a PyLong.
+ *                  - (int) The number of time steps to look ahead.
+ * \returns None.
+ */
+static PyObject* simulator_start_generator(PyObject *self, PyObject *args) {
+    PyObject* py_sim_handle;
+    unsigned int lookahead_steps;
+    if (!PyArg_ParseTuple(args, "OI", &py_sim_handle, &lookahead_steps)) {
+        fprintf(stderr, "Invalid argument types in the call to 'simulator_c.start_generator'.\n");
+        return NULL;
+    }
+    simulator<py_simulator_data>* sim_handle =
+            (simulator<py_simulator_data>*) PyLong_AsVoidPtr(py_sim_handle);
+    if (!sim_handle->start_generator(lookahead_steps)) {
+        PyErr_SetString(PyExc_RuntimeError, "Unable to start the background generator.");
+        return NULL;
+    }
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+/**
+ * Limits the memory occupied by the patches of the world, moving the patches
+ * that are far from all agents to an eviction file when the limit is exceeded
+ * (see `simulator::set_memory_budget`).
+ *
+ * \param   self    Pointer to the Python object calling this method.
+ * \param   args    Arguments:
+ *                  - Handle to the native simulator object as a PyLong.
+ *                  - (int) The approximate memory budget of the patches in
+ *                    bytes, or 0 to remove the limit.
+ *                  - (str or None) The path of the eviction file, or None to
+ *                    use an anonymous temporary file.
+ * \returns None.
+ */
+static PyObject* simulator_set_memory_budget(PyObject *self, PyObject *args) {
+    PyObject* py_sim_handle;
+    unsigned long long bytes;
+    const char* filepath;
+    if (!PyArg_ParseTuple(args, "OKz", &py_sim_handle, &bytes, &filepath)) {
+        fprintf(stderr, "Invalid argument types in the call to 'simulator_c.set_memory_budget'.\n");
+        return NULL;
+    }
+    simulator<py_simulator_data>* sim_handle =
+            (simulator<py_simulator_data>*) PyLong_AsVoidPtr(py_sim_handle);
+    bool success;
+    Py_BEGIN_ALLOW_THREADS
+    success = sim_handle->set_memory_budget((size_t) bytes, filepath);
+    Py_END_ALLOW_THREADS
+    if (!success) {
+        PyErr_SetString(PyExc_RuntimeError, "Unable to create the eviction file.");
+        return NULL;
+    }
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+/**
+ * Starts recording the history of the simulation to a trajectory file (see
+ * `simulator::start_recording`).
+ *
+ * \param   self    Pointer to the Python object calling this method.
+ * \param   args    Arguments:
+ *                  - Handle to the native simulator object as a PyLong.
+ *                  - (str) The path of the trajectory file.
+ *                  - (int) The number of steps in each chunk of the file.
+ *                  - (bool) Whether to compress the columns of each chunk.
+ * \returns None.
+ */
+static PyObject* simulator_start_recording(PyObject *self, PyObject *args) {
+    PyObject* py_sim_handle;
+    const char* filepath;
+    unsigned int chunk_steps;
+    PyObject* py_compress;
+    if (!PyArg_ParseTuple(args, "OsIO", &py_sim_handle, &filepath, &chunk_steps, &py_compress)) {
+        fprintf(stderr, "Invalid argument types in the call to 'simulator_c.start_recording'.\n");
+        return NULL;
+    }
+    simulator<py_simulator_data>* sim_handle =
+            (simulator<py_simulator_data>*) PyLong_AsVoidPtr(py_sim_handle);
+    bool compress = PyObject_IsTrue(py_compress);
+    bool success;
+    /* release the GIL, since a step in progress may be waiting for it to invoke the callback */
+    Py_BEGIN_ALLOW_THREADS
+    success = sim_handle->start_recording(filepath, chunk_steps, compress);
+    Py_END_ALLOW_THREADS
+    if (!success) {
+        PyErr_SetString(PyExc_RuntimeError, "Unable to start recording the trajectory.");
+        return NULL;
+    }
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+/**
+ * Stops recording the history of the simulation, and waits for the recorded
+ * steps to be written (see `simulator::stop_recording`).
+ *
+ * \param   self    Pointer to the Python object calling this method.
+ * \param   args    Arguments:
+ *                  - Handle to the native simulator object as a PyLong.
+ * \returns None.
+ */
+static PyObject* simulator_stop_recording(PyObject *self, PyObject *args) {
+    PyObject* py_sim_handle;
+    if (!PyArg_ParseTuple(args, "O", &py_sim_handle)) {
+        fprintf(stderr, "Invalid simulator handle argument in the call to 'simulator_c.stop_recording'.\n");
+        return NULL;
+    }
+    simulator<py_simulator_data>* sim_handle =
+            (simulator<py_simulator_data>*) PyLong_AsVoidPtr(py_sim_handle);
+    Py_BEGIN_ALLOW_THREADS
+    sim_handle->stop_recording();
+    Py_END_ALLOW_THREADS
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+/**
+ * Starts advancing the simulation on a dedicated thread (see
+ * `simulator::start_stepper`), so that `move` and `turn` return immediately.
+ *
+ * \param   self    Pointer to the Python object calling this method.
+ * \param   args    Arguments:
+ *                  - Handle to the native simulator object as a PyLong.
+ * \returns None.
+ */
+static PyObject* simulator_start_stepper(PyObject *self, PyObject *args) {
+    PyObject* py_sim_handle;
+    if (!PyArg_ParseTuple(args, "O", &py_sim_handle)) {
+        fprintf(stderr, "Invalid simulator handle argument in the call to 'simulator_c.start_stepper'.\n");
+        return NULL;
+    }
+    simulator<py_simulator_data>* sim_handle =
+            (simulator<py_simulator_data>*) PyLong_AsVoidPtr(py_sim_handle);
+    bool success;
+    Py_BEGIN_ALLOW_THREADS
+    success = sim_handle->start_stepper();
+    Py_END_ALLOW_THREADS
+    if (!success) {
+        PyErr_SetString(PyExc_RuntimeError, "Unable to start the stepper thread.");
+        return NULL;
+    }
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+/**
+ * Stops the thread started by `simulator_start_stepper`, after which `move`
+ * and `turn` advance the simulation synchronously again.
+ *
+ * \param   self    Pointer to the Python object calling this method.
+ * \param   args    Arguments:
+ *                  - Handle to the native simulator object as a PyLong.
+ * \returns None.
+ */
+static PyObject* simulator_stop_stepper(PyObject *self, PyObject *args) {
+    PyObject* py_sim_handle;
+    if (!PyArg_ParseTuple(args, "O", &py_sim_handle)) {
+        fprintf(stderr, "Invalid simulator handle argument in the call to 'simulator_c.stop_stepper'.\n");
+        return NULL;
+    }
+    simulator<py_simulator_data>* sim_handle =
+            (simulator<py_simulator_data>*) PyLong_AsVoidPtr(py_sim_handle);
+    Py_BEGIN_ALLOW_THREADS
+    sim_handle->stop_stepper();
+    Py_END_ALLOW_THREADS
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+/**
+ * Creates a new batch of simulators that are stepped together (see
+ * `simulator_batch`).
+ *
+ * \param   self    Pointer to the Python object calling this method.
+ * \param   args    Arguments:
+ *                  - The first 17 arguments of `simulator_new`, where the
+ *                    seed is that of the first simulator, and the thread
+ *                    count is the number of threads used to step the
+ *                    simulators in the batch.
+ *                  - (int) The number of simulators in the batch.
+ *                  - (int) The number of agents in each simulator.
+ * \returns Pointer to the new simulator batch.
+ */
+static PyObject* simulator_batch_new(PyObject *self, PyObject *args)
+{
+    simulator_config config;
+    PyObject* py_allowed_movement_directions;
+    PyObject* py_allowed_turn_directions;
+    PyObject* py_items;
+    PyObject* py_agent_color;
+    unsigned int seed;
+    unsigned int collision_policy;
+    PyObject* py_incremental_observations;
+    unsigned int simulator_count;
+    unsigned int agent_count;
+    if (!PyArg_ParseTuple(
+      args, "IIOOIIIIIOOIffIOIII", &seed, &config.max_steps_per_movement,
+      &py_allowed_movement_directions, &py_allowed_turn_directions, &config.scent_dimension,
+      &config.color_dimension, &config.vision_range, &config.patch_size, &config.gibbs_iterations,
+      &py_items, &py_agent_color, &collision_policy, &config.decay_param, &config.diffusion_param,
+      &config.deleted_item_lifetime, &py_incremental_observations, &config.thread_count,
+      &simulator_count, &agent_count)) {
+        fprintf(stderr, "Invalid argument types in the call to 'simulator_c.batch_new'.\n");
+        return NULL;
+    }
+    config.incremental_observations = PyObject_IsTrue(py_incremental_observations);
+
+    if (simulator_count == 0) {
+        PyErr_SetString(PyExc_ValueError, "The batch must contain at least one simulator.");
+        return NULL;
+    } else if (agent_count == 0) {
+        PyErr_SetString(PyExc_ValueError, "Each simulator in the batch must contain at least one agent.");
+        return NULL;
+    } else if (agent_count > 1 && collision_policy != (unsigned int) movement_conflict_policy::NO_COLLISIONS) {
+        /* every agent starts at the origin, so the agents after the first could not be added */
+        PyErr_SetString(PyExc_ValueError, "The collision policy must be NO_COLLISIONS if there is more than one agent per simulator.");
+        return NULL;
+    } else if (!PyArg_ParseConfig(config, py_allowed_movement_directions,
+            py_allowed_turn_directions, py_items, py_agent_color, collision_policy)) {
+        return NULL;
+    }
+
+    simulator_batch* batch = (simulator_batch*) malloc(sizeof(simulator_batch));
+    if (batch == NULL) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    bool success;
+    Py_BEGIN_ALLOW_THREADS
+    success = init(*batch, config, simulator_count, agent_count, seed, config.thread_count);
+    Py_END_ALLOW_THREADS
+    if (!success) {
+        free(batch);
+        PyErr_SetString(PyExc_RuntimeError, "Failed to initialize simulator batch.");
+        return NULL;
+    }
+    return PyLong_FromVoidPtr(batch);
+}
+
+/**
+ * Deletes the given simulator batch. Arrays returned by
+ * `simulator_batch_observations` must not be used afterwards.
+ *
+ * \param   self    Pointer to the Python object calling this method.
+ * \param   args    Arguments:
+ *                  - Handle to the native simulator batch as a PyLong.
+ * \returns None.
+ */
+static PyObject* simulator_batch_delete(PyObject *self, PyObject *args) {
+    PyObject* py_batch_handle;
+    if (!PyArg_ParseTuple(args, "O", &py_batch_handle)) {
+        fprintf(stderr, "Invalid batch handle argument in the call to 'simulator_c.batch_delete'.\n");
+        return NULL;
+    }
+    simulator_batch* batch = (simulator_batch*) PyLong_AsVoidPtr(py_batch_handle);
+    free(*batch); free(batch);
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+/**
+ * Takes one action for every agent in every simulator of the batch and
+ * advances all simulators by one time step, in parallel. The observations
+ * returned by `simulator_batch_observations` are updated in place.
+ *
+ * \param   self    Pointer to the Python object calling this method.
+ * \param   args    Arguments:
+ *                  - Handle to the native simulator batch as a PyLong.
+ *                  - (array of ints) The actions, with shape
+ *                    `(num_simulators, num_agents)`, where each element is a
+ *                    `batch_action`.
+ * \returns None.
+ */
+static PyObject* simulator_batch_step(PyObject *self, PyObject *args) {
+    PyObject* py_batch_handle;
+    PyObject* py_actions;
+    if (!PyArg_ParseTuple(args, "OO", &py_batch_handle, &py_actions)) {
+        fprintf(stderr, "Invalid argument types in the call to 'simulator_c.batch_step'.\n");
+        return NULL;
+    }
+    simulator_batch* batch = (simulator_batch*) PyLong_AsVoidPtr(py_batch_handle);
+
+    PyArrayObject* actions = (PyArrayObject*) PyArray_FROMANY(py_actions,
+            NPY_UINT32, 2, 2, NPY_ARRAY_IN_ARRAY | NPY_ARRAY_FORCECAST);
+    if (actions == NULL) {
+        return NULL;
+    } else if (PyArray_DIM(actions, 0) != (npy_intp) batch->simulator_count
+            || PyArray_DIM(actions, 1) != (npy_intp) batch->agent_count) {
+        Py_DECREF(actions);
+        PyErr_SetString(PyExc_ValueError, "'actions' must have shape (num_simulators, num_agents).");
+        return NULL;
+    }
+
+    bool success;
+    const unsigned int* action_data = (const unsigned int*) PyArray_DATA(actions);
+    Py_BEGIN_ALLOW_THREADS
+    success = batch->step(action_data);
+    Py_END_ALLOW_THREADS
+    Py_DECREF(actions);
+    if (!success) {
+        PyErr_SetString(PyExc_ValueError, "'actions' contains an action that is not allowed, or a simulator failed to reset.");
+        return NULL;
+    }
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+/**
+ * Replaces a simulator in the batch with a new simulator with a new seed.
+ *
+ * \param   self    Pointer to the Python object calling this method.
+ * \param   args    Arguments:
+ *                  - Handle to the native simulator batch as a PyLong.
+ *                  - (int) The index of the simulator to reset.
+ * \returns None.
+ */
+static PyObject* simulator_batch_reset(PyObject *self, PyObject *args) {
+    PyObject* py_batch_handle;
+    unsigned int index;
+    if (!PyArg_ParseTuple(args, "OI", &py_batch_handle, &index)) {
+        fprintf(stderr, "Invalid argument types in the call to 'simulator_c.batch_reset'.\n");
+        return NULL;
+    }
+    simulator_batch* batch = (simulator_batch*) PyLong_AsVoidPtr(py_batch_handle);
+    if (index >= batch->simulator_count) {
+        PyErr_SetString(PyExc_IndexError, "Simulator index out of range.");
+        return NULL;
+    }
+
+    bool success;
+    Py_BEGIN_ALLOW_THREADS
+    success = batch->reset(index);
+    Py_END_ALLOW_THREADS
+    if (!success) {
+        PyErr_SetString(PyExc_RuntimeError, "Failed to reset simulator.");
+        return NULL;
+    }
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+/**
+ * Returns NumPy arrays that share memory with the gathered observations of
+ * the given simulator batch. The arrays are updated in place by every call to
+ * `simulator_batch_step` and `simulator_batch_reset`. They keep their
+ * allocation alive, so they remain readable (but are no longer updated)
+ * after the batch is deleted.
+ *
+ * \param   self    Pointer to the Python object calling this method.
+ * \param   args    Arguments:
+ *                  - Handle to the native simulator batch as a PyLong.
+ * \returns A Python tuple `(positions, directions, scent, vision, items,
+ *          moved)`, where the first two dimensions of every array are
+ *          `(num_simulators, num_agents)`. `positions` has a trailing
+ *          dimension of size 2 and `directions` has no trailing dimensions,
+ *          both of type int64. `scent` has a trailing dimension of size
+ *          `scent_dimension` and `vision` has trailing dimensions
+ *          `(2*vision_range + 1, 2*vision_range + 1, color_dimension)`, both
+ *          of type float32. `items` has a trailing dimension of size
+ *          `num_item_types` and type uint32, and `moved` is of type bool.
+ */
+static PyObject* simulator_batch_observations(PyObject *self, PyObject *args) {
+    PyObject* py_batch_handle;
+    if (!PyArg_ParseTuple(args, "O", &py_batch_handle)) {
+        fprintf(stderr, "Invalid batch handle argument in the call to 'simulator_c.batch_observations'.\n");
+        return NULL;
+    }
+    simulator_batch* batch = (simulator_batch*) PyLong_AsVoidPtr(py_batch_handle);
+
+    const simulator_config& config = batch->config;
+    npy_intp simulator_count = (npy_intp) batch->simulator_count;
+    npy_intp agent_count = (npy_intp) batch->agent_count;
+    npy_intp positions_dim[] = {simulator_count, agent_count, 2};
+    npy_intp directions_dim[] = {simulator_count, agent_count};
+    npy_intp scent_dim[] = {simulator_count, agent_count, (npy_intp) config.scent_dimension};
+    npy_intp vision_dim[] = {simulator_count, agent_count,
+            2 * (npy_intp) config.vision_range + 1,
+            2 * (npy_intp) config.vision_range + 1,
+            (npy_intp) config.color_dimension};
+    npy_intp items_dim[] = {simulator_count, agent_count, (npy_intp) config.item_types.length};
+    PyObject* py_positions = new_shared_array(3, positions_dim, NPY_INT64, batch->positions, batch->block);
+    PyObject* py_directions = new_shared_array(2, directions_dim, NPY_INT64, batch->directions, batch->block);
+    PyObject* py_scent = new_shared_array(3, scent_dim, NPY_FLOAT, batch->scent, batch->block);
+    PyObject* py_vision = new_shared_array(5, vision_dim, NPY_FLOAT, batch->vision, batch->block);
+    PyObject* py_items = new_shared_array(3, items_dim, NPY_UINT32, batch->items, batch->block);
+    PyObject* py_moved = new_shared_array(2, directions_dim, NPY_BOOL, batch->moved, batch->block);
+    if (py_positions == NULL || py_directions == NULL || py_scent == NULL
+     || py_vision == NULL || py_items == NULL || py_moved == NULL)
+    {
+        Py_XDECREF(py_positions); Py_XDECREF(py_directions); Py_XDECREF(py_scent);
+        Py_XDECREF(py_vision); Py_XDECREF(py_items); Py_XDECREF(py_moved);
+        return NULL;
+    }
+    return Py_BuildValue("(NNNNNN)", py_positions, py_directions, py_scent, py_vision, py_items, py_moved);
+}
+
 } /* namespace nel */
 
 static PyMethodDef SimulatorMethods[] = {
@@ -1381,7 +2895,25 @@ static PyMethodDef SimulatorMethods[] = {
     {"add_agent",  nel::simulator_add_agent, METH_VARARGS, "Adds an agent to the simulator and returns its ID."},
     {"move",  nel::simulator_move, METH_VARARGS, "Attempts to move the agent in the simulation environment."},
     {"turn",  nel::simulator_turn, METH_VARARGS, "Attempts to turn the agent in the simulation environment."},
+    {"act",  nel::simulator_act, METH_VARARGS, "Attempts to move or turn several agents at once."},
     {"map",  nel::simulator_map, METH_VARARGS, "Returns a list of patches within a given bounding box."},
+    {"stats",  nel::simulator_stats, METH_VARARGS, "Returns the counters of the instrumented hot paths of the simulator."},
+    {"observations",  nel::simulator_observations, METH_VARARGS, "Returns arrays backed by the observation buffers of all agents."},
+    {"set_batched_observations",  nel::simulator_set_batched_observations, METH_VARARGS, "Enables or disables batched observations in the step callback."},
+    {"set_asynchronous_callbacks",  nel::simulator_set_asynchronous_callbacks, METH_VARARGS, "Enables or disables invoking the step callback on a dedicated thread."},
+    {"flush_callbacks",  nel::simulator_flush_callbacks, METH_VARARGS, "Waits until the step callback was invoked for every completed step."},
+    {"pregenerate",  nel::simulator_pregenerate, METH_VARARGS, "Generates all patches within a given bounding box."},
+    {"start_generator",  nel::simulator_start_generator, METH_VARARGS, "Starts generating patches ahead of the agents in the background."},
+    {"set_memory_budget",  nel::simulator_set_memory_budget, METH_VARARGS, "Limits the memory occupied by the patches of the world."},
+    {"start_recording",  nel::simulator_start_recording, METH_VARARGS, "Starts recording the history of the simulation to a trajectory file."},
+    {"stop_recording",  nel::simulator_stop_recording, METH_VARARGS, "Stops recording the history of the simulation."},
+    {"start_stepper",  nel::simulator_start_stepper, METH_VARARGS, "Starts advancing the simulation on a dedicated thread."},
+    {"stop_stepper",  nel::simulator_stop_stepper, METH_VARARGS, "Stops the thread that advances the simulation."},
+    {"batch_new",  nel::simulator_batch_new, METH_VARARGS, "Creates a new batch of simulators and returns its pointer."},
+    {"batch_delete",  nel::simulator_batch_delete, METH_VARARGS, "Deletes an existing simulator batch."},
+    {"batch_step",  nel::simulator_batch_step, METH_VARARGS, "Advances every simulator in the batch by one time step, in parallel."},
+    {"batch_reset",  nel::simulator_batch_reset, METH_VARARGS, "Replaces a simulator in the batch with a newly seeded one."},
+    {"batch_observations",  nel::simulator_batch_observations, METH_VARARGS, "Returns arrays backed by the gathered observations of the batch."},
     {NULL, NULL, 0, NULL}        /* Sentinel */
 };
 
@@ -8,7 +8,7 @@ import os
 
 from .item import IntensityFunction, InteractionFunction
 
-__all__ = ['MPIError', 'MovementConflictPolicy', 'SimulatorConfig', 'Simulator']
+__all__ = ['MPIError', 'MovementConflictPolicy', 'SimulatorConfig', 'Simulator', 'SimulatorBatch']
 
 
 class MPIError(Exception):
@@ -29,7 +29,8 @@ class SimulatorConfig(object):
   def __init__(self, max_steps_per_movement, allowed_movement_directions,
       allowed_turn_directions, vision_range, patch_size, gibbs_num_iter, items,
       agent_color, collision_policy, decay_param, diffusion_param,
-      deleted_item_lifetime, seed=0):
+      deleted_item_lifetime, seed=0, incremental_observations=False,
+      thread_count=1):
     """Creates a new simulator configuration.
 
     Arguments:
@@ -48,6 +49,13 @@ class SimulatorConfig(object):
       items:                       List of items to include in this world.
       seed:                        The initial seed for the pseudorandom number
                                    generator.
+      incremental_observations:    If True, each agent caches the scent and
+                                   vision of nearby items, and only recomputes
+                                   them when it moves or when those items
+                                   change.
+      thread_count:                The number of threads used by the
+                                   simulator to compute agent observations
+                                   and to generate new patches of the world.
     """
     assert len(items) > 0, 'A non-empty list of items must be provided.'
     self.max_steps_per_movement = max_steps_per_movement
@@ -71,6 +79,24 @@ class SimulatorConfig(object):
     self.diffusion_param = diffusion_param
     self.deleted_item_lifetime = deleted_item_lifetime
     self.seed = seed
+    self.incremental_observations = incremental_observations
+    self.thread_count = thread_count
+
+
+# the values of `nel::vision_format` for each `step_vision_format`
+_VISION_FORMATS = {'float32': 0, 'float16': 1, 'uint8': 2}
+
+
+def _config_args(sim_config):
+  """Returns the arguments of `simulator_c.new` that describe `sim_config`."""
+  return (sim_config.seed,
+    sim_config.max_steps_per_movement, [d.value for d in sim_config.allowed_movement_directions],
+    [d.value for d in sim_config.allowed_turn_directions], sim_config.scent_num_dims,
+    sim_config.color_num_dims, sim_config.vision_range, sim_config.patch_size, sim_config.gibbs_num_iter,
+    [(i.name, i.scent, i.color, i.required_item_counts, i.required_item_costs, i.blocks_movement, i.intensity_fn, i.intensity_fn_args, i.interaction_fns) for i in sim_config.items],
+    sim_config.agent_color, sim_config.collision_policy.value, sim_config.decay_param,
+    sim_config.diffusion_param, sim_config.deleted_item_lifetime,
+    sim_config.incremental_observations, sim_config.thread_count)
 
 
 class Simulator(object):
@@ -86,7 +112,13 @@ class Simulator(object):
       is_server=False, server_address=None, port=54353,
       conn_queue_capacity=256, num_workers=8,
 	    on_lost_connection_callback=None, save_frequency=1000,
-      save_filepath=None, load_filepath=None, load_time=-1):
+      save_filepath=None, load_filepath=None, load_time=-1,
+      pregenerated_region=None, generator_lookahead=0,
+      batched_observations=False, asynchronous_steps=False,
+      compact_steps=False, step_vision_format='float32', compress_steps=False,
+      nonblocking_server=False, shared_memory_capacity=0,
+      memory_budget=0, eviction_filepath=None, asynchronous_callbacks=False,
+      thread_count=1, incremental_observations=False):
     """This constructor may be used to either: (1) create a new simulator
     locally (local mode), (2) create a new simulator server in the current
     process (server mode), or (3) connect to a remote simulator server (client
@@ -129,6 +161,10 @@ class Simulator(object):
                           process.
       num_workers         (server mode) The number of worker threads that will
                           be used to process incoming client messages.
+      nonblocking_server  (server mode) If True, each worker thread waits on
+                          its own share of the client connections, and reads
+                          messages without blocking, so that a slow client
+                          cannot stall a worker. Only supported on Linux.
       on_lost_connection_callback (client mode) The function that is called
                           when the client loses its connection with the server.
       save_frequency      (local and server modes) Indicates how often the
@@ -138,7 +174,14 @@ class Simulator(object):
       save_filepath       (all modes) The path where the simulator and agents
                           are saved (in client mode, only agents are saved).
                           The directory containing this path is created if it
-                          doesn't already exist.
+                          doesn't already exist. The simulator is saved as an
+                          incremental checkpoint: the first save writes the
+                          full simulator to `save_filepath + 'checkpoint'`,
+                          and later saves append only the patches that
+                          changed to `save_filepath + 'checkpoint.delta'`
+                          on a background thread. The deltas are
+                          periodically merged into the base, after which the
+                          earlier times can no longer be loaded.
       load_filepath       (all modes) The path from which the simulator and
                           agents are loaded (in client mode, only agents are
                           loaded). This **should not** contain the simulation
@@ -146,12 +189,84 @@ class Simulator(object):
                           `load_time`.
       load_time           (all modes) The simulation time to load. This is used
                           in conjunction with `load_filepath` to determine the
-                          precise filenames to load.
+                          precise filenames to load. If no simulator file
+                          exists for this time, the simulator is restored
+                          from the checkpoint at `load_filepath`.
+      pregenerated_region (local and server modes) If specified, a pair of
+                          (x, y) positions indicating the bottom-left and
+                          top-right corners of a region of the world that is
+                          generated before the simulation starts.
+      generator_lookahead (local and server modes) If greater than zero, a
+                          background thread generates the parts of the world
+                          that the agents could reach within this many time
+                          steps, so that moving agents rarely wait for the
+                          map generator. The world is then no longer
+                          reproducible from the seed, since the order in
+                          which patches are generated depends on thread
+                          scheduling.
+      batched_observations (local and server modes) If True, the scent,
+                          vision, and collected items of the agents are not
+                          copied on every step. Instead, each agent's
+                          `scent()`, `vision()`, and `items()` are views into
+                          arrays owned by the simulator, which are updated in
+                          place. See `observations`.
+      asynchronous_steps  (local and server modes) If True, the simulator is
+                          advanced by a dedicated native thread once all
+                          agents have acted, and `move` and `turn` return
+                          without waiting for the step to complete. The step
+                          callback is then invoked from that thread.
+      compact_steps       (client mode) If True, the server only sends the
+                          parts of the agent states that changed in each step,
+                          rather than the full states.
+      step_vision_format  (client mode) The format in which the vision of
+                          each agent is sent when `compact_steps` is True: one
+                          of 'float32', 'float16', or 'uint8'. The latter two
+                          are lossy, and 'uint8' assumes that the vision lies
+                          in [0, 1].
+      compress_steps      (client mode) If True and `compact_steps` is True,
+                          the steps are compressed with LZ4, if the server was
+                          built with LZ4 support. The client must also be
+                          built with LZ4 support (see `NEL_USE_LZ4`), or it
+                          fails to connect.
+      shared_memory_capacity  (client mode) If positive and the server runs
+                          on the same Linux host, actions and full step
+                          responses are exchanged through a shared-memory
+                          region with room for this many agents, rather than
+                          through the socket. The socket is used if the region
+                          cannot be created.
+      memory_budget       (local and server modes) If positive, the
+                          approximate number of bytes that the patches of the
+                          world may occupy in memory. Once exceeded, the least
+                          recently used patches far from all agents are moved
+                          to disk after each step, and are loaded back when
+                          accessed.
+      eviction_filepath   (local and server modes) The path of the file that
+                          holds the evicted patches, which is deleted when the
+                          simulator is closed. If None, an anonymous temporary
+                          file is used.
+      asynchronous_callbacks (local and server modes) If True, each completed
+                          step is copied into a buffer, and the step callback
+                          (along with saving the agents) runs on a dedicated
+                          native thread, so that it does not delay the next
+                          step. `move` and `turn` may then return before the
+                          agents are updated; call `wait_for_callbacks` to
+                          wait for them. This cannot be combined with
+                          `batched_observations`.
+      thread_count        (local and server modes, when loading from file)
+                          The number of threads used by the loaded simulator,
+                          which is not saved with it. New simulators use the
+                          `thread_count` of `sim_config` instead.
+      incremental_observations (local and server modes, when loading from
+                          file) Whether the loaded simulator updates the
+                          agent observations incrementally (see
+                          `SimulatorConfig`), which is not saved with it.
     """
     self._handle = None
     self._server_handle = None
     self._client_handle = None
     self._save_filepath = save_filepath
+    self._batched_observations = batched_observations
+    self._observation_capacity = None
     self.agents = dict()
     if on_step_callback == None:
       self._on_step = lambda *args: None
@@ -176,6 +291,20 @@ class Simulator(object):
       raise ValueError('"save_frequency" must be strictly greater than zero.')
     if load_filepath != None and load_time < 0:
       raise ValueError('If "load_filepath" is specified, "load_time" must also be specified as a non-negative integer.')
+    if generator_lookahead < 0:
+      raise ValueError('"generator_lookahead" must be non-negative.')
+    if memory_budget < 0:
+      raise ValueError('"memory_budget" must be non-negative.')
+    if server_address != None and (memory_budget > 0 or eviction_filepath != None):
+      raise ValueError('"memory_budget" and "eviction_filepath" must be unspecified in client mode.')
+    if server_address != None and (pregenerated_region != None or generator_lookahead > 0 or batched_observations or asynchronous_steps):
+      raise ValueError('"pregenerated_region", "generator_lookahead", "batched_observations", and "asynchronous_steps" must be unspecified in client mode.')
+    if asynchronous_callbacks and (server_address != None or batched_observations):
+      raise ValueError('"asynchronous_callbacks" may not be specified in client mode or with "batched_observations".')
+    if server_address == None and compact_steps:
+      raise ValueError('"compact_steps" may only be specified in client mode.')
+    if step_vision_format not in _VISION_FORMATS:
+      raise ValueError('"step_vision_format" must be one of ' + ', '.join(_VISION_FORMATS.keys()) + '.')
 
     if sim_config != None:
       # create a local server or simulator
@@ -183,17 +312,20 @@ class Simulator(object):
         raise ValueError('"load_filepath" must be None if "sim_config" is specified.')
       elif server_address != None:
         raise ValueError('"server_address" must be None if "sim_config" is specified.')
-      self._handle = simulator_c.new(sim_config.seed,
-        sim_config.max_steps_per_movement, [d.value for d in sim_config.allowed_movement_directions],
-        [d.value for d in sim_config.allowed_turn_directions], sim_config.scent_num_dims,
-        sim_config.color_num_dims, sim_config.vision_range, sim_config.patch_size, sim_config.gibbs_num_iter,
-        [(i.name, i.scent, i.color, i.required_item_counts, i.required_item_costs, i.blocks_movement, i.intensity_fn, i.intensity_fn_args, i.interaction_fns) for i in sim_config.items],
-        sim_config.agent_color, sim_config.collision_policy.value, sim_config.decay_param,
-        sim_config.diffusion_param, sim_config.deleted_item_lifetime, self._step_callback,
-        save_frequency, save_filepath)
+      self._handle = simulator_c.new(*(_config_args(sim_config)
+        + (self._step_callback, save_frequency, save_filepath)))
+      if memory_budget > 0:
+        simulator_c.set_memory_budget(self._handle, memory_budget, eviction_filepath)
+      self._start_generation(pregenerated_region, generator_lookahead)
+      if batched_observations:
+        simulator_c.set_batched_observations(self._handle, True)
+      if asynchronous_callbacks:
+        simulator_c.set_asynchronous_callbacks(self._handle, True)
+      if asynchronous_steps:
+        simulator_c.start_stepper(self._handle)
       if is_server:
         self._server_handle = simulator_c.start_server(
-          self._handle, port, conn_queue_capacity, num_workers)
+          self._handle, port, conn_queue_capacity, num_workers, nonblocking_server)
       self._time = 0
     elif server_address != None:
       if load_filepath != None:
@@ -203,7 +335,9 @@ class Simulator(object):
       agent_ids = list(self.agents.keys())
       agent_values = list(self.agents.values())
       (self._time, self._client_handle, agent_states) = simulator_c.start_client(
-          server_address, port, self._step_callback, on_lost_connection_callback, agent_ids)
+          server_address, port, self._step_callback, on_lost_connection_callback, agent_ids,
+          compact_steps, _VISION_FORMATS[step_vision_format], compress_steps,
+          shared_memory_capacity)
       for i in range(len(agent_ids)):
         (position, direction, scent, vision, items) = agent_states[i]
         agent = agent_values[i]
@@ -213,14 +347,24 @@ class Simulator(object):
       if load_filepath == None:
         raise ValueError('"load_filepath" must be non-None if "sim_config" and "server_address" are None.')
       self._load_agents(load_filepath, load_time)
-      (self._time, self._handle, agent_states) = simulator_c.load(load_filepath + str(load_time), self._step_callback, save_frequency, save_filepath)
+      (self._time, self._handle, agent_states) = simulator_c.load(load_filepath, load_time, self._step_callback, save_frequency, save_filepath, thread_count, incremental_observations)
       for agent_state in agent_states:
         (position, direction, scent, vision, items, id) = agent_state
         agent = self.agents[id]
         (agent._position, agent._direction, agent._scent, agent._vision, agent._items) = (position, Direction(direction), scent, vision, items)
+      if memory_budget > 0:
+        simulator_c.set_memory_budget(self._handle, memory_budget, eviction_filepath)
+      self._start_generation(pregenerated_region, generator_lookahead)
+      if batched_observations:
+        simulator_c.set_batched_observations(self._handle, True)
+        self._update_observation_views()
+      if asynchronous_callbacks:
+        simulator_c.set_asynchronous_callbacks(self._handle, True)
+      if asynchronous_steps:
+        simulator_c.start_stepper(self._handle)
       if is_server:
         self._server_handle = simulator_c.start_server(
-          self._handle, port, conn_queue_capacity, num_workers)
+          self._handle, port, conn_queue_capacity, num_workers, nonblocking_server)
 
   def __del__(self):
     """Deletes this simulator and deallocates all
@@ -245,6 +389,8 @@ class Simulator(object):
     (position, direction, scent, vision, items, id) = simulator_c.add_agent(self._handle, self._client_handle)
     self.agents[id] = agent
     (agent._position, agent._direction, agent._scent, agent._vision, agent._items) = (position, Direction(direction), scent, vision, items)
+    if self._batched_observations:
+      self._update_observation_views()
     return id
 
   def move(self, agent, direction, num_steps=1):
@@ -283,6 +429,26 @@ class Simulator(object):
     return simulator_c.turn(self._handle,
       self._client_handle, agent._id, direction.value)
 
+  def act(self, moves=(), turns=()):
+    """Requests several actions at once. In client mode, all of the actions
+    are sent to the server in a single message, rather than one message per
+    action.
+
+    Arguments:
+      moves: A list of `(agent, direction, num_steps)` tuples, each requesting
+             a move as in `move`.
+      turns: A list of `(agent, direction)` tuples, each requesting a turn as
+             in `turn`.
+
+    Returns:
+      A pair of lists `(move_results, turn_results)` parallel to `moves` and
+      `turns`, where each element is `True` if the action was successful.
+    """
+    actions = [(agent._id, 0, direction.value, num_steps) for (agent, direction, num_steps) in moves]
+    actions += [(agent._id, 1, direction.value, 0) for (agent, direction) in turns]
+    results = simulator_c.act(self._handle, self._client_handle, actions)
+    return (results[:len(moves)], results[len(moves):])
+
   def get_agents(self):
     """Retrieves a list of the agents governed by this Simulator. This does not
     include the agents governed by other clients."""
@@ -295,14 +461,30 @@ class Simulator(object):
       agent_states: A list of tuples containing the states of each agent
                     governed by this Simulator. This does not include agents
                     governed by other clients.
+                    If batched observations are enabled, this is instead a
+                    tuple `(ids, positions, directions, capacity,
+                    observations)`, where `observations` holds new views of
+                    the observation buffers if they were reallocated since
+                    the last step (e.g. because a client added agents), and
+                    is `None` otherwise. The views cannot be retrieved with
+                    `simulator_c.observations` here, since the simulator is
+                    locked while the callback runs.
       saved:        A boolean indicating whether the simulation was saved this
                     turn.
     """
     self._time += 1
-    for agent_state in agent_states:
-      (position, direction, scent, vision, items, id) = agent_state
-      agent = self.agents[id]
-      (agent._position, agent._direction, agent._scent, agent._vision, agent._items) = (position, Direction(direction), scent, vision, items)
+    if self._batched_observations:
+      (ids, positions, directions, capacity, observations) = agent_states
+      if observations != None and capacity != self._observation_capacity:
+        self._set_observation_views(observations, capacity)
+      for i in range(len(ids)):
+        agent = self.agents[int(ids[i])]
+        (agent._position, agent._direction) = (positions[i], Direction(int(directions[i])))
+    else:
+      for agent_state in agent_states:
+        (position, direction, scent, vision, items, id) = agent_state
+        agent = self.agents[id]
+        (agent._position, agent._direction, agent._scent, agent._vision, agent._items) = (position, Direction(direction), scent, vision, items)
     if saved:
       self._save_agents()
     self._on_step()
@@ -311,21 +493,127 @@ class Simulator(object):
     """Returns the current simulation time."""
     return self._time
 
-  def _map(self, bottom_left, top_right):
+  def wait_for_callbacks(self):
+    """Waits until the step callback was invoked for every completed step.
+    This only has an effect if `asynchronous_callbacks` was specified, and it
+    must not be called from within the step callback."""
+    if self._handle != None:
+      simulator_c.flush_callbacks(self._handle)
+
+  def start_recording(self, filepath, chunk_steps=1024, compress=True):
+    """Starts recording the history of the simulation to the trajectory file
+    at `filepath`, which is overwritten if it exists. After every step, the
+    position, direction, action, and collected item counts of every agent
+    are appended to the file, along with the items that were created (when
+    their patch is generated, or when recording starts for the existing
+    patches, or when a patch that was moved to disk before recording started
+    is loaded again) or collected. The file is divided into chunks
+    of `chunk_steps` steps, which are written by a background thread. If
+    `compress` is `True` and the module was built with the `NEL_USE_LZ4`
+    environment variable set, the columns of each chunk are compressed with
+    LZ4. The file can be read with `TrajectoryReader`, even while it is being
+    recorded. This method is not available in client mode, and it must not be
+    called from within the step callback.
+    """
+    if self._client_handle != None:
+      raise RuntimeError('Recording is not available in client mode.')
+    simulator_c.start_recording(self._handle, filepath, chunk_steps, compress)
+
+  def stop_recording(self):
+    """Stops recording the history of the simulation (see
+    `start_recording`), and waits until the recorded steps are written to
+    the trajectory file. This method has no effect if the simulator is not
+    recording, and it must not be called from within the step callback."""
+    if self._handle != None:
+      simulator_c.stop_recording(self._handle)
+
+  def observations(self):
+    """Returns the observations of all agents in the simulator (including
+    those governed by other clients, in server mode) as NumPy arrays that
+    share memory with the simulator. Row `i` of each array belongs to the
+    agent with ID `i`, and the simulator updates the arrays in place on every
+    step. The arrays no longer receive updates after new agents are added, at
+    which point this method should be called again. They remain readable
+    (though stale) after that, and after the simulator is deleted. This
+    method is not available in client mode.
+
+    Returns:
+      A tuple `(scent, vision, items)` of arrays with shapes
+      `(num_agents, scent_num_dims)`,
+      `(num_agents, 2*vision_range + 1, 2*vision_range + 1, color_num_dims)`,
+      and `(num_agents, num_item_types)`, respectively.
+    """
+    if self._client_handle != None:
+      raise RuntimeError('Batched observations are not available in client mode.')
+    (scent, vision, items, _) = simulator_c.observations(self._handle)
+    return (scent, vision, items)
+
+  def stats(self):
+    """Returns the counters of the instrumented hot paths of the simulator
+    (or of the server, in client mode). The counters are only collected if
+    the module was built with the `NEL_ENABLE_STATS` environment variable
+    set, and otherwise the `enabled` entry is `False`. The counters are
+    shared by all simulators in the same process.
+
+    Returns:
+      A dictionary with the following entries:
+        - `enabled`: Whether the counters are collected.
+        - `step`: The latency histogram of the step function.
+        - `step_phases`: A dictionary from the name of each phase of the step
+          function (e.g. `resolve_moves` and `update_observations`) to its
+          latency histogram.
+        - `fix_patches`: The latency histogram of patch generation.
+        - `patches_generated`: The number of patches sampled.
+        - `gibbs_iterations`: The number of Gibbs sampling iterations run.
+        - `messages_sent`: A dictionary from each message type to the
+          number of such messages (`count`) and their bytes (`bytes`) sent by
+          the server.
+        - `event_queue_depth` and `max_event_queue_depth`: The current and
+          largest number of pending events in the server's socket listener.
+      Each latency histogram is a dictionary with the entries `count`,
+      `total_ns`, `max_ns`, and `buckets`, which is a list of tuples
+      `(upper_bound_ns, count)` (the last bucket also counts every longer
+      duration).
+    """
+    return simulator_c.stats(self._handle, self._client_handle)
+
+  def _update_observation_views(self):
+    (scent, vision, items, capacity) = simulator_c.observations(self._handle)
+    self._set_observation_views((scent, vision, items), capacity)
+
+  def _set_observation_views(self, observations, capacity):
+    (scent, vision, items) = observations
+    self._observation_capacity = capacity
+    for id, agent in self.agents.items():
+      (agent._scent, agent._vision, agent._items) = (scent[id], vision[id], items[id])
+
+  def _start_generation(self, pregenerated_region, generator_lookahead):
+    if pregenerated_region != None:
+      (bottom_left, top_right) = pregenerated_region
+      simulator_c.pregenerate(self._handle, tuple(bottom_left), tuple(top_right))
+    if generator_lookahead > 0:
+      simulator_c.start_generator(self._handle, generator_lookahead)
+
+  def _map(self, bottom_left, top_right, modified_since=0):
     """Returns a list of tuples, each containing the state information of a
     patch in the map. Only the patches visible in the bounding box defined by
     `bottom_left` and `top_right` are returned.
 
     Arguments:
-      bottom_left: A tuple of integers representing the bottom-left corner of
-                   the bounding box containing the patches to retrieve.
-      top_right:   A tuple of integers representing the top_right corner of the
-                   bounding box containing the patches to retrieve.
+      bottom_left:    A tuple of integers representing the bottom-left corner
+                      of the bounding box containing the patches to retrieve.
+      top_right:      A tuple of integers representing the top_right corner of
+                      the bounding box containing the patches to retrieve.
+      modified_since: If nonzero, only the patches whose scent, vision, or
+                      agents changed at or after this simulation time are
+                      returned, so that callers that poll the map can update
+                      only those patches.
 
     Returns:
       A list of tuples, where each tuple contains the state of a patch.
     """
-    return simulator_c.map(self._handle, self._client_handle, bottom_left, top_right)
+    return simulator_c.map(
+        self._handle, self._client_handle, bottom_left, top_right, modified_since)
 
   def _load_agents(self, load_filepath, load_time):
     with open(load_filepath + str(load_time) + '.agent_info', 'rb') as fin:
@@ -345,3 +633,65 @@ class Simulator(object):
         agent_type = type(agent)
         line = str(agent_id) + ' ' + agent_type.__module__ + '.' + agent_type.__name__ + '\n'
         fout.write(line.encode('utf-8'))
+
+
+class SimulatorBatch(object):
+  """A batch of independent simulators with the same configuration, stepped
+  together as a vectorized environment.
+
+  Each simulator contains the same number of agents, whose actions are given
+  together as an array, and all simulators are advanced in parallel native
+  threads without holding the GIL. Every agent starts at the origin, so if
+  there is more than one agent per simulator, the collision policy must be
+  `MovementConflictPolicy.NO_COLLISIONS`.
+
+  The actions are integers: 0 moves the agent forward, 1 and 2 turn it left
+  and right (as in the Gym environment), 3, 4, and 5 move it backward, left,
+  and right, and 6 turns it around. Each action must be allowed by the
+  configuration.
+  """
+
+  def __init__(self, sim_config, num_simulators, num_agents=1):
+    """Creates `num_simulators` simulators with the configuration
+    `sim_config`, each containing `num_agents` agents. Simulator `i` is seeded
+    with `sim_config.seed + i`, and `sim_config.thread_count` is the number of
+    threads used to step the batch (each simulator uses one thread).
+    """
+    self._handle = None
+    if num_simulators <= 0:
+      raise ValueError('"num_simulators" must be strictly greater than zero.')
+    if num_agents <= 0:
+      raise ValueError('"num_agents" must be strictly greater than zero.')
+    if num_agents > 1 and sim_config.collision_policy != MovementConflictPolicy.NO_COLLISIONS:
+      raise ValueError('"collision_policy" must be NO_COLLISIONS if "num_agents" is greater than one.')
+    self.num_simulators = num_simulators
+    self.num_agents = num_agents
+    self._handle = simulator_c.batch_new(*(_config_args(sim_config) + (num_simulators, num_agents)))
+    (self._positions, self._directions, self._scent, self._vision,
+     self._items, self._moved) = simulator_c.batch_observations(self._handle)
+
+  def __del__(self):
+    if self._handle != None:
+      simulator_c.batch_delete(self._handle)
+
+  def step(self, actions):
+    """Takes the given actions, an integer array with shape
+    `(num_simulators, num_agents)`, and advances every simulator by one time
+    step. Returns the observations (see `observations`)."""
+    simulator_c.batch_step(self._handle, actions)
+    return self.observations()
+
+  def reset(self, index):
+    """Replaces simulator `index` with a new simulator with a new seed, and
+    returns the observations (see `observations`)."""
+    simulator_c.batch_reset(self._handle, index)
+    return self.observations()
+
+  def observations(self):
+    """Returns a tuple `(positions, directions, scent, vision, items, moved)`
+    of arrays whose first two dimensions are `(num_simulators, num_agents)`.
+    The arrays share memory with the batch and are overwritten by every call
+    to `step` and `reset`, so they must be copied if they are to be retained.
+    `moved` indicates whether each agent's position changed in the last step.
+    """
+    return (self._positions, self._directions, self._scent, self._vision, self._items, self._moved)
@@ -0,0 +1,227 @@
+"""Reader for the trajectory files recorded by
+`Simulator.start_recording`."""
+
+from __future__ import absolute_import, division, print_function
+
+from enum import Enum
+import numpy as np
+
+try:
+  import lz4.block
+  lz4_loaded = True
+except ImportError:
+  lz4_loaded = False
+
+__all__ = ['TrajectoryEvent', 'TrajectoryChunk', 'TrajectoryReader']
+
+
+class TrajectoryEvent(Enum):
+  """The kinds of item events in a trajectory."""
+
+  CREATED = 0
+  COLLECTED = 1
+
+
+NO_ACTION = 255
+"""The value of `action_direction` for an agent that did not act in a step."""
+
+_TRAJECTORY_MAGIC = 0x314A5254204C454E
+_CHUNK_MAGIC = 0x314B4843204C454E
+_CODEC_RAW = 0
+_CODEC_LZ4 = 1
+
+# These mirror the structures in `nel/trajectory.h`, which are written in the
+# native byte order of the machine that recorded the file.
+_HEADER_DTYPE = np.dtype([
+  ('magic', '=u8'), ('item_type_count', '=u4'), ('column_count', '=u4')])
+_CHUNK_HEADER_DTYPE = np.dtype([
+  ('magic', '=u8'), ('length', '=u8'), ('agent_row_count', '=u8'),
+  ('event_count', '=u8'), ('step_count', '=u4'), ('column_count', '=u4')])
+_COLUMN_RECORD_DTYPE = np.dtype([
+  ('column', '=u4'), ('codec', '=u1'), ('element_size', '=u1'),
+  ('reserved', '=u2'), ('element_count', '=u8'), ('offset', '=u8'),
+  ('stored_length', '=u8')])
+
+# The columns of each chunk, in the order of `trajectory_column`.
+COLUMNS = [
+  ('step_time', np.dtype('=u8')),
+  ('step_agent_count', np.dtype('=u4')),
+  ('agent_id', np.dtype('=u8')),
+  ('agent_x', np.dtype('=i8')),
+  ('agent_y', np.dtype('=i8')),
+  ('agent_direction', np.dtype('=u1')),
+  ('action_direction', np.dtype('=u1')),
+  ('action_dx', np.dtype('=i4')),
+  ('action_dy', np.dtype('=i4')),
+  ('collected_items', np.dtype('=u4')),
+  ('event_time', np.dtype('=u8')),
+  ('event_kind', np.dtype('=u1')),
+  ('event_item_type', np.dtype('=u4')),
+  ('event_x', np.dtype('=i8')),
+  ('event_y', np.dtype('=i8'))]
+
+_COLUMN_INDICES = {name: i for i, (name, _) in enumerate(COLUMNS)}
+
+
+class TrajectoryChunk(object):
+  """A chunk of a trajectory file, covering a range of consecutive steps.
+
+  The columns are NumPy arrays, which are read-only views of the mapped file
+  if the column is not compressed, and are otherwise decompressed when first
+  accessed. The columns are:
+    - `step_time` and `step_agent_count`: The time of each step, and the
+      number of agents recorded in that step.
+    - `agent_id`, `agent_x`, `agent_y`, `agent_direction`,
+      `action_direction`, `action_dx`, and `action_dy`: The state of each
+      agent after each step, and the action (direction and displacement) that
+      it took in the step, or `NO_ACTION` if it did not act. There is a row
+      for each agent in each step, ordered by time and then by agent ID.
+    - `collected_items`: The number of items of each type collected by the
+      agent in each row, as a matrix with shape
+      `[num_agent_rows, num_item_types]`.
+    - `event_time`, `event_kind`, `event_item_type`, `event_x`, and
+      `event_y`: The time, kind (see `TrajectoryEvent`), item type, and
+      location of each item that was created or collected, in the order in
+      which they were recorded.
+  """
+
+  def __init__(self, data, offset, header, records, item_type_count):
+    self._data = data
+    self._offset = offset
+    self._records = records
+    self._item_type_count = item_type_count
+    self._columns = {}
+    self.num_steps = int(header['step_count'])
+    self.num_agent_rows = int(header['agent_row_count'])
+    self.num_events = int(header['event_count'])
+
+  def column(self, name):
+    """Returns the column with the given name (see `COLUMNS`)."""
+    if name in self._columns:
+      return self._columns[name]
+    index = _COLUMN_INDICES[name]
+    dtype = COLUMNS[index][1]
+    if index >= len(self._records):
+      values = np.zeros(0, dtype=dtype)
+    else:
+      record = self._records[index]
+      start = self._offset + int(record['offset'])
+      count = int(record['element_count'])
+      stored_length = int(record['stored_length'])
+      if record['codec'] == _CODEC_RAW:
+        values = np.frombuffer(self._data, dtype=dtype, count=count, offset=start)
+      elif record['codec'] == _CODEC_LZ4:
+        if not lz4_loaded:
+          raise RuntimeError('The `lz4` package is required to read compressed trajectories.')
+        buffer = lz4.block.decompress(
+          self._data[start:start + stored_length].tobytes(),
+          uncompressed_size=count * dtype.itemsize)
+        values = np.frombuffer(buffer, dtype=dtype, count=count)
+      else:
+        raise ValueError('Unknown codec %d of trajectory column `%s`.' % (record['codec'], name))
+    if name == 'collected_items':
+      values = values.reshape((-1, self._item_type_count))
+    self._columns[name] = values
+    return values
+
+  def __getitem__(self, name):
+    return self.column(name)
+
+  def steps(self):
+    """Iterates over the steps in this chunk, for replay.
+
+    Returns:
+      A generator of tuples `(time, agents, events)`, where `agents` is a
+      dictionary from the name of each agent column to its rows for this step,
+      and `events` is a dictionary from the name of each event column to its
+      rows with this time. The events recorded between steps have the time of
+      the previous step.
+    """
+    times = self.column('step_time')
+    agent_counts = self.column('step_agent_count').astype(np.int64)
+    agent_starts = np.concatenate([[0], np.cumsum(agent_counts)])
+    event_times = self.column('event_time')
+    agent_columns = [name for name, _ in COLUMNS
+                     if name.startswith('agent_') or name.startswith('action_')]
+    agent_columns.append('collected_items')
+    event_columns = [name for name, _ in COLUMNS if name.startswith('event_')]
+    for step in range(self.num_steps):
+      time = int(times[step])
+      (start, end) = (agent_starts[step], agent_starts[step + 1])
+      agents = {name: self.column(name)[start:end] for name in agent_columns}
+      event_start = np.searchsorted(event_times, time, side='left')
+      event_end = np.searchsorted(event_times, time, side='right')
+      events = {name: self.column(name)[event_start:event_end] for name in event_columns}
+      yield (time, agents, events)
+
+
+class TrajectoryReader(object):
+  """Reads a trajectory file recorded by `Simulator.start_recording`.
+
+  The file is mapped into memory, and its chunks are located when the
+  reader is constructed (or refreshed), without reading the columns. A file
+  may be read while it is being recorded, in which case only the chunks that
+  were completely written are visible, and `refresh` picks up the newer ones.
+  """
+
+  def __init__(self, filepath):
+    self.filepath = filepath
+    self.refresh()
+
+  def refresh(self):
+    """Maps the file into memory again and locates its complete chunks."""
+    data = np.memmap(self.filepath, dtype=np.uint8, mode='r')
+    if data.size < _HEADER_DTYPE.itemsize:
+      raise ValueError('`%s` is not a trajectory file.' % self.filepath)
+    header = np.frombuffer(data, dtype=_HEADER_DTYPE, count=1)[0]
+    if header['magic'] != _TRAJECTORY_MAGIC:
+      raise ValueError('`%s` is not a trajectory file.' % self.filepath)
+    self._data = data
+    self.num_item_types = int(header['item_type_count'])
+    self.chunks = []
+    offset = _HEADER_DTYPE.itemsize
+    while offset + _CHUNK_HEADER_DTYPE.itemsize <= data.size:
+      chunk_header = np.frombuffer(data, dtype=_CHUNK_HEADER_DTYPE, count=1, offset=offset)[0]
+      length = int(chunk_header['length'])
+      if chunk_header['magic'] != _CHUNK_MAGIC or length == 0:
+        raise ValueError('The chunk at offset %d of `%s` is corrupt.' % (offset, self.filepath))
+      if offset + length > data.size:
+        # this chunk is still being written
+        break
+      records = np.frombuffer(data, dtype=_COLUMN_RECORD_DTYPE,
+        count=int(chunk_header['column_count']),
+        offset=offset + _CHUNK_HEADER_DTYPE.itemsize)
+      self.chunks.append(TrajectoryChunk(data, offset, chunk_header, records, self.num_item_types))
+      offset += length
+
+  @property
+  def num_steps(self):
+    """The number of steps in the complete chunks of the file."""
+    return sum(chunk.num_steps for chunk in self.chunks)
+
+  def __len__(self):
+    return len(self.chunks)
+
+  def __getitem__(self, index):
+    return self.chunks[index]
+
+  def __iter__(self):
+    return iter(self.chunks)
+
+  def column(self, name):
+    """Returns the concatenation of the column with the given name (see
+    `TrajectoryChunk`) over all chunks. Unlike the columns of each chunk, the
+    result is a copy, so this is best used for datasets that fit in memory."""
+    columns = [chunk.column(name) for chunk in self.chunks]
+    if len(columns) == 0:
+      dtype = COLUMNS[_COLUMN_INDICES[name]][1]
+      if name == 'collected_items':
+        return np.zeros((0, self.num_item_types), dtype=dtype)
+      return np.zeros(0, dtype=dtype)
+    return np.concatenate(columns)
+
+  def steps(self):
+    """Iterates over the steps of every chunk (see `TrajectoryChunk.steps`)."""
+    for chunk in self.chunks:
+      for step in chunk.steps():
+        yield step
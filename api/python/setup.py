@@ -1,6 +1,7 @@
 from distutils.core import setup, Extension
 from distutils.command.build_ext import build_ext
 from os import environ
+from sys import platform
 import numpy as np
 
 extra_compile_args = {
@@ -26,12 +27,28 @@ class build_ext_subclass(build_ext):
         e.extra_link_args = extra_link_args[c]
     build_ext.build_extensions(self)
 
+define_macros = [('MAJOR_VERSION', '1'),
+                 ('MINOR_VERSION', '0')]
+libraries = []
+
+# compressed step responses require LZ4, which is enabled by setting NEL_USE_LZ4
+if 'NEL_USE_LZ4' in environ:
+  define_macros.append(('NEL_USE_LZ4', None))
+  libraries.append('lz4')
+
+# the instrumentation of the simulator and server hot paths is enabled by setting NEL_ENABLE_STATS
+if 'NEL_ENABLE_STATS' in environ:
+  define_macros.append(('NEL_ENABLE_STATS', None))
+
+# the shared-memory transport uses POSIX shared memory, which requires librt on older glibc
+if platform.startswith('linux'):
+  libraries.append('rt')
+
 simulator_c = Extension(
   'nel.simulator_c',
-  define_macros = [('MAJOR_VERSION', '1'),
-                   ('MINOR_VERSION', '0')],
+  define_macros = define_macros,
   include_dirs = ['../..', '../../deps', np.get_include()],
-  # libraries = ['...'],
+  libraries = libraries,
   # library_dirs = ['/usr/local/lib'],
   sources = ['nel/simulator.cpp'])
 
@@ -0,0 +1,48 @@
+import nel
+import numpy as np
+import time
+from simulator_test import SimpleAgent, make_config
+
+class StepRecorder(object):
+	def __init__(self, delay=0.0):
+		self.delay = delay
+		self.records = []
+		self.sim = None
+		self.agent = None
+
+	def on_step(self):
+		# a slow callback makes the asynchronous notifier fall behind the steps
+		if self.delay > 0.0:
+			time.sleep(self.delay)
+		if self.agent == None:
+			return
+		self.records.append((self.sim.time(), np.copy(self.agent.position()), self.agent.direction(),
+			np.copy(self.agent.scent()), np.copy(self.agent.vision()), np.copy(self.agent.collected_items())))
+
+# two simulators with the same seed, one of which invokes its step callback
+# on a separate thread, should observe the same sequence of agent states
+config = make_config()
+sync_recorder, async_recorder = StepRecorder(), StepRecorder(delay=0.002)
+sync_recorder.sim = nel.Simulator(sim_config=config, on_step_callback=sync_recorder.on_step)
+async_recorder.sim = nel.Simulator(sim_config=config, on_step_callback=async_recorder.on_step, asynchronous_callbacks=True)
+sync_recorder.agent = SimpleAgent(sync_recorder.sim)
+async_recorder.agent = SimpleAgent(async_recorder.sim)
+
+step_count = 200
+for t in range(step_count):
+	sync_recorder.agent.do_next_action()
+	async_recorder.agent.do_next_action()
+async_recorder.sim.wait_for_callbacks()
+
+# every step should be delivered exactly once, in order, with the state of that step
+if len(async_recorder.records) != len(sync_recorder.records):
+	raise RuntimeError('The asynchronous callback was invoked %d times, but the synchronous one %d times.' % (len(async_recorder.records), len(sync_recorder.records)))
+for (expected, actual) in zip(sync_recorder.records, async_recorder.records):
+	if actual[0] != expected[0]:
+		raise RuntimeError('The asynchronous callback received step %d in place of step %d.' % (actual[0], expected[0]))
+	if not np.array_equal(actual[1], expected[1]) or actual[2] != expected[2]:
+		raise RuntimeError('The agent position or direction differs at step %d.' % expected[0])
+	if not np.array_equal(actual[3], expected[3]) or not np.array_equal(actual[4], expected[4]) or not np.array_equal(actual[5], expected[5]):
+		raise RuntimeError('The agent observations or items differ at step %d.' % expected[0])
+
+print('The asynchronous callback received the same %d steps as the synchronous one.' % len(async_recorder.records))
@@ -0,0 +1,49 @@
+import nel
+from simulator_test import SimpleAgent, make_config
+from threading import Lock, Condition
+import numpy as np
+
+cv = Condition(Lock())
+steps = 0
+
+def on_step():
+	global steps
+	cv.acquire()
+	steps += 1
+	cv.notify()
+	cv.release()
+
+# agents are added at the same position, so collisions are disabled
+config = make_config()
+config.collision_policy = nel.MovementConflictPolicy.NO_COLLISIONS
+
+# create a server with batched observations, and a client in the same process
+server = nel.Simulator(sim_config=config, is_server=True, batched_observations=True, on_step_callback=on_step)
+server_agent = SimpleAgent(server)
+client = nel.Simulator(server_address="localhost")
+
+# the client adds agents until the observation buffers of the server are
+# reallocated (more than once), which the server only notices in its step
+# callback, while the simulator is locked
+client_agents = []
+for t in range(40):
+	client_agents.append(SimpleAgent(client))
+	expected_steps = steps + 1
+	server_agent.do_next_action()
+	for agent in client_agents:
+		agent.do_next_action()
+
+	cv.acquire()
+	while steps < expected_steps:
+		if not cv.wait(timeout=10.0):
+			cv.release()
+			raise RuntimeError('The server did not step within 10 seconds after %d client agents were added.' % len(client_agents))
+	cv.release()
+
+	(scent, vision, items) = server.observations()
+	if scent.shape[0] != len(client_agents) + 1:
+		raise RuntimeError('Expected observations of %d agents, but got %d.' % (len(client_agents) + 1, scent.shape[0]))
+	if not np.array_equal(server_agent.scent(), scent[0]) or not np.array_equal(server_agent.vision(), vision[0]):
+		raise RuntimeError('The observation views of the server agent are stale after %d client agents were added.' % len(client_agents))
+
+print('The observation views were updated as the client added %d agents.' % len(client_agents))
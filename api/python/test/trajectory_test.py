@@ -0,0 +1,58 @@
+import nel
+import numpy as np
+import os
+import tempfile
+from simulator_test import make_config
+
+class WalkingAgent(nel.Agent):
+	def do_next_action(self):
+		self.move(nel.RelativeDirection.FORWARD)
+
+	def save(self, filepath):
+		pass
+
+	def _load(self, filepath):
+		pass
+
+# with a tiny memory budget, the patches behind the agent are moved to disk as it walks away
+config = make_config()
+sim = nel.Simulator(sim_config=config, memory_budget=1)
+agent = WalkingAgent(sim)
+for t in range(200):
+	agent.do_next_action()
+agent.turn(nel.RelativeDirection.LEFT)
+agent.turn(nel.RelativeDirection.LEFT)
+
+# record the walk back, which loads the evicted patches again
+filepath = os.path.join(tempfile.mkdtemp(), 'trajectory')
+sim.start_recording(filepath, chunk_steps=64, compress=False)
+positions = []
+for t in range(200):
+	agent.do_next_action()
+	positions.append(agent.position().copy())
+sim.stop_recording()
+
+reader = nel.TrajectoryReader(filepath)
+if reader.num_steps != len(positions):
+	raise RuntimeError('Expected %d recorded steps, but found %d.' % (len(positions), reader.num_steps))
+recorded_positions = np.stack([reader.column('agent_x'), reader.column('agent_y')], axis=1)
+if not np.array_equal(recorded_positions, np.array(positions)):
+	raise RuntimeError('The recorded positions of the agent differ from its positions in the simulation.')
+
+# every patch the agent walked through must have its items recorded, including the evicted ones
+patch_size = config.patch_size
+kinds = reader.column('event_kind')
+created = (kinds == nel.TrajectoryEvent.CREATED.value)
+event_locations = np.stack([reader.column('event_x'), reader.column('event_y')], axis=1)
+created_patches = set(map(tuple, event_locations[created] // patch_size))
+visited_patches = set(map(tuple, np.array(positions) // patch_size))
+if not visited_patches <= created_patches:
+	raise RuntimeError('No items were recorded as created in the patches %s.' % sorted(visited_patches - created_patches))
+
+created_locations = set(map(tuple, event_locations[created]))
+for location in event_locations[kinds == nel.TrajectoryEvent.COLLECTED.value]:
+	if tuple(location) not in created_locations:
+		raise RuntimeError('The item collected at %s was never recorded as created.' % (tuple(location),))
+
+del sim
+print('The trajectory of %d steps matches the simulation.' % reader.num_steps)
@@ -0,0 +1,18 @@
+from __future__ import absolute_import, division, print_function
+
+import nel
+import numpy as np
+from nel.environments import sim_config, reward_fn
+
+num_envs = 4
+env = nel.NELVectorEnv(sim_config, reward_fn, num_envs)
+observation = env.reset()
+assert observation['scent'].shape[0] == num_envs
+
+for t in range(1000):
+  actions = env.action_space.sample()
+  observation, rewards, dones, infos = env.step(actions)
+  assert rewards.shape == (num_envs,)
+  assert observation['vision'].shape[0] == num_envs
+  assert not np.any(dones)
+print('Stepped %d environments for 1000 steps.' % num_envs)
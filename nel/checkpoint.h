@@ -0,0 +1,499 @@
+#ifndef NEL_CHECKPOINT_H_
+#define NEL_CHECKPOINT_H_
+
+#include <core/array.h>
+#include <core/io.h>
+#include <core/utility.h>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <random>
+#include <condition_variable>
+#include "snapshot.h"
+
+namespace nel {
+
+using namespace core;
+
+/**
+ * The header at the beginning of each delta in the delta file of an
+ * incremental checkpoint. A checkpoint consists of a base snapshot (see
+ * `snapshot_header`) and a delta file, to which a delta is appended at
+ * every checkpoint after the base was written. Each delta contains:
+ *
+ *  1. The header.
+ *  2. The state section, in the same format as the state section of a
+ *     snapshot. It is small compared to the patches, so it is written in
+ *     full.
+ *  3. The index of the patches that changed since the previous checkpoint,
+ *     an array of `patch_count` `snapshot_patch_record` structures whose
+ *     `item_offset` is relative to the beginning of the delta.
+ *  4. The items of those patches, each array of which begins at a multiple
+ *     of `SNAPSHOT_ALIGNMENT` bytes.
+ *  5. A footer containing `MAGIC ^ time`, so that a delta that was only
+ *     partially written (e.g. if the process was interrupted) is detected.
+ *
+ * The latest record of a patch among the deltas supersedes both the records
+ * of the earlier deltas and the base. Each delta records the `generation` of
+ * the base to which it applies, since the delta file is only truncated after
+ * a new base was written, and deltas left over from an earlier base must be
+ * ignored.
+ */
+struct checkpoint_delta_header {
+	static constexpr uint64_t MAGIC = 0x31544C44204C454Eull; /* "NEL DLT1" */
+
+	uint64_t magic;
+
+	/* the length of this delta in bytes, including the header and footer */
+	uint64_t length;
+	uint64_t time;
+	uint64_t base_generation;
+	uint64_t state_offset;
+	uint64_t state_length;
+	uint64_t index_offset;
+	uint64_t patch_count;
+
+	inline const snapshot_patch_record* records() const {
+		return (const snapshot_patch_record*) ((const char*) this + index_offset);
+	}
+};
+
+/**
+ * Finds the deltas in the `size` bytes of the delta file `data` whose time
+ * is at most `max_time`, and adds their offsets to `offsets` in the order
+ * in which they were written. Scanning stops at the first delta that is
+ * incomplete, inconsistent with the layout of `Item`, or that does not
+ * apply to the base with the given `generation`.
+ *
+ * \returns `true` if successful; `false` if memory could not be allocated.
+ */
+template<typename Item>
+bool find_checkpoint_deltas(const char* data, size_t size,
+		uint64_t generation, uint64_t max_time, array<uint64_t>& offsets)
+{
+	constexpr uint64_t min_length = sizeof(checkpoint_delta_header) + sizeof(uint64_t);
+	uint64_t offset = 0;
+	while (size - offset >= min_length) {
+		const checkpoint_delta_header& header = *(const checkpoint_delta_header*) (data + offset);
+		if (header.magic != checkpoint_delta_header::MAGIC
+		 || header.base_generation != generation
+		 || header.length < min_length || header.length > size - offset
+		 || header.length % SNAPSHOT_ALIGNMENT != 0
+		 || *(const uint64_t*) (data + offset + header.length - sizeof(uint64_t)) != (checkpoint_delta_header::MAGIC ^ header.time)
+		 || header.state_offset + header.state_length > header.length
+		 || header.index_offset % SNAPSHOT_ALIGNMENT != 0
+		 || header.index_offset + header.patch_count * sizeof(snapshot_patch_record) > header.length)
+			break;
+
+		bool valid = true;
+		const snapshot_patch_record* records = header.records();
+		for (uint64_t i = 0; valid && i < header.patch_count; i++) {
+			valid = (records[i].item_offset % SNAPSHOT_ALIGNMENT == 0)
+				 && (records[i].item_offset + (uint64_t) records[i].item_count * sizeof(Item) <= header.length);
+		}
+		if (!valid || header.time > max_time) break;
+
+		if (!offsets.add(offset)) return false;
+		offset += header.length;
+	}
+	return true;
+}
+
+/* a patch record that is merged during compaction, along with the location of its items */
+struct checkpoint_merge_record {
+	snapshot_patch_record record;
+	const char* items;
+
+	/* the index of the delta containing this record, where 0 is the base */
+	uint64_t order;
+
+	/* the records of each patch are sorted from the latest to the earliest */
+	inline bool operator < (const checkpoint_merge_record& other) const {
+		if (record.key < other.record.key) return true;
+		else if (other.record.key < record.key) return false;
+		return order > other.order;
+	}
+
+	static inline void move(const checkpoint_merge_record& src, checkpoint_merge_record& dst) {
+		dst = src;
+	}
+
+	static inline void swap(checkpoint_merge_record& first, checkpoint_merge_record& second) {
+		checkpoint_merge_record temp = first;
+		first = second;
+		second = temp;
+	}
+};
+
+/**
+ * Merges the deltas in the delta file at `delta_filepath` into the base
+ * snapshot at `base_filepath`. The merged snapshot contains the state
+ * section of the last delta and the latest version of each patch. It is
+ * written to a temporary file that is renamed over the base, so a
+ * simulator that has the base mapped is unaffected. The delta file is not
+ * modified: applying its deltas again to the merged snapshot produces the
+ * same state, so the caller can truncate it at any point afterwards.
+ *
+ * \returns `true` if successful; `false` otherwise.
+ */
+template<typename Item>
+bool compact_checkpoint(const char* base_filepath, const char* delta_filepath)
+{
+	const char* delta_data; size_t delta_size;
+	if (!map_snapshot_file(delta_filepath, delta_data, delta_size))
+		return true; /* there are no deltas to merge */
+
+	mapped_snapshot base;
+	if (!init<Item>(base, base_filepath)) {
+		unmap_snapshot_file(delta_data, delta_size);
+		return false;
+	}
+
+	array<uint64_t> offsets(16);
+	if (!find_checkpoint_deltas<Item>(delta_data, delta_size, base.header->generation, UINT64_MAX, offsets)) {
+		free(base); unmap_snapshot_file(delta_data, delta_size);
+		return false;
+	} else if (offsets.length == 0) {
+		free(base); unmap_snapshot_file(delta_data, delta_size);
+		return true;
+	}
+
+	array<checkpoint_merge_record> merged(max((size_t) 16, (size_t) base.header->patch_count));
+	bool success = true;
+	for (uint64_t i = 0; success && i < base.header->patch_count; i++)
+		success = merged.add({base.records[i], base.data + base.records[i].item_offset, 0});
+	for (unsigned int i = 0; success && i < offsets.length; i++) {
+		const checkpoint_delta_header& header = *(const checkpoint_delta_header*) (delta_data + offsets[i]);
+		const snapshot_patch_record* records = header.records();
+		for (uint64_t j = 0; success && j < header.patch_count; j++)
+			success = merged.add({records[j], (const char*) &header + records[j].item_offset, (uint64_t) i + 1});
+	}
+	if (merged.length > 1) sort(merged);
+
+	/* keep only the latest record of each patch */
+	array<snapshot_patch_record> records(max((size_t) 1, merged.length));
+	array<const Item*> items(max((size_t) 1, merged.length));
+	for (unsigned int i = 0; success && i < merged.length; i++) {
+		if (i > 0 && !(merged[i - 1].record.key < merged[i].record.key)) continue;
+		records[records.length++] = merged[i].record;
+		items[items.length++] = (const Item*) merged[i].items;
+	}
+
+	size_t length = strlen(base_filepath);
+	char* temp_filepath = (char*) malloc(sizeof(char) * (length + 5));
+	if (!success || temp_filepath == NULL) {
+		fprintf(stderr, "compact_checkpoint ERROR: Out of memory.\n");
+		if (temp_filepath != NULL) free(temp_filepath);
+		free(base); unmap_snapshot_file(delta_data, delta_size);
+		return false;
+	}
+	memcpy(temp_filepath, base_filepath, sizeof(char) * length);
+	memcpy(temp_filepath + length, ".tmp", sizeof(char) * 5);
+
+	FILE* file = open_file(temp_filepath, "wb");
+	if (file == NULL) {
+		fprintf(stderr, "compact_checkpoint ERROR: Unable to open '%s' for writing. ", temp_filepath);
+		perror(""); free(temp_filepath); free(base);
+		unmap_snapshot_file(delta_data, delta_size);
+		return false;
+	}
+
+	/* the header is written last, once the offsets of the sections are known */
+	auto get_items = [&](size_t i) { return items[i]; };
+	const checkpoint_delta_header& last = *(const checkpoint_delta_header*) (delta_data + offsets[offsets.length - 1]);
+	snapshot_header header;
+	memset(&header, 0, sizeof(header));
+	success = (fwrite(&header, sizeof(header), 1, file) == 1)
+		   && (fwrite((const char*) &last + last.state_offset, 1, (size_t) last.state_length, file) == last.state_length)
+		   && write_snapshot_index<Item>(file, sizeof(snapshot_header) + last.state_length,
+				records.data, records.length, get_items, base.header->generation);
+	if (fclose(file) != 0) success = false;
+	free(base); unmap_snapshot_file(delta_data, delta_size);
+
+#if defined(_WIN32)
+	remove(base_filepath);
+#endif
+	if (!success || rename(temp_filepath, base_filepath) != 0) {
+		fprintf(stderr, "compact_checkpoint ERROR: Unable to write the snapshot '%s'.\n", base_filepath);
+		remove(temp_filepath);
+		free(temp_filepath); return false;
+	}
+	free(temp_filepath);
+	return true;
+}
+
+/**
+ * Writes the incremental checkpoints of a simulator (see `checkpoint` in
+ * simulator.h). The first checkpoint writes a full snapshot to
+ * `base_filepath`. Every later checkpoint copies the state section and the
+ * patches that changed since the previous checkpoint into a buffer, which a
+ * background thread appends to `delta_filepath`, so the simulator is only
+ * blocked while the buffer is built. After every `compaction_frequency`
+ * deltas (unless it is 0), the background thread also merges the deltas
+ * into the base (keeping its `generation`) and truncates the delta file.
+ * Each new base is given a new `generation`, with which the later deltas
+ * are stamped. At most
+ * `MAX_PENDING_CHECKPOINTS` deltas are buffered at a time; further
+ * checkpoints wait for the background thread to catch up.
+ */
+struct checkpointer
+{
+	static constexpr unsigned int MAX_PENDING_CHECKPOINTS = 2;
+
+	char* base_filepath;
+	char* delta_filepath;
+
+	/* only accessed by the writer thread, or while no jobs are pending */
+	FILE* delta_file;
+
+	unsigned int compaction_frequency;
+	unsigned int delta_count;
+
+	/* the generation of the current base, only accessed by the thread writing the checkpoints */
+	uint64_t generation;
+
+	/* a buffered delta, or a request to compact the checkpoint if `data` is NULL */
+	struct job {
+		char* data;
+		size_t length;
+	};
+
+	/* the jobs that were not yet completed, in order, protected by `lock` */
+	array<job> pending;
+
+	/**
+	 * Set if no base was written yet, or if a delta could not be written,
+	 * in which case the later deltas are discarded and the next checkpoint
+	 * writes a new base. Protected by `lock`.
+	 */
+	bool needs_base;
+
+	bool running;
+	std::thread writer;
+	std::mutex lock;
+	std::condition_variable pending_cv;
+	std::condition_variable done_cv;
+
+	static inline void free(checkpointer& c) {
+		c.free_helper();
+		core::free(c.pending);
+		c.writer.~thread();
+		c.lock.~mutex();
+		c.pending_cv.~condition_variable();
+		c.done_cv.~condition_variable();
+	}
+
+private:
+	template<typename Item>
+	void run_writer() {
+		while (true) {
+			std::unique_lock<std::mutex> lck(lock);
+			while (running && pending.length == 0)
+				pending_cv.wait(lck);
+			if (pending.length == 0) return;
+			job next = pending[0];
+			bool discard = needs_base;
+			lck.unlock();
+
+			bool success = true;
+			if (discard) {
+				/* an earlier delta is missing, so this one is superseded by the next base */
+			} else if (next.data != NULL) {
+				success = (fwrite(next.data, 1, next.length, delta_file) == next.length)
+					   && (fflush(delta_file) == 0);
+				if (!success)
+					fprintf(stderr, "checkpointer.run_writer ERROR: Unable to append to '%s'.\n", delta_filepath);
+			} else if (compact_checkpoint<Item>(base_filepath, delta_filepath)) {
+				/* the base now contains every delta */
+				FILE* file = open_file(delta_filepath, "wb");
+				if (file == NULL) {
+					fprintf(stderr, "checkpointer.run_writer ERROR: Unable to truncate '%s'.\n", delta_filepath);
+				} else {
+					fclose(delta_file);
+					delta_file = file;
+				}
+			}
+			if (next.data != NULL)
+				core::free(next.data);
+
+			lck.lock();
+			if (!success) needs_base = true;
+			for (unsigned int i = 1; i < pending.length; i++)
+				pending[i - 1] = pending[i];
+			pending.length--;
+			done_cv.notify_all();
+		}
+	}
+
+	inline bool init_helper(const char* base, const char* delta, unsigned int frequency) {
+		base_filepath = (char*) malloc(sizeof(char) * (strlen(base) + 1));
+		if (base_filepath == NULL) {
+			fprintf(stderr, "checkpointer.init_helper ERROR: Insufficient memory for base_filepath.\n");
+			return false;
+		}
+		delta_filepath = (char*) malloc(sizeof(char) * (strlen(delta) + 1));
+		if (delta_filepath == NULL) {
+			fprintf(stderr, "checkpointer.init_helper ERROR: Insufficient memory for delta_filepath.\n");
+			core::free(base_filepath); return false;
+		}
+		strcpy(base_filepath, base);
+		strcpy(delta_filepath, delta);
+		delta_file = NULL;
+		compaction_frequency = frequency;
+		delta_count = 0;
+		generation = 0;
+		needs_base = true;
+		running = true;
+		return true;
+	}
+
+	inline void free_helper() {
+		/* the writer thread completes the pending jobs before it returns */
+		std::unique_lock<std::mutex> lck(lock);
+		running = false;
+		pending_cv.notify_all();
+		lck.unlock();
+		if (writer.joinable()) {
+			try {
+				writer.join();
+			} catch (...) { }
+		}
+		if (delta_file != NULL)
+			fclose(delta_file);
+		core::free(base_filepath);
+		core::free(delta_filepath);
+	}
+
+	template<typename Item>
+	friend bool init(checkpointer&, const char*, const char*, unsigned int);
+	template<typename Item>
+	friend bool start_checkpointer(checkpointer&);
+};
+
+/* starts the writer thread of `c`, whose deltas contain items of type `Item` */
+template<typename Item>
+bool start_checkpointer(checkpointer& c) {
+	try {
+		c.writer = std::thread(&checkpointer::run_writer<Item>, &c);
+	} catch (...) {
+		fprintf(stderr, "start_checkpointer ERROR: Unable to start the writer thread.\n");
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Initializes the checkpointer `c`, which writes its base snapshot to
+ * `base_filepath` and its deltas to `delta_filepath`, and merges the deltas
+ * into the base after every `compaction_frequency` deltas (or never, if it
+ * is 0).
+ */
+template<typename Item>
+bool init(checkpointer& c, const char* base_filepath,
+		const char* delta_filepath, unsigned int compaction_frequency)
+{
+	if (!array_init(c.pending, checkpointer::MAX_PENDING_CHECKPOINTS + 1)) {
+		return false;
+	} else if (!c.init_helper(base_filepath, delta_filepath, compaction_frequency)) {
+		free(c.pending); return false;
+	}
+	new (&c.writer) std::thread();
+	new (&c.lock) std::mutex();
+	new (&c.pending_cv) std::condition_variable();
+	new (&c.done_cv) std::condition_variable();
+	if (!start_checkpointer<Item>(c)) {
+		free(c);
+		return false;
+	}
+	return true;
+}
+
+/* returns `true` if the next checkpoint of `c` must write a new base */
+inline bool checkpoint_needs_base(checkpointer& c) {
+	std::unique_lock<std::mutex> lck(c.lock);
+	return c.needs_base;
+}
+
+/* waits until the writer thread of `c` has completed every pending job */
+inline void flush_checkpoints(checkpointer& c) {
+	std::unique_lock<std::mutex> lck(c.lock);
+	while (c.pending.length > 0)
+		c.done_cv.wait(lck);
+}
+
+/* returns a new nonzero generation for a checkpoint base, which is unlikely to repeat across processes */
+inline uint64_t new_checkpoint_generation() {
+	std::random_device device;
+	uint64_t generation = ((uint64_t) device() << 32) ^ device()
+			^ (uint64_t) std::chrono::high_resolution_clock::now().time_since_epoch().count();
+	return (generation == 0) ? 1 : generation;
+}
+
+/**
+ * Prepares `c` for a new base: waits for the pending jobs and chooses the
+ * `generation` of the new base. The caller then writes the base, with this
+ * generation, and calls `end_checkpoint_base`.
+ */
+inline void begin_checkpoint_base(checkpointer& c) {
+	flush_checkpoints(c);
+	c.generation = new_checkpoint_generation();
+}
+
+/**
+ * Truncates the delta file of `c`, once the new base has been written. If
+ * the process is interrupted before the truncation, the remaining deltas
+ * are ignored since they belong to the previous generation, so the
+ * checkpoint is still restored from the new base.
+ *
+ * \returns `true` if successful; `false` otherwise, in which case the next
+ *          checkpoint writes a new base.
+ */
+inline bool end_checkpoint_base(checkpointer& c) {
+	FILE* file = open_file(c.delta_filepath, "wb");
+	if (file == NULL) {
+		fprintf(stderr, "end_checkpoint_base ERROR: Unable to open '%s' for writing. ", c.delta_filepath);
+		perror(""); return false;
+	}
+	if (c.delta_file != NULL)
+		fclose(c.delta_file);
+	c.delta_file = file;
+
+	std::unique_lock<std::mutex> lck(c.lock);
+	c.needs_base = false;
+	c.delta_count = 0;
+	return true;
+}
+
+/**
+ * Passes the delta in the first `length` bytes of `data`, which must have
+ * been allocated with `malloc`, to the writer thread of `c`, which takes
+ * ownership of it. If the checkpoint is due for compaction, a compaction is
+ * requested after the delta is written. If too many deltas are buffered,
+ * this function waits for the writer thread to catch up.
+ *
+ * \returns `true` if successful; `false` otherwise, in which case `data` is
+ *          freed.
+ */
+inline bool submit_checkpoint_delta(checkpointer& c, char* data, size_t length)
+{
+	std::unique_lock<std::mutex> lck(c.lock);
+	while (c.pending.length >= checkpointer::MAX_PENDING_CHECKPOINTS)
+		c.done_cv.wait(lck);
+
+	bool compact = (c.compaction_frequency != 0 && ++c.delta_count >= c.compaction_frequency);
+	if (!c.pending.ensure_capacity(c.pending.length + 2)) {
+		fprintf(stderr, "submit_checkpoint_delta ERROR: Out of memory.\n");
+		core::free(data); return false;
+	}
+	c.pending[c.pending.length++] = {data, length};
+	if (compact) {
+		c.pending[c.pending.length++] = {NULL, 0};
+		c.delta_count = 0;
+	}
+	c.pending_cv.notify_one();
+	return true;
+}
+
+} /* namespace nel */
+
+#endif /* NEL_CHECKPOINT_H_ */
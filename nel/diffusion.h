@@ -21,6 +21,15 @@ struct diffusion
 	/* the cache of pre-computed states */
 	T** cache;
 
+	/**
+	 * The same states as `cache`, converted to float and unfolded into the
+	 * full quadrant, stored contiguously as a `max_time` by `radius` by
+	 * `radius` array. This is the table read by the scent computations, since
+	 * it requires neither the symmetric folding of `get_value` nor a pointer
+	 * indirection per time step.
+	 */
+	float* table;
+
 	~diffusion() { free_helper(); }
 
 	inline T get_value(unsigned int t, int x, int y) const {
@@ -38,6 +47,11 @@ struct diffusion
 		return cache[t][(x * (x + 1)) / 2 + y];
 	}
 
+	/* returns the value at time `t` and position (`x`, `y`), where both coordinates are absolute values less than `radius` */
+	inline float get_table_value(unsigned int t, unsigned int x, unsigned int y) const {
+		return table[(t * radius + x) * radius + y];
+	}
+
 	static inline void free(diffusion<T>& model) {
 		model.free_helper();
 	}
@@ -47,6 +61,7 @@ private:
 		for (unsigned int t = 0; t < max_time; t++)
 			core::free(cache[t]);
 		core::free(cache);
+		core::free(table);
 	}
 };
 
@@ -109,6 +124,18 @@ bool init(diffusion<T>& model, T alpha, T lambda,
 							+ model.get_value(t - 1, x, y + 1)
 							+ model.get_value(t - 1, x, y - 1));
 	}
+
+	/* unfold the cache into the float table */
+	model.table = (float*) malloc(sizeof(float) * max(1u, max_time * radius * radius));
+	if (model.table == NULL) {
+		fprintf(stderr, "init ERROR: Insufficient memory for diffusion.table.\n");
+		for (unsigned int t = 0; t < max_time; t++) free(model.cache[t]);
+		free(model.cache); return false;
+	}
+	for (unsigned int t = 0; t < max_time; t++)
+		for (unsigned int x = 0; x < radius; x++)
+			for (unsigned int y = 0; y < radius; y++)
+				model.table[(t * radius + x) * radius + y] = (float) model.get_value(t, x, y);
 	return true;
 }
 
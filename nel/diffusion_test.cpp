@@ -19,6 +19,13 @@ void test_diffusion(T alpha, T lambda,
 				model.get_value(t, 0, 0), model.get_value(t, radius - 1, 0), radius - 1,
 				model.get_value(t, radius - 1, radius - 1), radius - 1, radius - 1);
 	}
+
+	/* check that the unfolded table agrees with the folded cache */
+	for (unsigned int t = 0; t < max_time; t++)
+		for (int x = 1 - radius; x < radius; x++)
+			for (int y = 1 - radius; y < radius; y++)
+				if (model.get_table_value(t, abs(x), abs(y)) != (float) model.get_value(t, x, y))
+					fprintf(stderr, "test_diffusion ERROR: The table disagrees with the cache at t = %u, (%d,%d).\n", t, x, y);
 	free(model);
 }
 
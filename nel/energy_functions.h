@@ -2,6 +2,8 @@
 #define ENERGY_FUNCTIONS_H_
 
 #include "position.h"
+#include <math.h>
+#include <limits.h>
 
 namespace nel {
 
@@ -175,6 +177,38 @@ inline bool is_stationary(const interaction_function function) {
 		 || function == cross_interaction_fn);
 }
 
+/**
+ * Returns a radius `r` such that the given interaction function, with
+ * arguments `args`, is zero for any two positions whose Chebyshev distance
+ * (the maximum of the distances along each axis) is greater than `r`. If
+ * there is no such bound, or if the function is unrecognized, `UINT_MAX` is
+ * returned.
+ */
+inline unsigned int interaction_support_radius(const interaction_function function, const float* args)
+{
+	float radius;
+	if (function == zero_interaction_fn) {
+		return 0;
+	} else if (function == piecewise_box_interaction_fn) {
+		/* the Chebyshev distance is at most the Euclidean distance */
+		float cutoff = 0.0f;
+		if (args[2] != 0.0f) cutoff = args[0];
+		if (args[3] != 0.0f && args[1] > cutoff) cutoff = args[1];
+		if (cutoff <= 0.0f) return 0;
+		radius = ceil(sqrt(cutoff));
+	} else if (function == cross_interaction_fn) {
+		radius = 0.0f;
+		if (args[2] != 0.0f || args[4] != 0.0f) radius = args[0];
+		if ((args[3] != 0.0f || args[5] != 0.0f) && args[1] > radius) radius = args[1];
+		if (radius <= 0.0f) return 0;
+		radius = floor(radius);
+	} else {
+		return UINT_MAX;
+	}
+	if (!(radius < (float) UINT_MAX)) return UINT_MAX;
+	return (unsigned int) radius;
+}
+
 } /* namespace nel */
 
 #endif /* ENERGY_FUNCTIONS_H_ */
@@ -0,0 +1,294 @@
+#ifndef NEL_EVICTION_H_
+#define NEL_EVICTION_H_
+
+#include <core/array.h>
+#include <core/map.h>
+#include <core/utility.h>
+#include <stdio.h>
+#include <stdint.h>
+#include "position.h"
+
+#if !defined(_WIN32)
+#include <sys/types.h>
+#endif
+
+namespace nel {
+
+using namespace core;
+
+/**
+ * The location of an evicted patch in its `eviction_store`, along with the
+ * fields of the patch that are restored when it is loaded back into memory.
+ */
+struct evicted_patch {
+	uint64_t offset;
+	uint32_t item_count;
+	bool fixed;
+	bool checkpoint_fixed;
+
+	/* whether the patch was evicted before the current trajectory started recording, so its items were not recorded yet */
+	bool unrecorded;
+	uint64_t version;
+	uint64_t checkpoint_version;
+
+	inline bool is_dirty() const {
+		return version != checkpoint_version || fixed != checkpoint_fixed;
+	}
+
+	inline void mark_checkpointed() {
+		checkpoint_version = version;
+		checkpoint_fixed = fixed;
+	}
+};
+
+/**
+ * An on-disk store for the patches that were evicted from memory by
+ * `map.evict_patches`. The items of each patch are appended to a file, and
+ * only the index from the patch positions to their location in the file is
+ * kept in memory. When a patch is loaded back into memory, its items in the
+ * file become garbage, and once the garbage is more than half of the file,
+ * the remaining patches are copied to a new file.
+ *
+ * The file is a temporary file that is deleted when the store is freed: it
+ * is not a checkpoint, and the evicted patches are written to checkpoints and
+ * snapshots along with the patches in memory.
+ */
+template<typename Item>
+struct eviction_store
+{
+	/* the minimum size of the file, in bytes, before garbage is collected */
+	static constexpr uint64_t MIN_COMPACTION_LENGTH = 64 * 1024 * 1024;
+
+	FILE* file;
+
+	/* the path of `file`, or NULL if it is an anonymous temporary file */
+	char* filepath;
+
+	uint64_t length;
+	uint64_t garbage;
+	hash_map<position, evicted_patch> index;
+
+	/* returns the record of the evicted patch at `key`, or NULL if it was not evicted */
+	inline evicted_patch* find(const position& key) const {
+		if (index.table.size == 0) return NULL;
+		bool contains; unsigned int bucket;
+		index.get(key, contains, bucket);
+		return contains ? &index.values[bucket] : NULL;
+	}
+
+	/**
+	 * Appends the `item_count` items in `items` to the file, and adds the
+	 * patch at `key` to the index with the fields in `record` (whose
+	 * `offset` and `item_count` are overwritten).
+	 */
+	bool put(const position& key, const Item* items,
+			unsigned int item_count, evicted_patch record)
+	{
+		if (!index.check_size(alloc_position_keys)) {
+			fprintf(stderr, "eviction_store.put ERROR: Insufficient memory for index.\n");
+			return false;
+		}
+		record.offset = length;
+		record.item_count = item_count;
+		if (!seek(file, length)
+		 || fwrite(items, sizeof(Item), item_count, file) != item_count)
+		{
+			fprintf(stderr, "eviction_store.put ERROR: Unable to write to the eviction file.\n");
+			return false;
+		}
+		length += (uint64_t) item_count * sizeof(Item);
+
+		bool contains; unsigned int bucket;
+		index.get(key, contains, bucket);
+		if (contains) {
+			garbage += (uint64_t) index.values[bucket].item_count * sizeof(Item);
+		} else {
+			index.table.keys[bucket] = key;
+			index.table.size++;
+		}
+		index.values[bucket] = record;
+		return true;
+	}
+
+	/* reads the items of the evicted patch `record` into `items` */
+	bool read_items(const evicted_patch& record, array<Item>& items) {
+		if (!items.ensure_capacity(max((size_t) 1, (size_t) record.item_count))) {
+			fprintf(stderr, "eviction_store.read_items ERROR: Out of memory.\n");
+			return false;
+		} else if (!seek(file, record.offset)
+				|| fread(items.data, sizeof(Item), record.item_count, file) != record.item_count)
+		{
+			fprintf(stderr, "eviction_store.read_items ERROR: Unable to read from the eviction file.\n");
+			return false;
+		}
+		items.length = record.item_count;
+		return true;
+	}
+
+	/**
+	 * Removes the patch at `key` from the index, after it was loaded back
+	 * into memory.
+	 *
+	 * \returns `true` if successful; `false` if the garbage could not be
+	 *          collected, in which case the patch is still removed and the
+	 *          store is left unchanged otherwise.
+	 */
+	bool erase(const position& key) {
+		bool contains; unsigned int bucket;
+		index.get(key, contains, bucket);
+		if (!contains) return true;
+		garbage += (uint64_t) index.values[bucket].item_count * sizeof(Item);
+		index.remove_at(bucket);
+		if (garbage > MIN_COMPACTION_LENGTH && 2 * garbage > length)
+			return compact();
+		return true;
+	}
+
+	static inline void free(eviction_store<Item>& store) {
+		fclose(store.file);
+		if (store.filepath != NULL) {
+			remove(store.filepath);
+			core::free(store.filepath);
+		}
+		core::free(store.index);
+	}
+
+private:
+	/* moves to the 64-bit `offset` in `file`, since `long` is 32 bits on some platforms */
+	static inline bool seek(FILE* file, uint64_t offset) {
+#if defined(_WIN32)
+		return _fseeki64(file, (__int64) offset, SEEK_SET) == 0;
+#else
+		return fseeko(file, (off_t) offset, SEEK_SET) == 0;
+#endif
+	}
+
+	/**
+	 * Copies the evicted patches to a new file, discarding the garbage. The
+	 * offsets in the index are only updated once every patch was copied, so
+	 * if copying fails, the store still refers to the old file.
+	 */
+	bool compact() {
+		FILE* new_file = open_temporary_file(filepath);
+		if (new_file == NULL) return false;
+
+		array<Item> items(64);
+		array<uint64_t> new_offsets(max((size_t) 1, (size_t) index.table.size));
+		uint64_t new_length = 0;
+		for (auto entry : index) {
+			if (!read_items(entry.value, items)
+			 || fwrite(items.data, sizeof(Item), items.length, new_file) != items.length)
+			{
+				fprintf(stderr, "eviction_store.compact ERROR: Unable to copy the evicted patches.\n");
+				discard_temporary_file(new_file, filepath);
+				return false;
+			}
+			new_offsets[new_offsets.length++] = new_length;
+			new_length += (uint64_t) items.length * sizeof(Item);
+		}
+
+		if (filepath != NULL) {
+			char* temp_filepath = temporary_filepath(filepath);
+			if (temp_filepath == NULL || rename(temp_filepath, filepath) != 0) {
+				fprintf(stderr, "eviction_store.compact ERROR: Unable to replace the eviction file.\n");
+				if (temp_filepath != NULL) core::free(temp_filepath);
+				discard_temporary_file(new_file, filepath);
+				return false;
+			}
+			core::free(temp_filepath);
+		}
+		fclose(file);
+
+		/* the index is iterated in the same order as above */
+		unsigned int i = 0;
+		for (auto entry : index)
+			entry.value.offset = new_offsets[i++];
+		file = new_file;
+		length = new_length;
+		garbage = 0;
+		return true;
+	}
+
+	/* returns `filepath` followed by ".tmp", allocated with `malloc` */
+	static inline char* temporary_filepath(const char* filepath) {
+		size_t length = strlen(filepath);
+		char* temp_filepath = (char*) malloc(sizeof(char) * (length + 5));
+		if (temp_filepath == NULL) return NULL;
+		memcpy(temp_filepath, filepath, sizeof(char) * length);
+		memcpy(temp_filepath + length, ".tmp", sizeof(char) * 5);
+		return temp_filepath;
+	}
+
+	/* opens a new file next to `filepath`, or an anonymous temporary file if it is NULL */
+	static inline FILE* open_temporary_file(const char* filepath) {
+		FILE* new_file;
+		if (filepath == NULL) {
+			new_file = tmpfile();
+		} else {
+			char* temp_filepath = temporary_filepath(filepath);
+			if (temp_filepath == NULL) return NULL;
+			new_file = open_file(temp_filepath, "w+b");
+			core::free(temp_filepath);
+		}
+		if (new_file == NULL) {
+			fprintf(stderr, "eviction_store ERROR: Unable to create the eviction file. ");
+			perror("");
+		}
+		return new_file;
+	}
+
+	/* closes and removes the file created by `open_temporary_file` */
+	static inline void discard_temporary_file(FILE* new_file, const char* filepath) {
+		fclose(new_file);
+		if (filepath == NULL) return;
+		char* temp_filepath = temporary_filepath(filepath);
+		if (temp_filepath == NULL) return;
+		remove(temp_filepath);
+		core::free(temp_filepath);
+	}
+
+	template<typename A> friend bool init(eviction_store<A>&, const char*);
+};
+
+/**
+ * Initializes the eviction_store `store`, whose file is created at
+ * `filepath` (replacing any existing file), or as an anonymous temporary
+ * file if `filepath` is NULL.
+ */
+template<typename Item>
+bool init(eviction_store<Item>& store, const char* filepath)
+{
+	if (filepath == NULL) {
+		store.filepath = NULL;
+		store.file = tmpfile();
+	} else {
+		store.filepath = (char*) malloc(sizeof(char) * (strlen(filepath) + 1));
+		if (store.filepath == NULL) {
+			fprintf(stderr, "init ERROR: Insufficient memory for eviction_store.filepath.\n");
+			return false;
+		}
+		strcpy(store.filepath, filepath);
+		store.file = open_file(filepath, "w+b");
+	}
+	if (store.file == NULL) {
+		fprintf(stderr, "init ERROR: Unable to create the eviction file. ");
+		perror("");
+		if (store.filepath != NULL) free(store.filepath);
+		return false;
+	} else if (!hash_map_init(store.index, 1024, alloc_position_keys)) {
+		fprintf(stderr, "init ERROR: Insufficient memory for eviction_store.index.\n");
+		fclose(store.file);
+		if (store.filepath != NULL) {
+			remove(store.filepath);
+			free(store.filepath);
+		}
+		return false;
+	}
+	store.length = 0;
+	store.garbage = 0;
+	return true;
+}
+
+} /* namespace nel */
+
+#endif /* NEL_EVICTION_H_ */
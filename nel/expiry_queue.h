@@ -0,0 +1,123 @@
+#ifndef NEL_EXPIRY_QUEUE_H_
+#define NEL_EXPIRY_QUEUE_H_
+
+#include <core/array.h>
+#include <string.h>
+#include "position.h"
+
+namespace nel {
+
+using namespace core;
+
+struct expiry_entry {
+	uint64_t expiry_time;
+	position patch_position;
+
+	inline bool operator < (const expiry_entry& other) const {
+		if (expiry_time < other.expiry_time) return true;
+		else if (other.expiry_time < expiry_time) return false;
+		return patch_position < other.patch_position;
+	}
+
+	static inline void move(const expiry_entry& src, expiry_entry& dst) {
+		dst = src;
+	}
+
+	static inline void swap(expiry_entry& first, expiry_entry& second) {
+		expiry_entry temp = first;
+		first = second;
+		second = temp;
+	}
+};
+
+/**
+ * A queue of the patches that contain deleted items, ordered by the time at
+ * which those items expire. Since every item is deleted at the current time
+ * and expires a fixed number of steps later, entries are pushed in order of
+ * their expiry time, and the queue is a FIFO buffer where the entries in
+ * `[head, entries.length)` are pending. Each entry only identifies the
+ * patch, so that removing other items from the patch does not invalidate it.
+ */
+struct expiry_queue {
+	array<expiry_entry> entries;
+	size_t head;
+
+	expiry_queue(size_t initial_capacity) : entries(initial_capacity), head(0) { }
+
+	inline size_t size() const {
+		return entries.length - head;
+	}
+
+	/**
+	 * Adds an entry for the patch at `patch_position`, which contains an
+	 * item that expires at `expiry_time`. Unless the queue is being rebuilt
+	 * (see `sort_entries`), `expiry_time` must not be earlier than that of
+	 * any pending entry.
+	 */
+	inline bool push(uint64_t expiry_time, const position& patch_position) {
+		if (entries.length > head) {
+			const expiry_entry& last = entries.last();
+			if (last.expiry_time == expiry_time && last.patch_position == patch_position)
+				return true;
+		}
+		if (!entries.ensure_capacity(entries.length + 1)) {
+			fprintf(stderr, "expiry_queue.push ERROR: Out of memory.\n");
+			return false;
+		}
+		entries[entries.length++] = {expiry_time, patch_position};
+		return true;
+	}
+
+	/* sorts the pending entries after they were pushed out of order, e.g. when the queue is rebuilt from the items in a map */
+	inline void sort_entries() {
+		if (size() > 1)
+			sort(entries.data + head, (unsigned int) size());
+	}
+
+	/**
+	 * Removes the entries that expire at or before `current_time`, and adds
+	 * the positions of their patches to `patch_positions` (which may contain
+	 * duplicates).
+	 */
+	bool pop_expired(uint64_t current_time, array<position>& patch_positions) {
+		size_t end = head;
+		while (end < entries.length && entries[end].expiry_time <= current_time)
+			end++;
+		if (!patch_positions.ensure_capacity(patch_positions.length + (end - head))) {
+			fprintf(stderr, "expiry_queue.pop_expired ERROR: Out of memory.\n");
+			return false;
+		}
+		for (size_t i = head; i < end; i++)
+			patch_positions[patch_positions.length++] = entries[i].patch_position;
+		head = end;
+
+		/* reclaim the space of the removed entries once they make up most of the buffer */
+		if (head == entries.length) {
+			entries.clear();
+			head = 0;
+		} else if (head > entries.length / 2) {
+			memmove(entries.data, entries.data + head, sizeof(expiry_entry) * (entries.length - head));
+			entries.length -= head;
+			head = 0;
+		}
+		return true;
+	}
+
+	inline void clear() {
+		entries.clear();
+		head = 0;
+	}
+
+	static inline void free(expiry_queue& queue) {
+		core::free(queue.entries);
+	}
+};
+
+inline bool init(expiry_queue& queue, size_t initial_capacity) {
+	queue.head = 0;
+	return array_init(queue.entries, initial_capacity);
+}
+
+} /* namespace nel */
+
+#endif /* NEL_EXPIRY_QUEUE_H_ */
@@ -5,11 +5,176 @@
 #include <math/log.h>
 #include "position.h"
 #include "energy_functions.h"
+#include "simd.h"
+
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <string.h>
 
 namespace nel {
 
 using namespace core;
 
+/**
+ * The values of a stationary interaction function, with arguments `args`,
+ * between an item at the origin and an item at each offset within `radius`
+ * of it (in Chebyshev distance). `radius` is the support radius of the
+ * function (see `interaction_support_radius`), clipped to `2*n`, since
+ * `gibbs_field_cache` never looks up offsets further than that. The values at
+ * all other offsets are zero. A table is shared by every `gibbs_field_cache`
+ * with the same function, arguments, and patch size `n` (see
+ * `acquire_interaction_table`), and its values are only computed the first
+ * time they are needed.
+ */
+struct interaction_table {
+	interaction_function function;
+	float* args;
+	unsigned int arg_count;
+	unsigned int n;
+	unsigned int radius;
+
+	/* the number of gibbs_field_cache structures that use this table */
+	unsigned int reference_count;
+
+	/* an array of `(2*radius + 1)^2` values, or NULL if it was not yet computed */
+	std::atomic<float*> values;
+
+	/**
+	 * Returns the value of the interaction function between an item at
+	 * `first_position` and an item at `second_position`, where the offset
+	 * `first_position - second_position` is `(x, y)`.
+	 */
+	inline float get(int64_t x, int64_t y) {
+		const int64_t r = radius;
+		if (x < -r || x > r || y < -r || y > r) return 0.0f;
+		const float* table = values.load(std::memory_order_acquire);
+		if (table == NULL) table = compute_values();
+		return table[(x + r) * (2*r + 1) + (y + r)];
+	}
+
+	inline bool matches(interaction_function other_function,
+			const float* other_args, unsigned int other_arg_count, unsigned int other_n) const
+	{
+		return function == other_function && n == other_n && arg_count == other_arg_count
+			&& (arg_count == 0 || memcmp(args, other_args, sizeof(float) * arg_count) == 0);
+	}
+
+	static inline void free(interaction_table& table) {
+		float* table_values = table.values.load(std::memory_order_relaxed);
+		if (table_values != NULL) core::free(table_values);
+		table.values.~atomic();
+		core::free(table.args);
+	}
+
+private:
+	/* NOTE: this may be called concurrently by the threads sampling different patches */
+	const float* compute_values() {
+		const int64_t r = radius;
+		const int64_t width = 2*r + 1;
+		float* table = (float*) malloc(sizeof(float) * width * width);
+		if (table == NULL) {
+			/* this is called while sampling, where there is no way to recover */
+			fprintf(stderr, "interaction_table.compute_values ERROR: Insufficient memory for table.\n");
+			exit(EXIT_FAILURE);
+		}
+		for (int64_t x = -r; x <= r; x++) {
+			for (int64_t y = -r; y <= r; y++) {
+				float value;
+				if (x == 0 && y == 0)
+					value = 0.0f;
+				else value = function(position(0, 0), position(x, y), args);
+				table[(x + r) * width + (y + r)] = value;
+			}
+		}
+
+		/* if another thread computed the values first, use its table instead */
+		float* expected = NULL;
+		if (!values.compare_exchange_strong(expected, table, std::memory_order_acq_rel)) {
+			core::free(table);
+			return expected;
+		}
+		return table;
+	}
+};
+
+/**
+ * The set of `interaction_table` structures in use by this process. It is
+ * accessed from `acquire_interaction_table` and `release_interaction_table`,
+ * which may be called concurrently (e.g. by simulators in different threads).
+ */
+struct interaction_table_registry {
+	std::mutex lock;
+	array<interaction_table*> tables;
+
+	interaction_table_registry() : tables(8) { }
+};
+
+inline interaction_table_registry& get_interaction_tables() {
+	static interaction_table_registry registry;
+	return registry;
+}
+
+/**
+ * Returns the shared table for the stationary interaction function
+ * `function` with arguments `args` and patch size `n`, creating it if no
+ * such table exists (its values are computed lazily). The reference count of
+ * the table is incremented, and the caller must eventually call
+ * `release_interaction_table`.
+ *
+ * \returns the table if successful; NULL if there is insufficient memory.
+ */
+inline interaction_table* acquire_interaction_table(interaction_function function,
+		const float* args, unsigned int arg_count, unsigned int n)
+{
+	interaction_table_registry& registry = get_interaction_tables();
+	std::unique_lock<std::mutex> lck(registry.lock);
+	for (interaction_table* table : registry.tables) {
+		if (table->matches(function, args, arg_count, n)) {
+			table->reference_count++;
+			return table;
+		}
+	}
+
+	if (!registry.tables.ensure_capacity(registry.tables.length + 1)) {
+		fprintf(stderr, "acquire_interaction_table ERROR: Insufficient memory for the registry.\n");
+		return NULL;
+	}
+	interaction_table* table = (interaction_table*) malloc(sizeof(interaction_table));
+	if (table == NULL) {
+		fprintf(stderr, "acquire_interaction_table ERROR: Insufficient memory for table.\n");
+		return NULL;
+	}
+	table->args = (float*) malloc(max((size_t) 1, sizeof(float) * arg_count));
+	if (table->args == NULL) {
+		fprintf(stderr, "acquire_interaction_table ERROR: Insufficient memory for table.args.\n");
+		core::free(table); return NULL;
+	}
+	memcpy(table->args, args, sizeof(float) * arg_count);
+	table->function = function;
+	table->arg_count = arg_count;
+	table->n = n;
+	table->radius = min(interaction_support_radius(function, args), 2*n);
+	table->reference_count = 1;
+	new (&table->values) std::atomic<float*>(NULL);
+	registry.tables[registry.tables.length++] = table;
+	return table;
+}
+
+/* decrements the reference count of `table`, and frees it if it is no longer used */
+inline void release_interaction_table(interaction_table* table) {
+	interaction_table_registry& registry = get_interaction_tables();
+	std::unique_lock<std::mutex> lck(registry.lock);
+	if (--table->reference_count > 0) return;
+	for (unsigned int i = 0; i < registry.tables.length; i++) {
+		if (registry.tables[i] == table) {
+			registry.tables.remove(i);
+			break;
+		}
+	}
+	core::free(*table); core::free(table);
+}
+
 /**
  * Structure for optimizing gibbs_field sampling when the intensity and/or
  * interaction functions are stationary.
@@ -18,9 +183,52 @@ template<typename ItemType>
 struct gibbs_field_cache
 {
 	float* intensities;
-	float** interactions;
+
+	/**
+	 * For each pair of item types `(i, j)` whose interaction function is
+	 * stationary and not constant, `interactions[i*item_type_count + j]` is
+	 * the shared table of that function (see `acquire_interaction_table`).
+	 * Otherwise, it is NULL.
+	 */
+	interaction_table** interactions;
 	unsigned int two_n, four_n;
 
+	/**
+	 * A transposed copy of the interaction tables, for use by the vectorized
+	 * code path. For each item type `j` such that the interactions between
+	 * every item type and `j` are stationary, `transposed_interactions[j]` is
+	 * an array of `(2*r + 1)^2` rows, each of length `padded_type_count`,
+	 * where `r = transposed_radii[j]` and the row at `(x + r)*(2*r + 1) + (y + r)`
+	 * contains, at index `i`, the interaction between an item of type `i` and
+	 * an item of type `j` whose relative position is `(x, y)`. The padding in
+	 * each row is zero. The table is computed the first time it is needed, so
+	 * it is NULL until then.
+	 */
+	std::atomic<float*>* transposed_interactions;
+
+	/**
+	 * The largest support radius of the interactions with each item type
+	 * `j`, clipped to `two_n`, or `UINT_MAX` if some interaction with `j` is
+	 * not stationary (in which case `transposed_interactions[j]` is not used).
+	 */
+	unsigned int* transposed_radii;
+
+	/* a row of `padded_type_count` zeros, for the offsets outside the support */
+	float* zero_row;
+
+	/**
+	 * The number of floats in each row of `transposed_interactions`, which is
+	 * `item_type_count + 1` rounded up to a multiple of `SIMD_FLOAT_COUNT`.
+	 */
+	unsigned int padded_type_count;
+
+	/**
+	 * All interactions are zero between positions whose Chebyshev distance
+	 * is greater than this radius. This is `UINT_MAX` if there is no such
+	 * bound (e.g. if some interaction function is not stationary).
+	 */
+	unsigned int support_radius;
+
 	const ItemType* item_types;
 	unsigned int item_type_count;
 
@@ -38,24 +246,53 @@ struct gibbs_field_cache
 		else return item_types[item_type].intensity_fn(pos, item_types[item_type].intensity_fn_args);
 	}
 
+	/**
+	 * Returns the row of `transposed_interactions` containing the interactions
+	 * between an item of each type at `first_position` and an item of type
+	 * `second_item_type` at `second_position`, or NULL if the interactions
+	 * with `second_item_type` are not all stationary.
+	 */
+	inline const float* transposed_interaction(
+			const position& first_position, const position& second_position,
+			unsigned int second_item_type)
+	{
+		const unsigned int radius = transposed_radii[second_item_type];
+		if (radius == UINT_MAX) return NULL;
+		position diff = first_position - second_position;
+#if !defined(NDEBUG)
+		if (diff.x < -(int64_t) two_n || diff.x >= two_n || diff.y < -(int64_t) two_n || diff.y >= two_n) {
+			fprintf(stderr, "gibbs_field_cache.transposed_interaction WARNING: The "
+					"given two positions further than 4*n from each other.");
+			return NULL;
+		}
+#endif
+		const int64_t r = radius;
+		if (diff.x < -r || diff.x > r || diff.y < -r || diff.y > r)
+			return zero_row;
+		const float* table = transposed_interactions[second_item_type].load(std::memory_order_acquire);
+		if (table == NULL) table = compute_transposed_interactions(second_item_type);
+		return table + ((diff.x + r)*(2*r + 1) + (diff.y + r)) * padded_type_count;
+	}
+
 	inline float interaction(
 			const position& first_position, const position& second_position,
 			unsigned int first_item_type, unsigned int second_item_type)
 	{
-		interaction_function interaction = item_types[first_item_type].interaction_fns[second_item_type];
-		if (is_constant(interaction) || !is_stationary(interaction)) {
+		interaction_table* table = interactions[first_item_type*item_type_count + second_item_type];
+		if (table == NULL) {
 			if (first_position == second_position) return 0.0f;
+			interaction_function interaction = item_types[first_item_type].interaction_fns[second_item_type];
 			return interaction(first_position, second_position, item_types[first_item_type].interaction_fn_args[second_item_type]);
 		} else {
-			position diff = first_position - second_position + position(two_n, two_n);
+			position diff = first_position - second_position;
 #if !defined(NDEBUG)
-			if (diff.x < 0 || diff.x >= four_n || diff.y < 0 || diff.y >= four_n) {
+			if (diff.x < -(int64_t) two_n || diff.x >= two_n || diff.y < -(int64_t) two_n || diff.y >= two_n) {
 				fprintf(stderr, "gibbs_field_cache.interaction WARNING: The "
 						"given two positions further than 4*n from each other.");
 				return 0.0f;
 			}
 #endif
-			return interactions[first_item_type*item_type_count + second_item_type][diff.x*four_n + diff.y];
+			return table->get(diff.x, diff.y);
 		}
 	}
 
@@ -68,47 +305,114 @@ private:
 			fprintf(stderr, "gibbs_field_cache.init_helper ERROR: Insufficient memory for intensities.\n");
 			return false;
 		}
-		interactions = (float**) calloc(item_type_count * item_type_count, sizeof(float*));
+		interactions = (interaction_table**) calloc(item_type_count * item_type_count, sizeof(interaction_table*));
 		if (interactions == NULL) {
 			fprintf(stderr, "gibbs_field_cache.init_helper ERROR: Insufficient memory for interactions.\n");
 			core::free(intensities);
 			return false;
 		}
+		transposed_interactions = (std::atomic<float*>*) malloc(max((size_t) 1, sizeof(std::atomic<float*>) * item_type_count));
+		if (transposed_interactions == NULL) {
+			fprintf(stderr, "gibbs_field_cache.init_helper ERROR: Insufficient memory for transposed_interactions.\n");
+			core::free(intensities); core::free(interactions);
+			return false;
+		}
+		transposed_radii = (unsigned int*) malloc(max((size_t) 1, sizeof(unsigned int) * item_type_count));
+		if (transposed_radii == NULL) {
+			fprintf(stderr, "gibbs_field_cache.init_helper ERROR: Insufficient memory for transposed_radii.\n");
+			core::free(intensities); core::free(interactions);
+			core::free(transposed_interactions);
+			return false;
+		}
+		padded_type_count = simd_padded_length(item_type_count + 1);
+		zero_row = (float*) calloc(padded_type_count, sizeof(float));
+		if (zero_row == NULL) {
+			fprintf(stderr, "gibbs_field_cache.init_helper ERROR: Insufficient memory for zero_row.\n");
+			core::free(intensities); core::free(interactions);
+			core::free(transposed_interactions); core::free(transposed_radii);
+			return false;
+		}
+		for (unsigned int j = 0; j < item_type_count; j++) {
+			new (&transposed_interactions[j]) std::atomic<float*>(NULL);
+			transposed_radii[j] = 0;
+		}
+
+		support_radius = 0;
 		for (unsigned int i = 0; i < item_type_count; i++) {
 			if (is_stationary(item_types[i].intensity_fn))
 				intensities[i] = item_types[i].intensity_fn(position(0, 0), item_types[i].intensity_fn_args);
 
 			for (unsigned int j = 0; j < item_type_count; j++) {
 				interaction_function interaction = item_types[i].interaction_fns[j];
+				unsigned int radius = is_stationary(interaction) ?
+						interaction_support_radius(interaction, item_types[i].interaction_fn_args[j]) : UINT_MAX;
+				support_radius = max(support_radius, radius);
+				if (!is_stationary(interaction))
+					transposed_radii[j] = UINT_MAX;
+				else if (transposed_radii[j] != UINT_MAX)
+					transposed_radii[j] = max(transposed_radii[j], min(radius, two_n));
+
 				if (!is_constant(interaction) && is_stationary(interaction)) {
-					interactions[i*item_type_count + j] = (float*) malloc(sizeof(float) * four_n * four_n);
+					interactions[i*item_type_count + j] = acquire_interaction_table(interaction,
+							item_types[i].interaction_fn_args[j], item_types[i].interaction_fn_arg_counts[j], two_n / 2);
 					if (interactions[i*item_type_count + j] == NULL) {
-						fprintf(stderr, "gibbs_field_cache.init_helper ERROR: Insufficient memory for interactions.\n");
+						fprintf(stderr, "gibbs_field_cache.init_helper ERROR: Unable to acquire interaction table.\n");
 						free_helper(); return false;
 					}
+				}
+			}
+		}
+		return true;
+	}
 
-					for (unsigned int x = 0; x < four_n; x++) {
-						for (unsigned int y = 0; y < four_n; y++) {
-							float value;
-							if (x == two_n && y == two_n)
-								value = 0.0f;
-							else value = interaction(position(two_n, two_n), position(x, y), item_types[i].interaction_fn_args[j]);
-							interactions[i*item_type_count + j][x*four_n + y] = value;
-						}
+	/* NOTE: this may be called concurrently by the threads sampling different patches */
+	const float* compute_transposed_interactions(unsigned int j) {
+		const int64_t r = transposed_radii[j];
+		const int64_t width = 2*r + 1;
+		float* table = (float*) calloc(width * width * padded_type_count, sizeof(float));
+		if (table == NULL) {
+			/* this is called while sampling, where there is no way to recover */
+			fprintf(stderr, "gibbs_field_cache.compute_transposed_interactions ERROR: Insufficient memory for table.\n");
+			exit(EXIT_FAILURE);
+		}
+
+		for (unsigned int i = 0; i < item_type_count; i++) {
+			interaction_table* interaction_table = interactions[i*item_type_count + j];
+			for (int64_t x = -r; x <= r; x++) {
+				for (int64_t y = -r; y <= r; y++) {
+					float& value = table[((x + r)*width + (y + r))*padded_type_count + i];
+					if (interaction_table != NULL) {
+						value = interaction_table->get(x, y);
+					} else if (x != 0 || y != 0) {
+						/* this is a constant interaction */
+						value = item_types[i].interaction_fns[j](position(0, 0), position(x, y), item_types[i].interaction_fn_args[j]);
 					}
-				} else {
-					interactions[i*item_type_count + j] = NULL;
 				}
 			}
 		}
-		return true;
+
+		/* if another thread computed the table first, use its table instead */
+		float* expected = NULL;
+		if (!transposed_interactions[j].compare_exchange_strong(expected, table, std::memory_order_acq_rel)) {
+			core::free(table);
+			return expected;
+		}
+		return table;
 	}
 
 	inline void free_helper() {
 		core::free(intensities);
 		for (unsigned int i = 0; i < item_type_count * item_type_count; i++)
-			if (interactions[i] != NULL) core::free(interactions[i]);
+			if (interactions[i] != NULL) release_interaction_table(interactions[i]);
 		core::free(interactions);
+		for (unsigned int i = 0; i < item_type_count; i++) {
+			float* table = transposed_interactions[i].load(std::memory_order_relaxed);
+			if (table != NULL) core::free(table);
+			transposed_interactions[i].~atomic();
+		}
+		core::free(transposed_interactions);
+		core::free(transposed_radii);
+		core::free(zero_row);
 	}
 
 	template<typename A>
@@ -149,54 +453,68 @@ public:
 
 	template<typename RNGType>
 	void sample(RNGType& rng) {
-		for (unsigned int i = 0; i < patch_count; i++) {
-			position patch_position_offset = patch_positions[i] * n;
-			auto process_neighborhood = [&](unsigned int x, unsigned int y,
-					patch_type* neighborhood[4], unsigned int neighbor_count)
-			{
-				position world_position = patch_position_offset + position(x, y);
-				sample_cell(rng, neighborhood, neighbor_count, patch_positions[i], world_position);
-			};
+		for (unsigned int i = 0; i < patch_count; i++)
+			sample_patch(rng, i);
+	}
 
-			map.iterate_neighborhoods(patch_positions[i], process_neighborhood);
-		}
+	/**
+	 * Performs one sweep of Gibbs sampling over the cells of the patch at
+	 * `patch_positions[patch_index]`. This only modifies the items in that
+	 * patch, and it only reads from the patch and its eight neighbors, so
+	 * patches that are not adjacent may be sampled concurrently, provided
+	 * that each thread uses its own `rng`.
+	 */
+	template<typename RNGType>
+	void sample_patch(RNGType& rng, unsigned int patch_index) {
+		const position& patch_position = patch_positions[patch_index];
+		position patch_position_offset = patch_position * n;
+		auto process_neighborhood = [&](unsigned int x, unsigned int y,
+				patch_type* neighborhood[4], const position* neighbor_positions,
+				unsigned int neighbor_count)
+		{
+			position world_position = patch_position_offset + position(x, y);
+			sample_cell(rng, neighborhood, neighbor_positions, neighbor_count, world_position);
+		};
+
+		map.iterate_neighborhoods(patch_position, rng, process_neighborhood);
 	}
 
 private:
-	/* NOTE: we assume `neighborhood[0]` refers to the patch at the given `patch_position` */
+	/* NOTE: we assume `neighborhood[0]` refers to the patch containing `world_position` */
 	template<typename RNGType>
 	inline void sample_cell(RNGType& rng,
 			patch_type* neighborhood[4],
+			const position* neighbor_positions,
 			unsigned int neighbor_count,
-			const position& patch_position,
 			const position& world_position)
 	{
 		/* compute the old item type and index */
 		patch_type& current_patch = *neighborhood[0];
-		unsigned int old_item_index = 0, old_item_type = cache.item_type_count;
-		for (unsigned int m = 0; m < current_patch.items.length; m++) {
-			if (current_patch.items[m].location == world_position) {
-				old_item_type = current_patch.items[m].item_type;
-				old_item_index = m; break;
-			}
-		}
+		unsigned int old_item_type = cache.item_type_count;
+		unsigned int old_item_index = current_patch.item_at(world_position, n);
+		if (old_item_index != patch_type::EMPTY_CELL)
+			old_item_type = current_patch.items[old_item_index].item_type;
 
-		float* log_probabilities = (float*) alloca(sizeof(float) * (cache.item_type_count + 1));
+		float* log_probabilities = (float*) alloca(sizeof(float) * cache.padded_type_count);
 		for (unsigned int i = 0; i < cache.item_type_count; i++)
 			log_probabilities[i] = cache.intensity(world_position, i);
-		for (unsigned int j = 0; j < neighbor_count; j++) {
-			const auto& items = neighborhood[j]->items;
-			for (unsigned int m = 0; m < items.length; m++) {
-				for (unsigned int i = 0; i < cache.item_type_count; i++)
-					/* compute the energy contribution of this cell when the item type is `i` */
-					log_probabilities[i] += cache.interaction(world_position, items[m].location, i, items[m].item_type);
+		for (unsigned int i = cache.item_type_count; i < cache.padded_type_count; i++)
+			log_probabilities[i] = 0.0f;
+		if (cache.support_radius < n) {
+			for (unsigned int j = 0; j < neighbor_count; j++)
+				add_interactions_within_support(log_probabilities,
+						*neighborhood[j], neighbor_positions[j], world_position);
+		} else {
+			for (unsigned int j = 0; j < neighbor_count; j++) {
+				const auto& items = neighborhood[j]->items;
+				for (unsigned int m = 0; m < items.length; m++)
+					add_interactions(log_probabilities, world_position, items[m]);
 			}
 		}
 
-		log_probabilities[cache.item_type_count] = 0.0;
-		normalize_exp(log_probabilities, cache.item_type_count + 1);
+		simd_normalize_exp(log_probabilities, cache.item_type_count + 1);
 		float random = (float) rng() / rng.max();
-		unsigned int sampled_item_type = select_categorical(
+		unsigned int sampled_item_type = simd_select_categorical(
 				log_probabilities, random, cache.item_type_count + 1);
 
 		if (old_item_type == sampled_item_type) {
@@ -204,10 +522,69 @@ private:
 			return;
 		} if (old_item_type < cache.item_type_count) {
 			/* remove the old item position */
-			current_patch.items.remove(old_item_index);
+			current_patch.remove_item(old_item_index, n);
 		} if (sampled_item_type < cache.item_type_count) {
 			/* add the new item position */
-			current_patch.items.add({sampled_item_type, world_position, 0, 0});
+			current_patch.add_item({sampled_item_type, world_position, 0, 0}, n);
+		}
+	}
+
+	/**
+	 * Computes the energy contribution of `neighbor` to the cell at
+	 * `world_position` for each item type. If the interactions with the type
+	 * of `neighbor` are stationary, this is a single vectorized addition of a
+	 * row of `cache.transposed_interactions`.
+	 */
+	template<typename Item>
+	inline void add_interactions(float* log_probabilities,
+			const position& world_position, const Item& neighbor)
+	{
+		const float* row = cache.transposed_interaction(world_position, neighbor.location, neighbor.item_type);
+		if (row != NULL) {
+			simd_add(log_probabilities, row, cache.padded_type_count);
+			return;
+		}
+		for (unsigned int i = 0; i < cache.item_type_count; i++)
+			log_probabilities[i] += cache.interaction(world_position, neighbor.location, i, neighbor.item_type);
+	}
+
+	/**
+	 * Adds the energy contributions of the items in `neighbor` that lie within
+	 * `cache.support_radius` of `world_position`. Depending on which is
+	 * smaller, either the items in the patch are filtered by their distance,
+	 * or the cells of the patch in the support are looked up in
+	 * `neighbor.item_indices`.
+	 */
+	inline void add_interactions_within_support(float* log_probabilities,
+			const patch_type& neighbor, const position& neighbor_position,
+			const position& world_position)
+	{
+		const int64_t radius = cache.support_radius;
+		const position origin = neighbor_position * n;
+		int64_t min_x = max(world_position.x - radius, origin.x);
+		int64_t max_x = min(world_position.x + radius, origin.x + n - 1);
+		int64_t min_y = max(world_position.y - radius, origin.y);
+		int64_t max_y = min(world_position.y + radius, origin.y + n - 1);
+		if (min_x > max_x || min_y > max_y) return;
+
+		const auto& items = neighbor.items;
+		uint64_t cell_count = (uint64_t) (max_x - min_x + 1) * (max_y - min_y + 1);
+		if (items.length <= cell_count) {
+			for (unsigned int m = 0; m < items.length; m++) {
+				const position& location = items[m].location;
+				if (location.x < min_x || location.x > max_x || location.y < min_y || location.y > max_y)
+					continue;
+				add_interactions(log_probabilities, world_position, items[m]);
+			}
+		} else {
+			for (int64_t x = min_x; x <= max_x; x++) {
+				const unsigned int* column = neighbor.item_indices + (x - origin.x) * n;
+				for (int64_t y = min_y; y <= max_y; y++) {
+					unsigned int index = column[y - origin.y];
+					if (index != patch_type::EMPTY_CELL)
+						add_interactions(log_probabilities, world_position, items[index]);
+				}
+			}
 		}
 	}
 };
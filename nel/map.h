@@ -3,11 +3,25 @@
 
 #include <core/map.h>
 #include "gibbs_field.h"
+#include "patch_store.h"
+#include "pool_allocator.h"
+#include "snapshot.h"
+#include "eviction.h"
+#include "thread_pool.h"
+#include "stats.h"
 
 namespace nel {
 
 using namespace core;
 
+/* returns log2(n) if `n` is a power of two, and UINT_MAX otherwise */
+inline unsigned int power_of_two_shift(unsigned int n) {
+	if (n == 0 || (n & (n - 1)) != 0) return UINT_MAX;
+	unsigned int shift = 0;
+	while ((1u << shift) < n) shift++;
+	return shift;
+}
+
 struct item {
 	unsigned int item_type;
 
@@ -47,42 +61,221 @@ bool write(const item& i, Stream& out) {
 template<typename Data>
 struct patch
 {
+	/* indicates that there is no item at a cell in `item_indices` */
+	static constexpr unsigned int EMPTY_CELL = UINT_MAX;
+
 	array<item> items;
 
+	/**
+	 * An n x n grid, in column-major order, that maps each cell in this patch
+	 * to the index in `items` of the item at that cell, or `EMPTY_CELL` if
+	 * there is none. This assumes there is at most one item at any cell.
+	 * Modify `items` through `add_item` and `remove_item` to keep this grid
+	 * consistent.
+	 */
+	unsigned int* item_indices;
+
+	/**
+	 * Bitmaps over the n x n cells of this patch, indexed like
+	 * `item_indices`. `live_cells` marks the cells containing an item that is
+	 * not deleted, and `blocking_cells` marks those whose item also blocks
+	 * movement. They are stored in the same block as `item_indices`. Since
+	 * only the owner of the map knows which item types block movement, the
+	 * owner computes them from `items` (see `clear_occupancy` and
+	 * `set_occupancy`), and they are up to date if `occupancy_version` is
+	 * equal to `version`. Code that changes a single item can update the
+	 * bitmaps in place and set `occupancy_version` after incrementing
+	 * `version`, rather than having them recomputed.
+	 */
+	uint64_t* live_cells;
+	uint64_t* blocking_cells;
+	uint64_t occupancy_version;
+
+	/**
+	 * Incremented whenever `items` is modified, so that computations derived
+	 * from the items of this patch can detect when they are stale. Code that
+	 * modifies an item in place (e.g. by setting its `deletion_time`) must
+	 * also increment this counter.
+	 */
+	uint64_t version;
+
 	/**
 	 * Indicates if this patch is fixed, or if it can be resampled (for
 	 * example, if it's on the edge)
 	 */
 	bool fixed;
 
+	/**
+	 * The `version` and `fixed` of this patch when it was last written to a
+	 * checkpoint (see `checkpointer`), so that incremental checkpoints only
+	 * write the patches that changed since. `checkpoint_version` is
+	 * `UINT64_MAX` if the patch was never written.
+	 */
+	uint64_t checkpoint_version;
+	bool checkpoint_fixed;
+
+	/* the value of `map.access_time` when this patch was last accessed, used to evict the least recently used patches */
+	uint64_t last_access;
+
 	Data data;
 
+	/* returns the index of the cell in `item_indices` containing `location` */
+	static inline unsigned int cell_index(const position& location, unsigned int n) {
+		if ((n & (n - 1)) == 0) {
+			/* the mask is the floored remainder, since `n` is a power of two */
+			int64_t mask = (int64_t) n - 1;
+			return (unsigned int) ((location.x & mask) * n + (location.y & mask));
+		}
+		int64_t x = location.x % n;
+		int64_t y = location.y % n;
+		if (x < 0) x += n;
+		if (y < 0) y += n;
+		return (unsigned int) (x * n + y);
+	}
+
+	/* returns the number of 64-bit words in each occupancy bitmap */
+	static constexpr unsigned int occupancy_words(unsigned int n) {
+		return (n * n + 63) / 64;
+	}
+
+	/* returns the size in bytes of the blocks that contain `item_indices` and the occupancy bitmaps */
+	static constexpr size_t cell_block_size(unsigned int n) {
+		return ((sizeof(unsigned int) * n * n + sizeof(uint64_t) - 1) / sizeof(uint64_t)) * sizeof(uint64_t)
+			 + 2 * sizeof(uint64_t) * occupancy_words(n);
+	}
+
+	inline bool is_live(const position& location, unsigned int n) const {
+		unsigned int cell = cell_index(location, n);
+		return ((live_cells[cell / 64] >> (cell % 64)) & 1) != 0;
+	}
+
+	inline bool is_blocking(const position& location, unsigned int n) const {
+		unsigned int cell = cell_index(location, n);
+		return ((blocking_cells[cell / 64] >> (cell % 64)) & 1) != 0;
+	}
+
+	inline void clear_occupancy(unsigned int n) {
+		memset(live_cells, 0, sizeof(uint64_t) * occupancy_words(n));
+		memset(blocking_cells, 0, sizeof(uint64_t) * occupancy_words(n));
+	}
+
+	inline void set_occupancy(const position& location, unsigned int n, bool live, bool blocking) {
+		unsigned int cell = cell_index(location, n);
+		uint64_t bit = ((uint64_t) 1) << (cell % 64);
+		if (live) live_cells[cell / 64] |= bit;
+		else live_cells[cell / 64] &= ~bit;
+		if (blocking) blocking_cells[cell / 64] |= bit;
+		else blocking_cells[cell / 64] &= ~bit;
+	}
+
+	/* returns the index in `items` of the item at `location`, or `EMPTY_CELL` if there is none */
+	inline unsigned int item_at(const position& location, unsigned int n) const {
+		return item_indices[cell_index(location, n)];
+	}
+
+	inline bool add_item(const item& new_item, unsigned int n) {
+		if (!items.add(new_item)) return false;
+		item_indices[cell_index(new_item.location, n)] = (unsigned int) items.length - 1;
+		version++;
+		return true;
+	}
+
+	/* NOTE: this moves the last item in `items` into the position `index` */
+	inline void remove_item(unsigned int index, unsigned int n) {
+		item_indices[cell_index(items[index].location, n)] = EMPTY_CELL;
+		items.remove(index);
+		if (index < items.length)
+			item_indices[cell_index(items[index].location, n)] = index;
+		version++;
+	}
+
+	/* returns `true` if this patch changed since it was last written to a checkpoint */
+	inline bool is_dirty() const {
+		return version != checkpoint_version || fixed != checkpoint_fixed;
+	}
+
+	inline void mark_checkpointed() {
+		checkpoint_version = version;
+		checkpoint_fixed = fixed;
+	}
+
+	/**
+	 * Allocates `item_indices` and the occupancy bitmaps from `pool`, whose
+	 * blocks must have `cell_block_size(n)` bytes, and computes the grid from
+	 * the current contents of `items`. The bitmaps are computed on demand.
+	 */
+	inline bool init_item_indices(unsigned int n, block_pool& pool) {
+		item_indices = (unsigned int*) pool.allocate();
+		if (item_indices == NULL) {
+			fprintf(stderr, "patch.init_item_indices ERROR: Insufficient memory for item_indices.\n");
+			return false;
+		}
+		live_cells = (uint64_t*) ((char*) item_indices + (cell_block_size(n) - 2 * sizeof(uint64_t) * occupancy_words(n)));
+		blocking_cells = live_cells + occupancy_words(n);
+		occupancy_version = UINT64_MAX;
+		for (unsigned int i = 0; i < n * n; i++)
+			item_indices[i] = EMPTY_CELL;
+		for (unsigned int i = 0; i < items.length; i++)
+			item_indices[cell_index(items[i].location, n)] = i;
+		return true;
+	}
+
 	static inline void move(const patch& src, patch& dst) {
 		core::move(src.items, dst.items);
 		core::move(src.data, dst.data);
+		dst.item_indices = src.item_indices;
+		dst.live_cells = src.live_cells;
+		dst.blocking_cells = src.blocking_cells;
+		dst.occupancy_version = src.occupancy_version;
+		dst.version = src.version;
 		dst.fixed = src.fixed;
+		dst.checkpoint_version = src.checkpoint_version;
+		dst.checkpoint_fixed = src.checkpoint_fixed;
+		dst.last_access = src.last_access;
 	}
 
 	static inline void free(patch& p) {
 		core::free(p.items);
 		core::free(p.data);
+		if (p.item_indices != NULL)
+			block_pool::release(p.item_indices);
 	}
 };
 
+/**
+ * Initializes the given empty patch `new_patch`, allocating its `item_indices`
+ * grid from `cell_pool`.
+ */
 template<typename Data>
-inline bool init(patch<Data>& new_patch) {
+inline bool init(patch<Data>& new_patch, unsigned int n, block_pool& cell_pool) {
 	new_patch.fixed = false;
+	new_patch.version = 0;
+	new_patch.checkpoint_version = UINT64_MAX;
+	new_patch.checkpoint_fixed = false;
+	new_patch.last_access = 0;
 	if (!init(new_patch.data)) {
 		return false;
 	} else if (!array_init(new_patch.items, 8)) {
 		fprintf(stderr, "init ERROR: Insufficient memory for patch.items.\n");
 		free(new_patch.data); return false;
+	} else if (!new_patch.init_item_indices(n, cell_pool)) {
+		free(new_patch.data); free(new_patch.items);
+		return false;
 	}
 	return true;
 }
 
+/* NOTE: `p.item_indices` is not read, and so the caller must call `p.init_item_indices` */
 template<typename Data, typename Stream, typename... DataReader>
 bool read(patch<Data>& p, Stream& in, DataReader&&... reader) {
+	p.item_indices = NULL;
+	p.live_cells = NULL;
+	p.blocking_cells = NULL;
+	p.occupancy_version = UINT64_MAX;
+	p.version = 0;
+	p.checkpoint_version = UINT64_MAX;
+	p.checkpoint_fixed = false;
+	p.last_access = 0;
 	if (!read(p.fixed, in) || !read(p.items, in)) {
 		return false;
 	} else if (!read(p.data, in, std::forward<DataReader>(reader)...)) {
@@ -99,30 +292,76 @@ bool write(const patch<Data>& p, Stream& out, DataWriter&&... writer) {
 		&& write(p.data, out, std::forward<DataWriter>(writer)...);
 }
 
-void* alloc_position_keys(size_t n, size_t element_size) {
-	position* keys = (position*) malloc(sizeof(position) * n);
-	if (keys == NULL) return NULL;
-	for (unsigned int i = 0; i < n; i++)
-		position::set_empty(keys[i]);
-	return (void*) keys;
-}
-
 template<typename PerPatchData, typename ItemType>
 struct map {
-	hash_map<position, patch<PerPatchData>> patches;
+	/* NOTE: patches are never moved, so pointers to them remain valid as the map grows */
+	patch_store<patch<PerPatchData>> patches;
 
 	unsigned int n;
 	unsigned int gibbs_iterations;
 
+	/* log2(n) if `n` is a power of two, so that world coordinates are converted with shifts and masks, or UINT_MAX otherwise */
+	unsigned int n_shift;
+
+	/* pool for the `item_indices` grids and occupancy bitmaps of the patches */
+	block_pool cell_pool;
+
 	std::minstd_rand rng;
 	gibbs_field_cache<ItemType> cache;
 
+	/**
+	 * If not NULL, Gibbs sampling in `fix_patches` is distributed across the
+	 * threads of this pool. The map does not own the pool.
+	 */
+	thread_pool* sampler_pool;
+
+	/**
+	 * If not NULL, the patches in this snapshot that are not in `patches`
+	 * are part of the map as well, and they are loaded into `patches` when
+	 * they are first accessed. The map owns the snapshot.
+	 */
+	mapped_snapshot* snapshot;
+
+	/**
+	 * If not NULL, the patches in this store are part of the map as well, and
+	 * they are loaded back into `patches` when they are next accessed. They
+	 * take precedence over the patches in `snapshot`. See
+	 * `set_memory_budget`. The map owns the store.
+	 */
+	eviction_store<item>* evicted;
+
+	/**
+	 * The approximate number of bytes that the patches in memory may occupy
+	 * before `evict_patches` evicts some of them, or 0 if there is no limit.
+	 * `resident_patch_limit` is the corresponding number of patches, which is
+	 * re-estimated from the sizes of the patches whenever they are evicted.
+	 */
+	size_t memory_budget;
+	unsigned int resident_patch_limit;
+
+	/* incremented by every call to `evict_patches` */
+	uint64_t access_time;
+
+	/**
+	 * If not NULL, `fix_patches` appends the position of every patch that it
+	 * fixes to this array, so that the items in new patches can be observed
+	 * (see `trajectory_recorder`), as does `get_or_make_patch` for the fixed
+	 * patches that it loads from the eviction store and that are marked
+	 * `unrecorded`. The map does not own the array.
+	 */
+	array<position>* fixed_patch_log;
+
 	typedef patch<PerPatchData> patch_type;
 	typedef ItemType item_type;
 
+	/* the number of `item_indices` grids allocated at a time by `cell_pool` */
+	static constexpr unsigned int CELL_POOL_CHUNK_SIZE = 64;
+
 public:
 	map(unsigned int n, unsigned int gibbs_iterations, const ItemType* item_types, unsigned int item_type_count, uint_fast32_t seed) :
-		patches(1024, alloc_position_keys), n(n), gibbs_iterations(gibbs_iterations), cache(item_types, item_type_count, n)
+		patches(1024), n(n), gibbs_iterations(gibbs_iterations), n_shift(power_of_two_shift(n)),
+		cell_pool(patch_type::cell_block_size(n), CELL_POOL_CHUNK_SIZE), cache(item_types, item_type_count, n), sampler_pool(NULL), snapshot(NULL),
+		evicted(NULL), memory_budget(0), resident_patch_limit(UINT_MAX), access_time(0)
 	{
 		rng.seed(seed);
 #if !defined(NDEBUG)
@@ -140,53 +379,228 @@ public:
 			(uint_fast32_t) milliseconds()) { }
 #endif
 
-	~map() { free_helper(); }
+	~map() {
+		free_helper();
+		if (snapshot != NULL) {
+			core::free(*snapshot);
+			core::free(snapshot);
+		}
+		if (evicted != NULL) {
+			core::free(*evicted);
+			core::free(evicted);
+		}
+	}
 
 	inline void set_seed(uint_fast32_t new_seed) {
 		rng.seed(new_seed);
 	}
 
+	/**
+	 * Sets the thread pool used to sample new patches in parallel. If `pool`
+	 * is NULL or has only one thread, patches are sampled sequentially. Note
+	 * that the sampled world differs between the sequential and parallel
+	 * modes, but in the parallel mode, it only depends on the seed and not on
+	 * the number of threads.
+	 */
+	inline void set_thread_pool(thread_pool* pool) {
+		sampler_pool = pool;
+	}
+
+	inline void set_fixed_patch_log(array<position>* log) {
+		fixed_patch_log = log;
+	}
+
 	inline patch_type& get_existing_patch(const position& patch_position) {
+		patch_type* patch = get_patch_if_exists(patch_position);
 #if !defined(NDEBUG)
-		bool contains;
-		patch_type& patch = patches.get(patch_position, contains);
-		if (!contains) fprintf(stderr, "map.get_existing_patch WARNING: The requested patch does not exist.\n");
-		return patch;
-#else
-		return patches.get(patch_position);
+		if (patch == NULL) fprintf(stderr, "map.get_existing_patch WARNING: The requested patch does not exist.\n");
 #endif
+		return *patch;
 	}
 
 	inline patch_type* get_patch_if_exists(const position& patch_position) const
 	{
-		bool contains;
-		patch_type& p = patches.get(patch_position, contains);
-		if (!contains) return NULL;
-		else return &p;
+		patch_type* p = patches.get(patch_position);
+		if (p != NULL) return p;
+		if ((evicted == NULL || evicted->find(patch_position) == NULL)
+		 && (snapshot == NULL || snapshot->find(patch_position) == NULL))
+			return NULL;
+
+		/* the evicted patches and those in the snapshot are already part of the map, so loading one does not change the map */
+		return const_cast<map*>(this)->get_or_make_patch(patch_position);
 	}
 
-	template<bool ResizeMap = true>
-	inline patch_type& get_or_make_patch(const position& patch_position)
+	/**
+	 * Returns the patch at `patch_position`, creating it (or loading it from
+	 * the eviction store or the snapshot) if it is not in memory.
+	 *
+	 * \returns The patch if successful; `NULL` otherwise, in which case the
+	 *          patch is not added to the map.
+	 */
+	inline patch_type* get_or_make_patch(const position& patch_position)
 	{
-		bool contains; unsigned int bucket;
-		if (ResizeMap) patches.check_size(alloc_position_keys);
-		patch_type& p = patches.get(patch_position, contains, bucket);
-		if (!contains) {
-			/* add a new patch */
-			init(p);
-			patches.table.keys[bucket] = patch_position;
-			patches.table.size++;
+		bool contains;
+		patch_type* p = patches.get(patch_position, contains);
+		if (p == NULL) {
+			fprintf(stderr, "map.get_or_make_patch ERROR: Insufficient memory for new patch.\n");
+			return NULL;
+		} else if (!contains) {
+			/* add a new patch, or load it from the eviction store or the snapshot */
+			const evicted_patch* evicted_record = (evicted == NULL) ? NULL : evicted->find(patch_position);
+			const snapshot_patch_record* record = (snapshot == NULL || evicted_record != NULL) ? NULL : snapshot->find(patch_position);
+			if (!init(*p, n, cell_pool)) {
+				fprintf(stderr, "map.get_or_make_patch ERROR: Unable to initialize new patch.\n");
+				patches.remove(patch_position);
+				return NULL;
+			} else if ((evicted_record != NULL && !load_evicted_patch(*p, patch_position, *evicted_record))
+					|| (record != NULL && !load_snapshot_patch(*p, *record)))
+			{
+				fprintf(stderr, "map.get_or_make_patch ERROR: Unable to load the patch.\n");
+				core::free(*p);
+				patches.remove(patch_position);
+				return NULL;
+			}
 		}
+		p->last_access = access_time;
 		return p;
 	}
 
+	/**
+	 * Replaces the contents of the patch at `patch_position` with the
+	 * `item_count` items in `items`, creating the patch if it does not exist
+	 * (without loading it from the snapshot). This is used to restore patches
+	 * from incremental checkpoints, and so the patch is marked as written to
+	 * a checkpoint.
+	 */
+	inline bool restore_patch(const position& patch_position,
+			const item* items, unsigned int item_count, bool fixed)
+	{
+		bool contains;
+		patch_type* p = patches.get(patch_position, contains);
+		if (p == NULL) {
+			fprintf(stderr, "map.restore_patch ERROR: Insufficient memory for new patch.\n");
+			return false;
+		} else if (!contains && !init(*p, n, cell_pool)) {
+			fprintf(stderr, "map.restore_patch ERROR: Unable to initialize new patch.\n");
+			patches.remove(patch_position);
+			return false;
+		}
+		if (evicted != NULL && !evicted->erase(patch_position))
+			fprintf(stderr, "map.restore_patch WARNING: Unable to collect the garbage in the eviction file.\n");
+		while (p->items.length > 0)
+			p->remove_item((unsigned int) p->items.length - 1, n);
+		if (!p->items.ensure_capacity(item_count)) return false;
+		for (unsigned int i = 0; i < item_count; i++)
+			p->add_item(items[i], n);
+		p->fixed = fixed;
+		p->mark_checkpointed();
+		return true;
+	}
+
+	/**
+	 * Loads every patch of the snapshot, if any, that was not yet accessed,
+	 * and releases the snapshot.
+	 *
+	 * \returns `true` if successful; `false` otherwise, in which case the
+	 *          snapshot is kept.
+	 */
+	bool load_snapshot_patches() {
+		if (snapshot == NULL) return true;
+		for (uint64_t i = 0; i < snapshot->header->patch_count; i++)
+			if (get_or_make_patch(snapshot->records[i].key) == NULL) return false;
+		core::free(*snapshot);
+		core::free(snapshot);
+		snapshot = NULL;
+		return true;
+	}
+
+	/**
+	 * Limits the memory occupied by the patches of this map to approximately
+	 * `bytes` (or removes the limit, if it is 0). Once the limit is exceeded,
+	 * `evict_patches` moves the least recently used patches to an eviction
+	 * store whose file is created at `filepath` (or as an anonymous temporary
+	 * file if it is NULL). The evicted patches are loaded back into memory
+	 * transparently when they are accessed. The file is only created once,
+	 * so `filepath` is ignored if the store already exists.
+	 *
+	 * \returns `true` if successful; `false` otherwise.
+	 */
+	bool set_memory_budget(size_t bytes, const char* filepath) {
+		if (bytes != 0 && evicted == NULL) {
+			evicted = (eviction_store<item>*) malloc(sizeof(eviction_store<item>));
+			if (evicted == NULL) {
+				fprintf(stderr, "map.set_memory_budget ERROR: Out of memory.\n");
+				return false;
+			} else if (!init(*evicted, filepath)) {
+				core::free(evicted);
+				evicted = NULL;
+				return false;
+			}
+		}
+		memory_budget = bytes;
+		size_t patch_bytes = sizeof(patch_type) + patch_type::cell_block_size(n);
+		resident_patch_limit = (bytes == 0) ? UINT_MAX : (unsigned int) min((size_t) UINT_MAX, max((size_t) 1, bytes / patch_bytes));
+		return true;
+	}
+
+	/* returns `true` if the patches in memory exceed the memory budget, and `evict_patches` would evict some of them */
+	inline bool needs_eviction() const {
+		return evicted != NULL && memory_budget != 0 && patches.size > resident_patch_limit;
+	}
+
+	/**
+	 * If the patches in memory exceed the memory budget (see
+	 * `set_memory_budget`), this function moves the least recently used
+	 * patches, other than those for which `is_pinned(const position&)`
+	 * returns `true`, to the eviction store, until the patches in memory use
+	 * at most 7/8 of the budget. Before a patch is evicted, its items for
+	 * which `should_prune(const item&)` returns `true` (e.g. items that were
+	 * deleted long ago) are removed, and `on_evict(const position&)` is
+	 * called. The pinned patches must include every patch whose
+	 * `PerPatchData` refers to other objects (e.g. agents), since the data is
+	 * not stored.
+	 *
+	 * **NOTE:** Pointers to the evicted patches become invalid.
+	 *
+	 * \returns `true` if successful; `false` otherwise.
+	 */
+	template<typename IsPinned, typename ShouldPrune, typename OnEvict>
+	bool evict_patches(IsPinned is_pinned, ShouldPrune should_prune, OnEvict on_evict)
+	{
+		access_time++;
+		if (!needs_eviction()) return true;
+
+		/* estimate the number of patches that fit within the budget from their current sizes */
+		size_t total_bytes = 0;
+		array<eviction_candidate> candidates(max((size_t) 1, (size_t) patches.size));
+		for (auto entry : patches) {
+			total_bytes += sizeof(patch_type) + patch_type::cell_block_size(n) + sizeof(item) * entry.value.items.capacity;
+			candidates[candidates.length++] = {entry.value.last_access, entry.key};
+		}
+		size_t patch_bytes = max((size_t) 1, total_bytes / patches.size);
+		resident_patch_limit = (unsigned int) min((size_t) UINT_MAX, max((size_t) 1, memory_budget / patch_bytes));
+		if (patches.size <= resident_patch_limit) return true;
+
+		unsigned int target = resident_patch_limit - resident_patch_limit / 8;
+		if (candidates.length > 1) sort(candidates);
+		for (const eviction_candidate& candidate : candidates) {
+			if (patches.size <= target) break;
+			if (is_pinned(candidate.key)) continue;
+			on_evict(candidate.key);
+			if (!evict_patch(candidate.key, should_prune))
+				return false;
+		}
+		return true;
+	}
+
 	/**
 	 * Returns the patches in the world that intersect with a bounding box of
 	 * size n centered at `world_position`. This function will create any
 	 * missing patches and ensure that the returned patches are 'fixed': they
 	 * cannot be modified by future sampling. The patches and their positions
 	 * are returned in row-major order, and the function returns the index in
-	 * `neighborhood` of the patch containing `world_position`.
+	 * `neighborhood` of the patch containing `world_position`, or `UINT_MAX`
+	 * if a patch could not be created or loaded.
 	 */
 	unsigned int get_fixed_neighborhood(
 			position world_position,
@@ -195,14 +609,66 @@ public:
 	{
 		unsigned int index = get_neighborhood_positions(world_position, patch_positions);
 
-		patches.check_size(patches.table.size + 16, alloc_position_keys);
-		for (unsigned int i = 0; i < 4; i++)
-			neighborhood[i] = &get_or_make_patch<false>(patch_positions[i]);
+		for (unsigned int i = 0; i < 4; i++) {
+			neighborhood[i] = get_or_make_patch(patch_positions[i]);
+			if (neighborhood[i] == NULL) return UINT_MAX;
+		}
 
-		fix_patches(neighborhood, patch_positions, 4);
+		if (!fix_patches(neighborhood, patch_positions, 4))
+			return UINT_MAX;
 		return index;
 	}
 
+	/**
+	 * Returns `true` if the patch at `patch_position` exists and is fixed.
+	 */
+	inline bool is_fixed(const position& patch_position) const {
+		patch_type* p = get_patch_if_exists(patch_position);
+		return (p != NULL && p->fixed);
+	}
+
+	/**
+	 * Ensures that the patch at `patch_position` is fixed, creating and
+	 * sampling it (along with any missing neighbors) if necessary.
+	 *
+	 * \returns `true` if successful; `false` if a patch could not be created
+	 *          or loaded.
+	 */
+	inline bool fix_patch(const position& patch_position) {
+		return pregenerate_patches(&patch_position, 1);
+	}
+
+	/**
+	 * Ensures that every patch that intersects the bounding box with the given
+	 * corners (in world coordinates, inclusive) is fixed. This is equivalent
+	 * to the generation that `get_fixed_neighborhood` performs lazily, but it
+	 * samples the patches in batches, so that the sampler can distribute them
+	 * across threads (see `set_thread_pool`).
+	 *
+	 * \returns `true` if successful; `false` if a patch could not be created
+	 *          or loaded.
+	 */
+	bool pregenerate(position bottom_left_corner, position top_right_corner)
+	{
+		position bottom_left_patch_position, top_right_patch_position;
+		world_to_patch_coordinates(bottom_left_corner, bottom_left_patch_position);
+		world_to_patch_coordinates(top_right_corner, top_right_patch_position);
+
+		position batch[PREGENERATION_BATCH_SIZE];
+		unsigned int batch_size = 0;
+		for (int64_t x = bottom_left_patch_position.x; x <= top_right_patch_position.x; x++) {
+			for (int64_t y = bottom_left_patch_position.y; y <= top_right_patch_position.y; y++) {
+				if (is_fixed({x, y})) continue;
+				batch[batch_size++] = {x, y};
+				if (batch_size == PREGENERATION_BATCH_SIZE) {
+					if (!pregenerate_patches(batch, batch_size)) return false;
+					batch_size = 0;
+				}
+			}
+		}
+		return batch_size == 0 || pregenerate_patches(batch, batch_size);
+	}
+
 	/**
 	 * Returns the patches in the world that intersect with a bounding box of
 	 * size n centered at `world_position`. This function will not create any
@@ -230,7 +696,14 @@ public:
 	}
 
 	template<typename ProcessNeighborhood>
-	void iterate_neighborhoods(const position& patch_position, ProcessNeighborhood process_neighborhood_function)
+	inline void iterate_neighborhoods(const position& patch_position, ProcessNeighborhood process_neighborhood_function) {
+		iterate_neighborhoods(patch_position, rng, process_neighborhood_function);
+	}
+
+	/* NOTE: this function does not modify the map, and so it is safe to call concurrently with distinct `random_engine` objects */
+	template<typename RNGType, typename ProcessNeighborhood>
+	void iterate_neighborhoods(const position& patch_position,
+			RNGType& random_engine, ProcessNeighborhood process_neighborhood_function)
 	{
 		patch_type* current = get_patch_if_exists(patch_position);
 		patch_type* top = get_patch_if_exists(patch_position.up());
@@ -246,6 +719,10 @@ public:
 		patch_type* top_left_neighborhood[4];
 		patch_type* bottom_right_neighborhood[4];
 		patch_type* top_right_neighborhood[4];
+		position bottom_left_positions[4];
+		position top_left_positions[4];
+		position bottom_right_positions[4];
+		position top_right_positions[4];
 		unsigned int bottom_left_neighbor_count = 1;
 		unsigned int top_left_neighbor_count = 1;
 		unsigned int bottom_right_neighbor_count = 1;
@@ -254,39 +731,55 @@ public:
 		top_left_neighborhood[0] = current;
 		bottom_right_neighborhood[0] = current;
 		top_right_neighborhood[0] = current;
+		bottom_left_positions[0] = patch_position;
+		top_left_positions[0] = patch_position;
+		bottom_right_positions[0] = patch_position;
+		top_right_positions[0] = patch_position;
 		if (left != NULL) {
+			bottom_left_positions[bottom_left_neighbor_count] = patch_position.left();
 			bottom_left_neighborhood[bottom_left_neighbor_count++] = left;
+			top_left_positions[top_left_neighbor_count] = patch_position.left();
 			top_left_neighborhood[top_left_neighbor_count++] = left;
 		} if (right != NULL) {
+			bottom_right_positions[bottom_right_neighbor_count] = patch_position.right();
 			bottom_right_neighborhood[bottom_right_neighbor_count++] = right;
+			top_right_positions[top_right_neighbor_count] = patch_position.right();
 			top_right_neighborhood[top_right_neighbor_count++] = right;
 		} if (top != NULL) {
+			top_left_positions[top_left_neighbor_count] = patch_position.up();
 			top_left_neighborhood[top_left_neighbor_count++] = top;
+			top_right_positions[top_right_neighbor_count] = patch_position.up();
 			top_right_neighborhood[top_right_neighbor_count++] = top;
 		} if (bottom != NULL) {
+			bottom_left_positions[bottom_left_neighbor_count] = patch_position.down();
 			bottom_left_neighborhood[bottom_left_neighbor_count++] = bottom;
+			bottom_right_positions[bottom_right_neighbor_count] = patch_position.down();
 			bottom_right_neighborhood[bottom_right_neighbor_count++] = bottom;
 		} if (bottom_left != NULL) {
+			bottom_left_positions[bottom_left_neighbor_count] = patch_position.down().left();
 			bottom_left_neighborhood[bottom_left_neighbor_count++] = bottom_left;
 		} if (top_left != NULL) {
+			top_left_positions[top_left_neighbor_count] = patch_position.up().left();
 			top_left_neighborhood[top_left_neighbor_count++] = top_left;
 		} if (bottom_right != NULL) {
+			bottom_right_positions[bottom_right_neighbor_count] = patch_position.down().right();
 			bottom_right_neighborhood[bottom_right_neighbor_count++] = bottom_right;
 		} if (top_right != NULL) {
+			top_right_positions[top_right_neighbor_count] = patch_position.up().right();
 			top_right_neighborhood[top_right_neighbor_count++] = top_right;
 		}
 
 		unsigned int half_n = n / 2;
 		for (unsigned int i = 0; i < n * n; i++) {
-			switch (rng() % 4) {
+			switch (random_engine() % 4) {
 			case 0:
-				process_neighborhood_function(rng() % half_n, rng() % half_n, bottom_left_neighborhood, bottom_left_neighbor_count);
+				process_neighborhood_function(random_engine() % half_n, random_engine() % half_n, bottom_left_neighborhood, bottom_left_positions, bottom_left_neighbor_count);
 			case 1:
-				process_neighborhood_function(rng() % half_n, (rng() % half_n) + half_n, top_left_neighborhood, top_left_neighbor_count);
+				process_neighborhood_function(random_engine() % half_n, (random_engine() % half_n) + half_n, top_left_neighborhood, top_left_positions, top_left_neighbor_count);
 			case 2:
-				process_neighborhood_function((rng() % half_n) + half_n, rng() % half_n, bottom_right_neighborhood, bottom_right_neighbor_count);
+				process_neighborhood_function((random_engine() % half_n) + half_n, random_engine() % half_n, bottom_right_neighborhood, bottom_right_positions, bottom_right_neighbor_count);
 			case 3:
-				process_neighborhood_function((rng() % half_n) + half_n, (rng() % half_n) + half_n, top_right_neighborhood, top_right_neighbor_count);
+				process_neighborhood_function((random_engine() % half_n) + half_n, (random_engine() % half_n) + half_n, top_right_neighborhood, top_right_positions, top_right_neighbor_count);
 			}
 		}
 	}
@@ -343,6 +836,11 @@ public:
 			position world_position,
 			position& patch_position) const
 	{
+		if (n_shift != UINT_MAX) {
+			/* the arithmetic shift rounds towards negative infinity, as `floored_div` does */
+			patch_position = {world_position.x >> n_shift, world_position.y >> n_shift};
+			return;
+		}
 		int64_t x_quotient = floored_div(world_position.x, n);
 		int64_t y_quotient = floored_div(world_position.y, n);
 		patch_position = {x_quotient, y_quotient};
@@ -353,6 +851,11 @@ public:
 			position& patch_position,
 			position& position_within_patch) const
 	{
+		if (n_shift != UINT_MAX) {
+			patch_position = {world_position.x >> n_shift, world_position.y >> n_shift};
+			position_within_patch = {world_position.x & (int64_t) (n - 1), world_position.y & (int64_t) (n - 1)};
+			return;
+		}
 		lldiv_t x_quotient = floored_div_with_remainder(world_position.x, n);
 		lldiv_t y_quotient = floored_div_with_remainder(world_position.y, n);
 		patch_position = {x_quotient.quot, y_quotient.quot};
@@ -361,12 +864,103 @@ public:
 
 	static inline void free(map& world) {
 		world.free_helper();
+		if (world.snapshot != NULL) {
+			core::free(*world.snapshot);
+			core::free(world.snapshot);
+		}
+		if (world.evicted != NULL) {
+			core::free(*world.evicted);
+			core::free(world.evicted);
+		}
 		core::free(world.patches);
+		core::free(world.cell_pool);
 		core::free(world.cache);
 		world.rng.~linear_congruential_engine();
 	}
 
 private:
+	static constexpr unsigned int PREGENERATION_BATCH_SIZE = 32;
+
+	struct eviction_candidate {
+		uint64_t last_access;
+		position key;
+
+		inline bool operator < (const eviction_candidate& other) const {
+			return last_access < other.last_access;
+		}
+
+		static inline void move(const eviction_candidate& src, eviction_candidate& dst) {
+			dst = src;
+		}
+
+		static inline void swap(eviction_candidate& first, eviction_candidate& second) {
+			eviction_candidate temp = first;
+			first = second;
+			second = temp;
+		}
+	};
+
+	template<typename ShouldPrune>
+	bool evict_patch(const position& key, ShouldPrune& should_prune) {
+		patch_type& p = *patches.get(key);
+		for (unsigned int i = (unsigned int) p.items.length; i > 0; i--)
+			if (should_prune(p.items[i - 1])) p.remove_item(i - 1, n);
+
+		evicted_patch record;
+		record.fixed = p.fixed;
+		record.version = p.version;
+		record.checkpoint_version = p.checkpoint_version;
+		record.checkpoint_fixed = p.checkpoint_fixed;
+		record.unrecorded = false;
+		if (!evicted->put(key, p.items.data, (unsigned int) p.items.length, record))
+			return false;
+		core::free(p);
+		return patches.remove(key);
+	}
+
+	/* NOTE: the patch is restored with the same version, since its items are the same as when it was evicted */
+	inline bool load_evicted_patch(patch_type& p, const position& key, const evicted_patch& record) {
+		array<item> items(max((size_t) 1, (size_t) record.item_count));
+		if (!evicted->read_items(record, items) || !p.items.ensure_capacity(items.length))
+			return false;
+		for (const item& i : items)
+			p.add_item(i, n);
+		p.fixed = record.fixed;
+		p.version = record.version;
+		p.checkpoint_version = record.checkpoint_version;
+		p.checkpoint_fixed = record.checkpoint_fixed;
+
+		/* the items of a fixed patch that was evicted before recording started are new to the trajectory */
+		if (record.unrecorded && record.fixed && fixed_patch_log != NULL)
+			fixed_patch_log->add(key);
+		if (!evicted->erase(key))
+			fprintf(stderr, "map.load_evicted_patch WARNING: Unable to collect the garbage in the eviction file.\n");
+		return true;
+	}
+
+	inline bool load_snapshot_patch(patch_type& p, const snapshot_patch_record& record) {
+		if (!p.items.ensure_capacity(record.item_count)) return false;
+		const item* items = (const item*) (snapshot->data + record.item_offset);
+		for (unsigned int i = 0; i < record.item_count; i++)
+			p.add_item(items[i], n);
+		p.fixed = (record.fixed != 0);
+
+		/* the patch is unchanged from the snapshot, which was written as a checkpoint */
+		p.mark_checkpointed();
+		return true;
+	}
+
+	/* NOTE: `count` must be at most `PREGENERATION_BATCH_SIZE` */
+	inline bool pregenerate_patches(const position* patch_positions, unsigned int count)
+	{
+		patch_type* batch[PREGENERATION_BATCH_SIZE];
+		for (unsigned int i = 0; i < count; i++) {
+			batch[i] = get_or_make_patch(patch_positions[i]);
+			if (batch[i] == NULL) return false;
+		}
+		return fix_patches(batch, patch_positions, count);
+	}
+
 	inline int64_t floored_div(int64_t a, unsigned int b) const {
 		lldiv_t result = lldiv(a, b);
 		if (a < 0 && result.rem != 0)
@@ -433,10 +1027,10 @@ private:
 	 * modified in the future by further sampling. New neighboring patches are
 	 * created as needed, and sampling is done accordingly.
 	 *
-	 * NOTE: This function assumes `patches` has sufficient capacity to store
-	 * any new patches that may be initialized.
+	 * \returns `true` if successful; `false` if a neighboring patch could not
+	 *          be created or loaded, in which case no patch is sampled.
 	 */
-	void fix_patches(
+	bool fix_patches(
 			patch_type** patches,
 			const position* patch_positions,
 			unsigned int patch_count)
@@ -453,25 +1047,108 @@ private:
 			positions_to_sample.add(patch_positions[i].down().left());
 			positions_to_sample.add(patch_positions[i].down());
 			positions_to_sample.add(patch_positions[i].down().right());
+		}
+		if (positions_to_sample.length > 1) {
 			insertion_sort(positions_to_sample);
 			unique(positions_to_sample);
 		}
 
 		for (unsigned int i = 0; i < positions_to_sample.length; i++) {
-			if (get_or_make_patch<false>(positions_to_sample[i]).fixed) {
+			patch_type* p = get_or_make_patch(positions_to_sample[i]);
+			if (p == NULL) {
+				return false;
+			} else if (p->fixed) {
 				positions_to_sample.remove(i);
 				i--;
 			}
 		}
 
-		/* construct the Gibbs field and sample the patches at positions_to_sample */
-		gibbs_field<map<PerPatchData, ItemType>> field(
-				*this, cache, positions_to_sample.data, (unsigned int) positions_to_sample.length, n);
-		for (unsigned int i = 0; i < gibbs_iterations; i++)
-			field.sample(rng);
+		NEL_STATS(stats_stopwatch stopwatch);
+		if (sampler_pool != NULL && sampler_pool->thread_count() > 1 && positions_to_sample.length > 1) {
+			if (!sample_patches_in_parallel(positions_to_sample)) return false;
+		} else {
+			/* construct the Gibbs field and sample the patches at positions_to_sample */
+			gibbs_field<map<PerPatchData, ItemType>> field(
+					*this, cache, positions_to_sample.data, (unsigned int) positions_to_sample.length, n);
+			for (unsigned int i = 0; i < gibbs_iterations; i++)
+				field.sample(rng);
+		}
+		NEL_STATS(if (positions_to_sample.length > 0)
+			get_stats().record_generation(positions_to_sample.length, gibbs_iterations, stopwatch.nanoseconds()));
 
-		for (unsigned int i = 0; i < patch_count; i++)
+		for (unsigned int i = 0; i < patch_count; i++) {
+			if (fixed_patch_log != NULL && !patches[i]->fixed)
+				fixed_patch_log->add(patch_positions[i]);
 			patches[i]->fixed = true;
+		}
+		return true;
+	}
+
+	/**
+	 * Samples the patches at `positions_to_sample` using `sampler_pool`. The
+	 * patches are partitioned into four color classes by the parity of their
+	 * coordinates. Two distinct patches with the same color are never
+	 * adjacent, and since sampling a patch only writes to that patch and only
+	 * reads from its eight neighbors, the patches within a color class can be
+	 * sampled concurrently. The color classes are sampled one after another.
+	 * Each patch is sampled with its own random engine whose seed is drawn
+	 * from `rng`, so the result does not depend on the scheduling of threads.
+	 *
+	 * NOTE: This function assumes every patch in `positions_to_sample`
+	 * already exists, so that the map is not modified while sampling.
+	 *
+	 * \returns `true` if successful; `false` if there is insufficient memory,
+	 *          in which case no patch is sampled.
+	 */
+	bool sample_patches_in_parallel(array<position>& positions_to_sample)
+	{
+		/* reorder the positions so that each color class is contiguous (the
+		   number of patches is unbounded, so these are not on the stack) */
+		unsigned int class_start[5];
+		unsigned int patch_count = (unsigned int) positions_to_sample.length;
+		position* ordered = (position*) malloc(sizeof(position) * patch_count);
+		uint_fast32_t* seeds = (uint_fast32_t*) malloc(sizeof(uint_fast32_t) * patch_count);
+		if (ordered == NULL || seeds == NULL) {
+			fprintf(stderr, "map.sample_patches_in_parallel ERROR: Out of memory.\n");
+			if (ordered != NULL) core::free(ordered);
+			if (seeds != NULL) core::free(seeds);
+			return false;
+		}
+		unsigned int next = 0;
+		for (unsigned int color = 0; color < 4; color++) {
+			class_start[color] = next;
+			for (unsigned int i = 0; i < patch_count; i++) {
+				const position& patch_position = positions_to_sample[i];
+				if ((unsigned int) (((patch_position.x & 1) << 1) | (patch_position.y & 1)) == color)
+					ordered[next++] = patch_position;
+			}
+		}
+		class_start[4] = next;
+
+		/* load the neighbors of the patches from the eviction store and snapshot first, since the threads must not modify the map */
+		if (snapshot != NULL || evicted != NULL) {
+			for (unsigned int i = 0; i < patch_count; i++)
+				for (int64_t x = -1; x <= 1; x++)
+					for (int64_t y = -1; y <= 1; y++)
+						get_patch_if_exists(ordered[i] + position(x, y));
+		}
+
+		gibbs_field<map<PerPatchData, ItemType>> field(*this, cache, ordered, patch_count, n);
+		for (unsigned int i = 0; i < gibbs_iterations; i++) {
+			for (unsigned int j = 0; j < patch_count; j++)
+				seeds[j] = rng();
+
+			for (unsigned int color = 0; color < 4; color++) {
+				unsigned int offset = class_start[color];
+				auto sample_patch = [&](unsigned int task, unsigned int thread_id) {
+					std::minstd_rand patch_rng(seeds[offset + task]);
+					field.sample_patch(patch_rng, offset + task);
+				};
+				sampler_pool->run(class_start[color + 1] - offset, sample_patch);
+			}
+		}
+		core::free(ordered); core::free(seeds);
+		return true;
 	}
 
 	inline void free_helper() {
@@ -485,13 +1162,24 @@ inline bool init(map<PerPatchData, ItemType>& world, unsigned int n,
 		unsigned int gibbs_iterations, const ItemType* item_types,
 		unsigned int item_type_count, uint_fast32_t seed)
 {
-	if (!hash_map_init(world.patches, 1024, alloc_position_keys))
+	if (!init(world.patches, 1024))
 		return false;
 	world.n = n;
+	world.n_shift = power_of_two_shift(n);
 	world.gibbs_iterations = gibbs_iterations;
-	if (!init(world.cache, item_types, item_type_count, n)) {
+	world.sampler_pool = NULL;
+	world.snapshot = NULL;
+	world.evicted = NULL;
+	world.memory_budget = 0;
+	world.resident_patch_limit = UINT_MAX;
+	world.access_time = 0;
+	world.fixed_patch_log = NULL;
+	if (!init(world.cell_pool, patch<PerPatchData>::cell_block_size(n), map<PerPatchData, ItemType>::CELL_POOL_CHUNK_SIZE)) {
 		free(world.patches);
 		return false;
+	} else if (!init(world.cache, item_types, item_type_count, n)) {
+		free(world.patches); free(world.cell_pool);
+		return false;
 	}
 
 	new (&world.rng) std::minstd_rand(seed);
@@ -526,23 +1214,74 @@ bool read(map<PerPatchData, ItemType>& world, Stream& in,
 	std::stringstream buffer(std::string(state, length));
 	buffer >> world.rng;
 
-	default_scribe scribe;
+	world.sampler_pool = NULL;
+	world.snapshot = NULL;
+	world.evicted = NULL;
+	world.memory_budget = 0;
+	world.resident_patch_limit = UINT_MAX;
+	world.access_time = 0;
+	world.fixed_patch_log = NULL;
 	if (!read(world.n, in)
 	 || !read(world.gibbs_iterations, in)
-	 || !read(world.patches, in, alloc_position_keys, scribe, patch_reader))
+	 || !read(world.patches, in, patch_reader))
 		return false;
-	if (!init(world.cache, item_types, item_type_count, world.n)) {
+	world.n_shift = power_of_two_shift(world.n);
+	if (!init(world.cell_pool, patch<PerPatchData>::cell_block_size(world.n), map<PerPatchData, ItemType>::CELL_POOL_CHUNK_SIZE)) {
+		for (auto entry : world.patches)
+			free(entry.value);
 		free(world.patches);
 		return false;
 	}
+	for (auto entry : world.patches) {
+		if (!entry.value.init_item_indices(world.n, world.cell_pool)) {
+			for (auto entry : world.patches)
+				free(entry.value);
+			free(world.patches); free(world.cell_pool);
+			return false;
+		}
+	}
+	if (!init(world.cache, item_types, item_type_count, world.n)) {
+		for (auto entry : world.patches)
+			free(entry.value);
+		free(world.patches); free(world.cell_pool);
+		return false;
+	}
 	return true;
 }
 
-/* NOTE: this function assumes the variables in the map are not modified during writing */
+/**
+ * Writes the state of `world`, other than its patches, in the same format as
+ * `write`, but as if the map had no patches.
+ */
+template<typename PerPatchData, typename ItemType, typename Stream>
+bool write_without_patches(const map<PerPatchData, ItemType>& world, Stream& out)
+{
+	/* write the PRNG state into a stringstream buffer */
+	std::stringstream buffer;
+	buffer << world.rng;
+	std::string data = buffer.str();
+	return write(data.length(), out)
+		&& write(data.c_str(), out, (unsigned int) data.length())
+		&& write(world.n, out)
+		&& write(world.gibbs_iterations, out)
+		&& write(0u, out);
+}
+
+/**
+ * NOTE: this function assumes the variables in the map are not modified
+ * during writing. If the map was loaded from a snapshot, the patches that
+ * were not yet accessed are first loaded, since they are part of the map.
+ * The evicted patches are also part of the map, but they are read from the
+ * eviction store one at a time and written after the patches in memory, in
+ * the same format, so that writing does not exceed the memory budget.
+ */
 template<typename PerPatchData, typename ItemType, typename Stream, typename PatchWriter>
 bool write(const map<PerPatchData, ItemType>& world, Stream& out,
 		PatchWriter& patch_writer = default_scribe())
 {
+	if (!const_cast<map<PerPatchData, ItemType>&>(world).load_snapshot_patches())
+		return false;
+
 	/* write the PRNG state into a stringstream buffer */
 	std::stringstream buffer;
 	buffer << world.rng;
@@ -551,10 +1290,107 @@ bool write(const map<PerPatchData, ItemType>& world, Stream& out,
 	 || !write(data.c_str(), out, (unsigned int) data.length()))
 		return false;
 
-	default_scribe scribe;
-	return write(world.n, out)
-		&& write(world.gibbs_iterations, out)
-		&& write(world.patches, out, scribe, patch_writer);
+	unsigned int evicted_count = (world.evicted == NULL) ? 0 : world.evicted->index.table.size;
+	if (!write(world.n, out)
+	 || !write(world.gibbs_iterations, out)
+	 || !write(world.patches.size + evicted_count, out))
+		return false;
+	for (auto entry : world.patches) {
+		if (!write(entry.key, out)
+		 || !write(entry.value, out, patch_writer))
+			return false;
+	}
+	if (evicted_count == 0) return true;
+
+	/* the data of an evicted patch is not stored, and it is loaded with the initial data */
+	PerPatchData* initial_data = (PerPatchData*) malloc(sizeof(PerPatchData));
+	if (initial_data == NULL) {
+		fprintf(stderr, "write ERROR: Out of memory.\n");
+		return false;
+	} else if (!init(*initial_data)) {
+		core::free(initial_data);
+		return false;
+	}
+	array<item> items(64);
+	for (auto entry : world.evicted->index) {
+		if (!world.evicted->read_items(entry.value, items)
+		 || !write(entry.key, out)
+		 || !write(entry.value.fixed, out)
+		 || !write(items, out)
+		 || !write(*initial_data, out, patch_writer))
+		{
+			core::free(*initial_data); core::free(initial_data);
+			return false;
+		}
+	}
+	core::free(*initial_data); core::free(initial_data);
+	return true;
+}
+
+/**
+ * Writes the patch index and the items of the patches of `world` to the
+ * snapshot file `out` (see `snapshot_header`), after its state section,
+ * which ends at the offset `state_end`, and then writes the header, with the
+ * given `generation`, at the beginning of the file. If `world` was loaded
+ * from a snapshot, the patches that were never accessed are copied directly
+ * from the mapped file, and the evicted patches are read from the eviction
+ * store one at a time. The items of each patch are written with a single
+ * `fwrite`.
+ *
+ * \returns `true` if successful; `false` otherwise.
+ */
+template<typename PerPatchData, typename ItemType>
+bool write_snapshot_patches(const map<PerPatchData, ItemType>& world,
+		FILE* out, uint64_t state_end, uint64_t generation = 0)
+{
+	typedef typename map<PerPatchData, ItemType>::patch_type patch_type;
+
+	/* collect the patches in memory, the evicted patches, and those that are only in the snapshot */
+	const mapped_snapshot* snapshot = world.snapshot;
+	eviction_store<item>* evicted = world.evicted;
+	size_t patch_count = world.patches.size
+			+ (evicted == NULL ? 0 : (size_t) evicted->index.table.size)
+			+ (snapshot == NULL ? 0 : (size_t) snapshot->header->patch_count);
+	array<snapshot_patch_record> records(max((size_t) 1, patch_count));
+	for (auto entry : world.patches) {
+		snapshot_patch_record& record = records[records.length++];
+		record.key = entry.key;
+		record.item_offset = 0;
+		record.item_count = (uint32_t) entry.value.items.length;
+		record.fixed = entry.value.fixed ? 1 : 0;
+	}
+	if (evicted != NULL) {
+		for (auto entry : evicted->index) {
+			snapshot_patch_record& record = records[records.length++];
+			record.key = entry.key;
+			record.item_offset = 0;
+			record.item_count = entry.value.item_count;
+			record.fixed = entry.value.fixed ? 1 : 0;
+		}
+	}
+	if (snapshot != NULL) {
+		for (uint64_t i = 0; i < snapshot->header->patch_count; i++) {
+			const position& key = snapshot->records[i].key;
+			if (world.patches.get(key) == NULL && (evicted == NULL || evicted->find(key) == NULL))
+				records[records.length++] = snapshot->records[i];
+		}
+	}
+	if (records.length > 1) sort(records);
+
+	/* the items of the patches that are only in the snapshot are identified by a nonzero `item_offset` */
+	array<uint64_t> source_offsets(max((size_t) 1, records.length));
+	for (const snapshot_patch_record& record : records)
+		source_offsets[source_offsets.length++] = record.item_offset;
+
+	array<item> buffer(64);
+	auto get_items = [&](size_t i) -> const item* {
+		if (source_offsets[i] != 0)
+			return (const item*) (snapshot->data + source_offsets[i]);
+		const patch_type* p = world.patches.get(records[i].key);
+		if (p != NULL) return p->items.data;
+		return evicted->read_items(*evicted->find(records[i].key), buffer) ? buffer.data : NULL;
+	};
+	return write_snapshot_index<item>(out, state_end, records.data, records.length, get_items, generation);
 }
 
 } /* namespace nel */
@@ -44,6 +44,10 @@ int main(int argc, const char** argv) {
 	item_type.interaction_fn_arg_counts = &interaction_fn_arg_count;
 	auto m = map<empty_data, item_properties>(n, 10, &item_type, 1);
 
+	/* optionally sample the patches in parallel using the given number of threads */
+	thread_pool pool(argc > 1 ? (unsigned int) atoi(argv[1]) : 1);
+	m.set_thread_pool(&pool);
+
 	patch<empty_data>* neighborhood[4];
 	position neighbor_positions[4];
 	m.get_fixed_neighborhood({0, 0}, neighborhood, neighbor_positions);
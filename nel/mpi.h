@@ -3,6 +3,8 @@
 
 #include "network.h"
 #include "simulator.h"
+#include "step_encoding.h"
+#include "shared_memory.h"
 
 namespace nel {
 
@@ -17,9 +19,30 @@ enum class message_type : uint64_t {
 	TURN_RESPONSE,
 	GET_MAP,
 	GET_MAP_RESPONSE,
-	STEP_RESPONSE
+	STEP_RESPONSE,
+	BATCH_ACTIONS,
+	BATCH_ACTIONS_RESPONSE,
+	COMPACT_STEP_RESPONSE,
+	GET_STATS,
+	GET_STATS_RESPONSE,
+	RESYNC_STEPS
 };
 
+static_assert((size_t) message_type::RESYNC_STEPS < STATS_MESSAGE_TYPE_CAPACITY,
+		"STATS_MESSAGE_TYPE_CAPACITY must be larger than the number of message types");
+
+/**
+ * The version of the handshake sent by `init_client`. Clients send
+ * `PROTOCOL_VERSION_MARKER` in place of the agent count, followed by their
+ * version, the agent count, the requested `step_encoding`, and the requested
+ * shared-memory capacity. Clients that predate versioning send the agent
+ * count directly, and the server treats them as requesting full step
+ * responses over TCP. A client of this version cannot connect to a server
+ * that predates versioning.
+ */
+constexpr unsigned int PROTOCOL_VERSION = 1;
+constexpr unsigned int PROTOCOL_VERSION_MARKER = UINT_MAX;
+
 /**
  * Reads a message_type from `in` and stores the result in `type`.
  */
@@ -49,33 +72,118 @@ inline bool print(const message_type& type, Stream& out) {
 	case message_type::MOVE:             return core::print("MOVE", out);
 	case message_type::TURN:             return core::print("TURN", out);
 	case message_type::GET_MAP:          return core::print("GET_MAP", out);
+	case message_type::BATCH_ACTIONS:    return core::print("BATCH_ACTIONS", out);
+	case message_type::GET_STATS:        return core::print("GET_STATS", out);
+	case message_type::RESYNC_STEPS:     return core::print("RESYNC_STEPS", out);
 
 	case message_type::ADD_AGENT_RESPONSE:        return core::print("ADD_AGENT_RESPONSE", out);
 	case message_type::MOVE_RESPONSE:             return core::print("MOVE_RESPONSE", out);
 	case message_type::TURN_RESPONSE:             return core::print("TURN_RESPONSE", out);
 	case message_type::GET_MAP_RESPONSE:          return core::print("GET_MAP_RESPONSE", out);
 	case message_type::STEP_RESPONSE:             return core::print("STEP_RESPONSE", out);
+	case message_type::BATCH_ACTIONS_RESPONSE:    return core::print("BATCH_ACTIONS_RESPONSE", out);
+	case message_type::COMPACT_STEP_RESPONSE:     return core::print("COMPACT_STEP_RESPONSE", out);
+	case message_type::GET_STATS_RESPONSE:        return core::print("GET_STATS_RESPONSE", out);
 	}
 	fprintf(stderr, "print ERROR: Unrecognized message_type.\n");
 	return false;
 }
 
+/** The kinds of actions that can be sent in a `BATCH_ACTIONS` message. */
+enum class action_type : uint8_t { MOVE = 0, TURN = 1 };
+
+/**
+ * A single action in a `BATCH_ACTIONS` message. If `type` is
+ * `action_type::TURN`, `num_steps` is ignored.
+ */
+struct agent_action {
+	uint64_t agent_id;
+	action_type type;
+	direction dir;
+	unsigned int num_steps;
+};
+
+/**
+ * Reads the agent_action `action` from the stream `in`.
+ */
+template<typename Stream>
+inline bool read(agent_action& action, Stream& in) {
+	uint8_t type;
+	if (!read(action.agent_id, in) || !read(type, in)
+	 || !read(action.dir, in) || !read(action.num_steps, in))
+		return false;
+	action.type = (action_type) type;
+	return true;
+}
+
+/**
+ * Writes the agent_action `action` to the stream `out`.
+ */
+template<typename Stream>
+inline bool write(const agent_action& action, Stream& out) {
+	return write(action.agent_id, out)
+		&& write((uint8_t) action.type, out)
+		&& write(action.dir, out)
+		&& write(action.num_steps, out);
+}
+
+/**
+ * A part of a message that is sent with `send_gathered`: either `length`
+ * bytes at `offset` in a staging buffer (if `data` is NULL), or `length`
+ * bytes at `data`, which are sent without being copied.
+ */
+struct send_segment {
+	const void* data;
+	unsigned int offset;
+	unsigned int length;
+};
+
 /**
  * A structure that keeps track of additional state for each connection in
- * `async_server`. For now, it just keeps track of the agent IDs governed by
- * each connected client.
+ * `async_server`. It keeps track of the agent IDs governed by each connected
+ * client, and the encoder of the step responses sent to that client, whose
+ * `step_encoding` is requested by the client when it connects. The client
+ * sets `resync_requested` (with a `RESYNC_STEPS` message) to have the
+ * encoder reset before the next step. The remaining buffers are reused by
+ * every full step response sent to the client. If the client requested the
+ * shared-memory transport, `shared_memory` is not NULL.
  */
 struct connection_data {
 	array<uint64_t> agent_ids;
+	step_codec codec;
+	std::atomic_bool resync_requested;
+	shared_memory_connection* shared_memory;
 
-	connection_data() : agent_ids(8) { }
+	memory_stream staging;
+	array<send_segment> segments;
+	array<io_buffer> send_buffers;
+
+	connection_data() : agent_ids(8), resync_requested(false), shared_memory(NULL), segments(16), send_buffers(16) {
+		new (&staging) memory_stream(1024);
+	}
 
 	static inline void move(const connection_data& src, connection_data& dst) {
 		core::move(src.agent_ids, dst.agent_ids);
+		step_codec::move(src.codec, dst.codec);
+		new (&dst.resync_requested) std::atomic_bool(src.resync_requested.load());
+		dst.shared_memory = src.shared_memory;
+		dst.staging.buffer = src.staging.buffer;
+		dst.staging.length = src.staging.length;
+		dst.staging.position = src.staging.position;
+		core::move(src.segments, dst.segments);
+		core::move(src.send_buffers, dst.send_buffers);
 	}
 
 	static inline void free(connection_data& connection) {
 		core::free(connection.agent_ids);
+		core::free(connection.codec);
+		if (connection.shared_memory != NULL) {
+			core::free(*connection.shared_memory);
+			core::free(connection.shared_memory);
+		}
+		core::free(connection.staging.buffer);
+		core::free(connection.segments);
+		core::free(connection.send_buffers);
 	}
 };
 
@@ -83,7 +191,39 @@ struct connection_data {
  * Initializes a new empty connection_data structure in `connection`.
  */
 inline bool init(connection_data& connection) {
-	return array_init(connection.agent_ids, 8);
+	if (!array_init(connection.agent_ids, 8)) {
+		return false;
+	} else if (!init(connection.codec)) {
+		free(connection.agent_ids);
+		return false;
+	} else if (!array_init(connection.segments, 16)) {
+		free(connection.agent_ids); free(connection.codec);
+		return false;
+	} else if (!array_init(connection.send_buffers, 16)) {
+		free(connection.agent_ids); free(connection.codec);
+		free(connection.segments); return false;
+	}
+	new (&connection.staging) memory_stream(1024);
+	new (&connection.resync_requested) std::atomic_bool(false);
+	connection.shared_memory = NULL;
+	return true;
+}
+
+/**
+ * Adds the bytes written to `data.staging` since the last staged segment
+ * (which ended at `staged`) as a new segment.
+ */
+inline bool add_staged_segment(connection_data& data, unsigned int& staged) {
+	if (data.staging.position == staged) return true;
+	if (!data.segments.add({NULL, staged, data.staging.position - staged}))
+		return false;
+	staged = data.staging.position;
+	return true;
+}
+
+/* adds `length` bytes at `bytes` as a segment that is not copied */
+inline bool add_segment(connection_data& data, const void* bytes, unsigned int length) {
+	return data.segments.add({bytes, 0, length});
 }
 
 /**
@@ -133,7 +273,19 @@ inline bool init(async_server& new_server) {
  * Writes the bytes in `data` of length `length` to the TCP socket in `socket`.
  */
 inline bool send_message(socket_type& socket, const void* data, unsigned int length) {
-	return send(socket.handle, (const char*) data, length, 0) != 0;
+	io_buffer buffer;
+	set_io_buffer(buffer, data, length);
+	return send_gathered(socket, &buffer, 1);
+}
+
+/**
+ * Writes the message `data` of type `type` and length `length` to the TCP
+ * socket in `socket`, counting its bytes in the server statistics (see
+ * `stats.h`).
+ */
+inline bool send_message(socket_type& socket, message_type type, const void* data, unsigned int length) {
+	NEL_STATS(get_stats().record_message((uint64_t) type, length));
+	return send_message(socket, data, length);
 }
 
 /* TODO: the below functions should send an error back to client upon failure */
@@ -153,7 +305,7 @@ inline bool receive_add_agent(
 	return write(message_type::ADD_AGENT_RESPONSE, out)
 		&& write(new_agent.key, out)
 		&& (new_agent.value == NULL || write(*new_agent.value, out, sim.get_config()))
-		&& send_message(connection, mem_stream.buffer, mem_stream.position);
+		&& send_message(connection, message_type::ADD_AGENT_RESPONSE, mem_stream.buffer, mem_stream.position);
 }
 
 template<typename Stream, typename SimulatorData>
@@ -169,7 +321,7 @@ inline bool receive_move(Stream& in, socket_type& connection, simulator<Simulato
 
 	return write(message_type::MOVE_RESPONSE, out)
 		&& write(agent_id, out) && write(result, out)
-		&& send_message(connection, mem_stream.buffer, mem_stream.position);
+		&& send_message(connection, message_type::MOVE_RESPONSE, mem_stream.buffer, mem_stream.position);
 }
 
 template<typename Stream, typename SimulatorData>
@@ -184,17 +336,73 @@ inline bool receive_turn(Stream& in, socket_type& connection, simulator<Simulato
 
 	return write(message_type::TURN_RESPONSE, out)
 		&& write(agent_id, out) && write(result, out)
-		&& send_message(connection, mem_stream.buffer, mem_stream.position);
+		&& send_message(connection, message_type::TURN_RESPONSE, mem_stream.buffer, mem_stream.position);
+}
+
+/* the number of bytes that `write(const agent_action&, Stream&)` writes for each action */
+constexpr size_t SERIALIZED_ACTION_SIZE = sizeof(uint64_t) + 2 * sizeof(uint8_t) + sizeof(unsigned int);
+
+/* applies every action in the batch in order, and responds with the result of each one */
+template<typename SimulatorData>
+inline bool receive_batch_actions(memory_stream& frame, socket_type& connection, simulator<SimulatorData>& sim) {
+	unsigned int action_count;
+	fixed_width_stream<memory_stream> in(frame);
+	if (!read(action_count, in))
+		return false;
+
+	/* the count comes from the client, so check it before allocating anything */
+	if (action_count > (frame.length - frame.position) / SERIALIZED_ACTION_SIZE) {
+		fprintf(stderr, "receive_batch_actions ERROR: The message is too short for %u actions.\n", action_count);
+		return false;
+	} else if (action_count > sim.get_agent_count()) {
+		fprintf(stderr, "receive_batch_actions ERROR: The batch has more actions (%u) than there are agents.\n", action_count);
+		return false;
+	}
+	agent_action* actions = (agent_action*) malloc(sizeof(agent_action) * max(1u, action_count));
+	bool* results = (bool*) malloc(sizeof(bool) * max(1u, action_count));
+	if (actions == NULL || results == NULL) {
+		fprintf(stderr, "receive_batch_actions ERROR: Out of memory.\n");
+		if (actions != NULL) free(actions);
+		if (results != NULL) free(results);
+		return false;
+	}
+	for (unsigned int i = 0; i < action_count; i++) {
+		if (!read(actions[i], in)) {
+			free(actions); free(results);
+			return false;
+		}
+	}
+
+	for (unsigned int i = 0; i < action_count; i++) {
+		const agent_action& action = actions[i];
+		switch (action.type) {
+		case action_type::MOVE:
+			results[i] = sim.move(action.agent_id, action.dir, action.num_steps); continue;
+		case action_type::TURN:
+			results[i] = sim.turn(action.agent_id, action.dir); continue;
+		}
+		results[i] = false;
+	}
+
+	memory_stream mem_stream = memory_stream(sizeof(message_type) + sizeof(action_count)
+			+ action_count * (sizeof(uint64_t) + sizeof(bool)));
+	fixed_width_stream<memory_stream> out(mem_stream);
+	bool success = write(message_type::BATCH_ACTIONS_RESPONSE, out) && write(action_count, out);
+	for (unsigned int i = 0; success && i < action_count; i++)
+		success = write(actions[i].agent_id, out) && write(results[i], out);
+	free(actions); free(results);
+	return success && send_message(connection, message_type::BATCH_ACTIONS_RESPONSE, mem_stream.buffer, mem_stream.position);
 }
 
 template<typename Stream, typename SimulatorData>
 inline bool receive_get_map(Stream& in, socket_type& connection, simulator<SimulatorData>& sim) {
 	position bottom_left, top_right;
-	if (!read(bottom_left, in) || !read(top_right, in))
+	uint64_t modified_since;
+	if (!read(bottom_left, in) || !read(top_right, in) || !read(modified_since, in))
 		return false;
 
 	hash_map<position, patch_state> patches(32);
-	if (!sim.get_map(bottom_left, top_right, patches)) {
+	if (!sim.get_map(bottom_left, top_right, patches, modified_since)) {
 		for (auto entry : patches)
 			free(entry.value);
 		patches.clear();
@@ -205,20 +413,39 @@ inline bool receive_get_map(Stream& in, socket_type& connection, simulator<Simul
 	fixed_width_stream<memory_stream> out(mem_stream);
 	if (!write(message_type::GET_MAP_RESPONSE, out)
 	 || !write(patches, out, scribe, sim.get_config())
-	 || !send_message(connection, mem_stream.buffer, mem_stream.position))
+	 || !send_message(connection, message_type::GET_MAP_RESPONSE, mem_stream.buffer, mem_stream.position))
 		return false;
 	for (auto entry : patches)
 		free(entry.value);
 	return true;
 }
 
+/* responds with the counters of the instrumented hot paths, which are all zero unless NEL_ENABLE_STATS is defined */
+inline bool receive_get_stats(socket_type& connection) {
+	stats_snapshot& snapshot = *((stats_snapshot*) alloca(sizeof(stats_snapshot)));
+	get_stats(snapshot);
+
+	memory_stream mem_stream = memory_stream(sizeof(message_type) + sizeof(stats_snapshot));
+	fixed_width_stream<memory_stream> out(mem_stream);
+	return write(message_type::GET_STATS_RESPONSE, out)
+		&& write(snapshot, out)
+		&& send_message(connection, message_type::GET_STATS_RESPONSE, mem_stream.buffer, mem_stream.position);
+}
+
+/* resets the step encoder of the connection before the next step, since the client failed to decode a response */
+inline void receive_resync_steps(socket_type& connection,
+		hash_map<socket_type, connection_data>& connections)
+{
+	connections.get(connection).resync_requested = true;
+}
+
 template<typename SimulatorData>
-void server_process_message(socket_type& connection,
+void server_process_message(memory_stream& frame, socket_type& connection,
 		hash_map<socket_type, connection_data>& connections,
 		simulator<SimulatorData>& sim)
 {
 	message_type type;
-	fixed_width_stream<socket_type> in(connection);
+	fixed_width_stream<memory_stream> in(frame);
 	if (!read(type, in)) return;
 	switch (type) {
 		case message_type::ADD_AGENT:
@@ -229,12 +456,21 @@ void server_process_message(socket_type& connection,
 			receive_turn(in, connection, sim); return;
 		case message_type::GET_MAP:
 			receive_get_map(in, connection, sim); return;
+		case message_type::BATCH_ACTIONS:
+			receive_batch_actions(frame, connection, sim); return;
+		case message_type::GET_STATS:
+			receive_get_stats(connection); return;
+		case message_type::RESYNC_STEPS:
+			receive_resync_steps(connection, connections); return;
 
 		case message_type::ADD_AGENT_RESPONSE:
 		case message_type::MOVE_RESPONSE:
 		case message_type::TURN_RESPONSE:
 		case message_type::GET_MAP_RESPONSE:
 		case message_type::STEP_RESPONSE:
+		case message_type::BATCH_ACTIONS_RESPONSE:
+		case message_type::COMPACT_STEP_RESPONSE:
+		case message_type::GET_STATS_RESPONSE:
 			break;
 	}
 	fprintf(stderr, "server_process_message WARNING: Received message with unrecognized type.\n");
@@ -254,12 +490,27 @@ inline bool process_new_connection(socket_type& connection,
 		return false;
 	}
 
-	/* read the agent IDs owned by the new client */
-	unsigned int agent_count = 0;
+	/* read the agent IDs owned by the new client, and the requested step encoding */
+	unsigned int agent_count = 0, version = 0;
+	unsigned int shared_memory_capacity = 0;
 	fixed_width_stream<socket_type> in(connection);
 	if (!read(agent_count, in)) {
 		fprintf(stderr, "process_new_connection ERROR: Failed to read agent_count.\n");
 		return false;
+	} else if (agent_count == PROTOCOL_VERSION_MARKER) {
+		if (!read(version, in) || !read(agent_count, in)) {
+			fprintf(stderr, "process_new_connection ERROR: Failed to read the protocol version and agent_count.\n");
+			return false;
+		} else if (version > PROTOCOL_VERSION) {
+			fprintf(stderr, "process_new_connection ERROR: Unsupported protocol version %u.\n", version);
+			return false;
+		} else if (!read(data.codec.encoding, in)) {
+			fprintf(stderr, "process_new_connection ERROR: Failed to read the step encoding.\n");
+			return false;
+		} else if (!read(shared_memory_capacity, in)) {
+			fprintf(stderr, "process_new_connection ERROR: Failed to read the shared memory capacity.\n");
+			return false;
+		}
 	}
 
 	if (agent_count > 0) {
@@ -286,7 +537,35 @@ inline bool process_new_connection(socket_type& connection,
 		}
 		free(agent_ids); free(agent_states);
 	}
-	return send_message(connection, mem_stream.buffer, mem_stream.position);
+
+	/* create the shared memory region, if requested, and send its name (which is empty upon failure) */
+	if (shared_memory_capacity > 0) {
+		data.shared_memory = (shared_memory_connection*) malloc(sizeof(shared_memory_connection));
+		if (data.shared_memory != NULL && !init(*data.shared_memory, config, shared_memory_capacity)) {
+			free(data.shared_memory);
+			data.shared_memory = NULL;
+		}
+		unsigned int name_length = (data.shared_memory == NULL) ? 0 : (unsigned int) strlen(data.shared_memory->name);
+		if (!write(name_length, out)
+		 || (name_length > 0 && !write(data.shared_memory->name, out, name_length)))
+			return false;
+	}
+	if (!send_message(connection, mem_stream.buffer, mem_stream.position))
+		return false;
+
+	/* only use the region once the client acknowledges that it mapped it */
+	if (data.shared_memory != NULL) {
+		bool mapped;
+		if (!read(mapped, in) || !mapped) {
+			fprintf(stderr, "process_new_connection WARNING: The client did not map the shared memory region; using TCP instead.\n");
+			core::free(*data.shared_memory);
+			core::free(data.shared_memory);
+			data.shared_memory = NULL;
+		} else {
+			start<message_type>(*data.shared_memory, sim);
+		}
+	}
+	return true;
 }
 
 template<typename Stream>
@@ -304,12 +583,19 @@ inline bool write_extra_data(Stream& out,
 
 /**
  * Sends a step response to every client connected to the given `server`. This
- * function should be called whenever the simulator advances time.
+ * function should be called whenever the simulator advances time. Clients
+ * that requested a compact `step_encoding` receive a `COMPACT_STEP_RESPONSE`
+ * encoded by their `connection_data::codec`, whose buffers are reused across
+ * steps. Other clients receive a `STEP_RESPONSE`, which is sent with a single
+ * gathered send in which the observations of each agent are not copied.
+ * Clients that use the shared-memory transport receive the step through their
+ * region instead, unless their agents do not fit in it.
  *
  * \param extra_data Any additional state to be sent to every client at the end
  * 		of the step response. For each argument of type `T`, a function
  * 		`bool write(const T&, fixed_width_stream<memory_stream>&)` should be
- * 		defined.
+ * 		defined. If any client requested a compact `step_encoding` or the
+ * 		shared-memory transport, every argument must have a fundamental type.
  */
 template<typename... ExtraData>
 inline bool send_step_response(
@@ -322,27 +608,66 @@ inline bool send_step_response(
 	bool success = true;
 	for (const auto& client_connection : server.client_connections) {
 		const array<uint64_t>& agent_ids = client_connection.value.agent_ids;
-		memory_stream mem_stream = memory_stream(sizeof(message_type) + sizeof(unsigned int) +
-				(unsigned int) agent_ids.length * (sizeof(uint64_t) + sizeof(agent_state)));
-		fixed_width_stream<memory_stream> out(mem_stream);
-		if (!write(message_type::STEP_RESPONSE, out)
-		 || !write(agent_ids, out)) {
-			success = false;
+		shared_memory_connection* shared_memory = client_connection.value.shared_memory;
+		if (shared_memory != NULL && send_shared_step<message_type>(*shared_memory,
+				agent_ids, agents, config, std::forward<ExtraData>(extra_data)...))
 			continue;
-		}
 
-		bool client_success = true;
-		for (uint64_t agent_id : agent_ids) {
-			if (!write(*agents[(size_t) agent_id], out, config)) {
-				client_success = false;
-				break;
+		step_codec& codec = client_connection.value.codec;
+		if (codec.encoding.compact) {
+			if (client_connection.value.resync_requested.exchange(false))
+				codec.reset();
+			if (!encode_step(codec, message_type::COMPACT_STEP_RESPONSE, agent_ids, agents, config)
+			 || !put_step_extra_data(codec, std::forward<ExtraData>(extra_data)...)) {
+				codec.reset();
+				success = false;
+				continue;
+			}
+			/* the next step is only encoded as a delta against this one if it was delivered */
+			if (!send_message(client_connection.key, message_type::COMPACT_STEP_RESPONSE, codec.message.data, codec.message.length)) {
+				codec.reset();
+				success = false;
 			}
+			continue;
+		}
+
+		/* the small fields are staged, and the observations are sent directly from each agent */
+		connection_data& data = client_connection.value;
+		data.staging.position = 0;
+		data.segments.clear();
+		unsigned int staged = 0;
+		fixed_width_stream<memory_stream> out(data.staging);
+		const unsigned int vision_size = (2*config.vision_range + 1) * (2*config.vision_range + 1) * config.color_dimension;
+		bool client_success = write(message_type::STEP_RESPONSE, out) && write(agent_ids, out);
+		for (size_t i = 0; client_success && i < agent_ids.length; i++) {
+			const agent_state& agent = *agents[(size_t) agent_ids[i]];
+			client_success = write(agent.current_position, out)
+					&& write(agent.current_direction, out)
+					&& add_staged_segment(data, staged)
+					&& add_segment(data, agent.current_scent, sizeof(float) * config.scent_dimension)
+					&& add_segment(data, agent.current_vision, sizeof(float) * vision_size)
+					&& write(agent.agent_acted, out)
+					&& write(agent.requested_position, out)
+					&& write(agent.requested_direction, out)
+					&& add_staged_segment(data, staged)
+					&& add_segment(data, agent.collected_items, sizeof(unsigned int) * (unsigned int) config.item_types.length);
 		}
-		if (!client_success || !write_extra_data(out, std::forward<ExtraData>(extra_data)...)) {
+		if (!client_success || !write_extra_data(out, std::forward<ExtraData>(extra_data)...)
+		 || !add_staged_segment(data, staged) || !data.send_buffers.ensure_capacity(data.segments.length)) {
 			success = false;
 			continue;
 		}
-		success &= send_message(client_connection.key, mem_stream.buffer, mem_stream.position);
+
+		/* the staging buffer may have moved while it was written, so its segments are resolved last */
+		NEL_STATS(uint64_t message_length = 0);
+		for (size_t i = 0; i < data.segments.length; i++) {
+			const send_segment& segment = data.segments[i];
+			set_io_buffer(data.send_buffers[i], (segment.data == NULL)
+					? (const void*) (data.staging.buffer + segment.offset) : segment.data, segment.length);
+			NEL_STATS(message_length += segment.length);
+		}
+		NEL_STATS(get_stats().record_message((uint64_t) message_type::STEP_RESPONSE, message_length));
+		success &= send_gathered(client_connection.key, data.send_buffers.data, (unsigned int) data.segments.length);
 	}
 	return success;
 }
@@ -359,17 +684,21 @@ inline bool send_step_response(
  * 		connections that can be handled by the server.
  * \param worker_count The number of worker threads to dispatch. They are
  * 		tasked with processing incoming message from clients.
+ * \param io_mode Whether the workers read messages with blocking reads, or
+ * 		with non-blocking reads into per-connection buffers (see
+ * 		`server_io_mode`).
  * \returns `true` if successful; `false` otherwise.
  */
 template<typename SimulatorData>
 bool init_server(
 		async_server& new_server, simulator<SimulatorData>& sim, uint16_t server_port,
-		unsigned int connection_queue_capacity, unsigned int worker_count)
+		unsigned int connection_queue_capacity, unsigned int worker_count,
+		server_io_mode io_mode = server_io_mode::BLOCKING)
 {
 	std::condition_variable cv; std::mutex lock;
 	auto dispatch = [&]() {
 		run_server(new_server.server_socket, server_port,
-				connection_queue_capacity, worker_count, new_server.state, cv, lock,
+				connection_queue_capacity, worker_count, io_mode, new_server.state, cv, lock,
 				new_server.client_connections, new_server.connection_set_lock,
 				server_process_message<SimulatorData>, process_new_connection<SimulatorData>, sim);
 	};
@@ -400,18 +729,22 @@ bool init_server(
  * 		connections that can be handled by the server.
  * \param worker_count The number of worker threads to dispatch. They are
  * 		tasked with processing incoming message from clients.
+ * \param io_mode Whether the workers read messages with blocking reads, or
+ * 		with non-blocking reads into per-connection buffers (see
+ * 		`server_io_mode`).
  * \returns `true` if successful; `false` otherwise.
  */
 template<typename SimulatorData>
 inline bool init_server(simulator<SimulatorData>& sim, uint16_t server_port,
-		unsigned int connection_queue_capacity, unsigned int worker_count)
+		unsigned int connection_queue_capacity, unsigned int worker_count,
+		server_io_mode io_mode = server_io_mode::BLOCKING)
 {
 	socket_type server_socket;
 	server_state dummy = server_state::STARTING;
 	std::condition_variable cv; std::mutex lock, connection_set_lock;
 	hash_map<socket_type, connection_data> connections(1024, alloc_socket_keys);
 	return run_server(server_socket, server_port, connection_queue_capacity,
-			worker_count, dummy, cv, lock, connections, connection_set_lock,
+			worker_count, io_mode, dummy, cv, lock, connections, connection_set_lock,
 			server_process_message<SimulatorData>, process_new_connection<SimulatorData>, sim);
 }
 
@@ -426,6 +759,11 @@ void stop_server(async_server& server) {
 			server.server_thread.join();
 		} catch (...) { }
 	}
+
+	/* stop applying actions from shared-memory clients */
+	for (auto connection : server.client_connections)
+		if (connection.value.shared_memory != NULL)
+			connection.value.shared_memory->stop();
 }
 
 
@@ -444,10 +782,24 @@ struct client {
 	simulator_config config;
 	ClientData data;
 
+	/* the decoder of compact step responses from the server */
+	step_codec codec;
+
+	/* the shared-memory transport, if it was requested and is available */
+	shared_memory_client* shared_memory;
+
+	/* the extra data of the compact step response being processed by `on_step`, if any */
+	byte_reader* step_extra;
+
 	static inline void free(client<ClientData>& c) {
 		c.response_listener.~thread();
 		core::free(c.config);
 		core::free(c.data);
+		core::free(c.codec);
+		if (c.shared_memory != NULL) {
+			core::free(*c.shared_memory);
+			core::free(c.shared_memory);
+		}
 	}
 };
 
@@ -461,8 +813,14 @@ inline bool init(client<ClientData>& new_client) {
 	} else if (!init(new_client.data)) {
 		free(new_client.config);
 		return false;
+	} else if (!init(new_client.codec)) {
+		free(new_client.config);
+		free(new_client.data);
+		return false;
 	}
 	new (&new_client.response_listener) std::thread();
+	new_client.shared_memory = NULL;
+	new_client.step_extra = NULL;
 	return true;
 }
 
@@ -479,7 +837,7 @@ inline bool init(client<ClientData>& new_client) {
 template<typename ClientType>
 bool send_add_agent(ClientType& c) {
 	message_type message = message_type::ADD_AGENT;
-	return send_message(c.connection, &message, sizeof(message));
+	return send_frame(c.connection, &message, sizeof(message));
 }
 
 /**
@@ -492,13 +850,17 @@ bool send_add_agent(ClientType& c) {
  */
 template<typename ClientType>
 bool send_move(ClientType& c, uint64_t agent_id, direction dir, unsigned int num_steps) {
+	if (c.shared_memory != NULL) {
+		shared_action action = {(uint64_t) message_type::MOVE, agent_id, (uint32_t) dir, num_steps};
+		return c.shared_memory->push_action(action);
+	}
 	memory_stream mem_stream = memory_stream(sizeof(message_type) + sizeof(agent_id) + sizeof(dir) + sizeof(num_steps));
 	fixed_width_stream<memory_stream> out(mem_stream);
 	return write(message_type::MOVE, out)
 		&& write(agent_id, out)
 		&& write(dir, out)
 		&& write(num_steps, out)
-		&& send_message(c.connection, mem_stream.buffer, mem_stream.position);
+		&& send_frame(c.connection, mem_stream.buffer, mem_stream.position);
 }
 
 /**
@@ -511,12 +873,40 @@ bool send_move(ClientType& c, uint64_t agent_id, direction dir, unsigned int num
  */
 template<typename ClientType>
 bool send_turn(ClientType& c, uint64_t agent_id, direction dir) {
+	if (c.shared_memory != NULL) {
+		shared_action action = {(uint64_t) message_type::TURN, agent_id, (uint32_t) dir, 0};
+		return c.shared_memory->push_action(action);
+	}
 	memory_stream mem_stream = memory_stream(sizeof(message_type) + sizeof(agent_id) + sizeof(dir));
 	fixed_width_stream<memory_stream> out(mem_stream);
 	return write(message_type::TURN, out)
 		&& write(agent_id, out)
 		&& write(dir, out)
-		&& send_message(c.connection, mem_stream.buffer, mem_stream.position);
+		&& send_frame(c.connection, mem_stream.buffer, mem_stream.position);
+}
+
+/**
+ * Sends a `batch_actions` message to the server from the client `c`, which
+ * requests all of the `action_count` actions in `actions` at once, in order.
+ * Once the server responds, the function
+ * `on_batch_actions(ClientType&, const uint64_t*, const bool*, unsigned int)`
+ * will be invoked, where the first argument is `c`, the second is the array
+ * of agent IDs in the batch, the third is a parallel array indicating whether
+ * each action was successfully enqueued by the server, and the fourth is
+ * their length.
+ *
+ * \returns `true` if the sending is successful; `false` otherwise.
+ */
+template<typename ClientType>
+bool send_batch_actions(ClientType& c, const agent_action* actions, unsigned int action_count) {
+	memory_stream mem_stream = memory_stream(sizeof(message_type) + sizeof(action_count)
+			+ action_count * (sizeof(uint64_t) + sizeof(action_type) + sizeof(direction) + sizeof(unsigned int)));
+	fixed_width_stream<memory_stream> out(mem_stream);
+	if (!write(message_type::BATCH_ACTIONS, out) || !write(action_count, out))
+		return false;
+	for (unsigned int i = 0; i < action_count; i++)
+		if (!write(actions[i], out)) return false;
+	return send_frame(c.connection, mem_stream.buffer, mem_stream.position);
 }
 
 /**
@@ -531,15 +921,41 @@ bool send_turn(ClientType& c, uint64_t agent_id, direction dir) {
  * 		patches we wish to retrieve.
  * \param top_right The top-right corner of the bounding box containing the
  * 		patches we wish to retrieve.
+ * \param modified_since If nonzero, only the patches that changed at or after
+ * 		this simulation time are retrieved.
  * \returns `true` if the sending is successful; `false` otherwise.
  */
 template<typename ClientType>
-bool send_get_map(ClientType& c, position bottom_left, position top_right) {
-	memory_stream mem_stream = memory_stream(sizeof(message_type) + 2 * sizeof(position));
+bool send_get_map(ClientType& c, position bottom_left, position top_right, uint64_t modified_since = 0) {
+	memory_stream mem_stream = memory_stream(sizeof(message_type) + 2 * sizeof(position) + sizeof(uint64_t));
 	fixed_width_stream<memory_stream> out(mem_stream);
 	return write(message_type::GET_MAP, out)
 		&& write(bottom_left, out) && write(top_right, out)
-		&& send_message(c.connection, mem_stream.buffer, mem_stream.position);
+		&& write(modified_since, out)
+		&& send_frame(c.connection, mem_stream.buffer, mem_stream.position);
+}
+
+/**
+ * Sends a `get_stats` message to the server from the client `c`. Once the
+ * server responds, the function
+ * `on_get_stats(ClientType&, stats_snapshot*)` will be invoked, where the
+ * first argument is `c`, and the second is a pointer to the counters of the
+ * server (see `stats.h`), which is NULL upon error. Ownership of the
+ * snapshot is passed to `on_get_stats`.
+ *
+ * \returns `true` if the sending is successful; `false` otherwise.
+ */
+template<typename ClientType>
+bool send_get_stats(ClientType& c) {
+	message_type message = message_type::GET_STATS;
+	return send_frame(c.connection, &message, sizeof(message));
+}
+
+/* requests that the next compact step response be sent in full */
+template<typename ClientType>
+bool send_resync_steps(ClientType& c) {
+	message_type message = message_type::RESYNC_STEPS;
+	return send_frame(c.connection, &message, sizeof(message));
 }
 
 template<typename ClientType>
@@ -577,6 +993,31 @@ inline bool receive_turn_response(ClientType& c) {
 	return true;
 }
 
+template<typename ClientType>
+inline bool receive_batch_actions_response(ClientType& c) {
+	unsigned int action_count;
+	fixed_width_stream<socket_type> in(c.connection);
+	if (!read(action_count, in))
+		return false;
+	uint64_t* agent_ids = (uint64_t*) malloc(sizeof(uint64_t) * max(1u, action_count));
+	bool* results = (bool*) malloc(sizeof(bool) * max(1u, action_count));
+	if (agent_ids == NULL || results == NULL) {
+		fprintf(stderr, "receive_batch_actions_response ERROR: Out of memory.\n");
+		if (agent_ids != NULL) free(agent_ids);
+		if (results != NULL) free(results);
+		return false;
+	}
+	for (unsigned int i = 0; i < action_count; i++) {
+		if (!read(agent_ids[i], in) || !read(results[i], in)) {
+			free(agent_ids); free(results);
+			return false;
+		}
+	}
+	on_batch_actions(c, (const uint64_t*) agent_ids, (const bool*) results, action_count);
+	free(agent_ids); free(results);
+	return true;
+}
+
 template<typename ClientType>
 inline bool receive_get_map_response(ClientType& c) {
 	default_scribe scribe;
@@ -594,6 +1035,23 @@ inline bool receive_get_map_response(ClientType& c) {
 	return true;
 }
 
+template<typename ClientType>
+inline bool receive_get_stats_response(ClientType& c) {
+	fixed_width_stream<socket_type> in(c.connection);
+	stats_snapshot* snapshot = (stats_snapshot*) malloc(sizeof(stats_snapshot));
+	if (snapshot == NULL) {
+		fprintf(stderr, "receive_get_stats_response ERROR: Out of memory.\n");
+		return false;
+	} else if (!read(*snapshot, in)) {
+		free(snapshot);
+		on_get_stats(c, (stats_snapshot*) NULL);
+		return false;
+	}
+	/* ownership of `snapshot` is passed to the callee */
+	on_get_stats(c, snapshot);
+	return true;
+}
+
 template<typename ClientType>
 inline bool receive_step_response(ClientType& c) {
 	array<uint64_t>& agent_ids = *((array<uint64_t>*) alloca(sizeof(array<uint64_t>)));
@@ -622,6 +1080,74 @@ inline bool receive_step_response(ClientType& c) {
 	return true;
 }
 
+/**
+ * Reads a compact step response, including its extra data, before decoding
+ * it, so that the whole message is consumed even if it cannot be decoded.
+ * The extra data is then read by `read_step_data` from `c.step_extra`.
+ */
+template<typename ClientType>
+inline bool receive_compact_step_response(ClientType& c) {
+	uint8_t flags;
+	unsigned int payload_size, wire_size, extra_size;
+	fixed_width_stream<socket_type> in(c.connection);
+	if (!read(flags, in) || !read(payload_size, in) || !read(wire_size, in) || !read(extra_size, in))
+		return false;
+	if (payload_size > MAX_FRAME_LENGTH || wire_size > MAX_FRAME_LENGTH || extra_size > MAX_FRAME_LENGTH) {
+		/* the rest of the stream cannot be trusted, so the listener will report the lost connection */
+		fprintf(stderr, "receive_compact_step_response ERROR: The step response is too large.\n");
+		shutdown(c.connection.handle, 2); return false;
+	}
+
+	step_codec& codec = c.codec;
+	if (!codec.message.ensure_capacity((size_t) wire_size + extra_size)
+	 || !read(codec.message.data, in, wire_size + extra_size))
+	{
+		codec.reset(); return false;
+	} else if (!codec.payload.ensure_capacity(payload_size)) {
+		codec.reset(); return false;
+	}
+	if (flags & step_codec::COMPRESSED) {
+#if defined(NEL_USE_LZ4)
+		if (LZ4_decompress_safe(codec.message.data, codec.payload.data,
+				(int) wire_size, (int) payload_size) != (int) payload_size)
+		{
+			fprintf(stderr, "receive_compact_step_response ERROR: LZ4 decompression failed.\n");
+			codec.reset(); return false;
+		}
+#else
+		fprintf(stderr, "receive_compact_step_response ERROR: Received a compressed step response, but LZ4 support is disabled.\n");
+		codec.reset(); return false;
+#endif
+	} else if (wire_size != payload_size) {
+		codec.reset(); return false;
+	} else {
+		memcpy(codec.payload.data, codec.message.data, payload_size);
+	}
+	codec.payload.length = payload_size;
+	if (!decode_step(codec, c.config)) return false;
+
+	agent_state* agents = (agent_state*) malloc(sizeof(agent_state) * max((size_t) 1, codec.agent_ids.length));
+	if (agents == NULL) {
+		fprintf(stderr, "receive_compact_step_response ERROR: Out of memory.\n");
+		return false;
+	}
+	for (unsigned int i = 0; i < codec.agent_ids.length; i++) {
+		if (!init(agents[i], codec.states[i], codec.encoding.vision, c.config)) {
+			for (unsigned int j = 0; j < i; j++) free(agents[j]);
+			free(agents); return false;
+		}
+	}
+
+	byte_reader extra = {codec.message.data + wire_size, extra_size, 0};
+	c.step_extra = &extra;
+	on_step(c, (const array<uint64_t>&) codec.agent_ids, (const agent_state*) agents);
+	c.step_extra = NULL;
+	for (unsigned int i = 0; i < codec.agent_ids.length; i++)
+		free(agents[i]);
+	free(agents);
+	return true;
+}
+
 template<typename ClientType>
 void run_response_listener(ClientType& c) {
 	while (c.client_running) {
@@ -644,17 +1170,80 @@ void run_response_listener(ClientType& c) {
 				receive_get_map_response(c); continue;
 			case message_type::STEP_RESPONSE:
 				receive_step_response(c); continue;
+			case message_type::BATCH_ACTIONS_RESPONSE:
+				receive_batch_actions_response(c); continue;
+			case message_type::COMPACT_STEP_RESPONSE:
+				if (!receive_compact_step_response(c)) {
+					/* the decoder may have lost the previous states, so a keyframe is needed */
+					c.codec.reset();
+					send_resync_steps(c);
+				}
+				continue;
+			case message_type::GET_STATS_RESPONSE:
+				receive_get_stats_response(c); continue;
 
 			case message_type::ADD_AGENT:
 			case message_type::MOVE:
 			case message_type::TURN:
 			case message_type::GET_MAP:
+			case message_type::BATCH_ACTIONS:
+			case message_type::GET_STATS:
+			case message_type::RESYNC_STEPS:
 				break;
 		}
 		fprintf(stderr, "run_response_listener ERROR: Received invalid message type from server %" PRId64 ".\n", (uint64_t) type);
 	}
 }
 
+/**
+ * Dispatches the responses that the server pushes to the shared-memory region
+ * of the client `c`, until `stop_client` is called.
+ */
+template<typename ClientType>
+void run_shared_memory_listener(ClientType& c) {
+#if defined(__linux__)
+	/* the timeout (in milliseconds) after which the thread checks whether it should stop */
+	constexpr long WAIT_TIMEOUT = 100;
+
+	shared_memory_client& shared_memory = *c.shared_memory;
+	shared_memory.listener_id = std::this_thread::get_id();
+	shared_response response;
+	while (c.client_running) {
+		if (!pop(shared_memory.region->responses, response, WAIT_TIMEOUT)) continue;
+		switch ((message_type) response.type) {
+			case message_type::MOVE_RESPONSE:
+				on_move(c, response.agent_id, response.result != 0); continue;
+			case message_type::TURN_RESPONSE:
+				on_turn(c, response.agent_id, response.result != 0); continue;
+			case message_type::STEP_RESPONSE:
+				read_shared_step(shared_memory);
+				on_step(c, (const array<uint64_t>&) shared_memory.agent_ids, (const agent_state*) shared_memory.agents);
+				continue;
+			default: break;
+		}
+		fprintf(stderr, "run_shared_memory_listener ERROR: Received invalid message type from server %" PRId64 ".\n", response.type);
+	}
+#endif
+}
+
+/**
+ * Reads the next value of the extra data that the server sent with the step
+ * response currently being processed by `on_step`. This must be used instead
+ * of reading from `c.connection`, since the extra data is in the
+ * shared-memory region if the step arrived through the shared-memory
+ * transport. A client that uses that transport may still receive some steps
+ * through the socket (e.g. if its agents no longer fit in the region), so the
+ * transport is determined by the listener thread that is processing the step.
+ */
+template<typename ClientData, typename T>
+inline bool read_step_data(client<ClientData>& c, T& value) {
+	if (c.shared_memory != NULL && std::this_thread::get_id() == c.shared_memory->listener_id.load())
+		return c.shared_memory->read_extra(value);
+	else if (c.step_extra != NULL)
+		return c.step_extra->get(value);
+	return read(value, c.connection);
+}
+
 /**
  * Attempts to connect the given client `new_client` to the server at
  * `server_address:server_port`. A separate thread will be dispatched to listen
@@ -671,23 +1260,46 @@ void run_response_listener(ClientType& c) {
  * 		will write the states of the agents whose IDs are given by the parallel
  * 		array `agent_ids`.
  * \param agent_count The lengths of `agent_ids` and `agent_states`.
+ * \param encoding The encoding of the step responses that the server should
+ * 		send to this client. By default, the full agent states are sent.
+ * \param shared_memory_capacity If nonzero, and the server is on the same
+ * 		(Linux) host, actions and step responses are exchanged through a
+ * 		shared-memory region with room for this many agents, rather than
+ * 		through the socket. The client falls back to the socket if the region
+ * 		cannot be created or mapped. The server may create a smaller region
+ * 		than requested.
  * \returns The simulator time if successful; `UINT64_MAX` otherwise.
  */
 template<typename ClientData>
 uint64_t init_client(client<ClientData>& new_client,
 		const char* server_address, const char* server_port,
 		const uint64_t* agent_ids, agent_state* agent_states,
-		unsigned int agent_count)
+		unsigned int agent_count, const step_encoding& encoding = step_encoding(),
+		unsigned int shared_memory_capacity = 0)
 {
+#if !defined(NEL_USE_LZ4)
+	if (encoding.compress) {
+		fprintf(stderr, "init_client ERROR: Compressed step responses were requested, but LZ4 support is disabled.\n");
+		return UINT64_MAX;
+	}
+#endif
+
 	uint64_t simulator_time;
+	new_client.codec.reset();
+	new_client.codec.encoding = encoding;
 	auto process_connection = [&](socket_type& connection)
 	{
 		new_client.connection = connection;
 
-		/* send the list of agent IDs owned by this client */
-		memory_stream mem_stream = memory_stream(sizeof(agent_count) + sizeof(uint64_t) * agent_count);
+		/* send the protocol version, the list of agent IDs owned by this client, and the requested step encoding */
+		memory_stream mem_stream = memory_stream(3 * sizeof(unsigned int) + sizeof(step_encoding)
+				+ sizeof(shared_memory_capacity) + sizeof(uint64_t) * agent_count);
 		fixed_width_stream<memory_stream> out(mem_stream);
-		if (!write(agent_count, out)
+		if (!write(PROTOCOL_VERSION_MARKER, out)
+		 || !write(PROTOCOL_VERSION, out)
+		 || !write(agent_count, out)
+		 || !write(encoding, out)
+		 || !write(shared_memory_capacity, out)
 		 || !write(agent_ids, out, agent_count)
 		 || !send_message(connection, mem_stream.buffer, mem_stream.position))
 		{
@@ -717,10 +1329,53 @@ uint64_t init_client(client<ClientData>& new_client,
 			}
 		}
 
+		/* map the shared memory region, if the server created one */
+		if (shared_memory_capacity > 0) {
+			unsigned int name_length;
+			if (!read(name_length, in) || name_length >= shared_memory_connection::NAME_CAPACITY) {
+				fprintf(stderr, "init_client ERROR: Error receiving the shared memory region.\n");
+				for (unsigned int i = 0; i < agent_count; i++) free(agent_states[i]);
+				return false;
+			}
+			char name[shared_memory_connection::NAME_CAPACITY];
+			if (name_length > 0) {
+				if (!read(name, in, name_length)) {
+					fprintf(stderr, "init_client ERROR: Error receiving the shared memory region.\n");
+					for (unsigned int i = 0; i < agent_count; i++) free(agent_states[i]);
+					return false;
+				}
+				name[name_length] = '\0';
+				new_client.shared_memory = (shared_memory_client*) malloc(sizeof(shared_memory_client));
+				if (new_client.shared_memory != NULL && !init(*new_client.shared_memory, name, new_client.config)) {
+					free(new_client.shared_memory);
+					new_client.shared_memory = NULL;
+				}
+
+				/* the server only switches to the region once it is mapped */
+				bool mapped = (new_client.shared_memory != NULL);
+				mem_stream.position = 0;
+				fixed_width_stream<memory_stream> ack_out(mem_stream);
+				if (!write(mapped, ack_out) || !send_message(connection, mem_stream.buffer, mem_stream.position)) {
+					fprintf(stderr, "init_client ERROR: Error acknowledging the shared memory region.\n");
+					if (new_client.shared_memory != NULL) {
+						free(*new_client.shared_memory); free(new_client.shared_memory);
+						new_client.shared_memory = NULL;
+					}
+					for (unsigned int i = 0; i < agent_count; i++) free(agent_states[i]);
+					return false;
+				}
+			}
+		}
+
 		auto dispatch = [&]() {
 			run_response_listener(new_client);
 		};
 		new_client.response_listener = std::thread(dispatch);
+		if (new_client.shared_memory != NULL) {
+			new_client.shared_memory->response_listener = std::thread([&]() {
+				run_shared_memory_listener(new_client);
+			});
+		}
 		return true;
 	};
 
@@ -746,20 +1401,29 @@ uint64_t init_client(client<ClientData>& new_client,
  * 		will write the states of the agents whose IDs are given by the parallel
  * 		array `agent_ids`.
  * \param agent_count The lengths of `agent_ids` and `agent_states`.
+ * \param encoding The encoding of the step responses that the server should
+ * 		send to this client. By default, the full agent states are sent.
+ * \param shared_memory_capacity If nonzero, and the server is on the same
+ * 		(Linux) host, actions and step responses are exchanged through a
+ * 		shared-memory region with room for this many agents, rather than
+ * 		through the socket. The client falls back to the socket if the region
+ * 		cannot be created or mapped. The server may create a smaller region
+ * 		than requested.
  * \returns The simulator time if successful; `UINT64_MAX` otherwise.
  */
 template<typename ClientData>
 inline uint64_t init_client(client<ClientData>& new_client,
 		const char* server_address, uint16_t server_port,
 		const uint64_t* agent_ids, agent_state* agent_states,
-		unsigned int agent_count)
+		unsigned int agent_count, const step_encoding& encoding = step_encoding(),
+		unsigned int shared_memory_capacity = 0)
 {
 	constexpr static unsigned int BUFFER_SIZE = 8;
 	char port_str[BUFFER_SIZE];
 	if (snprintf(port_str, BUFFER_SIZE, "%u", server_port) > (int) BUFFER_SIZE - 1)
 		return false;
 
-	return init_client(new_client, server_address, port_str, agent_ids, agent_states, agent_count);
+	return init_client(new_client, server_address, port_str, agent_ids, agent_states, agent_count, encoding, shared_memory_capacity);
 }
 
 /**
@@ -774,6 +1438,11 @@ void stop_client(client<ClientData>& c) {
 			c.response_listener.join();
 		} catch (...) { }
 	}
+	if (c.shared_memory != NULL && c.shared_memory->response_listener.joinable()) {
+		try {
+			c.shared_memory->response_listener.join();
+		} catch (...) { }
+	}
 }
 
 } /* namespace nel */
@@ -3,9 +3,11 @@
 
 #include <core/array.h>
 #include <core/map.h>
+#include <core/io.h>
 #include <stdio.h>
 #include <thread>
 #include <condition_variable>
+#include "stats.h"
 
 #if defined(_WIN32) /* on Windows */
 #include <winsock2.h>
@@ -22,11 +24,21 @@ typedef int socklen_t;
 #else /* on Linux */
 #include <sys/epoll.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netdb.h>
 #include <unistd.h>
 #include <netinet/tcp.h>
 #endif
 
+#if defined(__APPLE__)
+#include <sys/uio.h>
+#endif
+
+#include <limits.h>
+#if !defined(_WIN32) && !defined(IOV_MAX)
+#define IOV_MAX 1024
+#endif
+
 
 #define EVENT_QUEUE_CAPACITY 1024
 
@@ -296,6 +308,7 @@ struct socket_listener {
 				/* there is an event on a client connection */
 				std::unique_lock<std::mutex> lck(event_queue_lock);
 				event_queue.add(socket);
+				NEL_STATS(get_stats().record_queue_depth(event_queue.length));
 				cv.notify_one();
 			}
 		}
@@ -307,8 +320,10 @@ struct socket_listener {
 		std::unique_lock<std::mutex> lck(event_queue_lock);
 		while (event_queue.length == 0 && is_running())
 			cv.wait(lck);
-		if (is_running())
+		if (is_running()) {
 			connection = event_queue.pop();
+			NEL_STATS(get_stats().record_queue_depth(event_queue.length));
+		}
 		return true;
 	}
 
@@ -394,6 +409,7 @@ struct socket_listener {
 				/* there is an event on a client connection */
 				std::unique_lock<std::mutex> lck(event_queue_lock);
 				event_queue.add(socket);
+				NEL_STATS(get_stats().record_queue_depth(event_queue.length));
 				cv.notify_one();
 			}
 		}
@@ -405,8 +421,10 @@ struct socket_listener {
 		std::unique_lock<std::mutex> lck(event_queue_lock);
 		while (event_queue.length == 0 && is_running())
 			cv.wait(lck);
-		if (is_running())
+		if (is_running()) {
 			connection = event_queue.pop();
+			NEL_STATS(get_stats().record_queue_depth(event_queue.length));
+		}
 		return true;
 	}
 
@@ -477,17 +495,178 @@ inline void network_error(const char* message) {
 	perror(message);
 }
 
+/**
+ * A reference to a contiguous range of bytes to be sent by `send_gathered`,
+ * which are sent without first being copied into a single buffer.
+ */
+#if defined(_WIN32)
+typedef WSABUF io_buffer;
+
+inline void set_io_buffer(io_buffer& buffer, const void* data, size_t length) {
+	buffer.buf = (char*) data;
+	buffer.len = (ULONG) length;
+}
+#else
+typedef iovec io_buffer;
+
+inline void set_io_buffer(io_buffer& buffer, const void* data, size_t length) {
+	buffer.iov_base = (void*) data;
+	buffer.iov_len = length;
+}
+#endif
+
+/**
+ * Sends the bytes referenced by the `count` elements of `buffers`, in order,
+ * to the TCP socket in `socket`, with as few system calls as possible. This
+ * function blocks until all bytes are sent, and modifies `buffers`.
+ */
+inline bool send_gathered(socket_type& socket, io_buffer* buffers, unsigned int count)
+{
+#if defined(_WIN32)
+	DWORD bytes_sent;
+	if (WSASend(socket.handle, buffers, count, &bytes_sent, 0, NULL, NULL) == SOCKET_ERROR) {
+		network_error("send_gathered ERROR: Failed to send data");
+		return false;
+	}
+	return true;
+#else
+#if defined(MSG_NOSIGNAL)
+	constexpr int flags = MSG_NOSIGNAL;
+#else
+	constexpr int flags = 0;
+#endif
+	while (count > 0) {
+		msghdr message = {};
+		message.msg_iov = buffers;
+		message.msg_iovlen = min(count, (unsigned int) IOV_MAX);
+		ssize_t bytes_sent = sendmsg(socket.handle, &message, flags);
+		if (bytes_sent < 0) {
+			if (errno == EINTR) continue;
+			network_error("send_gathered ERROR: Failed to send data");
+			return false;
+		}
+
+		/* skip past the buffers that were sent completely */
+		while (count > 0 && (size_t) bytes_sent >= buffers->iov_len) {
+			bytes_sent -= buffers->iov_len;
+			buffers++; count--;
+		}
+		if (count > 0) {
+			buffers->iov_base = (char*) buffers->iov_base + bytes_sent;
+			buffers->iov_len -= bytes_sent;
+		}
+	}
+	return true;
+#endif
+}
+
+/**
+ * The type of the length prefix of every message sent from a client to a
+ * server after the connection is established. This allows the server to read
+ * messages without blocking on clients that have only sent part of a message.
+ */
+typedef uint32_t frame_length;
+
+/**
+ * The maximum length of a message received by `read_frame` or by a
+ * `NONBLOCKING` server. Since the length prefix is supplied by the peer, a
+ * connection that announces a longer message is closed rather than having
+ * the memory allocated for it.
+ */
+constexpr frame_length MAX_FRAME_LENGTH = 1u << 28;
+
+/**
+ * Sends the bytes in `data` of length `length` to the TCP socket in
+ * `socket`, preceded by their length.
+ */
+inline bool send_frame(socket_type& socket, const void* data, unsigned int length) {
+	if (length > MAX_FRAME_LENGTH) {
+		fprintf(stderr, "send_frame ERROR: The message length %u exceeds MAX_FRAME_LENGTH.\n", length);
+		return false;
+	}
+	frame_length prefix = length;
+	io_buffer buffers[2];
+	set_io_buffer(buffers[0], &prefix, sizeof(prefix));
+	set_io_buffer(buffers[1], data, length);
+	return send_gathered(socket, buffers, 2);
+}
+
+/**
+ * Reads the message sent by `send_frame` from the socket `in` into `frame`,
+ * which must be uninitialized. This function blocks until the whole message
+ * is received.
+ *
+ * \returns `true` if successful; `false` if the message could not be read
+ *          or is longer than `MAX_FRAME_LENGTH`, in which case `frame` is left
+ *          uninitialized and the connection should be closed.
+ */
+inline bool read_frame(memory_stream& frame, socket_type& in) {
+	frame_length length;
+	if (!read(length, in)) return false;
+	if (length > MAX_FRAME_LENGTH) {
+		fprintf(stderr, "read_frame ERROR: The message length %u exceeds MAX_FRAME_LENGTH.\n", length);
+		return false;
+	}
+	new (&frame) memory_stream(max((frame_length) 1, length));
+	frame.length = length;
+	if (length > 0 && !read(frame.buffer, in, length)) {
+		frame.~memory_stream();
+		return false;
+	}
+	return true;
+}
+
 enum class server_state {
 	STOPPING = 0,
 	STARTING = 1,
 	STARTED = 2
 };
 
+/**
+ * How the workers of a server read messages from clients. In `BLOCKING`
+ * mode, the workers share one listener, and a worker reads each message with
+ * blocking reads once the message begins to arrive. In `NONBLOCKING` mode,
+ * each worker owns a shard of the connections, which it waits on with its own
+ * edge-triggered epoll instance. It reads whatever is available from each
+ * connection into a per-connection buffer, and processes each message once
+ * it has arrived completely, so a slow client cannot stall a worker.
+ * `NONBLOCKING` mode is only available on Linux.
+ */
+enum class server_io_mode {
+	BLOCKING = 0,
+	NONBLOCKING = 1
+};
+
+/**
+ * Removes `connection` from `connections` and closes it. The data of the
+ * connection is freed after `connection_set_lock` is released, since freeing
+ * it may wait for threads that need the lock (such as those that send step
+ * responses to every connection).
+ */
+template<typename ConnectionData>
+inline void close_connection(socket_type& connection,
+		hash_map<socket_type, ConnectionData>& connections, std::mutex& connection_set_lock)
+{
+	ConnectionData& removed = *((ConnectionData*) alloca(sizeof(ConnectionData)));
+	connection_set_lock.lock();
+	bool contains; unsigned int index;
+	ConnectionData& data = connections.get(connection, contains, index);
+	if (contains) {
+		core::move(data, removed);
+		connections.remove_at(index);
+	}
+	connection_set_lock.unlock();
+	if (contains) free(removed);
+	shutdown(connection.handle, 2);
+}
+
 template<typename ConnectionData, typename ProcessMessageCallback, typename... CallbackArgs>
 void run_worker(socket_listener& listener, hash_map<socket_type, ConnectionData>& connections,
 		std::mutex& connection_set_lock, server_state& state,
 		ProcessMessageCallback process_message, CallbackArgs&&... callback_args)
 {
+	/* the storage of each message, which is initialized by `read_frame` and destroyed after it is processed */
+	memory_stream& frame = *((memory_stream*) alloca(sizeof(memory_stream)));
 	while (state != server_state::STOPPING) {
 		socket_type connection;
 		if (!listener.listen(connection, [&]() { return state != server_state::STOPPING; }))
@@ -498,25 +677,18 @@ void run_worker(socket_listener& listener, hash_map<socket_type, ConnectionData>
 		if (recv(connection.handle, (char*)&next, sizeof(next), MSG_PEEK) <= 0) {
 			/* the other end of the socket was closed by the client */
 			listener.remove_socket(connection);
-			connection_set_lock.lock();
-			bool contains; unsigned int index;
-			free(connections.get(connection, contains, index));
-			connections.remove_at(index);
-			connection_set_lock.unlock();
-			shutdown(connection.handle, 2);
+			close_connection(connection, connections, connection_set_lock);
+		} else if (!read_frame(frame, connection)) {
+			/* the message was truncated or too long, so the stream can no longer be parsed */
+			listener.remove_socket(connection);
+			close_connection(connection, connections, connection_set_lock);
 		} else {
-			/* there is a data waiting to be read, so read it */
-			process_message(connection, connections, std::forward<CallbackArgs>(callback_args)...);
+			process_message(frame, connection, connections, std::forward<CallbackArgs>(callback_args)...);
+			frame.~memory_stream();
 
 			/* continue listening on this socket */
-			if (!listener.update_socket(connection)) {
-				connection_set_lock.lock();
-				bool contains; unsigned int index;
-				free(connections.get(connection, contains, index));
-				connections.remove_at(index);
-				connection_set_lock.unlock();
-				shutdown(connection.handle, 2);
-			}
+			if (!listener.update_socket(connection))
+				close_connection(connection, connections, connection_set_lock);
 		}
 	}
 }
@@ -543,6 +715,153 @@ inline std::thread start_worker(socket_listener& listener,
 			std::ref(state), process_message, std::ref(std::forward<CallbackArgs>(callback_args)...));
 }
 
+#if defined(__linux__)
+/**
+ * The bytes received on a connection of a `NONBLOCKING` server that have not
+ * yet been processed, which contain at most one incomplete message.
+ */
+struct frame_buffer {
+	char* data;
+	unsigned int length;
+	unsigned int capacity;
+
+	static inline void free(frame_buffer& buffer) {
+		core::free(buffer.data);
+	}
+};
+
+inline bool init(frame_buffer& buffer) {
+	buffer.length = 0;
+	buffer.capacity = 1024;
+	buffer.data = (char*) malloc(sizeof(char) * buffer.capacity);
+	if (buffer.data == NULL) {
+		fprintf(stderr, "init ERROR: Insufficient memory for frame_buffer.\n");
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Reads all available bytes from `connection` into `buffer`, without
+ * blocking. Since the connection is registered as edge-triggered, it must be
+ * drained completely before waiting on it again. The buffer never grows
+ * beyond twice `MAX_FRAME_LENGTH`, which holds any valid message.
+ *
+ * \returns `true` if the connection is still open; `false` if it was closed
+ *          by the client, an error occurred, or the client sent more
+ *          unprocessed data than the buffer may hold.
+ */
+inline bool receive_available(socket_type& connection, frame_buffer& buffer)
+{
+	while (true) {
+		if (buffer.length == buffer.capacity) {
+			if (buffer.capacity >= 2 * (size_t) MAX_FRAME_LENGTH) {
+				fprintf(stderr, "receive_available ERROR: The client sent too much data at once.\n");
+				return false;
+			}
+			char* new_data = (char*) realloc(buffer.data, sizeof(char) * 2 * buffer.capacity);
+			if (new_data == NULL) {
+				fprintf(stderr, "receive_available ERROR: Out of memory.\n");
+				return false;
+			}
+			buffer.data = new_data;
+			buffer.capacity *= 2;
+		}
+
+		ssize_t received = recv(connection.handle, buffer.data + buffer.length,
+				buffer.capacity - buffer.length, MSG_DONTWAIT);
+		if (received > 0) {
+			buffer.length += (unsigned int) received;
+		} else if (received == 0) {
+			return false;
+		} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			return true;
+		} else if (errno != EINTR) {
+			return false;
+		}
+	}
+}
+
+/**
+ * The loop of each worker of a `NONBLOCKING` server, which processes the
+ * messages from the connections registered with the epoll instance `epoll`.
+ * The read buffers of these connections are only accessed by this worker.
+ */
+template<typename ConnectionData, typename ProcessMessageCallback, typename... CallbackArgs>
+void run_nonblocking_worker(int epoll, hash_map<socket_type, ConnectionData>& connections,
+		std::mutex& connection_set_lock, server_state& state,
+		ProcessMessageCallback process_message, CallbackArgs&&... callback_args)
+{
+	/* the timeout (in milliseconds) after which the worker checks whether the server is stopping */
+	constexpr int WAIT_TIMEOUT = 100;
+
+	hash_map<socket_type, frame_buffer> buffers(64, alloc_socket_keys);
+	epoll_event* events = (epoll_event*) malloc(sizeof(epoll_event) * EVENT_QUEUE_CAPACITY);
+	if (events == NULL) {
+		fprintf(stderr, "run_nonblocking_worker ERROR: Out of memory.\n");
+		return;
+	}
+
+	while (state != server_state::STOPPING) {
+		int event_count = epoll_wait(epoll, events, EVENT_QUEUE_CAPACITY, WAIT_TIMEOUT);
+		if (event_count == -1) {
+			if (errno == EINTR) continue;
+			listener_error("run_nonblocking_worker ERROR: Error listening for incoming network activity");
+			break;
+		}
+
+		for (int i = 0; i < event_count && state != server_state::STOPPING; i++) {
+			socket_type connection = events[i].data.fd;
+			if (!buffers.check_size()) continue;
+			bool contains; unsigned int index;
+			frame_buffer& buffer = buffers.get(connection, contains, index);
+			if (!contains) {
+				if (!init(buffer)) {
+					close_connection(connection, connections, connection_set_lock);
+					continue;
+				}
+				buffers.table.keys[index] = connection;
+				buffers.table.size++;
+			}
+
+			bool open = receive_available(connection, buffer);
+
+			/* process every complete message in the buffer */
+			unsigned int position = 0;
+			while (buffer.length - position >= sizeof(frame_length)) {
+				frame_length length;
+				memcpy(&length, buffer.data + position, sizeof(length));
+				if (length > MAX_FRAME_LENGTH) {
+					fprintf(stderr, "run_nonblocking_worker ERROR: The message length %u exceeds MAX_FRAME_LENGTH.\n", length);
+					open = false; break;
+				}
+				if (buffer.length - position - sizeof(frame_length) < length) break;
+				position += sizeof(frame_length);
+
+				memory_stream frame = memory_stream(max((frame_length) 1, length));
+				memcpy(frame.buffer, buffer.data + position, length);
+				frame.length = length;
+				position += length;
+				process_message(frame, connection, connections, std::forward<CallbackArgs>(callback_args)...);
+			}
+			memmove(buffer.data, buffer.data + position, buffer.length - position);
+			buffer.length -= position;
+
+			if (!open || (events[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP))) {
+				epoll_ctl(epoll, EPOLL_CTL_DEL, connection.handle, NULL);
+				free(buffer);
+				buffers.remove_at(index);
+				close_connection(connection, connections, connection_set_lock);
+			}
+		}
+	}
+
+	for (auto entry : buffers)
+		free(entry.value);
+	core::free(events);
+}
+#endif
+
 template<typename ConnectionData, typename NewConnectionCallback, typename... CallbackArgs>
 inline void accept_connection(socket_type& connection,
 		hash_map<socket_type, ConnectionData>& connections,
@@ -584,11 +903,94 @@ inline void cleanup_server(server_state& state,
 	cleanup_server<Success>(state, init_cv, init_lock);
 }
 
+#if defined(__linux__)
+/**
+ * The remainder of `run_server` in `NONBLOCKING` mode, once the server socket
+ * is listening. New connections are accepted on this thread, and assigned to
+ * the workers in round-robin order.
+ */
+template<typename ConnectionData, typename ProcessMessageCallback,
+	typename NewConnectionCallback, typename... CallbackArgs>
+bool run_nonblocking_server(socket_type& sock, unsigned int worker_count,
+		server_state& state, std::condition_variable& init_cv, std::mutex& init_lock,
+		socket_listener& listener, hash_map<socket_type, ConnectionData>& connections,
+		std::mutex& connection_set_lock, ProcessMessageCallback process_message,
+		NewConnectionCallback new_connection_callback, CallbackArgs&&... callback_args)
+{
+	int* worker_epolls = (int*) malloc(sizeof(int) * max(1u, worker_count));
+	if (worker_epolls == NULL) {
+		fprintf(stderr, "run_nonblocking_server ERROR: Out of memory.\n");
+		core::free(listener, worker_count);
+		cleanup_server<false>(state, init_cv, init_lock, sock); return false;
+	}
+	for (unsigned int i = 0; i < worker_count; i++) {
+		worker_epolls[i] = epoll_create1(0);
+		if (worker_epolls[i] == -1) {
+			listener_error("run_nonblocking_server ERROR: Unable to initialize socket listener");
+			for (unsigned int j = 0; j < i; j++) ::close(worker_epolls[j]);
+			core::free(worker_epolls); core::free(listener, worker_count);
+			cleanup_server<false>(state, init_cv, init_lock, sock); return false;
+		}
+	}
+
+	std::thread* workers = new std::thread[worker_count];
+	for (unsigned int i = 0; i < worker_count; i++) {
+		workers[i] = std::thread([&, i]() {
+			run_nonblocking_worker(worker_epolls[i], connections, connection_set_lock,
+					state, process_message, callback_args...);
+		});
+	}
+
+	/* notify that the server has successfully started */
+	std::unique_lock<std::mutex> lock(init_lock);
+	state = server_state::STARTED;
+	init_cv.notify_all();
+	lock.unlock();
+
+	/* the main loop */
+	unsigned int next_worker = 0;
+	auto assign_connection = [&](socket_type& connection) {
+		/* the listener only waits on the server socket */
+		listener.remove_socket(connection);
+		accept_connection(connection, connections, connection_set_lock, new_connection_callback, callback_args...);
+
+		epoll_event new_event = {};
+		new_event.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+		new_event.data.fd = connection.handle;
+		if (epoll_ctl(worker_epolls[next_worker], EPOLL_CTL_ADD, connection.handle, &new_event) == -1) {
+			listener_error("run_nonblocking_server ERROR: Failed to listen to socket");
+			close_connection(connection, connections, connection_set_lock);
+			return;
+		}
+		next_worker = (next_worker + 1) % worker_count;
+	};
+	while (state != server_state::STOPPING)
+		listener.accept(sock, assign_connection);
+
+	core::free(listener, worker_count);
+	for (unsigned int i = 0; i < worker_count; i++) {
+		if (!workers[i].joinable()) continue;
+		try {
+			workers[i].join();
+		} catch (...) { }
+	}
+	for (unsigned int i = 0; i < worker_count; i++)
+		::close(worker_epolls[i]);
+	for (auto connection : connections)
+		shutdown(connection.key.handle, 2);
+	cleanup_server<true>(state, init_cv, init_lock, sock);
+	core::free(worker_epolls);
+	delete[] workers;
+	return true;
+}
+#endif
+
 template<typename ConnectionData = empty_data, typename ProcessMessageCallback,
 	typename NewConnectionCallback, typename... CallbackArgs>
 bool run_server(socket_type& sock, uint16_t server_port,
 		unsigned int connection_queue_capacity, unsigned int worker_count,
-		server_state& state, std::condition_variable& init_cv, std::mutex& init_lock,
+		server_io_mode io_mode, server_state& state,
+		std::condition_variable& init_cv, std::mutex& init_lock,
 		hash_map<socket_type, ConnectionData>& connections, std::mutex& connection_set_lock,
 		ProcessMessageCallback process_message, NewConnectionCallback new_connection_callback,
 		CallbackArgs&&... callback_args)
@@ -644,6 +1046,16 @@ bool run_server(socket_type& sock, uint16_t server_port,
 		return false;
 	}
 
+#if defined(__linux__)
+	if (io_mode == server_io_mode::NONBLOCKING)
+		return run_nonblocking_server(sock, worker_count, state, init_cv, init_lock,
+				listener, connections, connection_set_lock, process_message,
+				new_connection_callback, std::forward<CallbackArgs>(callback_args)...);
+#else
+	if (io_mode == server_io_mode::NONBLOCKING)
+		fprintf(stderr, "run_server WARNING: Non-blocking mode is not supported on this platform. Using blocking mode.\n");
+#endif
+
 	/* make the thread pool */
 	std::thread* workers = new std::thread[worker_count];
 	for (unsigned int i = 0; i < worker_count; i++)
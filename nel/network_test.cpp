@@ -19,18 +19,18 @@ struct test_server {
 	test_server() : client_connections(1024, alloc_socket_keys) { }
 };
 
-void process_test_server_message(socket_type& server,
+void process_test_server_message(memory_stream& in, socket_type& server,
 		const hash_map<socket_type, empty_data>& connections)
 {
 	bool is_string;
 	lock.lock();
-	if (!read(is_string, server)) {
+	if (!read(is_string, in)) {
 		fprintf(stderr, "Server failed to read is_string.\n");
 		lock.unlock(); return;
 	}
 	if (is_string) {
 		string s;
-		if (!read(s, server)) {
+		if (!read(s, in)) {
 			fprintf(stderr, "Server failed to read string.\n");
 			lock.unlock(); return;
 		}
@@ -38,7 +38,7 @@ void process_test_server_message(socket_type& server,
 		print(s, out); fprintf(out, "\".\n");
 	} else {
 		int64_t i;
-		if (!read(i, server)) {
+		if (!read(i, in)) {
 			fprintf(stderr, "Server failed to read int64_t.\n");
 			lock.unlock(); return;
 		}
@@ -50,12 +50,13 @@ void process_test_server_message(socket_type& server,
 inline void new_connection_callback(socket_type& server, const empty_data& data) { }
 
 bool init_server(test_server& new_server, uint16_t server_port,
-	unsigned int connection_queue_capacity, unsigned int worker_count)
+	unsigned int connection_queue_capacity, unsigned int worker_count,
+	server_io_mode io_mode)
 {
 	std::condition_variable cv; std::mutex lock;
 	auto dispatch = [&]() {
 		run_server(new_server.server_socket, server_port,
-			connection_queue_capacity, worker_count, new_server.state, cv, lock,
+			connection_queue_capacity, worker_count, io_mode, new_server.state, cv, lock,
 			new_server.client_connections, new_server.connection_set_lock,
 			process_test_server_message, new_connection_callback);
 	};
@@ -98,7 +99,7 @@ void test_client_send(socket_type& client, int64_t i) {
 	memory_stream out = memory_stream(sizeof(bool) + sizeof(i));
 	if (!write(false, out)
 	 || !write(i, out)
-	 || !send_message(client, out.buffer, out.position))
+	 || !send_frame(client, out.buffer, out.position))
 		 fprintf(stderr, "test_client_send ERROR: Failed to send int64_t to server.\n");
 }
 
@@ -106,13 +107,13 @@ void test_client_send(socket_type& client, const string& s) {
 	memory_stream out = memory_stream(sizeof(bool) + sizeof(char) * s.length);
 	if (!write(true, out)
 	 || !write(s, out)
-	 || !send_message(client, out.buffer, out.position))
+	 || !send_frame(client, out.buffer, out.position))
 		 fprintf(stderr, "test_client_send ERROR: Failed to send string to server.\n");
 }
 
-void test_network() {
+void test_network(server_io_mode io_mode) {
 	test_server new_server;
-	bool success = init_server(new_server, 54353, 16, 8);
+	bool success = init_server(new_server, 54353, 16, 8, io_mode);
 	fprintf(out, "init_server returned %s.\n", success ? "true" : "false");
 	if (!success) return;
 
@@ -153,7 +154,8 @@ void test_network() {
 }
 
 int main(int argc, const char** argv) {
-	test_network();
+	test_network(server_io_mode::BLOCKING);
+	test_network(server_io_mode::NONBLOCKING);
 	fflush(out);
 	return EXIT_SUCCESS;
 }
@@ -0,0 +1,354 @@
+#ifndef NEL_PATCH_STORE_H_
+#define NEL_PATCH_STORE_H_
+
+#include <core/core.h>
+#include <limits.h>
+#include "position.h"
+
+namespace nel {
+
+using namespace core;
+
+/**
+ * A map from positions to values of type `T`, designed to store the patches
+ * of the world. The values are stored in fixed-size pages in insertion order,
+ * and pages are never moved or freed while the store is alive, so pointers to
+ * values remain valid as the store grows. Values are located with an
+ * open-addressing (linear probing) index whose slots contain both the key and
+ * the index of the value, so a lookup does not need to dereference a separate
+ * key array. Iteration and serialization visit the values in insertion order.
+ *
+ * `remove` leaves a hole in its page (whose key is set to the empty
+ * position), which is reused by a later insertion, so pointers to the other
+ * values remain valid. Iteration skips the holes, but after a removal, the
+ * values are no longer visited in insertion order.
+ *
+ * Like `core::hash_map`, the store does not construct or destroy its values:
+ * `insert` returns uninitialized memory, and the owner of the store must free
+ * the values before calling `free` on the store (and before calling
+ * `remove`).
+ */
+template<typename T>
+struct patch_store
+{
+	static constexpr unsigned int PAGE_SIZE = 64;
+	static constexpr unsigned int EMPTY_SLOT = UINT_MAX;
+
+	struct page {
+		position keys[PAGE_SIZE];
+		T values[PAGE_SIZE];
+	};
+
+	struct index_slot {
+		position key;
+		unsigned int index;
+	};
+
+	struct entry {
+		const position& key;
+		T& value;
+	};
+
+	struct iterator {
+		const patch_store<T>& store;
+		unsigned int index;
+
+		inline entry operator * () const {
+			return {store.key(index), store.value(index)};
+		}
+
+		inline iterator& operator ++ () {
+			index = store.next_index(index + 1);
+			return *this;
+		}
+
+		inline bool operator != (const iterator& other) const {
+			return index != other.index;
+		}
+	};
+
+	page** pages;
+	unsigned int page_capacity;
+
+	index_slot* slots;
+	unsigned int slot_capacity;
+
+	/* the number of values in the store */
+	unsigned int size;
+
+	/* the number of indices that were ever used, including the holes left by `remove` */
+	unsigned int used;
+
+	/* the holes left by `remove`, which are reused by `get` */
+	unsigned int* free_indices;
+	unsigned int free_count;
+	unsigned int free_capacity;
+
+	patch_store(unsigned int initial_capacity) {
+		if (!init_helper(initial_capacity))
+			exit(EXIT_FAILURE);
+	}
+
+	~patch_store() { free_helper(); }
+
+	inline const position& key(unsigned int index) const {
+		return pages[index / PAGE_SIZE]->keys[index % PAGE_SIZE];
+	}
+
+	inline T& value(unsigned int index) const {
+		return pages[index / PAGE_SIZE]->values[index % PAGE_SIZE];
+	}
+
+	/**
+	 * Returns a pointer to the value with the given `key`, or NULL if the key
+	 * is not in this store.
+	 */
+	inline T* get(const position& key) const {
+		unsigned int index = slots[find_slot(key)].index;
+		return (index == EMPTY_SLOT) ? NULL : &value(index);
+	}
+
+	/**
+	 * Returns a pointer to the value with the given `key`. If the key is not
+	 * in this store, it is added, the returned value is uninitialized, and
+	 * `contains` is set to `false`. NULL is returned if there is insufficient
+	 * memory to add the key.
+	 */
+	T* get(const position& key, bool& contains)
+	{
+		unsigned int slot = find_slot(key);
+		if (slots[slot].index != EMPTY_SLOT) {
+			contains = true;
+			return &value(slots[slot].index);
+		}
+
+		contains = false;
+		if (2 * (size + 1) > slot_capacity) {
+			if (!resize_index(2 * slot_capacity)) return NULL;
+			slot = find_slot(key);
+		}
+		unsigned int index;
+		if (free_count > 0) {
+			index = free_indices[--free_count];
+		} else {
+			if (used % PAGE_SIZE == 0 && !add_page())
+				return NULL;
+			index = used++;
+		}
+		size++;
+		pages[index / PAGE_SIZE]->keys[index % PAGE_SIZE] = key;
+		slots[slot].key = key;
+		slots[slot].index = index;
+		return &value(index);
+	}
+
+	/**
+	 * Removes the value with the given `key`, which must have already been
+	 * freed by the caller, and returns `true`. Returns `false` if the key is
+	 * not in this store, or if there is insufficient memory.
+	 */
+	bool remove(const position& key)
+	{
+		unsigned int slot = find_slot(key);
+		unsigned int index = slots[slot].index;
+		if (index == EMPTY_SLOT) return false;
+		if (free_count == free_capacity) {
+			unsigned int new_capacity = (free_capacity == 0) ? 16 : (2 * free_capacity);
+			unsigned int* new_indices = (unsigned int*) realloc(free_indices, sizeof(unsigned int) * new_capacity);
+			if (new_indices == NULL) {
+				fprintf(stderr, "patch_store.remove ERROR: Insufficient memory for free_indices.\n");
+				return false;
+			}
+			free_indices = new_indices;
+			free_capacity = new_capacity;
+		}
+		free_indices[free_count++] = index;
+		position::set_empty(pages[index / PAGE_SIZE]->keys[index % PAGE_SIZE]);
+		size--;
+
+		/* shift the following slots in the probe sequence back, so that lookups need no tombstones */
+		unsigned int hole = slot;
+		unsigned int next = (slot + 1) & (slot_capacity - 1);
+		while (slots[next].index != EMPTY_SLOT) {
+			unsigned int home = (unsigned int) hash(slots[next].key) & (slot_capacity - 1);
+			if (((next - home) & (slot_capacity - 1)) >= ((next - hole) & (slot_capacity - 1))) {
+				slots[hole] = slots[next];
+				hole = next;
+			}
+			next = (next + 1) & (slot_capacity - 1);
+		}
+		slots[hole].index = EMPTY_SLOT;
+		return true;
+	}
+
+	inline iterator begin() const {
+		return {*this, next_index(0)};
+	}
+
+	inline iterator end() const {
+		return {*this, used};
+	}
+
+	/* returns the first index at least `index` that is not a hole, or `used` if there is none */
+	inline unsigned int next_index(unsigned int index) const {
+		while (index < used && position::is_empty(key(index)))
+			index++;
+		return index;
+	}
+
+	static inline void free(patch_store<T>& store) {
+		store.free_helper();
+	}
+
+private:
+	static inline uint64_t hash(const position& key) {
+		uint64_t h = (uint64_t) key.x * 0x9E3779B97F4A7C15ull;
+		h ^= (uint64_t) key.y * 0xC2B2AE3D27D4EB4Full;
+		return h ^ (h >> 32);
+	}
+
+	/* returns the slot containing `key`, or the empty slot where it would be inserted */
+	inline unsigned int find_slot(const position& key) const {
+		unsigned int slot = (unsigned int) hash(key) & (slot_capacity - 1);
+		while (slots[slot].index != EMPTY_SLOT && slots[slot].key != key)
+			slot = (slot + 1) & (slot_capacity - 1);
+		return slot;
+	}
+
+	bool resize_index(unsigned int new_capacity)
+	{
+		index_slot* new_slots = (index_slot*) malloc(sizeof(index_slot) * new_capacity);
+		if (new_slots == NULL) {
+			fprintf(stderr, "patch_store.resize_index ERROR: Insufficient memory for index.\n");
+			return false;
+		}
+		for (unsigned int i = 0; i < new_capacity; i++)
+			new_slots[i].index = EMPTY_SLOT;
+
+		if (slots != NULL) core::free(slots);
+		slots = new_slots;
+		slot_capacity = new_capacity;
+		for (unsigned int i = 0; i < used; i++) {
+			if (position::is_empty(key(i))) continue;
+			unsigned int slot = find_slot(key(i));
+			slots[slot].key = key(i);
+			slots[slot].index = i;
+		}
+		return true;
+	}
+
+	bool add_page()
+	{
+		unsigned int page_count = used / PAGE_SIZE;
+		if (page_count == page_capacity) {
+			/* only the array of page pointers is moved, never the pages themselves */
+			page** new_pages = (page**) realloc(pages, sizeof(page*) * 2 * page_capacity);
+			if (new_pages == NULL) {
+				fprintf(stderr, "patch_store.add_page ERROR: Insufficient memory for page table.\n");
+				return false;
+			}
+			pages = new_pages;
+			page_capacity *= 2;
+		}
+
+		pages[page_count] = (page*) malloc(sizeof(page));
+		if (pages[page_count] == NULL) {
+			fprintf(stderr, "patch_store.add_page ERROR: Insufficient memory for new page.\n");
+			return false;
+		}
+		return true;
+	}
+
+	inline bool init_helper(unsigned int initial_capacity)
+	{
+		size = 0;
+		used = 0;
+		free_indices = NULL;
+		free_count = 0;
+		free_capacity = 0;
+		page_capacity = 8;
+		pages = (page**) malloc(sizeof(page*) * page_capacity);
+		if (pages == NULL) {
+			fprintf(stderr, "patch_store.init_helper ERROR: Insufficient memory for page table.\n");
+			return false;
+		}
+
+		slots = NULL;
+		unsigned int capacity = 16;
+		while (capacity < 2 * initial_capacity)
+			capacity *= 2;
+		if (!resize_index(capacity)) {
+			core::free(pages);
+			return false;
+		}
+		return true;
+	}
+
+	inline void free_helper() {
+		for (unsigned int i = 0; i < (used + PAGE_SIZE - 1) / PAGE_SIZE; i++)
+			core::free(pages[i]);
+		core::free(pages);
+		core::free(slots);
+		if (free_indices != NULL)
+			core::free(free_indices);
+	}
+
+	template<typename A> friend bool init(patch_store<A>&, unsigned int);
+};
+
+/**
+ * Initializes the given patch_store `store` with enough capacity in its index
+ * for `initial_capacity` values.
+ */
+template<typename T>
+inline bool init(patch_store<T>& store, unsigned int initial_capacity) {
+	return store.init_helper(initial_capacity);
+}
+
+/**
+ * Reads the patch_store `store` from the input stream `in`. The values are
+ * read with `read(T&, Stream&, ValueReader&&...)`. If reading fails, the
+ * values read so far are freed, as is the store.
+ */
+template<typename T, typename Stream, typename... ValueReader>
+bool read(patch_store<T>& store, Stream& in, ValueReader&&... reader)
+{
+	unsigned int size;
+	if (!read(size, in) || !init(store, size))
+		return false;
+	for (unsigned int i = 0; i < size; i++) {
+		bool contains; position key;
+		T* value = NULL;
+		if (read(key, in))
+			value = store.get(key, contains);
+		if (value == NULL || contains || !read(*value, in, std::forward<ValueReader>(reader)...)) {
+			/* the value at index `i`, if any, was not successfully read */
+			for (unsigned int j = 0; j < i; j++)
+				free(store.value(j));
+			free(store);
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * Writes the patch_store `store` to the output stream `out`. The values are
+ * written in iteration order with `write(const T&, Stream&, ValueWriter&&...)`.
+ */
+template<typename T, typename Stream, typename... ValueWriter>
+bool write(const patch_store<T>& store, Stream& out, ValueWriter&&... writer)
+{
+	if (!write(store.size, out))
+		return false;
+	for (auto entry : store) {
+		if (!write(entry.key, out)
+		 || !write(entry.value, out, std::forward<ValueWriter>(writer)...))
+			return false;
+	}
+	return true;
+}
+
+} /* namespace nel */
+
+#endif /* NEL_PATCH_STORE_H_ */
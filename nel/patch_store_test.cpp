@@ -0,0 +1,164 @@
+#include "patch_store.h"
+
+#include <core/io.h>
+#include <inttypes.h>
+
+using namespace core;
+using namespace nel;
+
+struct test_value {
+	int64_t sum;
+
+	static inline void free(test_value& value) { }
+};
+
+template<typename Stream>
+inline bool read(test_value& value, Stream& in) {
+	return read(value.sum, in);
+}
+
+template<typename Stream>
+inline bool write(const test_value& value, Stream& out) {
+	return write(value.sum, out);
+}
+
+inline position key_of(unsigned int i) {
+	return position((int64_t) (i % 37) - 18, (int64_t) (i / 37) - 18);
+}
+
+/* checks that every key `i` for which `present[i]` is true maps to the value `address[i]` with the expected contents */
+bool check_contents(const patch_store<test_value>& store,
+		const bool* present, test_value* const* address, unsigned int key_count)
+{
+	unsigned int expected_size = 0;
+	for (unsigned int i = 0; i < key_count; i++) {
+		position key = key_of(i);
+		test_value* value = store.get(key);
+		if (!present[i]) {
+			if (value != NULL) {
+				fprintf(stderr, "check_contents ERROR: Removed key (%" PRId64 ", %" PRId64 ") is still in the store.\n", key.x, key.y);
+				return false;
+			}
+			continue;
+		}
+		expected_size++;
+		if (value == NULL) {
+			fprintf(stderr, "check_contents ERROR: Key (%" PRId64 ", %" PRId64 ") is missing.\n", key.x, key.y);
+			return false;
+		} else if (address != NULL && value != address[i]) {
+			fprintf(stderr, "check_contents ERROR: The value of key (%" PRId64 ", %" PRId64 ") moved.\n", key.x, key.y);
+			return false;
+		} else if (value->sum != key.x + key.y) {
+			fprintf(stderr, "check_contents ERROR: The value of key (%" PRId64 ", %" PRId64 ") is incorrect.\n", key.x, key.y);
+			return false;
+		}
+	}
+
+	unsigned int visited = 0;
+	for (auto entry : store) {
+		if (entry.value.sum != entry.key.x + entry.key.y) {
+			fprintf(stderr, "check_contents ERROR: Iteration visited an incorrect value.\n");
+			return false;
+		}
+		visited++;
+	}
+	if (store.size != expected_size || visited != expected_size) {
+		fprintf(stderr, "check_contents ERROR: Expected %u values, but the store has size %u and iteration visited %u.\n",
+				expected_size, store.size, visited);
+		return false;
+	}
+	return true;
+}
+
+bool test_patch_store(unsigned int key_count)
+{
+	bool* present = (bool*) calloc(key_count, sizeof(bool));
+	test_value** address = (test_value**) malloc(sizeof(test_value*) * key_count);
+	if (present == NULL || address == NULL) {
+		fprintf(stderr, "test_patch_store ERROR: Out of memory.\n");
+		if (present != NULL) free(present);
+		return false;
+	}
+
+	/* start with a small index so that it is resized many times */
+	patch_store<test_value> store(1);
+	bool success = true;
+	for (unsigned int i = 0; success && i < key_count; i++) {
+		bool contains;
+		address[i] = store.get(key_of(i), contains);
+		if (address[i] == NULL || contains) {
+			fprintf(stderr, "test_patch_store ERROR: Unable to insert key %u.\n", i);
+			success = false; break;
+		}
+		address[i]->sum = key_of(i).x + key_of(i).y;
+		present[i] = true;
+	}
+	/* the values must not move as pages and index slots are added */
+	success = success && check_contents(store, present, address, key_count);
+
+	/* remove every third key, which exercises the backward shift in the index */
+	for (unsigned int i = 0; success && i < key_count; i += 3) {
+		if (!store.remove(key_of(i))) {
+			fprintf(stderr, "test_patch_store ERROR: Unable to remove key %u.\n", i);
+			success = false;
+		}
+		present[i] = false;
+	}
+	if (success && store.remove(key_of(0))) {
+		fprintf(stderr, "test_patch_store ERROR: Removing a missing key succeeded.\n");
+		success = false;
+	}
+	success = success && check_contents(store, present, address, key_count);
+
+	/* reinserting the removed keys must reuse the holes and not allocate new pages */
+	unsigned int used = store.used;
+	for (unsigned int i = 0; success && i < key_count; i += 3) {
+		bool contains;
+		address[i] = store.get(key_of(i), contains);
+		if (address[i] == NULL || contains) {
+			fprintf(stderr, "test_patch_store ERROR: Unable to reinsert key %u.\n", i);
+			success = false; break;
+		}
+		address[i]->sum = key_of(i).x + key_of(i).y;
+		present[i] = true;
+	}
+	if (success && store.used != used) {
+		fprintf(stderr, "test_patch_store ERROR: Reinsertion did not reuse the holes left by removal.\n");
+		success = false;
+	}
+	success = success && check_contents(store, present, address, key_count);
+
+	/* check that the store survives a round trip through a stream */
+	if (success) {
+		memory_stream buffer(1 << 16);
+		fixed_width_stream<memory_stream> out(buffer);
+		if (!write(store, out)) {
+			fprintf(stderr, "test_patch_store ERROR: Unable to write store.\n");
+			success = false;
+		} else {
+			memory_stream in_buffer(buffer.buffer, buffer.position);
+			fixed_width_stream<memory_stream> in(in_buffer);
+			patch_store<test_value>& copy = *((patch_store<test_value>*) alloca(sizeof(patch_store<test_value>)));
+			if (!read(copy, in)) {
+				fprintf(stderr, "test_patch_store ERROR: Unable to read store.\n");
+				success = false;
+			} else {
+				success = check_contents(copy, present, NULL, key_count);
+				free(copy);
+			}
+		}
+		free(buffer);
+	}
+
+	free(present);
+	free(address);
+	if (success)
+		fprintf(stderr, "test_patch_store: All tests passed for %u keys.\n", key_count);
+	return success;
+}
+
+int main(int argc, const char** argv) {
+	if (!test_patch_store(1000))
+		return EXIT_FAILURE;
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,145 @@
+#ifndef NEL_POOL_ALLOCATOR_H_
+#define NEL_POOL_ALLOCATOR_H_
+
+#include <core/core.h>
+#include <stddef.h>
+
+namespace nel {
+
+using namespace core;
+
+/**
+ * An allocator for blocks of a fixed size. Blocks are carved out of large
+ * chunks, which are only returned to the system when the pool is freed, and
+ * released blocks are reused before new ones are carved. This avoids a `malloc`
+ * call per block and keeps blocks that are allocated together on the same
+ * pages.
+ *
+ * Each block is preceded by a header that points to its pool, so a block can
+ * be released with the static `block_pool::release` without a reference to
+ * the pool. This function is not thread-safe; callers must serialize access
+ * to each pool.
+ */
+struct block_pool
+{
+	/* the header is padded so that blocks have the maximum fundamental alignment */
+	static constexpr size_t HEADER_SIZE = ((sizeof(block_pool*) + alignof(max_align_t) - 1) / alignof(max_align_t)) * alignof(max_align_t);
+
+	/* the size of each block, including the header */
+	size_t stride;
+	unsigned int blocks_per_chunk;
+
+	char** chunks;
+	unsigned int chunk_count;
+	unsigned int chunk_capacity;
+
+	/* the number of blocks carved from the last chunk */
+	unsigned int used_in_last_chunk;
+
+	/* singly-linked list of released blocks, threaded through their headers */
+	void* free_list;
+
+	block_pool(size_t block_size, unsigned int blocks_per_chunk) {
+		if (!init_helper(block_size, blocks_per_chunk))
+			exit(EXIT_FAILURE);
+	}
+
+	~block_pool() { free_helper(); }
+
+	/**
+	 * Returns a block of the size given when this pool was initialized, or
+	 * NULL if there is insufficient memory. The contents of the block are
+	 * uninitialized.
+	 */
+	void* allocate()
+	{
+		char* block;
+		if (free_list != NULL) {
+			block = (char*) free_list;
+			free_list = *((void**) free_list);
+		} else {
+			if (chunk_count == 0 || used_in_last_chunk == blocks_per_chunk) {
+				if (!add_chunk()) return NULL;
+			}
+			block = chunks[chunk_count - 1] + stride * used_in_last_chunk;
+			used_in_last_chunk++;
+		}
+		*((block_pool**) block) = this;
+		return block + HEADER_SIZE;
+	}
+
+	/**
+	 * Returns the given block, which must have been returned by `allocate`
+	 * of some pool that has not yet been freed, to its pool.
+	 */
+	static inline void release(void* data) {
+		char* block = (char*) data - HEADER_SIZE;
+		block_pool* pool = *((block_pool**) block);
+		*((void**) block) = pool->free_list;
+		pool->free_list = block;
+	}
+
+	static inline void free(block_pool& pool) {
+		pool.free_helper();
+	}
+
+private:
+	bool add_chunk()
+	{
+		if (chunk_count == chunk_capacity) {
+			char** new_chunks = (char**) realloc(chunks, sizeof(char*) * 2 * chunk_capacity);
+			if (new_chunks == NULL) {
+				fprintf(stderr, "block_pool.add_chunk ERROR: Insufficient memory for chunk table.\n");
+				return false;
+			}
+			chunks = new_chunks;
+			chunk_capacity *= 2;
+		}
+
+		chunks[chunk_count] = (char*) malloc(stride * blocks_per_chunk);
+		if (chunks[chunk_count] == NULL) {
+			fprintf(stderr, "block_pool.add_chunk ERROR: Insufficient memory for new chunk.\n");
+			return false;
+		}
+		chunk_count++;
+		used_in_last_chunk = 0;
+		return true;
+	}
+
+	inline bool init_helper(size_t block_size, unsigned int chunk_size)
+	{
+		size_t alignment = alignof(max_align_t);
+		stride = HEADER_SIZE + ((block_size + alignment - 1) / alignment) * alignment;
+		blocks_per_chunk = max(1u, chunk_size);
+		chunk_count = 0;
+		chunk_capacity = 8;
+		used_in_last_chunk = 0;
+		free_list = NULL;
+		chunks = (char**) malloc(sizeof(char*) * chunk_capacity);
+		if (chunks == NULL) {
+			fprintf(stderr, "block_pool.init_helper ERROR: Insufficient memory for chunk table.\n");
+			return false;
+		}
+		return true;
+	}
+
+	inline void free_helper() {
+		for (unsigned int i = 0; i < chunk_count; i++)
+			core::free(chunks[i]);
+		core::free(chunks);
+	}
+
+	friend bool init(block_pool&, size_t, unsigned int);
+};
+
+/**
+ * Initializes the given block_pool `pool` to allocate blocks of `block_size`
+ * bytes, `blocks_per_chunk` at a time.
+ */
+inline bool init(block_pool& pool, size_t block_size, unsigned int blocks_per_chunk) {
+	return pool.init_helper(block_size, blocks_per_chunk);
+}
+
+} /* namespace nel */
+
+#endif /* NEL_POOL_ALLOCATOR_H_ */
@@ -80,6 +80,11 @@ struct position {
 		dst.x = src.x; dst.y = src.y;
 	}
 
+	static inline void swap(position& first, position& second) {
+		core::swap(first.x, second.x);
+		core::swap(first.y, second.y);
+	}
+
 	static inline unsigned int hash(const position& key) {
 		return default_hash(key.x) ^ default_hash(key.y);
 	}
@@ -101,6 +106,15 @@ struct position {
 	static constexpr int64_t MAX_INT64 = std::numeric_limits<int64_t>::max();
 };
 
+/* allocates the keys of a `hash_map` with `position` keys, initializing them as empty */
+void* alloc_position_keys(size_t n, size_t element_size) {
+	position* keys = (position*) malloc(sizeof(position) * n);
+	if (keys == NULL) return NULL;
+	for (unsigned int i = 0; i < n; i++)
+		position::set_empty(keys[i]);
+	return (void*) keys;
+}
+
 template<typename Stream>
 inline bool read(position& p, Stream& in) {
 	return read(p.x, in) && read(p.y, in);
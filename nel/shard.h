@@ -0,0 +1,1012 @@
+#ifndef NEL_SHARD_H_
+#define NEL_SHARD_H_
+
+#include "network.h"
+#include "simulator.h"
+
+namespace nel {
+
+using namespace core;
+
+/**
+ * A partition of the world into vertical strips of patches, each of which is
+ * simulated by its own process (a shard). Shard `i` owns the patches whose
+ * x-coordinate is at least `boundaries[i - 1]` and less than `boundaries[i]`,
+ * where the first shard extends to negative infinity and the last shard to
+ * positive infinity, so that every patch has exactly one owner.
+ */
+struct shard_layout {
+	/* the patch x-coordinate at which each shard after the first begins, in increasing order */
+	int64_t* boundaries;
+	unsigned int shard_count;
+
+	/* returns the index of the shard that owns the patch at `patch_position` */
+	inline unsigned int owner(const position& patch_position) const {
+		unsigned int low = 0, high = shard_count - 1;
+		while (low < high) {
+			unsigned int middle = low + (high - low) / 2;
+			if (boundaries[middle] <= patch_position.x) low = middle + 1;
+			else high = middle;
+		}
+		return low;
+	}
+
+	static inline void free(shard_layout& layout) {
+		core::free(layout.boundaries);
+	}
+};
+
+/**
+ * Initializes the given shard_layout `layout` with `shard_count` shards,
+ * where `boundaries` contains the `shard_count - 1` patch x-coordinates at
+ * which the shards after the first begin, in strictly increasing order.
+ */
+inline bool init(shard_layout& layout, const int64_t* boundaries, unsigned int shard_count)
+{
+	if (shard_count == 0) {
+		fprintf(stderr, "init ERROR: A shard_layout must have at least one shard.\n");
+		return false;
+	}
+	for (unsigned int i = 1; i + 1 < shard_count; i++) {
+		if (boundaries[i] <= boundaries[i - 1]) {
+			fprintf(stderr, "init ERROR: The boundaries of a shard_layout must be strictly increasing.\n");
+			return false;
+		}
+	}
+	layout.boundaries = (int64_t*) malloc(max((size_t) 1, sizeof(int64_t) * (shard_count - 1)));
+	if (layout.boundaries == NULL) {
+		fprintf(stderr, "init ERROR: Insufficient memory for shard_layout.boundaries.\n");
+		return false;
+	}
+	for (unsigned int i = 0; i + 1 < shard_count; i++)
+		layout.boundaries[i] = boundaries[i];
+	layout.shard_count = shard_count;
+	return true;
+}
+
+/**
+ * Returns the smallest radius (in patches, around the patch that contains an
+ * agent) of the halo that covers every patch an agent can observe or move
+ * into before the next call to `synchronize`, along with a ring of patches
+ * around them, which condition the Gibbs sampling of the patches at the
+ * boundary. If the generator of the simulator is running (see
+ * `simulator::start_generator`), the radius should also cover its lookahead.
+ */
+inline unsigned int default_halo_radius(const simulator_config& config) {
+	unsigned int reach = config.max_steps_per_movement + max(config.vision_range, config.patch_size / 2);
+	return (reach + config.patch_size - 1) / config.patch_size + 1;
+}
+
+/**
+ * The messages exchanged by the shards after each time step. Every shard
+ * sends one message of each type to every other shard, in this order, and
+ * waits for the messages of that type from every other shard before sending
+ * the next, so the exchange is also a barrier across all shards.
+ */
+enum class shard_message_type : uint64_t {
+	/* the items collected in, and the agents that moved into, the patches of the receiver */
+	UPDATE = 0,
+
+	/* the agents of the receiver that were accepted, and the patches of the receiver that the sender needs as halos */
+	REQUEST,
+
+	/* the requested patches that changed since the sender last sent them */
+	HALO,
+
+	/* the sender failed to synchronize and stopped, so the receiver must stop waiting for its messages */
+	ABORT
+};
+
+template<typename Stream>
+inline bool read(shard_message_type& type, Stream& in) {
+	uint64_t v;
+	if (!read(v, in)) return false;
+	type = (shard_message_type) v;
+	return true;
+}
+
+template<typename Stream>
+inline bool write(const shard_message_type& type, Stream& out) {
+	return write((uint64_t) type, out);
+}
+
+/**
+ * A message received from another shard, which is held by the receiving
+ * shard until it is processed by `synchronize`.
+ */
+struct shard_message {
+	shard_message_type type;
+	unsigned int sender;
+	uint64_t time;
+
+	/* the contents of the message, positioned after its header */
+	memory_stream contents;
+
+	static inline void move(const shard_message& src, shard_message& dst) {
+		dst.type = src.type;
+		dst.sender = src.sender;
+		dst.time = src.time;
+		dst.contents.buffer = src.contents.buffer;
+		dst.contents.length = src.contents.length;
+		dst.contents.position = src.contents.position;
+	}
+
+	static inline void free(shard_message& message) {
+		core::free(message.contents.buffer);
+	}
+};
+
+/* an agent that moves into this shard from another shard in the current step */
+struct shard_migrant {
+	uint64_t global_id;
+	position current_position;
+	direction current_direction;
+
+	/* the offset of the collected items of this agent in the buffer of `synchronize` */
+	size_t item_offset;
+};
+
+/* the contents of the messages that a shard sends to one other shard in a step */
+struct shard_exchange {
+	/* the locations of the items collected in the halo patches owned by the receiver */
+	array<position> collected_items;
+
+	/* the locations of the items that the receiver collected in the halo patches of
+	   this shard, but which were already collected by an agent of this shard or of
+	   another shard with a smaller index */
+	array<position> rejected_items;
+
+	/* the local IDs of the agents that moved into the patches of the receiver */
+	array<uint64_t> migrants;
+
+	/* the global IDs of the agents of the receiver that were accepted by this shard */
+	array<uint64_t> accepted;
+
+	/* the patches of the receiver that this shard needs as halos, in sorted order */
+	array<position> requested_patches;
+
+	static inline void free(shard_exchange& exchange) {
+		core::free(exchange.collected_items);
+		core::free(exchange.rejected_items);
+		core::free(exchange.migrants);
+		core::free(exchange.accepted);
+		core::free(exchange.requested_patches);
+	}
+};
+
+inline bool init(shard_exchange& exchange) {
+	if (!array_init(exchange.collected_items, 16)) {
+		return false;
+	} else if (!array_init(exchange.rejected_items, 4)) {
+		free(exchange.collected_items);
+		return false;
+	} else if (!array_init(exchange.migrants, 8)) {
+		free(exchange.collected_items); free(exchange.rejected_items);
+		return false;
+	} else if (!array_init(exchange.accepted, 8)) {
+		free(exchange.collected_items); free(exchange.rejected_items);
+		free(exchange.migrants); return false;
+	} else if (!array_init(exchange.requested_patches, 64)) {
+		free(exchange.collected_items); free(exchange.rejected_items);
+		free(exchange.migrants); free(exchange.accepted); return false;
+	}
+	return true;
+}
+
+/**
+ * One shard of a world that is partitioned across several processes by a
+ * `shard_layout`. Each shard runs its own simulator, which contains the
+ * agents in the patches owned by the shard, and copies of the patches of
+ * other shards near those agents (halos). The agents are simulated by the
+ * simulator as usual, and after every time step, `synchronize` exchanges the
+ * following with every other shard:
+ *
+ *  1. The items that the agents of this shard collected in the halo patches,
+ *     which are collected in the patches of their owner, and the agents that
+ *     moved into the patches of another shard, which migrate to that shard
+ *     (unless an agent of that shard already occupies their position, in
+ *     which case they remain on this shard and try again after the next
+ *     step). The owner is the only shard that decides who collects an item:
+ *     if the item was already collected by one of its own agents, or by an
+ *     agent of a shard with a smaller index, the owner rejects it, and the
+ *     agent that collected it reverts to the items that it had before the
+ *     step, whether it migrates or not.
+ *  2. The patches of other shards within `halo_radius` patches of the agents
+ *     of this shard (including the agents migrating to it). The owner fixes
+ *     these patches, sampling them if necessary, and sends the patches that
+ *     changed since it last sent them. They are installed as fixed patches,
+ *     so `get_fixed_neighborhood` returns them without sampling, and the
+ *     Gibbs sampler of this shard conditions on them when it samples the
+ *     patches at the boundary.
+ *
+ * Since every shard waits for the messages of every other shard, the shards
+ * advance in lockstep, and they must all be at the same time step.
+ *
+ * Agents are identified across shards by global IDs, which are assigned by
+ * `add_agent(shard&, ...)`. The agent with local ID `i` in the simulator has
+ * the global ID `global_ids[i]`, and local IDs change when agents migrate, so
+ * agents should be controlled through `global_ids` after each call to
+ * `synchronize`.
+ *
+ * **NOTE:** agents only observe and collide with the agents of their own
+ *      shard. Two agents on different shards may therefore move into the
+ *      same cell near a boundary, although only one of them keeps an item
+ *      in that cell (see above).
+ *
+ * **NOTE:** the exchanges of a time step are not transactional. If any of
+ *      them fails on one shard, some of its updates may already have been
+ *      applied by the other shards, so the world can no longer be kept
+ *      consistent. The failing shard therefore sends an `ABORT` message to
+ *      every other shard and stops (see `stop_shard`), and `synchronize`
+ *      then fails on every other shard too, which also stop, rather than
+ *      waiting forever for its messages. The shards must then be restarted,
+ *      for example from checkpoints. A shard whose process exits without
+ *      sending `ABORT` is not detected.
+ */
+template<typename SimulatorData>
+struct shard {
+	simulator<SimulatorData>* sim;
+	shard_layout layout;
+	unsigned int index;
+
+	/* the radius of the halo, in patches around each agent (see `default_halo_radius`) */
+	unsigned int halo_radius;
+
+	/* the global ID of the agent with each local ID in `sim`, and the inverse map */
+	array<uint64_t> global_ids;
+	hash_map<uint64_t, uint64_t> local_ids;
+	uint64_t next_agent_number;
+
+	/* the version of each halo patch in the map of its owner, when it was last received */
+	hash_map<position, uint64_t> halo_versions;
+
+	/* the collected items of the agent with each local ID at the end of the last call
+	   to `synchronize`, which the agent reverts to if the owner of a halo patch rejects
+	   an item that it collected there (an agent can collect at most one item per step) */
+	array<unsigned int> previous_items;
+
+	/* the connections to the other shards, indexed by shard, on which messages are sent */
+	socket_type* peers;
+
+	/* the server that receives the messages from the other shards */
+	std::thread server_thread;
+	socket_type server_socket;
+	server_state state;
+	hash_map<socket_type, empty_data> peer_connections;
+	std::mutex connection_set_lock;
+
+	/* the messages received from other shards that were not yet processed */
+	array<shard_message> inbox;
+	std::mutex inbox_lock;
+	std::condition_variable inbox_cv;
+
+	/* set, under `inbox_lock`, once another shard sent an `ABORT` message */
+	bool aborted;
+
+	static inline void free(shard<SimulatorData>& s) {
+		for (shard_message& message : s.inbox)
+			core::free(message);
+		core::free(s.inbox);
+		core::free(s.layout);
+		core::free(s.global_ids);
+		core::free(s.local_ids);
+		core::free(s.halo_versions);
+		core::free(s.previous_items);
+		core::free(s.peers);
+		core::free(s.peer_connections);
+		s.server_thread.~thread();
+		s.connection_set_lock.~mutex();
+		s.inbox_lock.~mutex();
+		s.inbox_cv.~condition_variable();
+	}
+};
+
+/**
+ * Initializes the shard `s` with index `index` of the world partitioned by
+ * the `shard_count - 1` given `boundaries` (see `shard_layout`), whose
+ * agents and halos are simulated by `sim`, which must not contain any
+ * agents. The shard communicates with the other shards once `start_shard`
+ * is called.
+ */
+template<typename SimulatorData>
+bool init(shard<SimulatorData>& s, simulator<SimulatorData>& sim,
+		const int64_t* boundaries, unsigned int shard_count,
+		unsigned int index, unsigned int halo_radius)
+{
+	if (index >= shard_count) {
+		fprintf(stderr, "init ERROR: The index of the shard is out of range.\n");
+		return false;
+	} else if (!init(s.layout, boundaries, shard_count)) {
+		return false;
+	} else if (!array_init(s.global_ids, 64)) {
+		fprintf(stderr, "init ERROR: Insufficient memory for shard.global_ids.\n");
+		free(s.layout); return false;
+	} else if (!hash_map_init(s.local_ids, 128)) {
+		fprintf(stderr, "init ERROR: Insufficient memory for shard.local_ids.\n");
+		free(s.layout); free(s.global_ids); return false;
+	} else if (!hash_map_init(s.halo_versions, 256, alloc_position_keys)) {
+		fprintf(stderr, "init ERROR: Insufficient memory for shard.halo_versions.\n");
+		free(s.layout); free(s.global_ids); free(s.local_ids); return false;
+	} else if (!hash_map_init(s.peer_connections, 64, alloc_socket_keys)) {
+		fprintf(stderr, "init ERROR: Insufficient memory for shard.peer_connections.\n");
+		free(s.layout); free(s.global_ids); free(s.local_ids);
+		free(s.halo_versions); return false;
+	} else if (!array_init(s.inbox, 16)) {
+		fprintf(stderr, "init ERROR: Insufficient memory for shard.inbox.\n");
+		free(s.layout); free(s.global_ids); free(s.local_ids);
+		free(s.halo_versions); free(s.peer_connections); return false;
+	} else if (!array_init(s.previous_items, 64 * max((size_t) 1, sim.get_config().item_types.length))) {
+		fprintf(stderr, "init ERROR: Insufficient memory for shard.previous_items.\n");
+		free(s.layout); free(s.global_ids); free(s.local_ids);
+		free(s.halo_versions); free(s.peer_connections);
+		free(s.inbox); return false;
+	}
+	s.peers = (socket_type*) malloc(sizeof(socket_type) * shard_count);
+	if (s.peers == NULL) {
+		fprintf(stderr, "init ERROR: Insufficient memory for shard.peers.\n");
+		free(s.layout); free(s.global_ids); free(s.local_ids);
+		free(s.halo_versions); free(s.peer_connections);
+		free(s.inbox); free(s.previous_items); return false;
+	}
+	for (unsigned int i = 0; i < shard_count; i++)
+		socket_type::set_empty(s.peers[i]);
+
+	s.sim = &sim;
+	s.index = index;
+	s.halo_radius = halo_radius;
+	s.next_agent_number = 0;
+	s.aborted = false;
+	s.state = server_state::STOPPING;
+	new (&s.server_thread) std::thread();
+	new (&s.connection_set_lock) std::mutex();
+	new (&s.inbox_lock) std::mutex();
+	new (&s.inbox_cv) std::condition_variable();
+	return true;
+}
+
+template<typename SimulatorData>
+void process_shard_message(memory_stream& frame, socket_type& connection,
+		hash_map<socket_type, empty_data>& connections, shard<SimulatorData>& s)
+{
+	shard_message message;
+	fixed_width_stream<memory_stream> in(frame);
+	if (!read(message.type, in) || !read(message.sender, in) || !read(message.time, in)
+	 || message.sender >= s.layout.shard_count || message.sender == s.index)
+	{
+		fprintf(stderr, "process_shard_message WARNING: Received message with an invalid header.\n");
+		return;
+	} else if (message.type == shard_message_type::ABORT) {
+		fprintf(stderr, "process_shard_message ERROR: Shard %u failed to synchronize.\n", message.sender);
+		std::unique_lock<std::mutex> lock(s.inbox_lock);
+		s.aborted = true;
+		s.inbox_cv.notify_all();
+		return;
+	}
+
+	/* the frame is freed by the worker, so its contents are copied */
+	new (&message.contents) memory_stream(max((unsigned int) 1, frame.length));
+	memcpy(message.contents.buffer, frame.buffer, frame.length);
+	message.contents.length = frame.length;
+	message.contents.position = frame.position;
+
+	std::unique_lock<std::mutex> lock(s.inbox_lock);
+	if (!s.inbox.add(message)) {
+		fprintf(stderr, "process_shard_message ERROR: Insufficient memory for message.\n");
+		core::free(message); return;
+	}
+	s.inbox_cv.notify_all();
+}
+
+template<typename SimulatorData>
+inline bool process_new_shard_connection(socket_type& connection,
+		empty_data& data, shard<SimulatorData>& s)
+{
+	return true;
+}
+
+/**
+ * Closes the connections of the shard `s` to the other shards, and stops
+ * its server.
+ */
+template<typename SimulatorData>
+void stop_shard(shard<SimulatorData>& s) {
+	s.state = server_state::STOPPING;
+	close(s.server_socket);
+	if (s.server_thread.joinable()) {
+		try {
+			s.server_thread.join();
+		} catch (...) { }
+	}
+	for (unsigned int i = 0; i < s.layout.shard_count; i++) {
+		if (!s.peers[i].is_valid()) continue;
+		close(s.peers[i]);
+		socket_type::set_empty(s.peers[i]);
+	}
+
+	/* wake up any thread that is waiting in `synchronize` */
+	std::unique_lock<std::mutex> lock(s.inbox_lock);
+	s.inbox_cv.notify_all();
+}
+
+/**
+ * Starts the server of the shard `s` on `server_port`, with `worker_count`
+ * threads that receive the messages from the other shards, and connects to
+ * the other shards, where the server of shard `i` is at `peer_addresses[i]`
+ * and `peer_ports[i]` (the entries for `s` itself are ignored). Since the
+ * shards are started independently, the connections are retried until
+ * `connect_timeout` milliseconds have passed.
+ *
+ * \returns `true` if successful; `false` otherwise.
+ */
+template<typename SimulatorData>
+bool start_shard(shard<SimulatorData>& s, uint16_t server_port,
+		const char* const* peer_addresses, const char* const* peer_ports,
+		unsigned int worker_count, uint64_t connect_timeout = 60000)
+{
+	std::condition_variable cv; std::mutex lock;
+	auto dispatch = [&]() {
+		run_server(s.server_socket, server_port, s.layout.shard_count, worker_count,
+				server_io_mode::BLOCKING, s.state, cv, lock, s.peer_connections, s.connection_set_lock,
+				process_shard_message<SimulatorData>, process_new_shard_connection<SimulatorData>, s);
+	};
+	s.state = server_state::STARTING;
+	s.server_thread = std::thread(dispatch);
+
+	std::unique_lock<std::mutex> lck(lock);
+	while (s.state == server_state::STARTING)
+		cv.wait(lck);
+	lck.unlock();
+	if (s.state == server_state::STOPPING) {
+		if (s.server_thread.joinable()) {
+			try {
+				s.server_thread.join();
+			} catch (...) { }
+		}
+		return false;
+	}
+
+	uint64_t start_time = milliseconds();
+	for (unsigned int i = 0; i < s.layout.shard_count; i++) {
+		if (i == s.index) continue;
+		auto process_connection = [&](socket_type& connection) { s.peers[i] = connection; };
+		while (!run_client(peer_addresses[i], peer_ports[i], process_connection)) {
+			if (milliseconds() - start_time > connect_timeout) {
+				fprintf(stderr, "start_shard ERROR: Unable to connect to shard %u.\n", i);
+				stop_shard(s); return false;
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		}
+	}
+	return true;
+}
+
+/**
+ * Adds a new agent at `initial_position`, which must be in a patch owned by
+ * the shard `s`, facing `initial_direction`.
+ *
+ * \returns The global ID of the new agent, or `UINT64_MAX` upon failure.
+ */
+template<typename SimulatorData>
+uint64_t add_agent(shard<SimulatorData>& s,
+		const position& initial_position, direction initial_direction)
+{
+	const size_t item_type_count = s.sim->get_config().item_types.length;
+	position patch_position;
+	s.sim->get_world().world_to_patch_coordinates(initial_position, patch_position);
+	if (s.layout.owner(patch_position) != s.index) {
+		fprintf(stderr, "add_agent ERROR: The given position is not owned by this shard.\n");
+		return UINT64_MAX;
+	} else if (!s.global_ids.ensure_capacity(s.global_ids.length + 1) || !s.local_ids.check_size()
+			|| !s.previous_items.ensure_capacity(s.previous_items.length + item_type_count)) {
+		fprintf(stderr, "add_agent ERROR: Out of memory.\n");
+		return UINT64_MAX;
+	}
+
+	pair<uint64_t, agent_state*> new_agent = s.sim->add_agent(initial_position, initial_direction, NULL);
+	if (new_agent.key == UINT64_MAX) return UINT64_MAX;
+	uint64_t global_id = s.next_agent_number++ * s.layout.shard_count + s.index;
+	s.global_ids[s.global_ids.length++] = global_id;
+	s.local_ids.put(global_id, new_agent.key);
+	memset(s.previous_items.data + s.previous_items.length, 0, sizeof(unsigned int) * item_type_count);
+	s.previous_items.length += item_type_count;
+	return global_id;
+}
+
+/**
+ * Returns the local ID in the simulator of the shard `s` of the agent with
+ * the given global ID, or `UINT64_MAX` if the agent is not on this shard.
+ */
+template<typename SimulatorData>
+inline uint64_t local_id(const shard<SimulatorData>& s, uint64_t global_id) {
+	bool contains;
+	uint64_t id = s.local_ids.get(global_id, contains);
+	return contains ? id : UINT64_MAX;
+}
+
+/* removes the agent with the given global ID, which migrated to another shard, from the simulator of `s` */
+template<typename SimulatorData>
+bool remove_agent(shard<SimulatorData>& s, uint64_t global_id)
+{
+	uint64_t id = local_id(s, global_id);
+	if (id == UINT64_MAX || !s.sim->remove_agent(id)) {
+		fprintf(stderr, "remove_agent ERROR: Unable to remove a migrating agent.\n");
+		return false;
+	}
+
+	/* the simulator moves the agent with the last local ID into the removed ID */
+	const size_t item_type_count = s.sim->get_config().item_types.length;
+	size_t last = s.global_ids.length - 1;
+	s.local_ids.remove(global_id);
+	if (id != last) {
+		uint64_t moved = s.global_ids[last];
+		s.global_ids[(size_t) id] = moved;
+		s.local_ids.get(moved) = id;
+		memcpy(s.previous_items.data + id * item_type_count,
+				s.previous_items.data + last * item_type_count,
+				sizeof(unsigned int) * item_type_count);
+	}
+	s.global_ids.length--;
+	s.previous_items.length -= item_type_count;
+	return true;
+}
+
+template<typename SimulatorData>
+inline bool write_shard_header(const shard<SimulatorData>& s,
+		shard_message_type type, fixed_width_stream<memory_stream>& out)
+{
+	return write(type, out)
+		&& write(s.index, out)
+		&& write(s.sim->time, out);
+}
+
+/* sends `messages[i]` to shard `i`, for every shard other than `s` */
+template<typename SimulatorData>
+bool send_to_peers(shard<SimulatorData>& s, const memory_stream* messages)
+{
+	for (unsigned int i = 0; i < s.layout.shard_count; i++) {
+		if (i == s.index) continue;
+		if (!send_frame(s.peers[i], messages[i].buffer, messages[i].position)) {
+			fprintf(stderr, "send_to_peers ERROR: Unable to send message to shard %u.\n", i);
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * Sends an `ABORT` message to every other shard, so that they stop waiting
+ * for the messages of the shard `s`, and then stops `s` (see the notes on
+ * `shard`). Messages that cannot be sent are ignored, since the connection
+ * may be the reason that `s` failed.
+ */
+template<typename SimulatorData>
+void abort_shard(shard<SimulatorData>& s) {
+	if (s.state == server_state::STOPPING) return;
+	memory_stream mem_stream = memory_stream(sizeof(shard_message_type) + sizeof(s.index) + sizeof(s.sim->time));
+	fixed_width_stream<memory_stream> out(mem_stream);
+	if (write_shard_header(s, shard_message_type::ABORT, out)) {
+		for (unsigned int i = 0; i < s.layout.shard_count; i++) {
+			if (i == s.index || !s.peers[i].is_valid()) continue;
+			send_frame(s.peers[i], mem_stream.buffer, mem_stream.position);
+		}
+	}
+	stop_shard(s);
+}
+
+/**
+ * Waits for a message of the given `type` from every shard other than `s`,
+ * and moves the message from shard `i` into `messages[i]`.
+ */
+template<typename SimulatorData>
+bool receive_from_peers(shard<SimulatorData>& s,
+		shard_message_type type, shard_message* messages)
+{
+	const unsigned int shard_count = s.layout.shard_count;
+	bool* received = (bool*) alloca(sizeof(bool) * shard_count);
+	for (unsigned int i = 0; i < shard_count; i++)
+		received[i] = (i == s.index);
+	unsigned int remaining = shard_count - 1;
+
+	std::unique_lock<std::mutex> lock(s.inbox_lock);
+	while (true) {
+		/* take the matching messages, keeping the order of the remaining messages */
+		size_t next = 0;
+		for (size_t i = 0; i < s.inbox.length; i++) {
+			shard_message& message = s.inbox[i];
+			if (message.type == type && !received[message.sender]) {
+				shard_message::move(message, messages[message.sender]);
+				received[message.sender] = true;
+				remaining--;
+			} else {
+				if (next != i) shard_message::move(message, s.inbox[next]);
+				next++;
+			}
+		}
+		s.inbox.length = next;
+		if (remaining == 0 || s.aborted || s.state == server_state::STOPPING) break;
+		s.inbox_cv.wait(lock);
+	}
+	bool aborted = s.aborted;
+	lock.unlock();
+
+	bool success = (remaining == 0 && !aborted);
+	if (aborted)
+		fprintf(stderr, "receive_from_peers ERROR: Another shard failed to synchronize.\n");
+	else if (!success)
+		fprintf(stderr, "receive_from_peers ERROR: The shard stopped before every message was received.\n");
+	for (unsigned int i = 0; success && i < shard_count; i++) {
+		if (i != s.index && messages[i].time != s.sim->time) {
+			fprintf(stderr, "receive_from_peers ERROR: Shard %u is at a different time step.\n", i);
+			success = false;
+		}
+	}
+	if (!success) {
+		for (unsigned int i = 0; i < shard_count; i++)
+			if (i != s.index && received[i]) free(messages[i]);
+	}
+	return success;
+}
+
+/**
+ * Completes the current time step of the shard `s` with every other shard
+ * (see `shard`). This must be called once every agent in the simulator has
+ * acted, so that the simulator has advanced to the next time step (if the
+ * simulator has no agents, it is advanced by this function), and before any
+ * agent acts in the next time step.
+ *
+ * \returns `true` if successful; `false` otherwise, in which case the shard
+ *          is stopped, as is every other shard (see the notes on `shard`).
+ */
+template<typename SimulatorData>
+bool synchronize(shard<SimulatorData>& s)
+{
+	typedef patch<patch_data> patch_type;
+
+	simulator<SimulatorData>& sim = *s.sim;
+	const simulator_config& config = sim.get_config();
+	const unsigned int item_type_count = (unsigned int) config.item_types.length;
+	const unsigned int shard_count = s.layout.shard_count;
+	sim.step_if_empty();
+
+	shard_exchange* exchanges = (shard_exchange*) malloc(sizeof(shard_exchange) * shard_count);
+	memory_stream* messages = (memory_stream*) malloc(sizeof(memory_stream) * shard_count);
+	shard_message* received = (shard_message*) malloc(sizeof(shard_message) * shard_count);
+	if (exchanges == NULL || messages == NULL || received == NULL) {
+		fprintf(stderr, "synchronize ERROR: Out of memory.\n");
+		if (exchanges != NULL) free(exchanges);
+		if (messages != NULL) free(messages);
+		if (received != NULL) free(received);
+		abort_shard(s); return false;
+	}
+	for (unsigned int i = 0; i < shard_count; i++) {
+		if (!init(exchanges[i])) {
+			for (unsigned int j = 0; j < i; j++) free(exchanges[j]);
+			free(exchanges); free(messages); free(received);
+			abort_shard(s); return false;
+		}
+	}
+	for (unsigned int i = 0; i < shard_count; i++)
+		new (&messages[i]) memory_stream(1024);
+
+	array<agent_state*> agents(max((size_t) 1, s.global_ids.length));
+	array<uint64_t> agent_ids(max((size_t) 1, s.global_ids.length));
+	array<position> halo_positions(max((unsigned int) 1, s.halo_versions.table.size));
+	array<shard_migrant> arrivals(8);
+	array<unsigned int> arrival_items(8 * max((unsigned int) 1, item_type_count));
+	array<position> occupied(max((size_t) 1, s.global_ids.length));
+	array<item> items(64);
+
+	const position* requested = NULL;
+	const uint64_t* known_versions = NULL;
+	size_t request_index = 0;
+	fixed_width_stream<memory_stream>* halo_out = NULL;
+	uint64_t halo_count = 0;
+	auto write_halo = [&](const patch_type& patch, const position& patch_position) {
+		uint64_t known_version = known_versions[request_index++];
+		if (patch.version == known_version) return true;
+		halo_count++;
+		return write(patch_position, *halo_out)
+			&& write(patch.version, *halo_out)
+			&& write((uint32_t) patch.items.length, *halo_out)
+			&& write(patch.items.data, *halo_out, (unsigned int) patch.items.length);
+	};
+
+	/* find the items collected in the halo patches during the last step */
+	auto find_collected_items = [&](const patch_type& patch, const position& patch_position) {
+		array<position>& collected_items = exchanges[s.layout.owner(patch_position)].collected_items;
+		for (const item& item : patch.items)
+			if (item.deletion_time == sim.time && !collected_items.add(item.location)) return false;
+		return true;
+	};
+
+	bool success = true;
+	for (auto entry : s.halo_versions)
+		halo_positions[halo_positions.length++] = entry.key;
+	success &= sim.get_fixed_patches(halo_positions.data, halo_positions.length, find_collected_items);
+
+	/* find the agents that moved into the patches of other shards */
+	for (size_t i = 0; i < s.global_ids.length; i++)
+		agent_ids[i] = i;
+	sim.get_agent_states(agents.data, agent_ids.data, (unsigned int) s.global_ids.length);
+	agents.length = s.global_ids.length;
+	for (size_t i = 0; success && i < agents.length; i++) {
+		position patch_position;
+		sim.get_world().world_to_patch_coordinates(agents[i]->current_position, patch_position);
+		unsigned int owner = s.layout.owner(patch_position);
+		occupied[occupied.length++] = agents[i]->current_position;
+		if (owner != s.index) success &= exchanges[owner].migrants.add(i);
+	}
+	if (occupied.length > 1) sort(occupied);
+
+	/* 1. send the collected items and migrating agents to each shard */
+	for (unsigned int i = 0; success && i < shard_count; i++) {
+		if (i == s.index) continue;
+		const shard_exchange& exchange = exchanges[i];
+		fixed_width_stream<memory_stream> out(messages[i]);
+		success &= write_shard_header(s, shard_message_type::UPDATE, out)
+				&& write((uint64_t) exchange.collected_items.length, out)
+				&& write(exchange.collected_items.data, out, (unsigned int) exchange.collected_items.length)
+				&& write((uint64_t) exchange.migrants.length, out);
+		for (uint64_t id : exchange.migrants) {
+			const agent_state& agent = *agents[(size_t) id];
+			success &= write(s.global_ids[(size_t) id], out)
+					&& write(agent.current_position, out)
+					&& write(agent.current_direction, out)
+					&& write(agent.collected_items, out, item_type_count)
+					&& write(s.previous_items.data + id * item_type_count, out, item_type_count);
+		}
+	}
+	bool received_all = success
+		&& send_to_peers(s, messages)
+		&& receive_from_peers(s, shard_message_type::UPDATE, received);
+	success = received_all;
+
+	/* collect the items collected by the other shards (in the order of their indices, so
+	   that the first shard to collect an item keeps it), and accept the migrants whose
+	   positions are free */
+	for (unsigned int i = 0; received_all && i < shard_count; i++) {
+		if (i == s.index) continue;
+		if (!success) { free(received[i]); continue; }
+		fixed_width_stream<memory_stream> in(received[i].contents);
+		array<position>& rejected_items = exchanges[i].rejected_items;
+		uint64_t collected_count, migrant_count;
+		success &= read(collected_count, in);
+		for (uint64_t j = 0; success && j < collected_count; j++) {
+			position location;
+			success &= read(location, in);
+			if (success && !sim.collect_item(location))
+				success &= rejected_items.add(location);
+		}
+		success &= read(migrant_count, in);
+		for (uint64_t j = 0; success && j < migrant_count; j++) {
+			shard_migrant migrant;
+			migrant.item_offset = arrival_items.length;
+			success &= arrival_items.ensure_capacity(arrival_items.length + 2 * item_type_count)
+					&& read(migrant.global_id, in)
+					&& read(migrant.current_position, in)
+					&& read(migrant.current_direction, in)
+					&& read(arrival_items.data + arrival_items.length, in, item_type_count)
+					&& read(arrival_items.data + arrival_items.length + item_type_count, in, item_type_count);
+			if (!success) break;
+
+			/* the migrant loses the item at its position if it was rejected */
+			for (const position& location : rejected_items) {
+				if (location != migrant.current_position) continue;
+				memcpy(arrival_items.data + arrival_items.length,
+						arrival_items.data + arrival_items.length + item_type_count,
+						sizeof(unsigned int) * item_type_count);
+				break;
+			}
+
+			bool accept = true;
+			if (config.collision_policy != movement_conflict_policy::NO_COLLISIONS) {
+				size_t low = 0, high = occupied.length;
+				while (low < high) {
+					size_t middle = low + (high - low) / 2;
+					if (occupied[middle] < migrant.current_position) low = middle + 1;
+					else high = middle;
+				}
+				if (low < occupied.length && occupied[low] == migrant.current_position)
+					accept = false;
+				for (const shard_migrant& arrival : arrivals)
+					if (arrival.current_position == migrant.current_position) accept = false;
+			}
+			if (!accept) continue;
+			arrival_items.length += item_type_count;
+			success &= arrivals.add(migrant) && exchanges[i].accepted.add(migrant.global_id);
+		}
+		free(received[i]);
+	}
+
+	/* find the patches of other shards within the halo of each agent, including the arriving agents */
+	const int64_t radius = (int64_t) s.halo_radius;
+	auto add_halo = [&](const position& agent_position) {
+		position patch_position;
+		sim.get_world().world_to_patch_coordinates(agent_position, patch_position);
+		for (int64_t x = patch_position.x - radius; x <= patch_position.x + radius; x++) {
+			unsigned int owner = s.layout.owner(position(x, 0));
+			if (owner == s.index) continue;
+			array<position>& requested_patches = exchanges[owner].requested_patches;
+			if (!requested_patches.ensure_capacity(requested_patches.length + 2 * radius + 1))
+				return false;
+			for (int64_t y = patch_position.y - radius; y <= patch_position.y + radius; y++)
+				requested_patches[requested_patches.length++] = position(x, y);
+		}
+		return true;
+	};
+	for (size_t i = 0; success && i < agents.length; i++)
+		success &= add_halo(agents[i]->current_position);
+	for (size_t i = 0; success && i < arrivals.length; i++)
+		success &= add_halo(arrivals[i].current_position);
+
+	/* 2. send the accepted migrants and the requested halo patches to each shard */
+	for (unsigned int i = 0; success && i < shard_count; i++) {
+		if (i == s.index) continue;
+		shard_exchange& exchange = exchanges[i];
+		if (exchange.requested_patches.length > 1) {
+			sort(exchange.requested_patches);
+			unique(exchange.requested_patches);
+		}
+		messages[i].position = 0;
+		fixed_width_stream<memory_stream> out(messages[i]);
+		success &= write_shard_header(s, shard_message_type::REQUEST, out)
+				&& write((uint64_t) exchange.rejected_items.length, out)
+				&& write(exchange.rejected_items.data, out, (unsigned int) exchange.rejected_items.length)
+				&& write((uint64_t) exchange.accepted.length, out)
+				&& write(exchange.accepted.data, out, (unsigned int) exchange.accepted.length)
+				&& write((uint64_t) exchange.requested_patches.length, out);
+		for (const position& patch_position : exchange.requested_patches) {
+			bool contains;
+			uint64_t version = s.halo_versions.get(patch_position, contains);
+			success &= write(patch_position, out) && write(contains ? version : UINT64_MAX, out);
+		}
+	}
+	received_all = success
+		&& send_to_peers(s, messages)
+		&& receive_from_peers(s, shard_message_type::REQUEST, received);
+	success = received_all;
+
+	/* revert the agents whose items were rejected by the other shards (before any agent
+	   is removed, so that the local IDs still match `agents`), remove the agents accepted
+	   by the other shards, and collect the patches that they requested */
+	for (unsigned int i = 0; received_all && i < shard_count; i++) {
+		if (i == s.index) continue;
+		if (!success) continue;
+		fixed_width_stream<memory_stream> in(received[i].contents);
+		uint64_t rejected_count;
+		success &= read(rejected_count, in);
+		for (uint64_t j = 0; success && j < rejected_count; j++) {
+			position location;
+			success &= read(location, in);
+
+			/* only the agent that collected the item changed its items in this step, so
+			   reverting every agent at the location is safe */
+			for (size_t k = 0; success && k < agents.length; k++) {
+				if (agents[k]->current_position != location) continue;
+				memcpy(agents[k]->collected_items, s.previous_items.data + k * item_type_count,
+						sizeof(unsigned int) * item_type_count);
+			}
+		}
+	}
+	for (unsigned int i = 0; received_all && i < shard_count; i++) {
+		if (i == s.index) continue;
+		if (!success) { free(received[i]); continue; }
+		fixed_width_stream<memory_stream> in(received[i].contents);
+		uint64_t accepted_count, request_count;
+		success &= read(accepted_count, in);
+		for (uint64_t j = 0; success && j < accepted_count; j++) {
+			uint64_t global_id;
+			success &= read(global_id, in) && remove_agent(s, global_id);
+		}
+
+		success &= read(request_count, in);
+		position* request_positions = (position*) malloc(sizeof(position) * max((uint64_t) 1, request_count));
+		uint64_t* request_versions = (uint64_t*) malloc(sizeof(uint64_t) * max((uint64_t) 1, request_count));
+		if (request_positions == NULL || request_versions == NULL) {
+			fprintf(stderr, "synchronize ERROR: Insufficient memory for requested patches.\n");
+			success = false;
+		}
+		for (uint64_t j = 0; success && j < request_count; j++)
+			success &= read(request_positions[j], in) && read(request_versions[j], in);
+
+		messages[i].position = 0;
+		fixed_width_stream<memory_stream> out(messages[i]);
+		success &= write_shard_header(s, shard_message_type::HALO, out);
+		unsigned int count_offset = messages[i].position;
+		success &= write((uint64_t) 0, out);
+		if (success) {
+			requested = request_positions;
+			known_versions = request_versions;
+			request_index = 0;
+			halo_out = &out;
+			halo_count = 0;
+			success &= sim.get_fixed_patches(requested, (size_t) request_count, write_halo);
+			memcpy(messages[i].buffer + count_offset, &halo_count, sizeof(halo_count));
+		}
+		if (request_positions != NULL) free(request_positions);
+		if (request_versions != NULL) free(request_versions);
+		free(received[i]);
+	}
+
+	/* 3. send the halo patches to each shard */
+	received_all = success
+		&& send_to_peers(s, messages)
+		&& receive_from_peers(s, shard_message_type::HALO, received);
+	success = received_all;
+
+	/* install the halo patches, and then add the accepted migrants, whose neighborhoods they contain */
+	for (unsigned int i = 0; received_all && i < shard_count; i++) {
+		if (i == s.index) continue;
+		if (!success) { free(received[i]); continue; }
+		fixed_width_stream<memory_stream> in(received[i].contents);
+		uint64_t patch_count;
+		success &= read(patch_count, in);
+		for (uint64_t j = 0; success && j < patch_count; j++) {
+			position patch_position;
+			uint64_t version;
+			uint32_t item_count;
+			success &= read(patch_position, in) && read(version, in) && read(item_count, in)
+					&& items.ensure_capacity(max((uint32_t) 1, item_count))
+					&& read(items.data, in, item_count)
+					&& sim.restore_patch(patch_position, items.data, item_count)
+					&& s.halo_versions.check_size(alloc_position_keys);
+			if (!success) break;
+
+			bool contains; unsigned int bucket;
+			uint64_t& halo_version = s.halo_versions.get(patch_position, contains, bucket);
+			if (!contains) {
+				s.halo_versions.table.keys[bucket] = patch_position;
+				s.halo_versions.table.size++;
+			}
+			halo_version = version;
+		}
+		free(received[i]);
+	}
+
+	for (size_t i = 0; success && i < arrivals.length; i++) {
+		const shard_migrant& migrant = arrivals[i];
+		if (!s.global_ids.ensure_capacity(s.global_ids.length + 1) || !s.local_ids.check_size()) {
+			fprintf(stderr, "synchronize ERROR: Out of memory.\n");
+			success = false; break;
+		}
+		pair<uint64_t, agent_state*> new_agent = sim.add_agent(migrant.current_position,
+				migrant.current_direction, arrival_items.data + migrant.item_offset);
+		if (new_agent.key == UINT64_MAX) {
+			fprintf(stderr, "synchronize ERROR: Unable to add a migrating agent.\n");
+			success = false; break;
+		}
+		s.global_ids[s.global_ids.length++] = migrant.global_id;
+		s.local_ids.put(migrant.global_id, new_agent.key);
+	}
+
+	/* record the items of every agent, which they revert to if an item that they collect in the next step is rejected */
+	if (success) {
+		const size_t agent_count = s.global_ids.length;
+		if (!agents.ensure_capacity(max((size_t) 1, agent_count))
+		 || !agent_ids.ensure_capacity(max((size_t) 1, agent_count))
+		 || !s.previous_items.ensure_capacity(max((size_t) 1, agent_count * item_type_count)))
+		{
+			fprintf(stderr, "synchronize ERROR: Out of memory.\n");
+			success = false;
+		} else {
+			for (size_t i = 0; i < agent_count; i++)
+				agent_ids[i] = i;
+			sim.get_agent_states(agents.data, agent_ids.data, (unsigned int) agent_count);
+			for (size_t i = 0; i < agent_count; i++)
+				memcpy(s.previous_items.data + i * item_type_count, agents[i]->collected_items, sizeof(unsigned int) * item_type_count);
+			s.previous_items.length = agent_count * item_type_count;
+		}
+	}
+
+	for (unsigned int i = 0; i < shard_count; i++) {
+		free(exchanges[i]);
+		free(messages[i].buffer);
+	}
+	free(exchanges); free(messages); free(received);
+	if (!success) abort_shard(s);
+	return success;
+}
+
+} /* namespace nel */
+
+#endif /* NEL_SHARD_H_ */
@@ -0,0 +1,549 @@
+#ifndef NEL_SHARED_MEMORY_H_
+#define NEL_SHARED_MEMORY_H_
+
+#include "simulator.h"
+#include "step_encoding.h"
+
+#include <atomic>
+#include <thread>
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <unistd.h>
+#endif
+
+namespace nel {
+
+using namespace core;
+
+/**
+ * The shared-memory transport lets a client on the same host as the server
+ * exchange actions and observations without going through the TCP socket.
+ * The server creates one region per client, which contains two
+ * single-producer single-consumer rings and the observations of the agents
+ * of that client:
+ *
+ *  - The action ring carries `MOVE` and `TURN` requests from the client to
+ *    the server, which applies them on a dedicated thread.
+ *  - The response ring carries `MOVE_RESPONSE`, `TURN_RESPONSE`, and
+ *    `STEP_RESPONSE` notifications from the server to the client.
+ *  - On every step, the server writes the state of each agent of the client
+ *    into its slot in the region before notifying the client, and the client
+ *    reads the agent states in place.
+ *
+ * Each side waits on its ring with a futex, and is only woken if it is
+ * waiting. The TCP connection is still used for the handshake and all other
+ * messages. The server only uses the region once the client acknowledges
+ * (over TCP) that it mapped the region; otherwise, the region is removed. If
+ * the agents of the client or the extra data of a step do not fit in the
+ * region, or the client is not consuming responses, that step is sent
+ * through the TCP connection instead, and the client reads it from there.
+ * This transport is only available on Linux.
+ */
+struct shared_action {
+	uint64_t type;
+	uint64_t agent_id;
+	uint32_t dir;
+	uint32_t num_steps;
+};
+
+struct shared_response {
+	uint64_t type;
+	uint64_t agent_id;
+	uint64_t result;
+};
+
+/* the fixed-size part of each agent slot, which is followed by its scent, vision, and items */
+struct shared_agent_slot {
+	uint64_t agent_id;
+	int64_t position[2];
+	int64_t requested_position[2];
+	uint8_t current_direction;
+	uint8_t requested_direction;
+	uint8_t agent_acted;
+};
+
+/**
+ * A single-producer single-consumer ring in shared memory. `head` is only
+ * advanced by the producer and `tail` by the consumer. `waiting` is set by
+ * the consumer before it waits on `head`.
+ */
+template<typename T, unsigned int Capacity>
+struct shared_ring {
+	static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two.");
+
+	std::atomic<uint32_t> head;
+	std::atomic<uint32_t> tail;
+	std::atomic<uint32_t> waiting;
+	T entries[Capacity];
+};
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2 && sizeof(std::atomic<uint32_t>) == sizeof(uint32_t),
+		"The shared-memory transport requires address-free 32-bit atomics.");
+
+struct shared_region_header {
+	static constexpr uint64_t MAGIC = 0x4E454C53484D3031; /* "NELSHM01" */
+	static constexpr unsigned int RING_CAPACITY = 1024;
+	static constexpr unsigned int EXTRA_CAPACITY = 256;
+
+	uint64_t magic;
+	uint32_t agent_capacity;
+	uint32_t slot_size;
+	uint64_t region_size;
+
+	shared_ring<shared_action, RING_CAPACITY> actions;
+	shared_ring<shared_response, RING_CAPACITY> responses;
+
+	/* the number of agents and the extra data of the last step */
+	uint32_t step_agent_count;
+	uint32_t step_extra_length;
+	char step_extra[EXTRA_CAPACITY];
+};
+
+/* the offset of the first agent slot in the region */
+constexpr size_t SHARED_SLOT_OFFSET = ((sizeof(shared_region_header) + 63) / 64) * 64;
+
+/* the largest region that the server creates, regardless of the capacity requested by the client */
+constexpr size_t MAX_SHARED_REGION_SIZE = ((size_t) 1) << 28;
+
+inline unsigned int shared_slot_size(const simulator_config& config) {
+	unsigned int vision_size = (2*config.vision_range + 1) * (2*config.vision_range + 1) * config.color_dimension;
+	size_t size = sizeof(shared_agent_slot) + sizeof(float) * (config.scent_dimension + vision_size)
+			+ sizeof(unsigned int) * config.item_types.length;
+	return (unsigned int) (((size + 63) / 64) * 64);
+}
+
+inline size_t shared_region_size(const simulator_config& config, unsigned int agent_capacity) {
+	return SHARED_SLOT_OFFSET + (size_t) shared_slot_size(config) * agent_capacity;
+}
+
+/* the most agents whose slots fit in a region of at most `MAX_SHARED_REGION_SIZE` bytes */
+inline unsigned int max_shared_agent_capacity(const simulator_config& config) {
+	return (unsigned int) ((MAX_SHARED_REGION_SIZE - SHARED_SLOT_OFFSET) / shared_slot_size(config));
+}
+
+inline shared_agent_slot* get_slot(shared_region_header* region, unsigned int index) {
+	return (shared_agent_slot*) ((char*) region + SHARED_SLOT_OFFSET + (size_t) region->slot_size * index);
+}
+
+inline float* slot_scent(shared_agent_slot* slot) {
+	return (float*) ((char*) slot + sizeof(shared_agent_slot));
+}
+
+inline float* slot_vision(shared_agent_slot* slot, const simulator_config& config) {
+	return slot_scent(slot) + config.scent_dimension;
+}
+
+inline unsigned int* slot_items(shared_agent_slot* slot, const simulator_config& config) {
+	unsigned int vision_size = (2*config.vision_range + 1) * (2*config.vision_range + 1) * config.color_dimension;
+	return (unsigned int*) (slot_vision(slot, config) + vision_size);
+}
+
+#if defined(__linux__)
+
+/* waits until `word` no longer contains `expected`, for at most `timeout_ms` milliseconds */
+inline void futex_wait(std::atomic<uint32_t>& word, uint32_t expected, long timeout_ms) {
+	timespec timeout = {timeout_ms / 1000, (timeout_ms % 1000) * 1000000};
+	syscall(SYS_futex, (uint32_t*) &word, FUTEX_WAIT, expected, &timeout, NULL, 0);
+}
+
+inline void futex_wake(std::atomic<uint32_t>& word) {
+	syscall(SYS_futex, (uint32_t*) &word, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+}
+
+/**
+ * Appends `entry` to `ring`. If the ring is full, this function waits for the
+ * consumer for at most `timeout_ms` milliseconds.
+ *
+ * \returns `true` if successful; `false` if the ring remained full.
+ */
+template<typename T, unsigned int Capacity>
+bool push(shared_ring<T, Capacity>& ring, const T& entry, long timeout_ms = 1000)
+{
+	uint32_t head = ring.head.load(std::memory_order_relaxed);
+	for (long waited = 0; head - ring.tail.load(std::memory_order_acquire) == Capacity; waited++) {
+		if (waited == timeout_ms) return false;
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	ring.entries[head & (Capacity - 1)] = entry;
+	ring.head.store(head + 1, std::memory_order_release);
+	if (ring.waiting.load(std::memory_order_seq_cst))
+		futex_wake(ring.head);
+	return true;
+}
+
+/**
+ * Removes the oldest entry of `ring` into `entry`, waiting for at most
+ * `timeout_ms` milliseconds if the ring is empty.
+ *
+ * \returns `true` if an entry was removed; `false` otherwise.
+ */
+template<typename T, unsigned int Capacity>
+bool pop(shared_ring<T, Capacity>& ring, T& entry, long timeout_ms)
+{
+	uint32_t tail = ring.tail.load(std::memory_order_relaxed);
+	uint32_t head = ring.head.load(std::memory_order_acquire);
+	if (head == tail) {
+		ring.waiting.store(1, std::memory_order_seq_cst);
+		head = ring.head.load(std::memory_order_seq_cst);
+		if (head == tail)
+			futex_wait(ring.head, head, timeout_ms);
+		ring.waiting.store(0, std::memory_order_relaxed);
+		head = ring.head.load(std::memory_order_acquire);
+		if (head == tail) return false;
+	}
+	entry = ring.entries[tail & (Capacity - 1)];
+	ring.tail.store(tail + 1, std::memory_order_release);
+	return true;
+}
+
+/* maps the shared-memory object `name` of `size` bytes, or returns NULL */
+inline shared_region_header* map_region(const char* name, size_t size, bool create)
+{
+	int fd = shm_open(name, O_RDWR | (create ? (O_CREAT | O_EXCL) : 0), 0600);
+	if (fd == -1) {
+		perror("map_region ERROR: Unable to open shared memory");
+		return NULL;
+	} else if (create && ftruncate(fd, (off_t) size) != 0) {
+		perror("map_region ERROR: Unable to resize shared memory");
+		::close(fd); shm_unlink(name); return NULL;
+	}
+	void* region = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (region == MAP_FAILED) {
+		perror("map_region ERROR: Unable to map shared memory");
+		if (create) shm_unlink(name);
+		return NULL;
+	}
+	return (shared_region_header*) region;
+}
+
+#endif
+
+/**
+ * The server side of the shared-memory transport of one connection. The
+ * actions of the client are applied on `action_thread`.
+ */
+struct shared_memory_connection {
+	static constexpr unsigned int NAME_CAPACITY = 64;
+
+	char name[NAME_CAPACITY];
+	shared_region_header* region;
+	std::thread action_thread;
+	std::atomic_bool running;
+
+	/* the server produces responses both on `action_thread` and on the thread that steps the simulator */
+	std::mutex response_lock;
+	byte_buffer extra_data;
+
+	shared_memory_connection() : extra_data(shared_region_header::EXTRA_CAPACITY) { }
+
+	/* stops `action_thread`, which must not be called while any lock needed by the simulator's step is held */
+	inline void stop() {
+		running = false;
+#if defined(__linux__)
+		futex_wake(region->actions.head);
+#endif
+		if (action_thread.joinable()) {
+			try {
+				action_thread.join();
+			} catch (...) { }
+		}
+	}
+
+	inline bool push_response(const shared_response& response) {
+#if defined(__linux__)
+		std::unique_lock<std::mutex> lock(response_lock);
+		return push(region->responses, response);
+#else
+		return false;
+#endif
+	}
+
+	static inline void free(shared_memory_connection& connection) {
+		connection.stop();
+#if defined(__linux__)
+		munmap(connection.region, (size_t) connection.region->region_size);
+		shm_unlink(connection.name);
+#endif
+		connection.action_thread.~thread();
+		connection.response_lock.~mutex();
+		core::free(connection.extra_data);
+	}
+};
+
+/**
+ * Applies the actions in the ring of `connection` to `sim` until the
+ * connection is stopped, responding to each one as the TCP server would.
+ */
+template<typename SimulatorData, typename MessageType>
+void run_shared_memory_actions(shared_memory_connection& connection, simulator<SimulatorData>& sim)
+{
+#if defined(__linux__)
+	/* the timeout (in milliseconds) after which the thread checks whether it should stop */
+	constexpr long WAIT_TIMEOUT = 100;
+
+	shared_action action;
+	while (connection.running) {
+		if (!pop(connection.region->actions, action, WAIT_TIMEOUT)) continue;
+
+		shared_response response;
+		response.agent_id = action.agent_id;
+		if (action.type == (uint64_t) MessageType::MOVE) {
+			response.type = (uint64_t) MessageType::MOVE_RESPONSE;
+			response.result = sim.move(action.agent_id, (direction) action.dir, action.num_steps);
+		} else if (action.type == (uint64_t) MessageType::TURN) {
+			response.type = (uint64_t) MessageType::TURN_RESPONSE;
+			response.result = sim.turn(action.agent_id, (direction) action.dir);
+		} else {
+			fprintf(stderr, "run_shared_memory_actions WARNING: Received action with unrecognized type.\n");
+			continue;
+		}
+		if (!connection.push_response(response))
+			fprintf(stderr, "run_shared_memory_actions ERROR: The client is not consuming responses.\n");
+	}
+#endif
+}
+
+/**
+ * Creates a new shared-memory region for a client with at most
+ * `agent_capacity` agents, which is clamped so that the region is no larger
+ * than `MAX_SHARED_REGION_SIZE`. The name of the region is written to
+ * `connection.name`. The actions of the client are not applied until
+ * `start` is called, once the client has mapped the region.
+ *
+ * \returns `true` if successful; `false` otherwise, in which case the client
+ *          should use TCP.
+ */
+inline bool init(shared_memory_connection& connection,
+		const simulator_config& config, unsigned int agent_capacity)
+{
+#if defined(__linux__)
+	static std::atomic_uint region_counter(0);
+	snprintf(connection.name, shared_memory_connection::NAME_CAPACITY,
+			"/nel-%d-%u", (int) getpid(), region_counter++);
+
+	agent_capacity = min(agent_capacity, max_shared_agent_capacity(config));
+	size_t size = shared_region_size(config, agent_capacity);
+	connection.region = map_region(connection.name, size, true);
+	if (connection.region == NULL) return false;
+
+	shared_region_header& region = *connection.region;
+	region.magic = shared_region_header::MAGIC;
+	region.agent_capacity = agent_capacity;
+	region.slot_size = shared_slot_size(config);
+	region.region_size = size;
+	new (&region.actions.head) std::atomic<uint32_t>(0);
+	new (&region.actions.tail) std::atomic<uint32_t>(0);
+	new (&region.actions.waiting) std::atomic<uint32_t>(0);
+	new (&region.responses.head) std::atomic<uint32_t>(0);
+	new (&region.responses.tail) std::atomic<uint32_t>(0);
+	new (&region.responses.waiting) std::atomic<uint32_t>(0);
+	region.step_agent_count = 0;
+	region.step_extra_length = 0;
+
+	if (!init(connection.extra_data, shared_region_header::EXTRA_CAPACITY)) {
+		munmap(connection.region, size); shm_unlink(connection.name);
+		return false;
+	}
+	new (&connection.response_lock) std::mutex();
+	new (&connection.running) std::atomic_bool(false);
+	new (&connection.action_thread) std::thread();
+	return true;
+#else
+	fprintf(stderr, "init ERROR: The shared-memory transport is not supported on this platform.\n");
+	return false;
+#endif
+}
+
+/**
+ * Starts the thread that applies the actions of the client of `connection`
+ * to `sim`. This should only be called once the client has acknowledged
+ * that it mapped the region.
+ */
+template<typename MessageType, typename SimulatorData>
+inline void start(shared_memory_connection& connection, simulator<SimulatorData>& sim)
+{
+	connection.running = true;
+	connection.action_thread = std::thread([&connection, &sim]() {
+		run_shared_memory_actions<SimulatorData, MessageType>(connection, sim);
+	});
+}
+
+/**
+ * Writes the states of the given agents (whose IDs are in `agent_ids`) into
+ * the region of `connection`, followed by the given (fundamental-typed)
+ * `extra_data`, and notifies the client with a `STEP_RESPONSE`.
+ *
+ * \returns `true` if successful; `false` if the agents or the extra data do
+ *          not fit in the region, or the client is not consuming responses.
+ */
+template<typename MessageType, typename... ExtraData>
+bool send_shared_step(shared_memory_connection& connection,
+		const array<uint64_t>& agent_ids, const array<agent_state*>& agents,
+		const simulator_config& config, ExtraData&&... extra_data)
+{
+	shared_region_header& region = *connection.region;
+	connection.extra_data.length = 0;
+	if (agent_ids.length > region.agent_capacity
+	 || !put_extra_data(connection.extra_data, std::forward<ExtraData>(extra_data)...)
+	 || connection.extra_data.length > shared_region_header::EXTRA_CAPACITY)
+		return false;
+
+	const unsigned int vision_size = (2*config.vision_range + 1) * (2*config.vision_range + 1) * config.color_dimension;
+	for (unsigned int i = 0; i < agent_ids.length; i++) {
+		const agent_state& agent = *agents[(size_t) agent_ids[i]];
+		shared_agent_slot* slot = get_slot(&region, i);
+		slot->agent_id = agent_ids[i];
+		slot->position[0] = agent.current_position.x;
+		slot->position[1] = agent.current_position.y;
+		slot->requested_position[0] = agent.requested_position.x;
+		slot->requested_position[1] = agent.requested_position.y;
+		slot->current_direction = (uint8_t) agent.current_direction;
+		slot->requested_direction = (uint8_t) agent.requested_direction;
+		slot->agent_acted = agent.agent_acted;
+		memcpy(slot_scent(slot), agent.current_scent, sizeof(float) * config.scent_dimension);
+		memcpy(slot_vision(slot, config), agent.current_vision, sizeof(float) * vision_size);
+		memcpy(slot_items(slot, config), agent.collected_items, sizeof(unsigned int) * config.item_types.length);
+	}
+	region.step_agent_count = (uint32_t) agent_ids.length;
+	region.step_extra_length = connection.extra_data.length;
+	memcpy(region.step_extra, connection.extra_data.data, connection.extra_data.length);
+
+	/* the release in `push` publishes the slots to the client */
+	shared_response response = {(uint64_t) MessageType::STEP_RESPONSE, 0, 0};
+	return connection.push_response(response);
+}
+
+/**
+ * The client side of the shared-memory transport. The agent states passed to
+ * `on_step` refer directly to the slots in the region, and remain valid until
+ * the agents of the client act.
+ */
+struct shared_memory_client {
+	shared_region_header* region;
+	std::thread response_listener;
+
+	/* the ID of the thread running `response_listener`, which it sets when it starts */
+	std::atomic<std::thread::id> listener_id;
+
+	/* the client produces actions on every thread that calls `send_move` or `send_turn` */
+	std::mutex action_lock;
+
+	array<uint64_t> agent_ids;
+	agent_state* agents;
+
+	/* the position of the next value read by `read_step_data` in the extra data of the last step */
+	unsigned int extra_position;
+
+	inline bool push_action(const shared_action& action) {
+#if defined(__linux__)
+		std::unique_lock<std::mutex> lock(action_lock);
+		return push(region->actions, action);
+#else
+		return false;
+#endif
+	}
+
+	template<typename T>
+	inline bool read_extra(T& value) {
+		if (extra_position + sizeof(T) > region->step_extra_length) return false;
+		memcpy(&value, region->step_extra + extra_position, sizeof(T));
+		extra_position += sizeof(T);
+		return true;
+	}
+
+	static inline void free(shared_memory_client& c) {
+		for (unsigned int i = 0; i < c.region->agent_capacity; i++)
+			core::free(c.agents[i]);
+		core::free(c.agents);
+		core::free(c.agent_ids);
+#if defined(__linux__)
+		munmap(c.region, (size_t) c.region->region_size);
+#endif
+		c.response_listener.~thread();
+		c.listener_id.~atomic();
+		c.action_lock.~mutex();
+	}
+};
+
+/**
+ * Maps the shared-memory region `name` created by the server, whose agents
+ * have the given `config`. The name is unlinked once the region is mapped.
+ * The response listener is not started.
+ */
+inline bool init(shared_memory_client& c, const char* name, const simulator_config& config)
+{
+#if defined(__linux__)
+	shared_region_header* header = map_region(name, sizeof(shared_region_header), false);
+	if (header == NULL) return false;
+	unsigned int agent_capacity = header->agent_capacity;
+	size_t size = header->region_size;
+	bool valid = (header->magic == shared_region_header::MAGIC && header->slot_size == shared_slot_size(config)
+			&& size == shared_region_size(config, agent_capacity));
+	munmap(header, sizeof(shared_region_header));
+	if (!valid) {
+		fprintf(stderr, "init ERROR: The shared memory region does not match the simulator configuration.\n");
+		shm_unlink(name); return false;
+	}
+
+	c.region = map_region(name, size, false);
+	shm_unlink(name);
+	if (c.region == NULL) return false;
+
+	c.agents = (agent_state*) malloc(sizeof(agent_state) * max(1u, agent_capacity));
+	if (c.agents == NULL || !array_init(c.agent_ids, max(1u, agent_capacity))) {
+		fprintf(stderr, "init ERROR: Insufficient memory for shared_memory_client.\n");
+		if (c.agents != NULL) core::free(c.agents);
+		munmap(c.region, size); return false;
+	}
+	for (unsigned int i = 0; i < agent_capacity; i++) {
+		shared_agent_slot* slot = get_slot(c.region, i);
+		agent_state& agent = c.agents[i];
+		if (!init_observation_buffers(agent, config, slot_scent(slot), slot_vision(slot, config), slot_items(slot, config))
+		 || !init_observation_cache(agent, config))
+		{
+			for (unsigned int j = 0; j < i; j++) core::free(c.agents[j]);
+			core::free(c.agents); core::free(c.agent_ids);
+			munmap(c.region, size); return false;
+		}
+		new (&agent.lock) std::mutex();
+	}
+	c.extra_position = 0;
+	new (&c.response_listener) std::thread();
+	new (&c.listener_id) std::atomic<std::thread::id>(std::thread::id());
+	new (&c.action_lock) std::mutex();
+	return true;
+#else
+	fprintf(stderr, "init ERROR: The shared-memory transport is not supported on this platform.\n");
+	return false;
+#endif
+}
+
+/**
+ * Copies the fixed-size fields of the agents of the last step from their
+ * slots into `c.agents`, whose observation buffers are the slots themselves.
+ */
+inline void read_shared_step(shared_memory_client& c) {
+	unsigned int agent_count = min(c.region->step_agent_count, c.region->agent_capacity);
+	c.agent_ids.length = agent_count;
+	for (unsigned int i = 0; i < agent_count; i++) {
+		const shared_agent_slot* slot = get_slot(c.region, i);
+		agent_state& agent = c.agents[i];
+		c.agent_ids[i] = slot->agent_id;
+		agent.current_position = position(slot->position[0], slot->position[1]);
+		agent.requested_position = position(slot->requested_position[0], slot->requested_position[1]);
+		agent.current_direction = (direction) slot->current_direction;
+		agent.requested_direction = (direction) slot->requested_direction;
+		agent.agent_acted = (slot->agent_acted != 0);
+	}
+	c.extra_position = 0;
+}
+
+} /* namespace nel */
+
+#endif /* NEL_SHARED_MEMORY_H_ */
@@ -0,0 +1,292 @@
+#ifndef NEL_SIMD_H_
+#define NEL_SIMD_H_
+
+#include <math.h>
+#include <stdint.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define NEL_USE_AVX2
+#define NEL_USE_SSE2
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define NEL_USE_SSE2
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define NEL_USE_NEON
+#endif
+
+namespace nel {
+
+/**
+ * The number of floats processed at once by the functions in this file. The
+ * buffers given to these functions must have a capacity of at least
+ * `simd_padded_length(length)` floats.
+ */
+#if defined(NEL_USE_AVX2)
+constexpr unsigned int SIMD_FLOAT_COUNT = 8;
+#elif defined(NEL_USE_SSE2) || defined(NEL_USE_NEON)
+constexpr unsigned int SIMD_FLOAT_COUNT = 4;
+#else
+constexpr unsigned int SIMD_FLOAT_COUNT = 1;
+#endif
+
+constexpr unsigned int simd_padded_length(unsigned int length) {
+	return ((length + SIMD_FLOAT_COUNT - 1) / SIMD_FLOAT_COUNT) * SIMD_FLOAT_COUNT;
+}
+
+/* NOTE: `length` must be a multiple of `SIMD_FLOAT_COUNT` */
+inline void simd_add(float* dst, const float* src, unsigned int length)
+{
+	for (unsigned int i = 0; i < length; i += SIMD_FLOAT_COUNT) {
+#if defined(NEL_USE_AVX2)
+		_mm256_storeu_ps(dst + i, _mm256_add_ps(_mm256_loadu_ps(dst + i), _mm256_loadu_ps(src + i)));
+#elif defined(NEL_USE_SSE2)
+		_mm_storeu_ps(dst + i, _mm_add_ps(_mm_loadu_ps(dst + i), _mm_loadu_ps(src + i)));
+#elif defined(NEL_USE_NEON)
+		vst1q_f32(dst + i, vaddq_f32(vld1q_f32(dst + i), vld1q_f32(src + i)));
+#else
+		dst[i] += src[i];
+#endif
+	}
+}
+
+/* the constants of the polynomial approximation to exp in the Cephes library */
+#define NEL_EXP_HI 88.3762626647949f
+#define NEL_EXP_LO -88.3762626647949f
+#define NEL_LOG2E 1.44269504088896341f
+#define NEL_EXP_C1 0.693359375f
+#define NEL_EXP_C2 -2.12194440e-4f
+#define NEL_EXP_P0 1.9875691500e-4f
+#define NEL_EXP_P1 1.3981999507e-3f
+#define NEL_EXP_P2 8.3334519073e-3f
+#define NEL_EXP_P3 4.1665795894e-2f
+#define NEL_EXP_P4 1.6666665459e-1f
+#define NEL_EXP_P5 5.0000001201e-1f
+
+#if defined(NEL_USE_AVX2)
+inline __m256 simd_exp(__m256 x) {
+	x = _mm256_min_ps(x, _mm256_set1_ps(NEL_EXP_HI));
+	x = _mm256_max_ps(x, _mm256_set1_ps(NEL_EXP_LO));
+	__m256 fx = _mm256_floor_ps(_mm256_add_ps(_mm256_mul_ps(x, _mm256_set1_ps(NEL_LOG2E)), _mm256_set1_ps(0.5f)));
+	x = _mm256_sub_ps(x, _mm256_mul_ps(fx, _mm256_set1_ps(NEL_EXP_C1)));
+	x = _mm256_sub_ps(x, _mm256_mul_ps(fx, _mm256_set1_ps(NEL_EXP_C2)));
+	__m256 y = _mm256_set1_ps(NEL_EXP_P0);
+	y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(NEL_EXP_P1));
+	y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(NEL_EXP_P2));
+	y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(NEL_EXP_P3));
+	y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(NEL_EXP_P4));
+	y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(NEL_EXP_P5));
+	y = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(y, _mm256_mul_ps(x, x)), x), _mm256_set1_ps(1.0f));
+	__m256i exponent = _mm256_add_epi32(_mm256_cvttps_epi32(fx), _mm256_set1_epi32(0x7f));
+	return _mm256_mul_ps(y, _mm256_castsi256_ps(_mm256_slli_epi32(exponent, 23)));
+}
+#elif defined(NEL_USE_SSE2)
+inline __m128 simd_exp(__m128 x) {
+	const __m128 one = _mm_set1_ps(1.0f);
+	x = _mm_min_ps(x, _mm_set1_ps(NEL_EXP_HI));
+	x = _mm_max_ps(x, _mm_set1_ps(NEL_EXP_LO));
+	__m128 fx = _mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(NEL_LOG2E)), _mm_set1_ps(0.5f));
+	/* compute the floor of `fx` without SSE4.1 */
+	__m128 truncated = _mm_cvtepi32_ps(_mm_cvttps_epi32(fx));
+	fx = _mm_sub_ps(truncated, _mm_and_ps(_mm_cmpgt_ps(truncated, fx), one));
+	x = _mm_sub_ps(x, _mm_mul_ps(fx, _mm_set1_ps(NEL_EXP_C1)));
+	x = _mm_sub_ps(x, _mm_mul_ps(fx, _mm_set1_ps(NEL_EXP_C2)));
+	__m128 y = _mm_set1_ps(NEL_EXP_P0);
+	y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(NEL_EXP_P1));
+	y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(NEL_EXP_P2));
+	y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(NEL_EXP_P3));
+	y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(NEL_EXP_P4));
+	y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(NEL_EXP_P5));
+	y = _mm_add_ps(_mm_add_ps(_mm_mul_ps(y, _mm_mul_ps(x, x)), x), one);
+	__m128i exponent = _mm_add_epi32(_mm_cvttps_epi32(fx), _mm_set1_epi32(0x7f));
+	return _mm_mul_ps(y, _mm_castsi128_ps(_mm_slli_epi32(exponent, 23)));
+}
+#elif defined(NEL_USE_NEON)
+inline float32x4_t simd_exp(float32x4_t x) {
+	const float32x4_t one = vdupq_n_f32(1.0f);
+	x = vminq_f32(x, vdupq_n_f32(NEL_EXP_HI));
+	x = vmaxq_f32(x, vdupq_n_f32(NEL_EXP_LO));
+	float32x4_t fx = vaddq_f32(vmulq_f32(x, vdupq_n_f32(NEL_LOG2E)), vdupq_n_f32(0.5f));
+	float32x4_t truncated = vcvtq_f32_s32(vcvtq_s32_f32(fx));
+	uint32x4_t mask = vandq_u32(vcgtq_f32(truncated, fx), vreinterpretq_u32_f32(one));
+	fx = vsubq_f32(truncated, vreinterpretq_f32_u32(mask));
+	x = vsubq_f32(x, vmulq_f32(fx, vdupq_n_f32(NEL_EXP_C1)));
+	x = vsubq_f32(x, vmulq_f32(fx, vdupq_n_f32(NEL_EXP_C2)));
+	float32x4_t y = vdupq_n_f32(NEL_EXP_P0);
+	y = vaddq_f32(vmulq_f32(y, x), vdupq_n_f32(NEL_EXP_P1));
+	y = vaddq_f32(vmulq_f32(y, x), vdupq_n_f32(NEL_EXP_P2));
+	y = vaddq_f32(vmulq_f32(y, x), vdupq_n_f32(NEL_EXP_P3));
+	y = vaddq_f32(vmulq_f32(y, x), vdupq_n_f32(NEL_EXP_P4));
+	y = vaddq_f32(vmulq_f32(y, x), vdupq_n_f32(NEL_EXP_P5));
+	y = vaddq_f32(vaddq_f32(vmulq_f32(y, vmulq_f32(x, x)), x), one);
+	int32x4_t exponent = vaddq_s32(vcvtq_s32_f32(fx), vdupq_n_s32(0x7f));
+	return vmulq_f32(y, vreinterpretq_f32_s32(vshlq_n_s32(exponent, 23)));
+}
+#endif
+
+/**
+ * Given log probabilities in `values[0..length)`, this function computes the
+ * normalized probabilities in place, as `normalize_exp` in math/log.h does.
+ * The padding `values[length..simd_padded_length(length))` is set to zero.
+ */
+inline void simd_normalize_exp(float* values, unsigned int length)
+{
+	const unsigned int padded_length = simd_padded_length(length);
+#if defined(NEL_USE_AVX2) || defined(NEL_USE_SSE2) || defined(NEL_USE_NEON)
+	float lanes[SIMD_FLOAT_COUNT];
+	for (unsigned int i = length; i < padded_length; i++)
+		values[i] = -INFINITY;
+
+	/* compute the maximum */
+#if defined(NEL_USE_AVX2)
+	__m256 maximum = _mm256_loadu_ps(values);
+	for (unsigned int i = SIMD_FLOAT_COUNT; i < padded_length; i += SIMD_FLOAT_COUNT)
+		maximum = _mm256_max_ps(maximum, _mm256_loadu_ps(values + i));
+	_mm256_storeu_ps(lanes, maximum);
+#elif defined(NEL_USE_SSE2)
+	__m128 maximum = _mm_loadu_ps(values);
+	for (unsigned int i = SIMD_FLOAT_COUNT; i < padded_length; i += SIMD_FLOAT_COUNT)
+		maximum = _mm_max_ps(maximum, _mm_loadu_ps(values + i));
+	_mm_storeu_ps(lanes, maximum);
+#else
+	float32x4_t maximum = vld1q_f32(values);
+	for (unsigned int i = SIMD_FLOAT_COUNT; i < padded_length; i += SIMD_FLOAT_COUNT)
+		maximum = vmaxq_f32(maximum, vld1q_f32(values + i));
+	vst1q_f32(lanes, maximum);
+#endif
+	float max_value = lanes[0];
+	for (unsigned int i = 1; i < SIMD_FLOAT_COUNT; i++)
+		if (lanes[i] > max_value) max_value = lanes[i];
+
+	/* exponentiate the shifted values */
+	for (unsigned int i = 0; i < padded_length; i += SIMD_FLOAT_COUNT) {
+#if defined(NEL_USE_AVX2)
+		_mm256_storeu_ps(values + i, simd_exp(_mm256_sub_ps(_mm256_loadu_ps(values + i), _mm256_set1_ps(max_value))));
+#elif defined(NEL_USE_SSE2)
+		_mm_storeu_ps(values + i, simd_exp(_mm_sub_ps(_mm_loadu_ps(values + i), _mm_set1_ps(max_value))));
+#else
+		vst1q_f32(values + i, simd_exp(vsubq_f32(vld1q_f32(values + i), vdupq_n_f32(max_value))));
+#endif
+	}
+	for (unsigned int i = length; i < padded_length; i++)
+		values[i] = 0.0f;
+
+	/* compute the sum and normalize */
+#if defined(NEL_USE_AVX2)
+	__m256 sum = _mm256_loadu_ps(values);
+	for (unsigned int i = SIMD_FLOAT_COUNT; i < padded_length; i += SIMD_FLOAT_COUNT)
+		sum = _mm256_add_ps(sum, _mm256_loadu_ps(values + i));
+	_mm256_storeu_ps(lanes, sum);
+#elif defined(NEL_USE_SSE2)
+	__m128 sum = _mm_loadu_ps(values);
+	for (unsigned int i = SIMD_FLOAT_COUNT; i < padded_length; i += SIMD_FLOAT_COUNT)
+		sum = _mm_add_ps(sum, _mm_loadu_ps(values + i));
+	_mm_storeu_ps(lanes, sum);
+#else
+	float32x4_t sum = vld1q_f32(values);
+	for (unsigned int i = SIMD_FLOAT_COUNT; i < padded_length; i += SIMD_FLOAT_COUNT)
+		sum = vaddq_f32(sum, vld1q_f32(values + i));
+	vst1q_f32(lanes, sum);
+#endif
+	float total = 0.0f;
+	for (unsigned int i = 0; i < SIMD_FLOAT_COUNT; i++)
+		total += lanes[i];
+
+	const float inverse = 1.0f / total;
+	for (unsigned int i = 0; i < padded_length; i += SIMD_FLOAT_COUNT) {
+#if defined(NEL_USE_AVX2)
+		_mm256_storeu_ps(values + i, _mm256_mul_ps(_mm256_loadu_ps(values + i), _mm256_set1_ps(inverse)));
+#elif defined(NEL_USE_SSE2)
+		_mm_storeu_ps(values + i, _mm_mul_ps(_mm_loadu_ps(values + i), _mm_set1_ps(inverse)));
+#else
+		vst1q_f32(values + i, vmulq_f32(vld1q_f32(values + i), vdupq_n_f32(inverse)));
+#endif
+	}
+#else
+	float max_value = values[0];
+	for (unsigned int i = 1; i < length; i++)
+		if (values[i] > max_value) max_value = values[i];
+	float total = 0.0f;
+	for (unsigned int i = 0; i < length; i++) {
+		values[i] = expf(values[i] - max_value);
+		total += values[i];
+	}
+	for (unsigned int i = 0; i < length; i++)
+		values[i] /= total;
+#endif
+}
+
+/* returns the index of the lowest set bit of `mask`, which must be nonzero */
+inline unsigned int simd_lowest_set_bit(unsigned int mask) {
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return (unsigned int) index;
+#else
+	return (unsigned int) __builtin_ctz(mask);
+#endif
+}
+
+/**
+ * Returns the smallest index `i` such that the cumulative sum of
+ * `probabilities[0..i]` is greater than `random`, or `length - 1` if there
+ * is none, as `select_categorical` in math/log.h does. The padding
+ * `probabilities[length..simd_padded_length(length))` must be zero (as
+ * `simd_normalize_exp` leaves it).
+ */
+inline unsigned int simd_select_categorical(
+		const float* probabilities, float random, unsigned int length)
+{
+#if defined(NEL_USE_SSE2)
+	/* four lanes suffice for the small categorical distributions in this library */
+	const __m128 threshold = _mm_set1_ps(random);
+	__m128 carry = _mm_setzero_ps();
+	for (unsigned int i = 0; i < length; i += 4) {
+		__m128 v = _mm_loadu_ps(probabilities + i);
+		v = _mm_add_ps(v, _mm_castsi128_ps(_mm_slli_si128(_mm_castps_si128(v), 4)));
+		v = _mm_add_ps(v, _mm_castsi128_ps(_mm_slli_si128(_mm_castps_si128(v), 8)));
+		v = _mm_add_ps(v, carry);
+		int mask = _mm_movemask_ps(_mm_cmpgt_ps(v, threshold));
+		if (mask != 0) {
+			unsigned int index = i + simd_lowest_set_bit((unsigned int) mask);
+			return (index < length) ? index : (length - 1);
+		}
+		carry = _mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 3, 3, 3));
+	}
+	return length - 1;
+#elif defined(NEL_USE_NEON)
+	const float32x4_t threshold = vdupq_n_f32(random);
+	const float32x4_t zero = vdupq_n_f32(0.0f);
+	float32x4_t carry = zero;
+	for (unsigned int i = 0; i < length; i += 4) {
+		float32x4_t v = vld1q_f32(probabilities + i);
+		v = vaddq_f32(v, vextq_f32(zero, v, 3));
+		v = vaddq_f32(v, vextq_f32(zero, v, 2));
+		v = vaddq_f32(v, carry);
+		uint32_t lanes[4];
+		vst1q_u32(lanes, vcgtq_f32(v, threshold));
+		for (unsigned int j = 0; j < 4; j++) {
+			if (lanes[j] != 0)
+				return (i + j < length) ? (i + j) : (length - 1);
+		}
+		carry = vdupq_n_f32(vgetq_lane_f32(v, 3));
+	}
+	return length - 1;
+#else
+	float cumulative = 0.0f;
+	for (unsigned int i = 0; i + 1 < length; i++) {
+		cumulative += probabilities[i];
+		if (cumulative > random) return i;
+	}
+	return length - 1;
+#endif
+}
+
+} /* namespace nel */
+
+#endif /* NEL_SIMD_H_ */
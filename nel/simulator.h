@@ -5,8 +5,15 @@
 #include <core/utility.h>
 #include <atomic>
 #include <mutex>
+#include <thread>
+#include <condition_variable>
 #include "map.h"
+#include "checkpoint.h"
+#include "trajectory.h"
+#include "expiry_queue.h"
 #include "diffusion.h"
+#include "thread_pool.h"
+#include "pool_allocator.h"
 
 namespace nel {
 
@@ -356,7 +363,22 @@ struct simulator_config {
     float decay_param, diffusion_param;
     unsigned int deleted_item_lifetime;
 
-    simulator_config() : item_types(8), agent_color(NULL) { }
+    /* simulation options that do not change the behavior of the environment */
+
+    /**
+     * If `true`, each agent caches the scent and vision contributions of the
+     * items around it, and only recomputes them when it moves or when the
+     * items in its neighborhood change. See `agent_state::update_state_incremental`.
+     */
+    bool incremental_observations;
+
+    /**
+     * The number of threads used by the simulator to compute agent
+     * observations and to sample new patches of the world.
+     */
+    unsigned int thread_count;
+
+    simulator_config() : item_types(8), agent_color(NULL), incremental_observations(false), thread_count(1) { }
 
     simulator_config(const simulator_config& src) : item_types(src.item_types.length) {
         if (!init_helper(src))
@@ -382,6 +404,8 @@ struct simulator_config {
         core::swap(first.decay_param, second.decay_param);
         core::swap(first.diffusion_param, second.diffusion_param);
         core::swap(first.deleted_item_lifetime, second.deleted_item_lifetime);
+        core::swap(first.incremental_observations, second.incremental_observations);
+        core::swap(first.thread_count, second.thread_count);
     }
 
     static inline void free(simulator_config& config) {
@@ -424,6 +448,8 @@ private:
         decay_param = src.decay_param;
         diffusion_param = src.diffusion_param;
         deleted_item_lifetime = src.deleted_item_lifetime;
+        incremental_observations = src.incremental_observations;
+        thread_count = src.thread_count;
         return true;
     }
 
@@ -444,6 +470,8 @@ private:
  */
 inline bool init(simulator_config& config) {
     config.agent_color = NULL;
+    config.incremental_observations = false;
+    config.thread_count = 1;
     return array_init(config.item_types, 8);
 }
 
@@ -500,6 +528,10 @@ bool read(simulator_config& config, Stream& in) {
             free(properties, (unsigned int) config.item_types.length);
         free(config.agent_color); free(config.item_types); return false;
     }
+
+    /* these options do not change the behavior of the environment, so they are not saved */
+    config.incremental_observations = false;
+    config.thread_count = 1;
     return true;
 }
 
@@ -525,6 +557,38 @@ bool write(const simulator_config& config, Stream& out) {
         && write(config.deleted_item_lifetime, out);
 }
 
+/**
+ * A request by `agent` to move to `target` in the current time step, which
+ * is resolved against the requests of the other agents by `simulator::step`.
+ * `sequence` is the order in which the request was made, `stays` indicates
+ * whether `agent` is already at `target`, and `moves` is the outcome of the
+ * resolution.
+ */
+struct move_request {
+    position target;
+    agent_state* agent;
+    uint32_t sequence;
+    bool stays;
+    bool moves;
+
+    /* orders the requests by target and, for each target, puts the agent that is already there first, followed by the others in the order of their requests */
+    inline bool operator < (const move_request& other) const {
+        if (target != other.target) return target < other.target;
+        if (stays != other.stays) return stays;
+        return sequence < other.sequence;
+    }
+
+    static inline void move(const move_request& src, move_request& dst) {
+        dst = src;
+    }
+
+    static inline void swap(move_request& first, move_request& second) {
+        move_request temp = first;
+        first = second;
+        second = temp;
+    }
+};
+
 /**
  * A structure that is used to store additional state information in the map
  * structure. So far, this structure stores an array of agents that inhabit the
@@ -596,33 +660,196 @@ inline void add_scent(float* dst, const float* scent, unsigned int scent_dimensi
         dst[i] += scent[i] * value;
 }
 
-template<typename T>
+/**
+ * Returns `true` if the scent of `item` does not change after `current_time`
+ * (until it is deleted), since it has existed for at least
+ * `deleted_item_lifetime` steps.
+ */
+inline bool has_constant_scent(const item& item, uint64_t current_time, const simulator_config& config) {
+    return item.deletion_time == 0 && (item.creation_time == 0
+        || current_time - item.creation_time + 1 >= config.deleted_item_lifetime);
+}
+
+/**
+ * Returns `true` if `item` was deleted at least `deleted_item_lifetime` steps
+ * before `current_time`, so that its scent has fully dissipated.
+ */
+inline bool is_expired(const item& item, uint64_t current_time, const simulator_config& config) {
+    return item.deletion_time > 0 && current_time >= item.deletion_time + config.deleted_item_lifetime;
+}
+
+/**
+ * Dimensions of the observations and of the patches that are fixed at compile
+ * time, so that the loops over them in `agent_state::update_state`,
+ * `agent_state::update_state_incremental`, and `simulator::get_map` have
+ * constant bounds. A zero parameter means that the corresponding value is
+ * read from the `simulator_config` at runtime (so `generic_dimensions` works
+ * with any configuration). Nonzero parameters must equal the values in the
+ * configuration; `select_dimensions` picks the specialization that matches.
+ *
+ * The number of item types (`config.item_types.length`) is deliberately not
+ * a parameter. The per-item and per-cell loops never run over the item
+ * types: they only index them. The loops that do run over the item types
+ * (e.g. in `add_scent_contributions`) run once per call, not once per item
+ * or cell. Adding the count would also make a prebuilt specialization stop
+ * matching as soon as an item type is added to a configuration, and that
+ * configuration would silently fall back to `generic_dimensions`.
+ */
+template<unsigned int ScentDimension, unsigned int ColorDimension,
+    unsigned int VisionRange, unsigned int PatchSize>
+struct fixed_dimensions {
+    static constexpr unsigned int scent_dimension_value = ScentDimension;
+    static constexpr unsigned int color_dimension_value = ColorDimension;
+    static constexpr unsigned int vision_range_value = VisionRange;
+    static constexpr unsigned int patch_size_value = PatchSize;
+
+    static inline unsigned int scent_dimension(const simulator_config& config) {
+        return (ScentDimension == 0) ? config.scent_dimension : ScentDimension;
+    }
+
+    static inline unsigned int color_dimension(const simulator_config& config) {
+        return (ColorDimension == 0) ? config.color_dimension : ColorDimension;
+    }
+
+    static inline unsigned int vision_range(const simulator_config& config) {
+        return (VisionRange == 0) ? config.vision_range : VisionRange;
+    }
+
+    static inline unsigned int patch_size(const simulator_config& config) {
+        return (PatchSize == 0) ? config.patch_size : PatchSize;
+    }
+
+    static inline bool matches(const simulator_config& config) {
+        return (ScentDimension == 0 || ScentDimension == config.scent_dimension)
+            && (ColorDimension == 0 || ColorDimension == config.color_dimension)
+            && (VisionRange == 0 || VisionRange == config.vision_range)
+            && (PatchSize == 0 || PatchSize == config.patch_size);
+    }
+};
+
+typedef fixed_dimensions<0, 0, 0, 0> generic_dimensions;
+
+/* the configuration of `nel/environments.py` in the Python API */
+typedef fixed_dimensions<3, 3, 5, 32> scent3_color3_vision5_patch32;
+
+/* the configuration of `simulator_test.cpp` and `simulator_benchmark.cpp` */
+typedef fixed_dimensions<3, 3, 10, 32> scent3_color3_vision10_patch32;
+
+/**
+ * The `fixed_dimensions` specializations that are compiled into the
+ * simulator. To add one, add a typedef above, a value here, a case in
+ * `select_dimensions`, and a case in each of the functions that dispatch on
+ * this enum (`agent_state::update_state`,
+ * `agent_state::update_state_incremental`, and `simulator::get_map`).
+ */
+enum class dimension_specialization : uint8_t {
+    GENERIC = 0,
+    SCENT3_COLOR3_VISION5_PATCH32,
+    SCENT3_COLOR3_VISION10_PATCH32
+};
+
+/* returns the specialization for `config`, or `GENERIC` if none of the prebuilt ones match */
+inline dimension_specialization select_dimensions(const simulator_config& config) {
+    if (scent3_color3_vision5_patch32::matches(config))
+        return dimension_specialization::SCENT3_COLOR3_VISION5_PATCH32;
+    else if (scent3_color3_vision10_patch32::matches(config))
+        return dimension_specialization::SCENT3_COLOR3_VISION10_PATCH32;
+    return dimension_specialization::GENERIC;
+}
+
+/* if `ScentDimension` is nonzero, it must equal `config.scent_dimension` */
+template<unsigned int ScentDimension = 0, typename T>
 void compute_scent_contribution(
         const diffusion<T>& scent_model, const item& item,
         position pos, uint64_t current_time,
         const simulator_config& config, float* dst)
 {
+    const unsigned int scent_dimension = (ScentDimension == 0) ? config.scent_dimension : ScentDimension;
+
     /* compute item position in agent coordinates */
     position relative_position = item.location - pos;
 
     /* if the item is within scent range, add its contribution */
-    if ((unsigned int) abs(relative_position.x) < scent_model.radius
-     && (unsigned int) abs(relative_position.y) < scent_model.radius)
+    unsigned int x = (unsigned int) abs(relative_position.x);
+    unsigned int y = (unsigned int) abs(relative_position.y);
+    if (x < scent_model.radius && y < scent_model.radius)
     {
         unsigned int creation_t = config.deleted_item_lifetime - 1;
         if (item.creation_time > 0)
             creation_t = min(creation_t, (unsigned int) (current_time - item.creation_time));
-        add_scent(dst, config.item_types[item.item_type].scent, config.scent_dimension,
-                (float) scent_model.get_value(creation_t, (int) relative_position.x, (int) relative_position.y));
+        add_scent(dst, config.item_types[item.item_type].scent, scent_dimension,
+                scent_model.get_table_value(creation_t, x, y));
 
         if (item.deletion_time > 0) {
             unsigned int deletion_t = (unsigned int) (current_time - item.deletion_time);
-            add_scent(dst, config.item_types[item.item_type].scent, config.scent_dimension,
-                (float) -scent_model.get_value(deletion_t, (int) relative_position.x, (int) relative_position.y));
+            add_scent(dst, config.item_types[item.item_type].scent, scent_dimension,
+                -scent_model.get_table_value(deletion_t, x, y));
         }
     }
 }
 
+/**
+ * Adds the scent contributions of the `item_count` items in `items` at the
+ * position `pos` to `dst`, as calling `compute_scent_contribution` for each
+ * item would (up to the order of the floating-point additions). The diffusion
+ * values of the items are first summed per item type, so the loop over the
+ * items only reads the diffusion table, and the scent vectors are added once
+ * per item type. If `ScentDimension` is nonzero, it must equal
+ * `config.scent_dimension`, and the loops over the scent dimensions are
+ * unrolled at compile time (see the overload below, which selects it).
+ */
+template<unsigned int ScentDimension, typename T>
+void add_scent_contributions(
+        const diffusion<T>& scent_model, const item* items, size_t item_count,
+        position pos, uint64_t current_time,
+        const simulator_config& config, float* dst)
+{
+    const unsigned int scent_dimension = (ScentDimension == 0) ? config.scent_dimension : ScentDimension;
+    const unsigned int item_type_count = (unsigned int) config.item_types.length;
+    float* type_weights = (float*) alloca(sizeof(float) * item_type_count);
+    for (unsigned int i = 0; i < item_type_count; i++)
+        type_weights[i] = 0.0f;
+
+    const unsigned int radius = scent_model.radius;
+    const unsigned int max_creation_t = config.deleted_item_lifetime - 1;
+    for (size_t i = 0; i < item_count; i++) {
+        const item& item = items[i];
+        unsigned int x = (unsigned int) abs(item.location.x - pos.x);
+        unsigned int y = (unsigned int) abs(item.location.y - pos.y);
+        if (x >= radius || y >= radius) continue;
+
+        unsigned int creation_t = max_creation_t;
+        if (item.creation_time > 0)
+            creation_t = min(creation_t, (unsigned int) (current_time - item.creation_time));
+        float weight = scent_model.get_table_value(creation_t, x, y);
+        if (item.deletion_time > 0)
+            weight -= scent_model.get_table_value((unsigned int) (current_time - item.deletion_time), x, y);
+        type_weights[item.item_type] += weight;
+    }
+
+    for (unsigned int i = 0; i < item_type_count; i++) {
+        if (type_weights[i] == 0.0f) continue;
+        const float* scent = config.item_types[i].scent;
+        for (unsigned int j = 0; j < scent_dimension; j++)
+            dst[j] += scent[j] * type_weights[i];
+    }
+}
+
+template<typename T>
+inline void add_scent_contributions(
+        const diffusion<T>& scent_model, const item* items, size_t item_count,
+        position pos, uint64_t current_time,
+        const simulator_config& config, float* dst)
+{
+    switch (config.scent_dimension) {
+    case 1: add_scent_contributions<1>(scent_model, items, item_count, pos, current_time, config, dst); return;
+    case 2: add_scent_contributions<2>(scent_model, items, item_count, pos, current_time, config, dst); return;
+    case 3: add_scent_contributions<3>(scent_model, items, item_count, pos, current_time, config, dst); return;
+    case 4: add_scent_contributions<4>(scent_model, items, item_count, pos, current_time, config, dst); return;
+    default: add_scent_contributions<0>(scent_model, items, item_count, pos, current_time, config, dst); return;
+    }
+}
+
 /** Represents the state of an agent in the simulator. */
 struct agent_state {
     /* Current position of the agent. */
@@ -660,15 +887,47 @@ struct agent_state {
     /** Number of items of each type in the agent's storage. */
     unsigned int* collected_items;
 
+    /**
+     * `true` if `current_scent`, `current_vision`, and `collected_items` were
+     * allocated for this agent alone. Otherwise, they are rows of an
+     * `agent_observation_buffers` owned by the simulator.
+     */
+    bool owns_buffers;
+
     /** 
      * Lock used by the simulator to prevent simultaneous updates 
      * to an agent's state.
      */
     std::mutex lock;
 
-    inline void add_color(
+    /**
+     * The following fields cache the observation contributions of the items
+     * near the agent, for `update_state_incremental`. `static_scent` is the
+     * scent of the items whose contribution does not change with time (they
+     * are not deleted and have existed for at least `deleted_item_lifetime`
+     * steps). The contributions of the remaining items are recomputed every
+     * step, and they are listed in `transient_items` as pairs of indices
+     * into the neighborhood and into the items of that patch. `item_vision`
+     * is the vision of the items, before it is rotated into the direction of
+     * the agent. The cache is valid as long as the agent remains at
+     * `cached_position` and the patches in its neighborhood have the
+     * positions `cached_patch_positions` and versions `cached_patch_versions`.
+     */
+    float* static_scent;
+    float* item_vision;
+    array<pair<unsigned int, unsigned int>> transient_items;
+    position cached_position;
+    position cached_patch_positions[4];
+    uint64_t cached_patch_versions[4];
+    bool observation_cache_valid;
+
+    /**
+     * Returns the offset in `current_vision` of the pixel at the given
+     * position, relative to the agent and in world coordinates.
+     */
+    inline unsigned int pixel_offset(
             position relative_position, unsigned int vision_range,
-            const float* color, unsigned int color_dimension)
+            unsigned int color_dimension) const
     {
         switch (current_direction) {
         case direction::UP: break;
@@ -686,43 +945,66 @@ struct agent_state {
         }
         unsigned int x = (unsigned int) (relative_position.x + vision_range);
         unsigned int y = (unsigned int) (relative_position.y + vision_range);
-        unsigned int offset = (x*(2*vision_range + 1) + y) * color_dimension;
-        for (unsigned int i = 0; i < color_dimension; i++)
+        return (x*(2*vision_range + 1) + y) * color_dimension;
+    }
+
+    /* if `ColorDimension` is nonzero, it must equal `color_dimension` */
+    template<unsigned int ColorDimension = 0>
+    inline void add_color(
+            position relative_position, unsigned int vision_range,
+            const float* color, unsigned int color_dimension)
+    {
+        const unsigned int dimension = (ColorDimension == 0) ? color_dimension : ColorDimension;
+        unsigned int offset = pixel_offset(relative_position, vision_range, dimension);
+        for (unsigned int i = 0; i < dimension; i++)
             current_vision[offset + i] += color[i];
     }
 
-    template<typename T>
+    /**
+     * Recomputes the scent and vision of this agent from the items and agents
+     * in `neighborhood`. The patches must not contain expired items (the
+     * simulator removes them at the beginning of each step; see
+     * `simulator::remove_expired_items`). This function does not modify the
+     * patches, so it may be called concurrently for different agents. The
+     * loops over the dimensions in `Dimensions` (see `fixed_dimensions`) are
+     * unrolled at compile time; the overload below selects them.
+     */
+    template<typename Dimensions, typename T>
     inline void update_state(
             patch<patch_data>* neighborhood[4],
             const diffusion<T>& scent_model,
             const simulator_config& config,
             uint64_t current_time)
     {
+        const unsigned int scent_dimension = Dimensions::scent_dimension(config);
+        const unsigned int color_dimension = Dimensions::color_dimension(config);
+        const unsigned int vision_range = Dimensions::vision_range(config);
+
         /* first zero out both current scent and vision */
-        for (unsigned int i = 0; i < config.scent_dimension; i++)
+        for (unsigned int i = 0; i < scent_dimension; i++)
             current_scent[i] = 0.0f;
-        for (unsigned int i = 0; i < (2*config.vision_range + 1) * (2*config.vision_range + 1) * config.color_dimension; i++)
+        for (unsigned int i = 0; i < (2*vision_range + 1) * (2*vision_range + 1) * color_dimension; i++)
             current_vision[i] = 0.0f;
 
         for (unsigned int i = 0; i < 4; i++) {
-            /* iterate over neighboring items, and add their contributions to scent and vision */
+            /* add the scent contributions of the neighboring items */
+            if (Dimensions::scent_dimension_value == 0)
+                add_scent_contributions(scent_model, neighborhood[i]->items.data, neighborhood[i]->items.length,
+                        current_position, current_time, config, current_scent);
+            else add_scent_contributions<Dimensions::scent_dimension_value>(scent_model, neighborhood[i]->items.data,
+                        neighborhood[i]->items.length, current_position, current_time, config, current_scent);
+
+            /* iterate over neighboring items, and add their colors to the vision */
             for (unsigned int j = 0; j < neighborhood[i]->items.length; j++) {
                 const item& item = neighborhood[i]->items[j];
 
-                /* check if the item is too old; if so, delete it */
-                if (item.deletion_time > 0 && current_time >= item.deletion_time + config.deleted_item_lifetime) {
-                    neighborhood[i]->items.remove(j); j--; continue;
-                }
-
-                compute_scent_contribution(scent_model, item, current_position, current_time, config, current_scent);
-
                 /* if the item is in the visual field, add its color to the appropriate pixel */
                 position relative_position = item.location - current_position;
                 if (item.deletion_time == 0
-                 && (unsigned int) abs(relative_position.x) <= config.vision_range
-                 && (unsigned int) abs(relative_position.y) <= config.vision_range) {
-                    add_color(relative_position, config.vision_range,
-                            config.item_types[item.item_type].color, config.color_dimension);
+                 && (unsigned int) abs(relative_position.x) <= vision_range
+                 && (unsigned int) abs(relative_position.y) <= vision_range) {
+                    add_color<Dimensions::color_dimension_value>(relative_position, vision_range,
+                            config.item_types[item.item_type].color, color_dimension);
                 }
             }
 
@@ -732,24 +1014,257 @@ struct agent_state {
                 position relative_position = agent->current_position - current_position;
 
                 /* if the neighbor is in the visual field, add its color to the appropriate pixel */
-                if ((unsigned int) abs(relative_position.x) <= config.vision_range
-                 && (unsigned int) abs(relative_position.y) <= config.vision_range) {
-                    add_color(relative_position, config.vision_range,
-                            config.agent_color, config.color_dimension);
+                if ((unsigned int) abs(relative_position.x) <= vision_range
+                 && (unsigned int) abs(relative_position.y) <= vision_range) {
+                    add_color<Dimensions::color_dimension_value>(relative_position, vision_range,
+                            config.agent_color, color_dimension);
+                }
+            }
+        }
+        observation_cache_valid = false;
+    }
+
+    template<typename T>
+    inline void update_state(
+            patch<patch_data>* neighborhood[4],
+            const diffusion<T>& scent_model,
+            const simulator_config& config,
+            uint64_t current_time)
+    {
+        switch (select_dimensions(config)) {
+        case dimension_specialization::SCENT3_COLOR3_VISION5_PATCH32:
+            update_state<scent3_color3_vision5_patch32>(neighborhood, scent_model, config, current_time); return;
+        case dimension_specialization::SCENT3_COLOR3_VISION10_PATCH32:
+            update_state<scent3_color3_vision10_patch32>(neighborhood, scent_model, config, current_time); return;
+        case dimension_specialization::GENERIC:
+            break;
+        }
+        update_state<generic_dimensions>(neighborhood, scent_model, config, current_time);
+    }
+
+    /**
+     * Computes the same scent and vision as `update_state`, but reuses the
+     * contributions of items that were cached by a previous call. The cache
+     * is rebuilt if the agent moved or if the items in any of the patches in
+     * `neighborhood` changed (for example, if an item was collected or
+     * removed). Otherwise, only the contributions of items whose scent
+     * changes over time, of the other agents, and of the agent's rotation
+     * are recomputed. As with `update_state`, the patches must not contain
+     * expired items, and they are not modified.
+     */
+    template<typename Dimensions, typename T>
+    inline void update_state_incremental(
+            patch<patch_data>* neighborhood[4],
+            const position patch_positions[4],
+            const diffusion<T>& scent_model,
+            const simulator_config& config,
+            uint64_t current_time)
+    {
+        bool cache_valid = observation_cache_valid && cached_position == current_position;
+        for (unsigned int i = 0; cache_valid && i < 4; i++) {
+            if (cached_patch_positions[i] != patch_positions[i]
+             || cached_patch_versions[i] != neighborhood[i]->version)
+                cache_valid = false;
+        }
+        if (!cache_valid && !rebuild_observation_cache(neighborhood, patch_positions, scent_model, config, current_time)) {
+            /* we were unable to build the cache, so recompute the observations fully */
+            update_state<Dimensions>(neighborhood, scent_model, config, current_time);
+            return;
+        }
+
+        /* add the contributions of items whose scent changes over time */
+        const unsigned int scent_dimension = Dimensions::scent_dimension(config);
+        for (unsigned int i = 0; i < scent_dimension; i++)
+            current_scent[i] = static_scent[i];
+        for (const pair<unsigned int, unsigned int>& entry : transient_items) {
+            const item& item = neighborhood[entry.key]->items[entry.value];
+            compute_scent_contribution<Dimensions::scent_dimension_value>(scent_model, item, current_position, current_time, config, current_scent);
+        }
+
+        /* rotate the cached item vision into the direction of the agent */
+        const unsigned int vision_range = Dimensions::vision_range(config);
+        const unsigned int color_dimension = Dimensions::color_dimension(config);
+        const float* src = item_vision;
+        for (int64_t x = -(int64_t) vision_range; x <= (int64_t) vision_range; x++) {
+            for (int64_t y = -(int64_t) vision_range; y <= (int64_t) vision_range; y++) {
+                float* dst = current_vision + pixel_offset(position(x, y), vision_range, color_dimension);
+                for (unsigned int i = 0; i < color_dimension; i++)
+                    dst[i] = src[i];
+                src += color_dimension;
+            }
+        }
+
+        /* iterate over neighboring agents, and add their contributions to vision */
+        for (unsigned int i = 0; i < 4; i++) {
+            for (agent_state* agent : neighborhood[i]->data.agents) {
+                position relative_position = agent->current_position - current_position;
+                if ((unsigned int) abs(relative_position.x) <= vision_range
+                 && (unsigned int) abs(relative_position.y) <= vision_range) {
+                    add_color<Dimensions::color_dimension_value>(relative_position, vision_range,
+                            config.agent_color, color_dimension);
                 }
             }
         }
     }
 
+    template<typename T>
+    inline void update_state_incremental(
+            patch<patch_data>* neighborhood[4],
+            const position patch_positions[4],
+            const diffusion<T>& scent_model,
+            const simulator_config& config,
+            uint64_t current_time)
+    {
+        switch (select_dimensions(config)) {
+        case dimension_specialization::SCENT3_COLOR3_VISION5_PATCH32:
+            update_state_incremental<scent3_color3_vision5_patch32>(neighborhood, patch_positions, scent_model, config, current_time); return;
+        case dimension_specialization::SCENT3_COLOR3_VISION10_PATCH32:
+            update_state_incremental<scent3_color3_vision10_patch32>(neighborhood, patch_positions, scent_model, config, current_time); return;
+        case dimension_specialization::GENERIC:
+            break;
+        }
+        update_state_incremental<generic_dimensions>(neighborhood, patch_positions, scent_model, config, current_time);
+    }
+
     /** Frees all allocated memory associated with this agent state. */
     inline static void free(agent_state& agent) {
-        core::free(agent.current_scent);
-        core::free(agent.current_vision);
-        core::free(agent.collected_items);
+        if (agent.owns_buffers) {
+            core::free(agent.current_scent);
+            core::free(agent.current_vision);
+            core::free(agent.collected_items);
+        }
+        core::free(agent.static_scent);
+        core::free(agent.item_vision);
+        core::free(agent.transient_items);
         agent.lock.~mutex();
     }
+
+private:
+    template<typename T>
+    inline bool rebuild_observation_cache(
+            patch<patch_data>* neighborhood[4],
+            const position patch_positions[4],
+            const diffusion<T>& scent_model,
+            const simulator_config& config,
+            uint64_t current_time)
+    {
+        const unsigned int vision_width = 2*config.vision_range + 1;
+        for (unsigned int i = 0; i < config.scent_dimension; i++)
+            static_scent[i] = 0.0f;
+        for (unsigned int i = 0; i < vision_width * vision_width * config.color_dimension; i++)
+            item_vision[i] = 0.0f;
+        transient_items.clear();
+
+        for (unsigned int i = 0; i < 4; i++) {
+            for (unsigned int j = 0; j < neighborhood[i]->items.length; j++) {
+                const item& item = neighborhood[i]->items[j];
+
+                if (has_constant_scent(item, current_time, config)) {
+                    compute_scent_contribution(scent_model, item, current_position, current_time, config, static_scent);
+                } else if (!transient_items.add(make_pair(i, j))) {
+                    observation_cache_valid = false;
+                    return false;
+                }
+
+                /* if the item is in the visual field, add its color to the appropriate pixel */
+                position relative_position = item.location - current_position;
+                if (item.deletion_time == 0
+                 && (unsigned int) abs(relative_position.x) <= config.vision_range
+                 && (unsigned int) abs(relative_position.y) <= config.vision_range) {
+                    unsigned int x = (unsigned int) (relative_position.x + config.vision_range);
+                    unsigned int y = (unsigned int) (relative_position.y + config.vision_range);
+                    float* pixel = item_vision + (x*vision_width + y) * config.color_dimension;
+                    const float* color = config.item_types[item.item_type].color;
+                    for (unsigned int k = 0; k < config.color_dimension; k++)
+                        pixel[k] += color[k];
+                }
+            }
+        }
+
+        cached_position = current_position;
+        for (unsigned int i = 0; i < 4; i++) {
+            cached_patch_positions[i] = patch_positions[i];
+            cached_patch_versions[i] = neighborhood[i]->version;
+        }
+        observation_cache_valid = true;
+        return true;
+    }
 };
 
+/**
+ * Allocates the buffers used by `agent_state::update_state_incremental`, and
+ * marks the cache as invalid.
+ */
+inline bool init_observation_cache(agent_state& agent, const simulator_config& config)
+{
+    agent.static_scent = (float*) malloc(sizeof(float) * config.scent_dimension);
+    if (agent.static_scent == NULL) {
+        fprintf(stderr, "init_observation_cache ERROR: Insufficient memory for agent_state.static_scent.\n");
+        return false;
+    }
+    agent.item_vision = (float*) malloc(sizeof(float)
+        * (2*config.vision_range + 1) * (2*config.vision_range + 1) * config.color_dimension);
+    if (agent.item_vision == NULL) {
+        fprintf(stderr, "init_observation_cache ERROR: Insufficient memory for agent_state.item_vision.\n");
+        free(agent.static_scent); return false;
+    } else if (!array_init(agent.transient_items, 16)) {
+        fprintf(stderr, "init_observation_cache ERROR: Insufficient memory for agent_state.transient_items.\n");
+        free(agent.static_scent); free(agent.item_vision); return false;
+    }
+    agent.observation_cache_valid = false;
+    return true;
+}
+
+/**
+ * Sets the scent, vision, and collected item buffers of the given `agent`.
+ * If the given buffers are NULL, new buffers are allocated and owned by the
+ * agent. Otherwise, the agent uses the given buffers, which must remain valid
+ * for the lifetime of the agent. The collected items are initialized to zero.
+ */
+inline bool init_observation_buffers(agent_state& agent,
+        const simulator_config& config, float* scent_buffer,
+        float* vision_buffer, unsigned int* items_buffer)
+{
+    if (scent_buffer != NULL) {
+        agent.current_scent = scent_buffer;
+        agent.current_vision = vision_buffer;
+        agent.collected_items = items_buffer;
+        agent.owns_buffers = false;
+        memset(agent.collected_items, 0, sizeof(unsigned int) * config.item_types.length);
+        return true;
+    }
+
+    agent.current_scent = (float*) malloc(sizeof(float) * config.scent_dimension);
+    if (agent.current_scent == NULL) {
+        fprintf(stderr, "init_observation_buffers ERROR: Insufficient memory for agent_state.current_scent.\n");
+        return false;
+    }
+    agent.current_vision = (float*) malloc(sizeof(float)
+        * (2*config.vision_range + 1) * (2*config.vision_range + 1) * config.color_dimension);
+    if (agent.current_vision == NULL) {
+        fprintf(stderr, "init_observation_buffers ERROR: Insufficient memory for agent_state.current_vision.\n");
+        free(agent.current_scent); return false;
+    }
+    agent.collected_items = (unsigned int*) calloc(config.item_types.length, sizeof(unsigned int));
+    if (agent.collected_items == NULL) {
+        fprintf(stderr, "init_observation_buffers ERROR: Insufficient memory for agent_state.collected_items.\n");
+        free(agent.current_scent); free(agent.current_vision); return false;
+    }
+    agent.owns_buffers = true;
+    return true;
+}
+
+/**
+ * Frees the buffers set by `init_observation_buffers`, if they are owned by
+ * the agent.
+ */
+inline void free_observation_buffers(agent_state& agent) {
+    if (!agent.owns_buffers) return;
+    free(agent.current_scent);
+    free(agent.current_vision);
+    free(agent.collected_items);
+}
+
 /**
  * Initializes an agent's state in the provided world.
  *
@@ -758,6 +1273,11 @@ struct agent_state {
  * \param   scent_model     The scent diffusion model.
  * \param   config          The configuration for this simulation.
  * \param   current_time    The current simulation time.
+ * \param   scent_buffer    If not NULL, the agent stores its scent, vision,
+ *                          and collected items in the given buffers (see
+ *                          `init_observation_buffers`).
+ * \param   initial_position    The position at which the agent is placed.
+ * \param   initial_direction   The direction the agent initially faces.
  *
  * \tparam  T               The arithmetic type for the scent diffusion model.
  */
@@ -767,27 +1287,22 @@ inline bool init(
         map<patch_data, item_properties>& world,
         const diffusion<T>& scent_model,
         const simulator_config& config,
-        uint64_t& current_time)
+        uint64_t& current_time,
+        float* scent_buffer = NULL,
+        float* vision_buffer = NULL,
+        unsigned int* items_buffer = NULL,
+        position initial_position = position(0, 0),
+        direction initial_direction = direction::UP)
 {
-    agent.current_position = {0, 0};
-    agent.current_direction = direction::UP;
-    agent.requested_position = {0, 0};
-    agent.requested_direction = direction::UP;
-    agent.current_scent = (float*) malloc(sizeof(float) * config.scent_dimension);
-    if (agent.current_scent == NULL) {
-        fprintf(stderr, "init ERROR: Insufficient memory for agent_state.current_scent.\n");
+    agent.current_position = initial_position;
+    agent.current_direction = initial_direction;
+    agent.requested_position = initial_position;
+    agent.requested_direction = initial_direction;
+    if (!init_observation_buffers(agent, config, scent_buffer, vision_buffer, items_buffer)) {
+        return false;
+    } else if (!init_observation_cache(agent, config)) {
+        free_observation_buffers(agent);
         return false;
-    }
-    agent.current_vision = (float*) malloc(sizeof(float)
-        * (2*config.vision_range + 1) * (2*config.vision_range + 1) * config.color_dimension);
-    if (agent.current_vision == NULL) {
-        fprintf(stderr, "init ERROR: Insufficient memory for agent_state.current_vision.\n");
-        free(agent.current_scent); return false;
-    }
-    agent.collected_items = (unsigned int*) calloc(config.item_types.length, sizeof(unsigned int));
-    if (agent.collected_items == NULL) {
-        fprintf(stderr, "init ERROR: Insufficient memory for agent_state.collected_items.\n");
-        free(agent.current_scent); free(agent.current_vision); return false;
     }
 
     agent.agent_acted = false;
@@ -795,6 +1310,12 @@ inline bool init(
 
     patch<patch_data>* neighborhood[4]; position patch_positions[4];
     unsigned int index = world.get_fixed_neighborhood(agent.current_position, neighborhood, patch_positions);
+    if (index == UINT_MAX) {
+        free_observation_buffers(agent); free(agent.static_scent);
+        free(agent.item_vision); free(agent.transient_items);
+        agent.lock.~mutex();
+        return false;
+    }
     neighborhood[index]->data.patch_lock.lock();
     if (config.collision_policy != movement_conflict_policy::NO_COLLISIONS) {
         for (const agent_state* neighbor : neighborhood[index]->data.agents) {
@@ -804,8 +1325,9 @@ inline bool init(
                 FILE* out = stderr;
                 core::print("init ERROR: An agent already occupies position ", out);
                 print(agent.current_position, out); core::print(".\n", out);
-                free(agent.current_scent); free(agent.current_vision);
-                free(agent.collected_items); agent.lock.~mutex();
+                free_observation_buffers(agent); free(agent.static_scent);
+                free(agent.item_vision); free(agent.transient_items);
+                agent.lock.~mutex();
                 neighborhood[index]->data.patch_lock.unlock();
                 return false;
             }
@@ -823,7 +1345,8 @@ inline bool init(
             if (neighbor == &agent) continue;
 
             patch<patch_data>* other_neighborhood[4];
-            world.get_fixed_neighborhood(neighbor->current_position, other_neighborhood, patch_positions);
+            if (world.get_fixed_neighborhood(neighbor->current_position, other_neighborhood, patch_positions) == UINT_MAX)
+                continue;
             neighbor->update_state(other_neighborhood, scent_model, config, current_time);
         }
     }
@@ -831,26 +1354,20 @@ inline bool init(
 }
 
 /**
- * Reads the given agent_state `agent` from the input stream `in`. 
+ * Reads the given agent_state `agent` from the input stream `in`. If
+ * `scent_buffer` is not NULL, the agent stores its scent, vision, and
+ * collected items in the given buffers (see `init_observation_buffers`).
  */
 template<typename Stream>
-inline bool read(agent_state& agent, Stream& in, const simulator_config& config)
+inline bool read(agent_state& agent, Stream& in, const simulator_config& config,
+        float* scent_buffer = NULL, float* vision_buffer = NULL,
+        unsigned int* items_buffer = NULL)
 {
-    agent.current_scent = (float*) malloc(sizeof(float) * config.scent_dimension);
-    if (agent.current_scent == NULL) {
-        fprintf(stderr, "read ERROR: Insufficient memory for agent_state.current_scent.\n");
+    if (!init_observation_buffers(agent, config, scent_buffer, vision_buffer, items_buffer)) {
+        return false;
+    } else if (!init_observation_cache(agent, config)) {
+        free_observation_buffers(agent);
         return false;
-    }
-    agent.current_vision = (float*) malloc(sizeof(float)
-        * (2*config.vision_range + 1) * (2*config.vision_range + 1) * config.color_dimension);
-    if (agent.current_vision == NULL) {
-        fprintf(stderr, "read ERROR: Insufficient memory for agent_state.current_vision.\n");
-        free(agent.current_scent); return false;
-    }
-    agent.collected_items = (unsigned int*) malloc(sizeof(unsigned int) * config.item_types.length);
-    if (agent.collected_items == NULL) {
-        fprintf(stderr, "read ERROR: Insufficient memory for agent_state.collected_items.\n");
-        free(agent.current_scent); free(agent.current_vision); return false;
     }
     new (&agent.lock) std::mutex();
 
@@ -862,8 +1379,9 @@ inline bool read(agent_state& agent, Stream& in, const simulator_config& config)
      || !read(agent.requested_position, in)
      || !read(agent.requested_direction, in)
      || !read(agent.collected_items, in, (unsigned int) config.item_types.length)) {
-         free(agent.current_scent); free(agent.current_vision);
-         free(agent.collected_items); return false;
+         free_observation_buffers(agent); free(agent.static_scent);
+         free(agent.item_vision); free(agent.transient_items);
+         return false;
      }
      return true;
 }
@@ -885,71 +1403,367 @@ inline bool write(const agent_state& agent, Stream& out, const simulator_config&
 }
 
 /**
- * This structure contains full information about a patch. This is more than we
- * need for simulation, but it is useful for visualization.
+ * A reference-counted allocation, which is freed when its last reference is
+ * released. This allows code other than the owner of the memory (e.g. NumPy
+ * arrays that view it) to keep it readable after the owner has moved on to a
+ * new allocation or has been freed.
  */
-struct patch_state {
-    position patch_position;
-    bool fixed;
-    float* scent;
-    float* vision;
-    item* items;
-    unsigned int item_count;
-    position* agent_positions;
-    direction* agent_directions;
-    unsigned int agent_count;
+struct alignas(16) shared_block {
+    std::atomic<unsigned int> references;
 
-    static inline void move(const patch_state& src, patch_state& dst) {
-        core::move(src.patch_position, dst.patch_position);
-        core::move(src.fixed, dst.fixed);
-        core::move(src.scent, dst.scent);
-        core::move(src.vision, dst.vision);
-        core::move(src.items, dst.items);
+    /* the data of the block immediately follows this header */
+    inline void* data() { return this + 1; }
+};
+
+/**
+ * Allocates a shared_block with `size` bytes of data, holding one reference.
+ *
+ * \returns The new block, or `NULL` if out of memory.
+ */
+inline shared_block* allocate_shared_block(size_t size) {
+    shared_block* block = (shared_block*) malloc(sizeof(shared_block) + size);
+    if (block == NULL) return NULL;
+    new (&block->references) std::atomic<unsigned int>(1);
+    return block;
+}
+
+inline void retain(shared_block* block) {
+    block->references.fetch_add(1, std::memory_order_relaxed);
+}
+
+/* releases a reference to the given `block`, freeing it if it was the last one */
+inline void release(shared_block* block) {
+    if (block->references.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        block->references.~atomic();
+        core::free(block);
+    }
+}
+
+/**
+ * Contiguous structure-of-arrays storage for the observations of the agents
+ * in a simulator. Row `i` of `scent`, `vision`, and `items` holds the scent,
+ * vision, and collected items of the agent with ID `i`, and the three arrays
+ * share one allocation, so the observations of all agents can be exposed to
+ * other code (e.g. NumPy) without copying.
+ *
+ * When the buffers grow, the rows are copied into a larger allocation, the
+ * buffer pointers of every agent are updated, and the reference of these
+ * buffers to the previous allocation `block` is released. Pointers obtained
+ * before the growth are therefore invalidated, unless the caller retained
+ * `block` (see `retain`), in which case they remain readable until released
+ * but no longer receive updates.
+ */
+struct agent_observation_buffers {
+    float* scent;
+    float* vision;
+    unsigned int* items;
+
+    /* the number of elements in each row of `scent`, `vision`, and `items` */
+    unsigned int scent_size;
+    unsigned int vision_size;
+    unsigned int item_count;
+
+    /* the number of rows */
+    size_t capacity;
+
+    /* the allocation containing `scent`, `vision`, and `items` */
+    shared_block* block;
+
+    agent_observation_buffers(const simulator_config& config, size_t initial_capacity) {
+        if (!init_helper(config, initial_capacity))
+            exit(EXIT_FAILURE);
+    }
+
+    ~agent_observation_buffers() { free_helper(); }
+
+    inline float* scent_row(size_t index) const { return scent + index * scent_size; }
+    inline float* vision_row(size_t index) const { return vision + index * vision_size; }
+    inline unsigned int* items_row(size_t index) const { return items + index * item_count; }
+
+    /**
+     * Ensures there are at least `new_capacity` rows. If the buffers are
+     * reallocated, the buffers of the agents in `agents`, which must own
+     * rows `0, ..., agents.length - 1` in order, are updated, and the
+     * previous allocation is released.
+     */
+    bool ensure_capacity(size_t new_capacity, const array<agent_state*>& agents)
+    {
+        if (new_capacity <= capacity) return true;
+        size_t old_capacity = capacity;
+        shared_block* old_block = block;
+        float* old_scent = scent;
+        float* old_vision = vision;
+        unsigned int* old_items = items;
+
+        size_t next_capacity = max((size_t) 1, capacity);
+        while (next_capacity < new_capacity)
+            next_capacity *= 2;
+        if (!allocate(next_capacity))
+            return false;
+
+        memcpy(scent, old_scent, sizeof(float) * scent_size * old_capacity);
+        memcpy(vision, old_vision, sizeof(float) * vision_size * old_capacity);
+        memcpy(items, old_items, sizeof(unsigned int) * item_count * old_capacity);
+        release(old_block);
+
+        for (size_t i = 0; i < agents.length; i++) {
+            agents[i]->current_scent = scent_row(i);
+            agents[i]->current_vision = vision_row(i);
+            agents[i]->collected_items = items_row(i);
+        }
+        return true;
+    }
+
+    static inline void free(agent_observation_buffers& buffers) {
+        buffers.free_helper();
+    }
+
+private:
+    /* all three arrays contain 4-byte elements, so they can be packed back to back */
+    inline bool allocate(size_t new_capacity) {
+        shared_block* new_block = allocate_shared_block(max((size_t) 1,
+                (sizeof(float) * (scent_size + vision_size) + sizeof(unsigned int) * item_count) * new_capacity));
+        if (new_block == NULL) {
+            fprintf(stderr, "agent_observation_buffers.allocate ERROR: Insufficient memory for observations.\n");
+            return false;
+        }
+        block = new_block;
+        scent = (float*) block->data();
+        vision = scent + scent_size * new_capacity;
+        items = (unsigned int*) (vision + vision_size * new_capacity);
+        capacity = new_capacity;
+        return true;
+    }
+
+    inline bool init_helper(const simulator_config& config, size_t initial_capacity) {
+        scent_size = config.scent_dimension;
+        vision_size = (2*config.vision_range + 1) * (2*config.vision_range + 1) * config.color_dimension;
+        item_count = (unsigned int) config.item_types.length;
+        return allocate(initial_capacity);
+    }
+
+    inline void free_helper() {
+        release(block);
+    }
+
+    friend bool init(agent_observation_buffers&, const simulator_config&, size_t);
+};
+
+/**
+ * Initializes the given agent_observation_buffers `buffers` with
+ * `initial_capacity` rows for agents with the given simulator_config `config`.
+ */
+inline bool init(agent_observation_buffers& buffers,
+        const simulator_config& config, size_t initial_capacity)
+{
+    return buffers.init_helper(config, initial_capacity);
+}
+
+/**
+ * The actions submitted by the agents for the next time step, indexed by
+ * agent ID, used when the simulator is advanced by its own thread (see
+ * `simulator::start_stepper`). Submitting an action takes no lock: the slot
+ * of the agent is claimed with a single compare-and-swap, and the number of
+ * agents that have acted is an atomic counter. The slots are stored in
+ * fixed-size pages, and the page table is allocated once, so adding agents
+ * never moves a slot that another thread may be writing.
+ */
+struct action_buffer
+{
+    static constexpr unsigned int PAGE_SIZE = 1024;
+    static constexpr unsigned int MAX_PAGE_COUNT = 4096;
+
+    /* an action is encoded as (kind << 40) | (direction << 32) | num_steps */
+    static constexpr uint64_t EMPTY = 0;
+    static constexpr uint64_t MOVE = 1;
+    static constexpr uint64_t TURN = 2;
+
+    std::atomic<uint64_t>** pages;
+    unsigned int page_count;
+
+    /* the number of agents that submit actions for each time step */
+    std::atomic<size_t> agent_count;
+
+    /* the number of actions that have been submitted and not yet taken */
+    std::atomic<size_t> arrived_count;
+
+    action_buffer() : agent_count(0), arrived_count(0) {
+        if (!init_helper())
+            exit(EXIT_FAILURE);
+    }
+
+    ~action_buffer() { free_helper(); }
+
+    static inline uint64_t encode_move(direction dir, unsigned int num_steps) {
+        return (MOVE << 40) | ((uint64_t) dir << 32) | num_steps;
+    }
+
+    static inline uint64_t encode_turn(direction dir) {
+        return (TURN << 40) | ((uint64_t) dir << 32);
+    }
+
+    static inline uint64_t kind(uint64_t action) { return action >> 40; }
+    static inline direction dir(uint64_t action) { return (direction) ((action >> 32) & 0xFF); }
+    static inline unsigned int num_steps(uint64_t action) { return (unsigned int) action; }
+
+    inline std::atomic<uint64_t>& slot(uint64_t agent_id) const {
+        return pages[agent_id / PAGE_SIZE][agent_id % PAGE_SIZE];
+    }
+
+    /**
+     * Records `action` for the agent with the given ID, which must be less
+     * than `agent_count`. This is safe to call concurrently with any other
+     * function of this buffer except `free`.
+     *
+     * \returns `true` if successful; `false` if the agent has already
+     *          submitted an action that has not yet been taken.
+     */
+    inline bool submit(uint64_t agent_id, uint64_t action) {
+        uint64_t expected = EMPTY;
+        if (!slot(agent_id).compare_exchange_strong(expected, action, std::memory_order_release))
+            return false;
+        arrived_count.fetch_add(1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * Returns `true` if every agent has submitted an action.
+     */
+    inline bool all_arrived() const {
+        size_t count = agent_count.load(std::memory_order_acquire);
+        return count > 0 && arrived_count.load(std::memory_order_acquire) >= count;
+    }
+
+    /**
+     * Removes and returns the action of the agent with the given ID, or
+     * `EMPTY` if there is none. Only one thread may take actions at a time.
+     */
+    inline uint64_t take(uint64_t agent_id) {
+        uint64_t action = slot(agent_id).exchange(EMPTY, std::memory_order_acquire);
+        if (action != EMPTY)
+            arrived_count.fetch_sub(1, std::memory_order_release);
+        return action;
+    }
+
+    /**
+     * Ensures there are slots for `new_agent_count` agents. Calls to this
+     * function must be serialized with each other, but not with `submit`.
+     */
+    bool ensure_capacity(size_t new_agent_count)
+    {
+        while ((size_t) page_count * PAGE_SIZE < new_agent_count) {
+            if (page_count == MAX_PAGE_COUNT) {
+                fprintf(stderr, "action_buffer.ensure_capacity ERROR: Too many agents.\n");
+                return false;
+            }
+            std::atomic<uint64_t>* page = (std::atomic<uint64_t>*) malloc(sizeof(std::atomic<uint64_t>) * PAGE_SIZE);
+            if (page == NULL) {
+                fprintf(stderr, "action_buffer.ensure_capacity ERROR: Insufficient memory for page.\n");
+                return false;
+            }
+            for (unsigned int i = 0; i < PAGE_SIZE; i++)
+                new (page + i) std::atomic<uint64_t>(EMPTY);
+            pages[page_count++] = page;
+        }
+        return true;
+    }
+
+    static inline void free(action_buffer& buffer) {
+        buffer.free_helper();
+        buffer.agent_count.~atomic();
+        buffer.arrived_count.~atomic();
+    }
+
+private:
+    inline bool init_helper() {
+        page_count = 0;
+        pages = (std::atomic<uint64_t>**) calloc(MAX_PAGE_COUNT, sizeof(std::atomic<uint64_t>*));
+        if (pages == NULL) {
+            fprintf(stderr, "action_buffer.init_helper ERROR: Insufficient memory for page table.\n");
+            return false;
+        }
+        return true;
+    }
+
+    inline void free_helper() {
+        for (unsigned int i = 0; i < page_count; i++)
+            core::free(pages[i]);
+        core::free(pages);
+    }
+
+    friend bool init(action_buffer&);
+};
+
+/**
+ * Initializes the given action_buffer `buffer` with no agents.
+ */
+inline bool init(action_buffer& buffer) {
+    new (&buffer.agent_count) std::atomic<size_t>(0);
+    new (&buffer.arrived_count) std::atomic<size_t>(0);
+    return buffer.init_helper();
+}
+
+/**
+ * This structure contains full information about a patch. This is more than we
+ * need for simulation, but it is useful for visualization.
+ */
+struct patch_state {
+    position patch_position;
+    bool fixed;
+    float* scent;
+    float* vision;
+    item* items;
+    unsigned int item_count;
+    position* agent_positions;
+    direction* agent_directions;
+    unsigned int agent_count;
+
+    /* the number of items and agents for which the arrays above have room */
+    unsigned int item_capacity;
+    unsigned int agent_capacity;
+
+    static inline void move(const patch_state& src, patch_state& dst) {
+        core::move(src.patch_position, dst.patch_position);
+        core::move(src.fixed, dst.fixed);
+        core::move(src.scent, dst.scent);
+        core::move(src.vision, dst.vision);
+        core::move(src.items, dst.items);
         core::move(src.item_count, dst.item_count);
         core::move(src.agent_positions, dst.agent_positions);
         core::move(src.agent_directions, dst.agent_directions);
         core::move(src.agent_count, dst.agent_count);
+        core::move(src.item_capacity, dst.item_capacity);
+        core::move(src.agent_capacity, dst.agent_capacity);
     }
 
+    /* NOTE: all arrays share a single allocation, which begins at `items` */
     static inline void free(patch_state& patch) {
-        core::free(patch.scent);
-        core::free(patch.vision);
         core::free(patch.items);
-        core::free(patch.agent_positions);
-        core::free(patch.agent_directions);
     }
 
     inline bool init_helper(unsigned int n,
             unsigned int scent_dimension, unsigned int color_dimension,
             unsigned int item_count, unsigned int agent_count)
     {
-        scent = (float*) calloc(n * n * scent_dimension, sizeof(float));
-        if (scent == NULL) {
-            fprintf(stderr, "patch_state.init_helper ERROR: Insufficient memory for scent.\n");
+        /* the arrays are laid out in order of decreasing alignment */
+        size_t scent_offset = sizeof(item) * item_count + sizeof(position) * agent_count;
+        size_t vision_offset = scent_offset + sizeof(float) * n * n * scent_dimension;
+        size_t directions_offset = vision_offset + sizeof(float) * n * n * color_dimension;
+        size_t total_size = directions_offset + sizeof(direction) * agent_count;
+
+        char* block = (char*) malloc(max((size_t) 1, total_size));
+        if (block == NULL) {
+            fprintf(stderr, "patch_state.init_helper ERROR: Insufficient memory for patch state.\n");
             return false;
         }
-        vision = (float*) calloc(n * n * color_dimension, sizeof(float));
-        if (vision == NULL) {
-            fprintf(stderr, "patch_state.init_helper ERROR: Insufficient memory for vision.\n");
-            core::free(scent); return false;
-        }
-        items = (item*) malloc(sizeof(item) * item_count);
-        if (items == NULL) {
-            fprintf(stderr, "patch_state.init_helper ERROR: Insufficient memory for items.\n");
-            core::free(scent); core::free(vision); return false;
-        }
-        agent_positions = (position*) malloc(sizeof(position) * agent_count);
-        if (agent_positions == NULL) {
-            fprintf(stderr, "patch_state.init_helper ERROR: Insufficient memory for agent_positions.\n");
-            core::free(scent); core::free(vision);
-            core::free(items); return false;
-        }
-        agent_directions = (direction*) malloc(sizeof(direction) * agent_count);
-        if (agent_directions == NULL) {
-            fprintf(stderr, "patch_state.init_helper ERROR: Insufficient memory for agent_directions.\n");
-            core::free(scent); core::free(vision);
-            core::free(items); return false;
-        }
+        items = (item*) block;
+        agent_positions = (position*) (block + sizeof(item) * item_count);
+        scent = (float*) (block + scent_offset);
+        vision = (float*) (block + vision_offset);
+        agent_directions = (direction*) (block + directions_offset);
+        memset(scent, 0, directions_offset - scent_offset);
+        item_capacity = item_count;
+        agent_capacity = agent_count;
         return true;
     }
 };
@@ -999,6 +1813,80 @@ bool write(const patch_state& patch, Stream& out, const simulator_config& config
         && write(patch.agent_directions, out, patch.agent_count);
 }
 
+/**
+ * The scent and vision of a patch as last computed by `simulator::get_map`,
+ * which reuses them until the items in the 3x3 neighborhood of the patch
+ * change or time advances. As in the observation cache of `agent_state`,
+ * `static_scent` contains the scent of the items whose scent does not change
+ * with time, and the remaining items are listed in `transient_items` as pairs
+ * of indices into the neighborhood and into the items of that patch.
+ * `item_vision` is the vision of the items in the patch, and `scent` is the
+ * full scent at `computed_time`. The cache is valid as long as the patches in
+ * the neighborhood have the versions `neighbor_versions` (where `UINT64_MAX`
+ * indicates that the neighbor does not exist). `modified_time` is the last
+ * time at which the scent, vision, or agents of the patch were seen to change.
+ */
+struct map_patch_cache {
+    float* scent;
+    float* static_scent;
+    float* item_vision;
+    array<pair<unsigned int, unsigned int>> transient_items;
+    uint64_t neighbor_versions[9];
+    uint64_t computed_time;
+    uint64_t modified_time;
+    bool valid;
+
+    /* the agents in the patch when the cache was last refreshed */
+    array<position> agent_positions;
+    array<direction> agent_directions;
+
+    static inline void move(const map_patch_cache& src, map_patch_cache& dst) {
+        dst.scent = src.scent;
+        dst.static_scent = src.static_scent;
+        dst.item_vision = src.item_vision;
+        core::move(src.transient_items, dst.transient_items);
+        for (unsigned int i = 0; i < 9; i++)
+            dst.neighbor_versions[i] = src.neighbor_versions[i];
+        dst.computed_time = src.computed_time;
+        dst.modified_time = src.modified_time;
+        dst.valid = src.valid;
+        core::move(src.agent_positions, dst.agent_positions);
+        core::move(src.agent_directions, dst.agent_directions);
+    }
+
+    /* NOTE: the scent and vision arrays share a single allocation, which begins at `scent` */
+    static inline void free(map_patch_cache& cache) {
+        core::free(cache.scent);
+        core::free(cache.transient_items);
+        core::free(cache.agent_positions);
+        core::free(cache.agent_directions);
+    }
+};
+
+inline bool init(map_patch_cache& cache, const simulator_config& config)
+{
+    size_t scent_size = (size_t) config.patch_size * config.patch_size * config.scent_dimension;
+    size_t vision_size = (size_t) config.patch_size * config.patch_size * config.color_dimension;
+    cache.scent = (float*) malloc(sizeof(float) * max((size_t) 1, 2 * scent_size + vision_size));
+    if (cache.scent == NULL) {
+        fprintf(stderr, "init ERROR: Insufficient memory for map_patch_cache.\n");
+        return false;
+    } else if (!array_init(cache.transient_items, 8)) {
+        core::free(cache.scent); return false;
+    } else if (!array_init(cache.agent_positions, 4)) {
+        core::free(cache.scent); core::free(cache.transient_items); return false;
+    } else if (!array_init(cache.agent_directions, 4)) {
+        core::free(cache.scent); core::free(cache.transient_items);
+        core::free(cache.agent_positions); return false;
+    }
+    cache.static_scent = cache.scent + scent_size;
+    cache.item_vision = cache.static_scent + scent_size;
+    cache.computed_time = 0;
+    cache.modified_time = 0;
+    cache.valid = false;
+    return true;
+}
+
 /**
  * Simulator that forms the core of our experimentation framework.
  *
@@ -1018,16 +1906,26 @@ class simulator {
     /* Agents managed by this simulator. */
     array<agent_state*> agents;
 
+    /* Storage for the agent_state structures, which are never moved. */
+    block_pool agent_pool;
+
+    /* The scent, vision, and collected items of every agent, indexed by agent ID. */
+    agent_observation_buffers observations;
+
     /* Lock for the agents array and their state (not including their requested
        actions), used to prevent simultaneous updates. */
     std::mutex agent_states_lock;
 
-    /* A map from positions to a list of agents that request to move there. */
-    hash_map<position, array<agent_state*>> requested_moves;
+    /* The moves requested by the agents in the current time step, in the
+       order of the requests until they are resolved by `resolve_moves`. */
+    array<move_request> requested_moves;
 
-    /* Lock for the requested_moves map, used to prevent simultaneous updates. */
+    /* Lock for the requested_moves array, used to prevent simultaneous updates. */
     std::mutex requested_move_lock;
 
+    /* The stack of cells kept by agents that cannot move, used by `resolve_moves`. */
+    array<position> kept_positions;
+
     /** 
      * Counter for how many agents have acted during each time step. This
      * counter is used to force the simulator to wait until all agents have
@@ -1038,8 +1936,43 @@ class simulator {
     /* For storing additional state in the simulation. */
     SimulatorData data;
 
+    /* Worker threads used to compute agent observations and to sample new patches. */
+    thread_pool workers;
+
+    /* The neighborhoods of each agent (and their positions), which are resolved before computing observations. */
+    array<patch<patch_data>*> agent_neighborhoods;
+    array<position> agent_neighborhood_positions;
+
+    /* The cached scent and vision of the patches retrieved by `get_map`, protected by `agent_states_lock`. */
+    hash_map<position, map_patch_cache> map_cache;
+
+    /* The patches containing deleted items, ordered by when the items expire (see `remove_expired_items`). */
+    expiry_queue expiring_items;
+
+    /* Background thread that fixes patches ahead of the agents (see `start_generator`). */
+    std::thread generator;
+    std::mutex generator_lock;
+    std::condition_variable generator_cv;
+    unsigned int generator_lookahead;
+    std::atomic_bool generator_running;
+    bool generator_pending;
+
+    /* Background thread that advances the simulation when all agents have
+       submitted an action to `submitted_actions` (see `start_stepper`). */
+    action_buffer submitted_actions;
+    std::thread stepper;
+    std::mutex stepper_lock;
+    std::condition_variable stepper_cv;
+    std::atomic_bool stepper_running;
+
+    /* Records the history of the simulation if not NULL (see `start_recording`), protected by `agent_states_lock`. */
+    trajectory_recorder* recorder;
+
     typedef patch<patch_data> patch_type;
 
+    /* the number of agent_state structures allocated at a time by `agent_pool` */
+    static constexpr unsigned int AGENT_POOL_CHUNK_SIZE = 64;
+
 public:
     /**
      * Constructs a new simulator with the given simulator_config `conf` and
@@ -1053,14 +1986,19 @@ public:
             config.gibbs_iterations,
             config.item_types.data,
             (unsigned int) config.item_types.length, seed),
-        agents(16), requested_moves(32, alloc_position_keys),
-        acted_agent_count(0), data(data), time(0)
+        agents(16), agent_pool(sizeof(agent_state), AGENT_POOL_CHUNK_SIZE),
+        observations(config, 16), requested_moves(32), kept_positions(32),
+        acted_agent_count(0), data(data), workers(config.thread_count),
+        agent_neighborhoods(64), agent_neighborhood_positions(64),
+        map_cache(64, alloc_position_keys), expiring_items(64), generator_lookahead(0), generator_running(false), generator_pending(false),
+        stepper_running(false), recorder(NULL), time(0)
     {
         if (!init(scent_model, (double) config.diffusion_param,
                 (double) config.decay_param, config.patch_size, config.deleted_item_lifetime)) {
             fprintf(stderr, "simulator ERROR: Unable to initialize scent_model.\n");
             exit(EXIT_FAILURE);
         }
+        world.set_thread_pool(&workers);
     }
 
     /**
@@ -1075,7 +2013,7 @@ public:
         simulator(conf, data, (uint_fast32_t) milliseconds()) { }
 #endif
 
-    ~simulator() { free_helper(); }
+    ~simulator() { join_stepper(); stop_generator(); stop_recording(); free_helper(); }
 
     /* Current simulation time step. */
     uint64_t time;
@@ -1086,99 +2024,457 @@ public:
      * \returns A pair containing the ID of the new agent and its state.
      */
     inline pair<uint64_t, agent_state*> add_agent() {
-        agent_states_lock.lock();
-        agents.ensure_capacity(agents.length + 1);
-        agent_state* new_agent = (agent_state*) malloc(sizeof(agent_state));
+        return add_agent(position(0, 0), direction::UP, NULL);
+    }
+
+    /**
+     * Adds a new agent to this simulator at `initial_position`, facing
+     * `initial_direction`, and with the items in `collected_items` (an array
+     * with an element for each item type, or NULL if the agent has no items).
+     * This is used to move agents between the shards of a world (see
+     * `shard.h`).
+     *
+     * \returns A pair containing the ID of the new agent and its state, or
+     *          `UINT64_MAX` and NULL if the agent could not be added (e.g.
+     *          if another agent occupies `initial_position`).
+     */
+    pair<uint64_t, agent_state*> add_agent(const position& initial_position,
+            direction initial_direction, const unsigned int* collected_items)
+    {
+        /* the agent is initialized while holding the lock, since this modifies the map */
+        std::unique_lock<std::mutex> lock(agent_states_lock);
+        if (!agents.ensure_capacity(agents.length + 1)
+         || !observations.ensure_capacity(agents.length + 1, agents)
+         || !submitted_actions.ensure_capacity(agents.length + 1))
+            return make_pair(UINT64_MAX, (agent_state*) NULL);
+        agent_state* new_agent = (agent_state*) agent_pool.allocate();
         uint64_t id = agents.length;
         if (new_agent == NULL) {
             fprintf(stderr, "simulator.add_agent ERROR: Insufficient memory for new agent.\n");
             return make_pair(UINT64_MAX, (agent_state*) NULL);
-        } else if (!agents.add(new_agent)) {
-            core::free(new_agent);
-            return make_pair(UINT64_MAX, (agent_state*) NULL);
-        }
-        agent_states_lock.unlock();
-
-        if (!init(*new_agent, world, scent_model, config, time)) {
-            agent_states_lock.lock();
-            agents.remove((size_t) id);
-            core::free(new_agent);
-            agent_states_lock.unlock();
+        } else if (!init(*new_agent, world, scent_model, config, time,
+                observations.scent_row(id), observations.vision_row(id), observations.items_row(id),
+                initial_position, initial_direction))
+        {
+            block_pool::release(new_agent);
             return make_pair(UINT64_MAX, (agent_state*) NULL);
         }
+        if (collected_items != NULL)
+            memcpy(new_agent->collected_items, collected_items, sizeof(unsigned int) * config.item_types.length);
+        agents.add(new_agent);
+        submitted_actions.agent_count = agents.length;
         return make_pair(id, new_agent);
     }
 
-    /** 
-     * Moves an agent.
-     *
-     * Note that the agent is only actually moved when the simulation time step 
-     * advances, and only if the agent has not already acted for the current 
-     * time step.
+    /**
+     * Removes the agent with ID `agent_id` from this simulator. The agent with
+     * the largest ID (if it is not the removed agent) takes the ID
+     * `agent_id`, along with its row in the observation buffers. Agents can
+     * only be removed between time steps, before any agent has acted.
      *
-     * \param   agent_id  ID of the agent to move.
-     * \param   dir       Direction along which to move, *relative* to the
-     *                    agent's current direction.
-     * \param   num_steps Number of steps to take in the specified direction.
-     * \returns `true` if the move was successful, and `false` otherwise.
+     * \returns `true` if successful; `false` if there is no such agent, or if
+     *          an agent has already acted in the current time step.
      */
-    inline bool move(uint64_t agent_id, direction dir, unsigned int num_steps)
+    bool remove_agent(uint64_t agent_id)
     {
-        if (num_steps > config.max_steps_per_movement
-         || !config.allowed_movement_directions[(size_t) dir])
+        std::unique_lock<std::mutex> lock(agent_states_lock);
+        if (agent_id >= agents.length) {
+            fprintf(stderr, "simulator.remove_agent ERROR: There is no agent with the given ID.\n");
+            return false;
+        } else if (acted_agent_count > 0 || submitted_actions.arrived_count > 0) {
+            fprintf(stderr, "simulator.remove_agent ERROR: Agents cannot be removed while they are acting.\n");
             return false;
-
-        agent_states_lock.lock();
-        agent_state& agent = *agents[(size_t) agent_id];
-        agent_states_lock.unlock();
-
-        agent.lock.lock();
-        if (agent.agent_acted) {
-            agent.lock.unlock(); return false;
         }
-        agent.agent_acted = true;
 
-        agent.requested_position = agent.current_position;
-        agent.requested_direction = agent.current_direction;
-        position diff(0, 0);
-        switch (dir) {
-        case direction::UP   : diff.x = 0; diff.y = num_steps; break;
-        case direction::DOWN : diff.x = 0; diff.y = -((int64_t) num_steps); break;
-        case direction::LEFT : diff.x = -((int64_t) num_steps); diff.y = 0; break;
-        case direction::RIGHT: diff.x = num_steps; diff.y = 0; break;
-        case direction::COUNT: break;
+        agent_state* agent = agents[(size_t) agent_id];
+        patch_type* neighborhood[4]; position patch_positions[4];
+        unsigned int index = world.get_fixed_neighborhood(agent->current_position, neighborhood, patch_positions);
+        if (index == UINT_MAX) return false;
+        array<agent_state*>& patch_agents = neighborhood[index]->data.agents;
+        patch_agents.remove(patch_agents.index_of(agent));
+
+        /* move the last agent into the row of the removed agent */
+        size_t last = agents.length - 1;
+        if (agent_id != last) {
+            agent_state* moved = agents[last];
+            memcpy(observations.scent_row(agent_id), moved->current_scent, sizeof(float) * observations.scent_size);
+            memcpy(observations.vision_row(agent_id), moved->current_vision, sizeof(float) * observations.vision_size);
+            memcpy(observations.items_row(agent_id), moved->collected_items, sizeof(unsigned int) * observations.item_count);
+            moved->current_scent = observations.scent_row(agent_id);
+            moved->current_vision = observations.vision_row(agent_id);
+            moved->collected_items = observations.items_row(agent_id);
+            agents[(size_t) agent_id] = moved;
         }
+        agents.length--;
+        submitted_actions.agent_count = agents.length;
+        core::free(*agent);
+        block_pool::release(agent);
 
-        switch (agent.current_direction) {
-        case direction::UP: break;
-        case direction::DOWN: diff.x *= -1; diff.y *= -1; break;
-        case direction::LEFT:
-            core::swap(diff.x, diff.y);
-            diff.x *= -1; break;
-        case direction::RIGHT:
-            core::swap(diff.x, diff.y);
-            diff.y *= -1; break;
-        case direction::COUNT: break;
+        /* update the scent and vision of nearby agents */
+        for (unsigned int i = 0; i < 4; i++) {
+            for (agent_state* neighbor : neighborhood[i]->data.agents) {
+                patch_type* other_neighborhood[4];
+                if (world.get_fixed_neighborhood(neighbor->current_position, other_neighborhood, patch_positions) == UINT_MAX)
+                    continue;
+                neighbor->update_state(other_neighborhood, scent_model, config, time);
+            }
         }
+        return true;
+    }
 
-        agent.requested_position += diff;
-        agent.lock.unlock();
-
-        /* add the agent's move to the list of requested moves */
-        request_position(agent);
-
-        agent_states_lock.lock();
-        if (++acted_agent_count == agents.length)
-            step(); /* advance the simulation by one time step */
-        agent_states_lock.unlock();
+    /**
+     * Advances the simulation by one time step if this simulator has no
+     * agents (otherwise, the simulation advances once every agent has
+     * acted). This keeps the time of a shard without agents in step with the
+     * other shards of the world (see `shard.h`).
+     *
+     * \returns `true` if the simulation advanced; `false` otherwise.
+     */
+    inline bool step_if_empty() {
+        std::unique_lock<std::mutex> lock(agent_states_lock);
+        if (agents.length > 0) return false;
+        step();
         return true;
     }
 
-    /** 
-     * Turns an agent.
+    /**
+     * Collects the item at `location` at the current time, if there is one
+     * that is not deleted, on behalf of an agent that is not in this
+     * simulator. This is used to apply the items collected by agents on
+     * another shard of the world, which modified their copies of the patches
+     * at the boundary (see `shard.h`).
      *
-     * Note that the agent is only actually turned when the simulation time
-     * step advances, and only if the agent has not already acted for the
+     * \returns `true` if an item was collected; `false` otherwise.
+     */
+    bool collect_item(const position& location) {
+        std::unique_lock<std::mutex> lock(agent_states_lock);
+        patch_type* neighborhood[4]; position patch_positions[4];
+        unsigned int index = world.get_fixed_neighborhood(location, neighborhood, patch_positions);
+        if (index == UINT_MAX) return false;
+        patch_type& patch = *neighborhood[index];
+        update_occupancy(patch);
+        if (!patch.is_live(location, config.patch_size)) return false;
+        mark_collected(patch, patch.items[patch.item_at(location, config.patch_size)], patch_positions[index]);
+        return true;
+    }
+
+    /**
+     * Fixes the patches at the `count` positions in `patch_positions`, and
+     * calls `process_patch(patch, patch_position)` for each of them while
+     * holding the lock on the map. `process_patch` returns `false` to stop.
+     *
+     * \returns `true` if `process_patch` returned `true` for every patch;
+     *          `false` otherwise.
+     */
+    template<typename ProcessPatch>
+    bool get_fixed_patches(const position* patch_positions, size_t count, ProcessPatch process_patch)
+    {
+        std::unique_lock<std::mutex> lock(agent_states_lock);
+        for (size_t i = 0; i < count; i++) {
+            if (!world.fix_patch(patch_positions[i])) return false;
+            const patch_type& patch = world.get_existing_patch(patch_positions[i]);
+            if (!process_patch(patch, patch_positions[i])) return false;
+        }
+        return true;
+    }
+
+    /**
+     * Replaces the patch at `patch_position` with a fixed patch that contains
+     * the `item_count` items in `items`, which were sampled elsewhere (e.g.
+     * by the shard of the world that owns the patch; see `shard.h`). The
+     * agents in the patch are not affected.
+     *
+     * \returns `true` if successful; `false` otherwise.
+     */
+    bool restore_patch(const position& patch_position, const item* items, unsigned int item_count)
+    {
+        std::unique_lock<std::mutex> lock(agent_states_lock);
+        if (!world.restore_patch(patch_position, items, item_count, true))
+            return false;
+
+        /* the deleted items may expire before the items already in the queue */
+        bool out_of_order = false;
+        for (unsigned int i = 0; i < item_count; i++) {
+            if (items[i].deletion_time == 0) continue;
+            uint64_t expiry_time = items[i].deletion_time + config.deleted_item_lifetime;
+            if (expiring_items.size() > 0 && expiry_time < expiring_items.entries.last().expiry_time)
+                out_of_order = true;
+            if (!expiring_items.push(expiry_time, patch_position)) return false;
+        }
+        if (out_of_order) expiring_items.sort_entries();
+        return true;
+    }
+
+    /**
+     * Generates and fixes every patch of the world that intersects the
+     * bounding box with the given corners (in world coordinates, inclusive),
+     * so that agents moving within this region never wait for the map
+     * generator.
+     *
+     * \returns `true` if successful; `false` if a patch could not be created
+     *          or loaded.
+     */
+    inline bool pregenerate(position bottom_left_corner, position top_right_corner) {
+        std::unique_lock<std::mutex> lock(agent_states_lock);
+        return world.pregenerate(bottom_left_corner, top_right_corner);
+    }
+
+    /**
+     * Limits the memory occupied by the patches of the world to approximately
+     * `bytes` (or removes the limit, if it is 0). After every step, the least
+     * recently used patches that are far from all agents are moved to an
+     * eviction file at `filepath` (or an anonymous temporary file, if it is
+     * NULL) until the world is within the budget. Evicted patches are loaded
+     * back into memory when they are accessed, and are included in snapshots
+     * and checkpoints. Items that expired before the patch is evicted are
+     * discarded.
+     *
+     * \returns `true` if successful; `false` otherwise.
+     */
+    inline bool set_memory_budget(size_t bytes, const char* filepath) {
+        std::unique_lock<std::mutex> lock(agent_states_lock);
+        return world.set_memory_budget(bytes, filepath);
+    }
+
+    /**
+     * Starts a background thread that, after every simulation step, fixes
+     * the patches that the agents could reach within the next
+     * `lookahead_steps` time steps. This moves most of the map generation out
+     * of `step`. The thread only modifies the map while holding the same lock
+     * as `step`, so the world is sampled from the same distribution as when
+     * it is generated lazily.
+     *
+     * **NOTE:** the world is not reproducible while the generator runs. The
+     *      patches are sampled from the random engine of the map, and each
+     *      patch is conditioned on the neighboring patches that are fixed
+     *      before it. Both depend on how far the generator gets between
+     *      steps, which depends on the scheduling of threads. So the same
+     *      seed may generate different worlds on different runs.
+     *
+     * \returns `true` if successful; `false` if the generator is already
+     *          running or the thread could not be created.
+     */
+    bool start_generator(unsigned int lookahead_steps) {
+        std::unique_lock<std::mutex> lock(generator_lock);
+        if (generator_running) {
+            fprintf(stderr, "simulator.start_generator ERROR: The generator is already running.\n");
+            return false;
+        }
+        generator_lookahead = lookahead_steps;
+        generator_pending = true;
+        generator_running = true;
+        try {
+            generator = std::thread(&simulator<SimulatorData>::run_generator, this);
+        } catch (...) {
+            fprintf(stderr, "simulator.start_generator ERROR: Unable to start generator thread.\n");
+            generator_running = false;
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * Stops the background thread started by `start_generator`, waiting for
+     * it to finish fixing its current patch. This function has no effect if
+     * the generator is not running.
+     */
+    void stop_generator() {
+        std::unique_lock<std::mutex> lock(generator_lock);
+        if (!generator_running) return;
+        generator_running = false;
+        generator_cv.notify_one();
+        lock.unlock();
+
+        if (generator.joinable()) {
+            try {
+                generator.join();
+            } catch (...) { }
+        }
+    }
+
+    /**
+     * Starts recording the history of the simulation to the trajectory file
+     * at `filepath`, which is overwritten if it exists (see
+     * `trajectory_header` for its format). After every step, the position,
+     * direction, action, and collected item counts of every agent are
+     * appended to the file, along with the items that were created or
+     * collected since the previous step. The file is divided into chunks of
+     * `chunk_steps` steps, which are written by a background thread, and
+     * whose columns are compressed if `compress` is `true` and the library
+     * was built with `NEL_USE_LZ4`.
+     *
+     * The live items of the patches that are already fixed, including those
+     * in the snapshot of the world (if any), are recorded as created at the
+     * current time. The items of the fixed patches that were evicted to disk
+     * (see `map::set_memory_budget`) are recorded as created once the patch
+     * is loaded back into memory, after the step in which it is loaded.
+     *
+     * \returns `true` if successful; `false` if the simulator is already
+     *          recording or the file could not be created.
+     */
+    bool start_recording(const char* filepath, unsigned int chunk_steps, bool compress) {
+        std::unique_lock<std::mutex> lock(agent_states_lock);
+        if (recorder != NULL) {
+            fprintf(stderr, "simulator.start_recording ERROR: The simulator is already recording.\n");
+            return false;
+        }
+        trajectory_recorder* new_recorder = (trajectory_recorder*) malloc(sizeof(trajectory_recorder));
+        if (new_recorder == NULL) {
+            fprintf(stderr, "simulator.start_recording ERROR: Insufficient memory for trajectory_recorder.\n");
+            return false;
+        } else if (!init(*new_recorder, filepath, (unsigned int) config.item_types.length, chunk_steps, compress)) {
+            core::free(new_recorder);
+            return false;
+        }
+        recorder = new_recorder;
+
+        bool success = true;
+        for (auto entry : world.patches) {
+            if (entry.value.fixed && !record_created_items(entry.value.items.data, entry.value.items.length))
+                success = false;
+        }
+        if (world.evicted != NULL) {
+            for (auto entry : world.evicted->index)
+                entry.value.unrecorded = true;
+        }
+        if (world.snapshot != NULL) {
+            const mapped_snapshot& snapshot = *world.snapshot;
+            for (uint64_t j = 0; success && j < snapshot.header->patch_count; j++) {
+                const snapshot_patch_record& record = snapshot.records[j];
+                if (!record.fixed || world.patches.get(record.key) != NULL
+                 || (world.evicted != NULL && world.evicted->find(record.key) != NULL)) continue;
+                if (!record_created_items((const item*) (snapshot.data + record.item_offset), record.item_count))
+                    success = false;
+            }
+        }
+        if (!success) {
+            fprintf(stderr, "simulator.start_recording ERROR: Unable to record the existing items.\n");
+            core::free(*recorder); core::free(recorder);
+            recorder = NULL;
+            return false;
+        }
+        world.set_fixed_patch_log(&recorder->fixed_patches);
+        return true;
+    }
+
+    /**
+     * Stops recording the history of the simulation, and waits for the
+     * recorded steps to be written to the trajectory file. This function has
+     * no effect if the simulator is not recording.
+     */
+    void stop_recording() {
+        std::unique_lock<std::mutex> lock(agent_states_lock);
+        if (recorder == NULL) return;
+        world.set_fixed_patch_log(NULL);
+        core::free(*recorder);
+        core::free(recorder);
+        recorder = NULL;
+    }
+
+    /**
+     * Starts a background thread that advances the simulation. Until
+     * `stop_stepper` is called, `move` and `turn` only record the action in
+     * a lock-free buffer and return immediately, and the thread runs the time
+     * step (and the step callback) once every agent has acted. An agent may
+     * submit its action for the next time step while the current one is
+     * running.
+     *
+     * \returns `true` if successful; `false` if the stepper is already
+     *          running, an agent has already acted in the current time step,
+     *          or the thread could not be created.
+     */
+    bool start_stepper() {
+        std::unique_lock<std::mutex> lock(stepper_lock);
+        if (stepper_running) {
+            fprintf(stderr, "simulator.start_stepper ERROR: The stepper is already running.\n");
+            return false;
+        }
+        agent_states_lock.lock();
+        unsigned int acted = acted_agent_count;
+        agent_states_lock.unlock();
+        if (acted > 0) {
+            fprintf(stderr, "simulator.start_stepper ERROR: Agents have already acted in the current time step.\n");
+            return false;
+        }
+
+        stepper_running = true;
+        try {
+            stepper = std::thread(&simulator<SimulatorData>::run_stepper, this);
+        } catch (...) {
+            fprintf(stderr, "simulator.start_stepper ERROR: Unable to start stepper thread.\n");
+            stepper_running = false;
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * Stops the background thread started by `start_stepper`, waiting for it
+     * to finish its current time step. Actions that were submitted for the
+     * next time step are kept, as if they were requested by `move` and
+     * `turn` synchronously. This function has no effect if the stepper is not
+     * running, and it must not be called concurrently with `move` or `turn`.
+     */
+    void stop_stepper() {
+        if (!join_stepper()) return;
+        std::unique_lock<std::mutex> lock(agent_states_lock);
+        take_submitted_actions();
+        if (agents.length > 0 && acted_agent_count == agents.length)
+            step(); /* advance the simulation by one time step */
+    }
+
+    /** 
+     * Moves an agent.
+     *
+     * Note that the agent is only actually moved when the simulation time step 
+     * advances, and only if the agent has not already acted for the current 
+     * time step.
+     *
+     * \param   agent_id  ID of the agent to move.
+     * \param   dir       Direction along which to move, *relative* to the
+     *                    agent's current direction.
+     * \param   num_steps Number of steps to take in the specified direction.
+     * \returns `true` if the move was successful, and `false` otherwise.
+     */
+    inline bool move(uint64_t agent_id, direction dir, unsigned int num_steps)
+    {
+        if (num_steps > config.max_steps_per_movement
+         || !config.allowed_movement_directions[(size_t) dir])
+            return false;
+        if (stepper_running)
+            return submit_action(agent_id, action_buffer::encode_move(dir, num_steps));
+
+        agent_states_lock.lock();
+        if (agent_id >= agents.length) {
+            agent_states_lock.unlock(); return false;
+        }
+        agent_state& agent = *agents[(size_t) agent_id];
+        agent_states_lock.unlock();
+
+        agent.lock.lock();
+        if (agent.agent_acted) {
+            agent.lock.unlock(); return false;
+        }
+        agent.agent_acted = true;
+
+        request_move(agent, dir, num_steps);
+        agent.lock.unlock();
+
+        /* add the agent's move to the list of requested moves */
+        request_position(agent);
+
+        agent_states_lock.lock();
+        if (++acted_agent_count == agents.length)
+            step(); /* advance the simulation by one time step */
+        agent_states_lock.unlock();
+        return true;
+    }
+
+    /** 
+     * Turns an agent.
+     *
+     * Note that the agent is only actually turned when the simulation time
+     * step advances, and only if the agent has not already acted for the
      * current time step.
      *
      * \param   agent_id ID of the agent to move.
@@ -1190,8 +2486,13 @@ public:
     {
         if (!config.allowed_rotations[(size_t) dir])
             return false;
+        if (stepper_running)
+            return submit_action(agent_id, action_buffer::encode_turn(dir));
 
         agent_states_lock.lock();
+        if (agent_id >= agents.length) {
+            agent_states_lock.unlock(); return false;
+        }
         agent_state& agent = *agents[(size_t) agent_id];
         agent_states_lock.unlock();
 
@@ -1201,31 +2502,7 @@ public:
         }
         agent.agent_acted = true;
 
-        agent.requested_position = agent.current_position;
-        agent.requested_direction = agent.current_direction;
-
-        switch (dir) {
-        case direction::UP: break;
-        case direction::DOWN:
-            if (agent.current_direction == direction::UP) agent.requested_direction = direction::DOWN;
-            else if (agent.current_direction == direction::DOWN) agent.requested_direction = direction::UP;
-            else if (agent.current_direction == direction::LEFT) agent.requested_direction = direction::RIGHT;
-            else if (agent.current_direction == direction::RIGHT) agent.requested_direction = direction::LEFT;
-            break;
-        case direction::LEFT:
-            if (agent.current_direction == direction::UP) agent.requested_direction = direction::LEFT;
-            else if (agent.current_direction == direction::DOWN) agent.requested_direction = direction::RIGHT;
-            else if (agent.current_direction == direction::LEFT) agent.requested_direction = direction::DOWN;
-            else if (agent.current_direction == direction::RIGHT) agent.requested_direction = direction::UP;
-            break;
-        case direction::RIGHT:
-            if (agent.current_direction == direction::UP) agent.requested_direction = direction::RIGHT;
-            else if (agent.current_direction == direction::DOWN) agent.requested_direction = direction::LEFT;
-            else if (agent.current_direction == direction::LEFT) agent.requested_direction = direction::UP;
-            else if (agent.current_direction == direction::RIGHT) agent.requested_direction = direction::DOWN;
-            break;
-        case direction::COUNT: break;
-        }
+        request_turn(agent, dir);
         agent.lock.unlock();
 
         /* add the agent's move to the list of requested moves */
@@ -1256,6 +2533,14 @@ public:
         agent_states_lock.unlock();
     }
 
+    /**
+     * Returns the number of agents in this simulator.
+     */
+    inline size_t get_agent_count() {
+        std::unique_lock<std::mutex> lock(agent_states_lock);
+        return agents.length;
+    }
+
     /**
      * Returns a SimulatorData reference associated with this simulator.
      */
@@ -1270,6 +2555,17 @@ public:
         return data;
     }
 
+    /**
+     * Invokes `modify(data)` while holding the lock on the agent states, so
+     * that no step (and so no call to `on_step`) is in progress while the
+     * SimulatorData of this simulator is modified.
+     */
+    template<typename Function>
+    inline void modify_data(Function modify) {
+        std::unique_lock<std::mutex> lock(agent_states_lock);
+        modify(data);
+    }
+
     /**
      * Returns the simulator configuration used to construct this simulator.
      */
@@ -1281,10 +2577,51 @@ public:
         return world;
     }
 
+    /**
+     * Returns the buffers containing the observations of every agent, where
+     * row `i` belongs to the agent with ID `i`. The rows are updated in place
+     * by every simulation step.
+     *
+     * **NOTE:** the buffers are reallocated when agents are added, so this
+     *      function should only be called while the simulator is not adding
+     *      agents (e.g. from within the step callback). Otherwise, use
+     *      `get_observations(float*&, float*&, unsigned int*&, size_t&, size_t&, shared_block*&)`.
+     */
+    inline const agent_observation_buffers& get_observations() const {
+        return observations;
+    }
+
+    /**
+     * Retrieves the current observation buffers (see `get_observations()`),
+     * the number of agents `agent_count` (i.e. the number of rows in use),
+     * and the number of allocated rows `capacity`. The capacity only changes
+     * when the buffers are reallocated, which invalidates pointers retrieved
+     * before the reallocation (see `agent_observation_buffers`). To keep them
+     * readable, a reference to the allocation containing the buffers is
+     * retained and returned in `block`, which the caller must release.
+     */
+    inline void get_observations(float*& scent, float*& vision,
+            unsigned int*& items, size_t& agent_count, size_t& capacity,
+            shared_block*& block)
+    {
+        std::unique_lock<std::mutex> lock(agent_states_lock);
+        block = observations.block;
+        retain(block);
+        scent = observations.scent;
+        vision = observations.vision;
+        items = observations.items;
+        agent_count = agents.length;
+        capacity = observations.capacity;
+    }
+
     /**
      * Retrieves the set of patches of the map within the bounding box defined
      * by `bottom_left_corner` and `top_right_corner`. The patches are stored
-     * in the map `patches`.
+     * in the map `patches`. The scent and vision of each patch are cached,
+     * and they are only recomputed if the items near the patch changed or if
+     * time advanced (and only the contributions of items whose scent changes
+     * over time are recomputed in the latter case). If `patches` already
+     * contains a patch, its memory is reused.
      *
      * \param bottom_left_corner The bottom-left corner of the bounding box in
      *      which to retrieve the map patches.
@@ -1292,25 +2629,56 @@ public:
      *      which to retrieve the map patches.
      * \param patches The output map from patch position to patch_state
      *      structures which will contain the state of the retrieved patches.
+     * \param modified_since If nonzero, only the patches whose scent, vision,
+     *      or agents changed at or after this time are retrieved.
      * \returns `true` if successful; `false` otherwise.
      */
     bool get_map(
             position bottom_left_corner,
             position top_right_corner,
-            hash_map<position, patch_state>& patches)
+            hash_map<position, patch_state>& patches,
+            uint64_t modified_since = 0)
     {
+        const unsigned int n = config.patch_size;
         auto process_patch = [&](const patch_type& patch, position patch_position)
         {
             bool contains; unsigned int bucket;
+            if (!map_cache.check_size(alloc_position_keys)) return false;
+            map_patch_cache& cache = map_cache.get(patch_position, contains, bucket);
+            if (!contains) {
+                if (!init(cache, config)) return false;
+                map_cache.table.keys[bucket] = patch_position;
+                map_cache.table.size++;
+            }
+            bool refreshed;
+            switch (select_dimensions(config)) {
+            case dimension_specialization::SCENT3_COLOR3_VISION5_PATCH32:
+                refreshed = refresh_map_cache<scent3_color3_vision5_patch32>(cache, patch, patch_position); break;
+            case dimension_specialization::SCENT3_COLOR3_VISION10_PATCH32:
+                refreshed = refresh_map_cache<scent3_color3_vision10_patch32>(cache, patch, patch_position); break;
+            default:
+                refreshed = refresh_map_cache<generic_dimensions>(cache, patch, patch_position); break;
+            }
+            if (!refreshed) return false;
+            if (modified_since > 0 && cache.modified_time < modified_since) return true;
+
             if (!patches.check_size(alloc_position_keys)) return false;
             patch_state& state = patches.get(patch_position, contains, bucket);
-            if (!init(state, config.patch_size,
-                    config.scent_dimension, config.color_dimension,
-                    (unsigned int) patch.items.length,
-                    (unsigned int) patch.data.agents.length))
-                return false;
-            patches.table.keys[bucket] = patch_position;
-            patches.table.size++;
+            bool reuse = contains && state.item_capacity >= patch.items.length
+                    && state.agent_capacity >= patch.data.agents.length;
+            if (!reuse) {
+                if (contains) core::free(state);
+                if (!init(state, n, config.scent_dimension, config.color_dimension,
+                        (unsigned int) patch.items.length, (unsigned int) patch.data.agents.length))
+                {
+                    if (contains) patches.remove_at(bucket);
+                    return false;
+                }
+                if (!contains) {
+                    patches.table.keys[bucket] = patch_position;
+                    patches.table.size++;
+                }
+            }
 
             state.patch_position = patch_position;
             state.item_count = 0;
@@ -1322,135 +2690,66 @@ public:
                 }
             }
 
+            memcpy(state.scent, cache.scent, sizeof(float) * n * n * config.scent_dimension);
+            memcpy(state.vision, cache.item_vision, sizeof(float) * n * n * config.color_dimension);
+            state.agent_count = (unsigned int) patch.data.agents.length;
             for (unsigned int i = 0; i < patch.data.agents.length; i++) {
-                state.agent_positions[i] = patch.data.agents[i]->current_position;
-                state.agent_directions[i] = patch.data.agents[i]->current_direction;
+                const agent_state* agent = patch.data.agents[i];
+                state.agent_positions[i] = agent->current_position;
+                state.agent_directions[i] = agent->current_direction;
+
+                /* add the color contribution of the agent */
+                position relative_position = agent->current_position - patch_position * n;
+                float* pixel = state.vision + ((relative_position.x*n + relative_position.y)*config.color_dimension);
+                for (unsigned int j = 0; j < config.color_dimension; j++)
+                    pixel[j] += config.agent_color[j];
             }
             return true;
         };
 
         std::unique_lock<std::mutex> lock(agent_states_lock);
-        position bottom_left_patch_position, top_right_patch_position;
-        if (!world.get_state(bottom_left_corner, top_right_corner,
-                process_patch, bottom_left_patch_position, top_right_patch_position))
-            return false;
-
-        for (int64_t x = bottom_left_patch_position.x - 1; x < top_right_patch_position.x + 1; x++) {
-            for (int64_t y = bottom_left_patch_position.y - 1; y < top_right_patch_position.y + 1; y++) {
-                const patch_type* patch = world.get_patch_if_exists({x, y});
-                if (patch == NULL) continue;
-
-                /* consider all patches in the neighborhood of 'patch' */
-                for (int diff_x = -1; diff_x <= 1; diff_x++) {
-                    for (int diff_y = -1; diff_y <= 1; diff_y++) {
-                        bool contains;
-                        patch_state& neighbor = patches.get({x + diff_x, y + diff_y}, contains);
-                        position world_position = neighbor.patch_position * config.patch_size;
-                        if (!contains) continue;
-
-                        /* for every item in 'patch', add its scent/vision contribution to 'neighbor' */
-                        for (unsigned int i = 0; i < patch->items.length; i++) {
-                            const item& item = patch->items[i];
-
-                            /* check if the item is too old; if so, ignore it */
-                            if (item.deletion_time > 0 && time >= item.deletion_time + config.deleted_item_lifetime)
-                                continue;
-
-                            for (unsigned int a = 0; a < config.patch_size; a++)
-                                for (unsigned int b = 0; b < config.patch_size; b++)
-                                    compute_scent_contribution(scent_model, item, world_position + position(a, b), time,
-                                            config, neighbor.scent + ((a*config.patch_size + b)*config.scent_dimension));
-                        }
-                    }
-                }
-
-                /* add color contribution from the items and agents in the current patch */
-                bool contains;
-                patch_state& state = patches.get({x, y}, contains);
-                if (!contains) continue;
-                for (const item& item : patch->items) {
-                    if (item.deletion_time != 0) continue;
-                    position relative_position = item.location - position(x, y) * config.patch_size;
-                    float* pixel = state.vision + ((relative_position.x*config.patch_size + relative_position.y)*config.color_dimension);
-                    for (unsigned int i = 0; i < config.color_dimension; i++)
-                        pixel[i] += config.item_types[item.item_type].color[i];
-                }
-
-                for (const agent_state* agent : patch->data.agents) {
-                    position relative_position = agent->current_position - position(x, y) * config.patch_size;
-                    float* pixel = state.vision + ((relative_position.x*config.patch_size + relative_position.y)*config.color_dimension);
-                    for (unsigned int i = 0; i < config.color_dimension; i++)
-                        pixel[i] += config.agent_color[i];
-                }
-            }
-        }
-
-        return true;
+        return world.get_state(bottom_left_corner, top_right_corner, process_patch);
     }
 
     static inline void free(simulator& s) {
+        s.join_stepper();
+        s.stop_generator();
+        s.stop_recording();
         s.free_helper();
         core::free(s.agents);
+        core::free(s.agent_pool);
+        core::free(s.observations);
         core::free(s.requested_moves);
         core::free(s.config);
         core::free(s.scent_model);
         core::free(s.world);
         core::free(s.data);
+        core::free(s.workers);
+        core::free(s.agent_neighborhoods);
+        core::free(s.agent_neighborhood_positions);
+        core::free(s.map_cache);
+        core::free(s.expiring_items);
+        core::free(s.kept_positions);
         s.agent_states_lock.~mutex();
         s.requested_move_lock.~mutex();
+        s.generator.~thread();
+        s.generator_lock.~mutex();
+        s.generator_cv.~condition_variable();
+        core::free(s.submitted_actions);
+        s.stepper.~thread();
+        s.stepper_lock.~mutex();
+        s.stepper_cv.~condition_variable();
     }
 
 private:
     /* Precondition: The mutex is locked. This function does not release the mutex. */
     inline void step()
     {
+        NEL_STATS(stats_stopwatch step_stopwatch, phase_stopwatch);
         requested_move_lock.lock();
-        if (config.collision_policy == movement_conflict_policy::RANDOM) {
-            for (auto entry : requested_moves) {
-                array<agent_state*>& conflicts = entry.value;
-                if (conflicts[0]->current_position == entry.key) continue; /* give preference to agents that don't move */
-                unsigned int result = sample_uniform((unsigned int) conflicts.length);
-                core::swap(conflicts[0], conflicts[result]);
-            }
-        }
-
-        /* check for items that block movement */
-        array<position> occupied_positions(16);
-        for (auto entry : requested_moves) {
-            patch_type* neighborhood[4]; position patch_positions[4];
-            unsigned int index = world.get_fixed_neighborhood(entry.key, neighborhood, patch_positions);
-            patch_type& current_patch = *neighborhood[index];
-            for (item& item : current_patch.items) {
-                if (item.location == entry.key && item.deletion_time == 0 && config.item_types[item.item_type].blocks_movement) {
-                    /* there is an item at our new position that blocks movement */
-                    array<agent_state*>& conflicts = entry.value;
-                    occupied_positions.add(conflicts[0]->current_position);
-                    conflicts[0] = NULL; /* prevent any agent from moving here */
-                }
-            }
-        }
-
-        /* need to ensure agents don't move into positions where other agents failed to move */
-        if (config.collision_policy != movement_conflict_policy::NO_COLLISIONS) {
-            array<position> occupied_positions(16);
-            for (auto entry : requested_moves) {
-                array<agent_state*>& conflicts = entry.value;
-                for (unsigned int i = 1; i < conflicts.length; i++)
-                    occupied_positions.add(conflicts[i]->current_position);
-            }
-        }
-
-        bool contains;
-        while (occupied_positions.length > 0) {
-            array<agent_state*>& conflicts = requested_moves.get(occupied_positions.pop(), contains);
-            if (!contains || conflicts[0] == NULL) {
-                continue;
-            } else if (contains) {
-                for (unsigned int i = 0; i < conflicts.length; i++)
-                    occupied_positions.add(conflicts[i]->current_position);
-                conflicts[0] = NULL; /* prevent any agent from moving here */
-            }
-        }
+        if (recorder != NULL) record_actions();
+        resolve_moves();
+        NEL_STATS(get_stats().record_phase(step_phase::RESOLVE_MOVES, phase_stopwatch.lap()));
 
         time++;
         acted_agent_count = 0;
@@ -1463,34 +2762,38 @@ private:
             position old_patch_position;
             world.world_to_patch_coordinates(agent->current_position, old_patch_position);
             if (config.collision_policy == movement_conflict_policy::NO_COLLISIONS
-             || (agent == requested_moves.get(agent->requested_position)[0]))
+             || moves_to_requested_position(*agent))
             {
+                /* the agent stays in place if the patches at its destination could not be loaded */
+                patch_type* neighborhood[4]; position patch_positions[4];
+                unsigned int index = world.get_fixed_neighborhood(agent->requested_position, neighborhood, patch_positions);
+                if (index == UINT_MAX) {
+                    agent->agent_acted = false;
+                    continue;
+                }
                 agent->current_position = agent->requested_position;
 
                 /* delete any items that are automatically picked up at this cell */
-                patch_type* neighborhood[4]; position patch_positions[4];
-                unsigned int index = world.get_fixed_neighborhood(agent->current_position, neighborhood, patch_positions);
                 patch_type& current_patch = *neighborhood[index];
-                for (item& item : current_patch.items) {
-                    if (item.location == agent->current_position && item.deletion_time == 0) {
-                        /* there is an item at our new position */
-                        bool collect = true;
-                        for (unsigned int i = 0; i < config.item_types.length; i++) {
-                            if (agent->collected_items[i] < config.item_types[item.item_type].required_item_counts[i]) {
-                                collect = false; break;
-                            }
+                update_occupancy(current_patch);
+                if (current_patch.is_live(agent->current_position, config.patch_size)) {
+                    /* there is an item at our new position */
+                    item& item = current_patch.items[current_patch.item_at(agent->current_position, config.patch_size)];
+                    bool collect = true;
+                    for (unsigned int i = 0; i < config.item_types.length; i++) {
+                        if (agent->collected_items[i] < config.item_types[item.item_type].required_item_counts[i]) {
+                            collect = false; break;
                         }
+                    }
 
-                        if (collect) {
-                            /* collect this item */
-                            item.deletion_time = time;
-                            agent->collected_items[item.item_type]++;
+                    if (collect) {
+                        mark_collected(current_patch, item, patch_positions[index]);
+                        agent->collected_items[item.item_type]++;
 
-                            for (unsigned int i = 0; i < config.item_types.length; i++) {
-                                if (agent->collected_items[i] < config.item_types[item.item_type].required_item_costs[i])
-                                    agent->collected_items[i] = 0;
-                                else agent->collected_items[i] -= config.item_types[item.item_type].required_item_costs[i];
-                            }
+                        for (unsigned int i = 0; i < config.item_types.length; i++) {
+                            if (agent->collected_items[i] < config.item_types[item.item_type].required_item_costs[i])
+                                agent->collected_items[i] = 0;
+                            else agent->collected_items[i] -= config.item_types[item.item_type].required_item_costs[i];
                         }
                     }
                 }
@@ -1508,35 +2811,532 @@ private:
             agent->agent_acted = false;
         }
 
-#if !defined(NDEBUG)
-        /* check for collisions, if there aren't supposed to be any */
-        if (config.collision_policy != movement_conflict_policy::NO_COLLISIONS) {
-            for (unsigned int i = 0; i < agents.length; i++)
-                for (unsigned int j = i + 1; j < agents.length; j++)
-                    if (agents[i]->current_position == agents[j]->current_position)
-                        fprintf(stderr, "simulator.step WARNING: Agents %u and %u are at the same position.\n", i, j);
+#if !defined(NDEBUG)
+        /* check for collisions, if there aren't supposed to be any */
+        if (config.collision_policy != movement_conflict_policy::NO_COLLISIONS) {
+            for (unsigned int i = 0; i < agents.length; i++)
+                for (unsigned int j = i + 1; j < agents.length; j++)
+                    if (agents[i]->current_position == agents[j]->current_position)
+                        fprintf(stderr, "simulator.step WARNING: Agents %u and %u are at the same position.\n", i, j);
+        }
+#endif
+
+        /* reset the requested moves */
+        requested_moves.clear();
+        requested_move_lock.unlock();
+        NEL_STATS(get_stats().record_phase(step_phase::MOVE_AGENTS, phase_stopwatch.lap()));
+
+        /* remove the items whose scent has fully dissipated, so that the observations below only read the patches */
+        remove_expired_items();
+        NEL_STATS(get_stats().record_phase(step_phase::REMOVE_EXPIRED_ITEMS, phase_stopwatch.lap()));
+
+        /* compute new scent and vision for each agent */
+        update_agent_scent_and_vision();
+        NEL_STATS(get_stats().record_phase(step_phase::UPDATE_OBSERVATIONS, phase_stopwatch.lap()));
+
+        /* append the new state of the agents to the trajectory, before the patches fixed since the last step can be evicted */
+        if (recorder != NULL) record_step();
+
+        /* move the patches far from all agents to disk, if the world exceeds its memory budget */
+        evict_distant_patches();
+        NEL_STATS(get_stats().record_phase(step_phase::EVICT_PATCHES, phase_stopwatch.lap()));
+
+        /* let the generator know that the agents have moved */
+        if (generator_running) {
+            std::unique_lock<std::mutex> lock(generator_lock);
+            generator_pending = true;
+            generator_cv.notify_one();
+        }
+
+        /* Invoke the step callback function for each agent. */
+        on_step((const simulator<SimulatorData>*) this, (const array<agent_state*>&) agents, time);
+        NEL_STATS(get_stats().record_phase(step_phase::STEP_CALLBACK, phase_stopwatch.lap()));
+        NEL_STATS(get_stats().record_phase(step_phase::TOTAL, step_stopwatch.nanoseconds()));
+    }
+
+    /* Precondition: `requested_move_lock` is held. Decides which agents in
+       `requested_moves` move, according to the collision policy, and sets
+       the `moves` field of their requests. Only the first request for each
+       target can move, and only if no item at the target blocks movement. An
+       agent that does not move keeps its cell, so the request for that cell
+       cannot move either, and so on along the chain. The requests are sorted
+       by target, so the requests for a given cell are found by a binary
+       search, and each request is blocked at most once. */
+    inline void resolve_moves() {
+        const size_t request_count = requested_moves.length;
+        if (request_count > 1) sort(requested_moves);
+
+        /* select the request that moves to each target */
+        for (size_t start = 0; start < request_count; ) {
+            size_t end = start + 1;
+            while (end < request_count && requested_moves[end].target == requested_moves[start].target)
+                end++;
+            if (config.collision_policy == movement_conflict_policy::RANDOM && !requested_moves[start].stays) {
+                unsigned int result = sample_uniform((unsigned int) (end - start));
+                core::swap(requested_moves[start], requested_moves[start + result]);
+            }
+            requested_moves[start].moves = !is_blocked(requested_moves[start].target);
+            for (size_t i = start + 1; i < end; i++)
+                requested_moves[i].moves = false;
+            start = end;
+        }
+
+        /* block the requests for the cells kept by agents that do not move (each agent is added at most once) */
+        if (!kept_positions.ensure_capacity(max((size_t) 1, request_count))) {
+            fprintf(stderr, "simulator.resolve_moves ERROR: Out of memory.\n");
+            for (move_request& request : requested_moves)
+                request.moves = request.stays;
+            return;
+        }
+        kept_positions.clear();
+        for (const move_request& request : requested_moves) {
+            if (!request.moves && !request.stays)
+                kept_positions[kept_positions.length++] = request.agent->current_position;
+        }
+        while (kept_positions.length > 0) {
+            size_t index = find_move_request(kept_positions.pop());
+            if (index == request_count || !requested_moves[index].moves) continue;
+            requested_moves[index].moves = false;
+            if (!requested_moves[index].stays)
+                kept_positions[kept_positions.length++] = requested_moves[index].agent->current_position;
+        }
+    }
+
+    /* marks `item` in `patch` as deleted at the current time, and clears its cell in the occupancy bitmaps rather than recomputing them */
+    inline void mark_collected(patch_type& patch, item& item, const position& patch_position) {
+        item.deletion_time = time;
+        patch.version++;
+        patch.set_occupancy(item.location, config.patch_size, false, false);
+        patch.occupancy_version = patch.version;
+        expiring_items.push(time + config.deleted_item_lifetime, patch_position);
+        if (recorder != NULL && !recorder->record_event(time, trajectory_event::COLLECTED, item.item_type, item.location))
+            fprintf(stderr, "simulator.mark_collected ERROR: Unable to record the collected item.\n");
+    }
+
+    /* records the action of each agent in the current step, before `step` clears them */
+    inline void record_actions() {
+        if (!recorder->clear_actions(agents.length)) {
+            fprintf(stderr, "simulator.record_actions ERROR: Out of memory.\n");
+            return;
+        }
+        for (unsigned int i = 0; i < agents.length; i++) {
+            const agent_state& agent = *agents[i];
+            if (!agent.agent_acted) continue;
+            recorder->set_action(i, (uint8_t) agent.requested_direction,
+                    agent.requested_position - agent.current_position);
+        }
+    }
+
+    /* records the live items among the `item_count` items in `items` as created at the current time */
+    inline bool record_created_items(const item* items, size_t item_count) {
+        for (size_t i = 0; i < item_count; i++) {
+            if (items[i].deletion_time != 0) continue;
+            if (!recorder->record_event(time, trajectory_event::CREATED, items[i].item_type, items[i].location))
+                return false;
+        }
+        return true;
+    }
+
+    /* appends the items in the patches fixed since the last step and the state of every agent to the trajectory */
+    inline void record_step() {
+        bool success = true;
+        for (const position& patch_position : recorder->fixed_patches) {
+            const patch_type* patch = world.get_patch_if_exists(patch_position);
+            if (patch != NULL && !record_created_items(patch->items.data, patch->items.length))
+                success = false;
+        }
+        recorder->fixed_patches.clear();
+
+        for (unsigned int i = 0; i < agents.length; i++) {
+            const agent_state& agent = *agents[i];
+            if (!recorder->record_agent(i, agent.current_position,
+                    (uint8_t) agent.current_direction, agent.collected_items))
+                success = false;
+        }
+        if (!recorder->end_step(time, (uint32_t) agents.length))
+            success = false;
+        if (!success)
+            fprintf(stderr, "simulator.record_step ERROR: Unable to record the current step.\n");
+    }
+
+    /* returns `true` if an item that blocks movement is at `target`, fixing its neighborhood if necessary */
+    inline bool is_blocked(const position& target) {
+        position patch_position;
+        world.world_to_patch_coordinates(target, patch_position);
+        patch_type* patch = world.get_patch_if_exists(patch_position);
+        if (patch == NULL || !patch->fixed) {
+            /* a target whose patches could not be loaded is treated as blocked */
+            patch_type* neighborhood[4]; position patch_positions[4];
+            unsigned int index = world.get_fixed_neighborhood(target, neighborhood, patch_positions);
+            if (index == UINT_MAX) return true;
+            patch = neighborhood[index];
+        }
+
+        update_occupancy(*patch);
+        return patch->is_blocking(target, config.patch_size);
+    }
+
+    /* recomputes the occupancy bitmaps of `patch` (see `patch::live_cells`) if its items changed since they were computed */
+    inline void update_occupancy(patch_type& patch) {
+        if (patch.occupancy_version == patch.version) return;
+        patch.clear_occupancy(config.patch_size);
+        for (const item& item : patch.items) {
+            if (item.deletion_time != 0) continue;
+            patch.set_occupancy(item.location, config.patch_size, true, config.item_types[item.item_type].blocks_movement);
+        }
+        patch.occupancy_version = patch.version;
+    }
+
+    /* returns the index of the request that moves to `target` (the first one, after `resolve_moves`), or `requested_moves.length` if there is none */
+    inline size_t find_move_request(const position& target) const {
+        size_t low = 0, high = requested_moves.length;
+        while (low < high) {
+            size_t middle = low + (high - low) / 2;
+            if (requested_moves[middle].target < target) low = middle + 1;
+            else high = middle;
+        }
+        return (low < requested_moves.length && requested_moves[low].target == target) ? low : requested_moves.length;
+    }
+
+    /* Precondition: `resolve_moves` was called. */
+    inline bool moves_to_requested_position(const agent_state& agent) const {
+        size_t index = find_move_request(agent.requested_position);
+        return index < requested_moves.length
+            && requested_moves[index].agent == &agent
+            && requested_moves[index].moves;
+    }
+
+    /* Precondition: `agent_states_lock` is held. Removes the items that expired
+       at or before the current time from the patches in `expiring_items`. */
+    inline void remove_expired_items() {
+        array<position> patch_positions(16);
+        if (!expiring_items.pop_expired(time, patch_positions)) return;
+        if (patch_positions.length > 1) {
+            sort(patch_positions);
+            unique(patch_positions);
+        }
+        for (const position& patch_position : patch_positions) {
+            /* the patch may have been evicted, in which case it is loaded back */
+            patch_type* patch = world.get_patch_if_exists(patch_position);
+            if (patch == NULL) continue;
+            for (unsigned int j = 0; j < patch->items.length; j++) {
+                if (is_expired(patch->items[j], time, config)) {
+                    patch->remove_item(j, config.patch_size); j--;
+                }
+            }
+        }
+    }
+
+    /* Adds every patch containing deleted items to `expiring_items`, including
+       the patches that are still in the snapshot of the world (if any), since
+       the queue is not stored when the simulator is written. */
+    bool rebuild_expiry_queue() {
+        expiring_items.clear();
+        for (auto entry : world.patches) {
+            for (const item& i : entry.value.items) {
+                if (i.deletion_time != 0 && !expiring_items.push(i.deletion_time + config.deleted_item_lifetime, entry.key))
+                    return false;
+            }
+        }
+        if (world.snapshot != NULL) {
+            const mapped_snapshot& snapshot = *world.snapshot;
+            for (uint64_t j = 0; j < snapshot.header->patch_count; j++) {
+                const snapshot_patch_record& record = snapshot.records[j];
+                if (world.patches.get(record.key) != NULL) continue;
+                const item* items = (const item*) (snapshot.data + record.item_offset);
+                for (uint32_t k = 0; k < record.item_count; k++) {
+                    if (items[k].deletion_time != 0 && !expiring_items.push(items[k].deletion_time + config.deleted_item_lifetime, record.key))
+                        return false;
+                }
+            }
+        }
+        expiring_items.sort_entries();
+        return true;
+    }
+
+    /* the patches at the sorted `positions` are not evicted */
+    struct pinned_patches {
+        const position* positions;
+        size_t count;
+
+        inline bool operator () (const position& key) const {
+            size_t low = 0, high = count;
+            while (low < high) {
+                size_t middle = low + (high - low) / 2;
+                if (positions[middle] < key) low = middle + 1;
+                else if (key < positions[middle]) high = middle;
+                else return true;
+            }
+            return false;
+        }
+    };
+
+    struct expired_item_pruner {
+        uint64_t time;
+        const simulator_config& config;
+
+        inline bool operator () (const item& i) const {
+            return is_expired(i, time, config);
+        }
+    };
+
+    struct map_cache_evictor {
+        hash_map<position, map_patch_cache>& map_cache;
+
+        inline void operator () (const position& key) const {
+            bool contains; unsigned int bucket;
+            map_cache.get(key, contains, bucket);
+            if (!contains) return;
+            core::free(map_cache.values[bucket]);
+            map_cache.remove_at(bucket);
+        }
+    };
+
+    /* Precondition: `agent_states_lock` is held. */
+    inline void evict_distant_patches() {
+        if (!world.needs_eviction()) {
+            /* only advances the access time of the map */
+            world.evict_patches(pinned_patches{NULL, 0}, expired_item_pruner{time, config}, map_cache_evictor{map_cache});
+            return;
+        }
+
+        /* pin the patches that the agents can see, or reach before the generator or the next step needs them */
+        int64_t radius = (int64_t) config.vision_range + (int64_t) (generator_lookahead + 1) * config.max_steps_per_movement + 2 * config.patch_size;
+        array<position> pinned(max((size_t) 16, (size_t) agents.length * 9));
+        for (const agent_state* agent : agents) {
+            position bottom_left_patch_position, top_right_patch_position;
+            world.world_to_patch_coordinates(agent->current_position - position(radius, radius), bottom_left_patch_position);
+            world.world_to_patch_coordinates(agent->current_position + position(radius, radius), top_right_patch_position);
+            for (int64_t x = bottom_left_patch_position.x; x <= top_right_patch_position.x; x++) {
+                for (int64_t y = bottom_left_patch_position.y; y <= top_right_patch_position.y; y++) {
+                    if (!pinned.add({x, y})) {
+                        fprintf(stderr, "simulator.evict_distant_patches ERROR: Insufficient memory for pinned patches.\n");
+                        return;
+                    }
+                }
+            }
+        }
+        if (pinned.length > 1) {
+            sort(pinned);
+            unique(pinned);
+        }
+
+        if (!world.evict_patches(pinned_patches{pinned.data, pinned.length}, expired_item_pruner{time, config}, map_cache_evictor{map_cache}))
+            fprintf(stderr, "simulator.evict_distant_patches ERROR: Unable to evict patches.\n");
+    }
+
+    inline void update_agent_scent_and_vision() {
+        if (workers.thread_count() <= 1) {
+            for (agent_state* agent : agents) {
+                patch_type* neighborhood[4]; position patch_positions[4];
+                if (world.get_fixed_neighborhood(agent->current_position, neighborhood, patch_positions) == UINT_MAX)
+                    continue;
+                if (config.incremental_observations)
+                    agent->update_state_incremental(neighborhood, patch_positions, scent_model, config, time);
+                else agent->update_state(neighborhood, scent_model, config, time);
+            }
+            return;
+        }
+
+        /* fix the neighborhoods of all agents first, since this modifies the map */
+        if (!agent_neighborhoods.ensure_capacity(4 * agents.length)
+         || !agent_neighborhood_positions.ensure_capacity(4 * agents.length))
+        {
+            fprintf(stderr, "simulator.update_agent_scent_and_vision ERROR: Insufficient memory for agent neighborhoods.\n");
+            return;
+        }
+        /* the observations of an agent whose neighborhood could not be loaded are not updated */
+        for (unsigned int i = 0; i < agents.length; i++) {
+            if (world.get_fixed_neighborhood(agents[i]->current_position,
+                    agent_neighborhoods.data + 4*i, agent_neighborhood_positions.data + 4*i) == UINT_MAX)
+                agent_neighborhoods[4*i] = NULL;
+        }
+        agent_neighborhoods.length = 4 * agents.length;
+        agent_neighborhood_positions.length = 4 * agents.length;
+
+        /* compute the observations of the agents in parallel */
+        static constexpr unsigned int AGENTS_PER_TASK = 8;
+        unsigned int task_count = (unsigned int) ((agents.length + AGENTS_PER_TASK - 1) / AGENTS_PER_TASK);
+        auto process_agents = [&](unsigned int task, unsigned int thread_id) {
+            size_t end = min(agents.length, (size_t) (task + 1) * AGENTS_PER_TASK);
+            for (size_t i = task * AGENTS_PER_TASK; i < end; i++) {
+                if (agent_neighborhoods[4*i] == NULL) {
+                    continue;
+                } else if (config.incremental_observations) {
+                    agents[i]->update_state_incremental(agent_neighborhoods.data + 4*i,
+                            agent_neighborhood_positions.data + 4*i, scent_model, config, time);
+                } else {
+                    agents[i]->update_state(agent_neighborhoods.data + 4*i, scent_model, config, time);
+                }
+            }
+        };
+        workers.run(task_count, process_agents);
+    }
+
+    void run_generator()
+    {
+        array<position> candidates(64);
+        while (true) {
+            std::unique_lock<std::mutex> lock(generator_lock);
+            while (generator_running && !generator_pending)
+                generator_cv.wait(lock);
+            if (!generator_running) return;
+            generator_pending = false;
+            lock.unlock();
+
+            /* find the unfixed patches that the agents could reach within the lookahead */
+            candidates.clear();
+            agent_states_lock.lock();
+            int64_t radius = (int64_t) generator_lookahead * config.max_steps_per_movement + config.patch_size;
+            for (const agent_state* agent : agents) {
+                position bottom_left_patch_position, top_right_patch_position;
+                world.world_to_patch_coordinates(agent->current_position - position(radius, radius), bottom_left_patch_position);
+                world.world_to_patch_coordinates(agent->current_position + position(radius, radius), top_right_patch_position);
+                for (int64_t x = bottom_left_patch_position.x; x <= top_right_patch_position.x; x++) {
+                    for (int64_t y = bottom_left_patch_position.y; y <= top_right_patch_position.y; y++) {
+                        if (!world.is_fixed({x, y}) && !candidates.add({x, y})) {
+                            fprintf(stderr, "simulator.run_generator ERROR: Insufficient memory for candidate patches.\n");
+                            break;
+                        }
+                    }
+                }
+            }
+            agent_states_lock.unlock();
+            if (candidates.length > 1) {
+                sort(candidates);
+                unique(candidates);
+            }
+
+            /* fix one patch at a time, so that `step` is never blocked for long */
+            for (const position& patch_position : candidates) {
+                if (!generator_running) break;
+                std::unique_lock<std::mutex> lock(agent_states_lock);
+                world.fix_patch(patch_position);
+            }
+        }
+    }
+
+    /* sets the requested position and direction of `agent` for a move of `num_steps` along `dir` */
+    inline void request_move(agent_state& agent, direction dir, unsigned int num_steps)
+    {
+        agent.requested_position = agent.current_position;
+        agent.requested_direction = agent.current_direction;
+        position diff(0, 0);
+        switch (dir) {
+        case direction::UP   : diff.x = 0; diff.y = num_steps; break;
+        case direction::DOWN : diff.x = 0; diff.y = -((int64_t) num_steps); break;
+        case direction::LEFT : diff.x = -((int64_t) num_steps); diff.y = 0; break;
+        case direction::RIGHT: diff.x = num_steps; diff.y = 0; break;
+        case direction::COUNT: break;
+        }
+
+        switch (agent.current_direction) {
+        case direction::UP: break;
+        case direction::DOWN: diff.x *= -1; diff.y *= -1; break;
+        case direction::LEFT:
+            core::swap(diff.x, diff.y);
+            diff.x *= -1; break;
+        case direction::RIGHT:
+            core::swap(diff.x, diff.y);
+            diff.y *= -1; break;
+        case direction::COUNT: break;
+        }
+
+        agent.requested_position += diff;
+    }
+
+    /* sets the requested position and direction of `agent` for a turn towards `dir` */
+    inline void request_turn(agent_state& agent, direction dir)
+    {
+        agent.requested_position = agent.current_position;
+        agent.requested_direction = agent.current_direction;
+
+        switch (dir) {
+        case direction::UP: break;
+        case direction::DOWN:
+            if (agent.current_direction == direction::UP) agent.requested_direction = direction::DOWN;
+            else if (agent.current_direction == direction::DOWN) agent.requested_direction = direction::UP;
+            else if (agent.current_direction == direction::LEFT) agent.requested_direction = direction::RIGHT;
+            else if (agent.current_direction == direction::RIGHT) agent.requested_direction = direction::LEFT;
+            break;
+        case direction::LEFT:
+            if (agent.current_direction == direction::UP) agent.requested_direction = direction::LEFT;
+            else if (agent.current_direction == direction::DOWN) agent.requested_direction = direction::RIGHT;
+            else if (agent.current_direction == direction::LEFT) agent.requested_direction = direction::DOWN;
+            else if (agent.current_direction == direction::RIGHT) agent.requested_direction = direction::UP;
+            break;
+        case direction::RIGHT:
+            if (agent.current_direction == direction::UP) agent.requested_direction = direction::RIGHT;
+            else if (agent.current_direction == direction::DOWN) agent.requested_direction = direction::LEFT;
+            else if (agent.current_direction == direction::LEFT) agent.requested_direction = direction::UP;
+            else if (agent.current_direction == direction::RIGHT) agent.requested_direction = direction::DOWN;
+            break;
+        case direction::COUNT: break;
+        }
+    }
+
+    inline bool submit_action(uint64_t agent_id, uint64_t action) {
+        /* the buffer has slots for every agent counted in `agent_count` */
+        if (agent_id >= submitted_actions.agent_count.load(std::memory_order_acquire)
+         || !submitted_actions.submit(agent_id, action))
+            return false;
+        if (submitted_actions.all_arrived()) {
+            /* notify while holding the lock, so the wakeup cannot be missed */
+            std::unique_lock<std::mutex> lock(stepper_lock);
+            stepper_cv.notify_one();
         }
-#endif
-
-        /* reset the requested moves */
-        for (auto entry : requested_moves)
-            core::free(entry.value);
-        requested_moves.clear();
-        requested_move_lock.unlock();
+        return true;
+    }
 
-        /* compute new scent and vision for each agent */
-        update_agent_scent_and_vision();
+    /* Precondition: `agent_states_lock` is held. Requests the submitted actions
+       of the agents, as `move` and `turn` do, and removes them from the buffer. */
+    inline void take_submitted_actions()
+    {
+        for (size_t i = 0; i < agents.length; i++) {
+            uint64_t action = submitted_actions.take(i);
+            if (action == action_buffer::EMPTY) continue;
+
+            agent_state& agent = *agents[i];
+            agent.agent_acted = true;
+            if (action_buffer::kind(action) == action_buffer::MOVE)
+                request_move(agent, action_buffer::dir(action), action_buffer::num_steps(action));
+            else request_turn(agent, action_buffer::dir(action));
+            request_position(agent);
+            acted_agent_count++;
+        }
+    }
 
-        /* Invoke the step callback function for each agent. */
-        on_step((const simulator<SimulatorData>*) this, (const array<agent_state*>&) agents, time);
+    void run_stepper()
+    {
+        while (true) {
+            std::unique_lock<std::mutex> lock(stepper_lock);
+            while (stepper_running && !submitted_actions.all_arrived())
+                stepper_cv.wait(lock);
+            if (!stepper_running) return;
+            lock.unlock();
+
+            std::unique_lock<std::mutex> states_lock(agent_states_lock);
+            /* an agent may have been added after the last action arrived */
+            if (!submitted_actions.all_arrived()) continue;
+            take_submitted_actions();
+            step(); /* advance the simulation by one time step */
+        }
     }
 
-    inline void update_agent_scent_and_vision() {
-        for (agent_state* agent : agents) {
-            patch_type* neighborhood[4]; position patch_positions[4];
-            world.get_fixed_neighborhood(agent->current_position, neighborhood, patch_positions);
-            agent->update_state(neighborhood, scent_model, config, time);
+    /* stops the stepper thread, returning `false` if it was not running */
+    bool join_stepper() {
+        std::unique_lock<std::mutex> lock(stepper_lock);
+        if (!stepper_running) return false;
+        stepper_running = false;
+        stepper_cv.notify_one();
+        lock.unlock();
+
+        if (stepper.joinable()) {
+            try {
+                stepper.join();
+            } catch (...) { }
         }
+        return true;
     }
 
     inline void request_position(agent_state& agent)
@@ -1545,33 +3345,148 @@ private:
         if (config.collision_policy == movement_conflict_policy::NO_COLLISIONS)
             return;
 
-        bool contains; unsigned int bucket;
         requested_move_lock.lock();
-        requested_moves.check_size(alloc_position_keys);
-        array<agent_state*>& agents = requested_moves.get(agent.requested_position, contains, bucket);
-        if (!contains) {
-            array_init(agents, 8);
-            requested_moves.table.keys[bucket] = agent.requested_position;
-            requested_moves.table.size++;
+        if (!requested_moves.ensure_capacity(requested_moves.length + 1)) {
+            /* without a request, the agent does not move */
+            fprintf(stderr, "simulator.request_position ERROR: Insufficient memory for move request.\n");
+            requested_move_lock.unlock();
+            return;
         }
-        agents.add(&agent);
-        if (agent.current_position == agent.requested_position)
-            core::swap(agents[0], agents.last());
+        move_request& request = requested_moves[requested_moves.length];
+        request.target = agent.requested_position;
+        request.agent = &agent;
+        request.sequence = (uint32_t) requested_moves.length;
+        request.stays = (agent.current_position == agent.requested_position);
+        request.moves = false;
+        requested_moves.length++;
         requested_move_lock.unlock();
     }
 
+    /**
+     * Brings the cached scent and vision of the (existing) patch `patch` at
+     * `patch_position` up to date with the current time, and updates
+     * `cache.modified_time` if they, or the agents in the patch, changed.
+     *
+     * \returns `true` if successful; `false` if out of memory.
+     */
+    template<typename Dimensions>
+    bool refresh_map_cache(map_patch_cache& cache,
+            const patch_type& patch, position patch_position)
+    {
+        const unsigned int n = Dimensions::patch_size(config);
+        const unsigned int scent_dimension = Dimensions::scent_dimension(config);
+        const unsigned int color_dimension = Dimensions::color_dimension(config);
+        const patch_type* neighborhood[9];
+        bool items_changed = !cache.valid;
+        for (int64_t x = -1; x <= 1; x++) {
+            for (int64_t y = -1; y <= 1; y++) {
+                unsigned int index = (unsigned int) ((x + 1) * 3 + (y + 1));
+                neighborhood[index] = (x == 0 && y == 0) ? &patch
+                        : world.get_patch_if_exists(patch_position + position(x, y));
+                uint64_t version = (neighborhood[index] == NULL) ? UINT64_MAX : neighborhood[index]->version;
+                if (cache.neighbor_versions[index] != version) {
+                    cache.neighbor_versions[index] = version;
+                    items_changed = true;
+                }
+            }
+        }
+
+        position world_position = patch_position * n;
+        bool scent_changed = items_changed;
+        if (items_changed) {
+            /* partition the items near this patch by whether their scent changes over time */
+            memset(cache.static_scent, 0, sizeof(float) * n * n * scent_dimension);
+            memset(cache.item_vision, 0, sizeof(float) * n * n * color_dimension);
+            cache.transient_items.clear();
+            cache.valid = false;
+            for (unsigned int i = 0; i < 9; i++) {
+                if (neighborhood[i] == NULL) continue;
+                for (unsigned int j = 0; j < neighborhood[i]->items.length; j++) {
+                    const item& item = neighborhood[i]->items[j];
+                    if (is_expired(item, time, config)) {
+                        continue;
+                    } else if (!has_constant_scent(item, time, config)) {
+                        if (!cache.transient_items.add(make_pair(i, j))) return false;
+                    } else {
+                        for (unsigned int a = 0; a < n; a++)
+                            for (unsigned int b = 0; b < n; b++)
+                                compute_scent_contribution<Dimensions::scent_dimension_value>(scent_model, item, world_position + position(a, b), time,
+                                        config, cache.static_scent + ((a*n + b)*scent_dimension));
+                    }
+
+                    /* add the color contribution of the items in this patch */
+                    if (i != 4 || item.deletion_time != 0) continue;
+                    position relative_position = item.location - world_position;
+                    float* pixel = cache.item_vision + ((relative_position.x*n + relative_position.y)*color_dimension);
+                    for (unsigned int k = 0; k < color_dimension; k++)
+                        pixel[k] += config.item_types[item.item_type].color[k];
+                }
+            }
+            cache.valid = true;
+        } else if (cache.computed_time != time) {
+            /* the scent changed if any transient item still contributed at the last computation */
+            for (const pair<unsigned int, unsigned int>& entry : cache.transient_items) {
+                const item& item = neighborhood[entry.key]->items[entry.value];
+                if (!is_expired(item, cache.computed_time, config) && !has_constant_scent(item, cache.computed_time, config)) {
+                    scent_changed = true;
+                    break;
+                }
+            }
+        }
+
+        if (items_changed || cache.computed_time != time) {
+            memcpy(cache.scent, cache.static_scent, sizeof(float) * n * n * scent_dimension);
+            for (const pair<unsigned int, unsigned int>& entry : cache.transient_items) {
+                const item& item = neighborhood[entry.key]->items[entry.value];
+                if (is_expired(item, time, config)) continue;
+                for (unsigned int a = 0; a < n; a++)
+                    for (unsigned int b = 0; b < n; b++)
+                        compute_scent_contribution<Dimensions::scent_dimension_value>(scent_model, item, world_position + position(a, b), time,
+                                config, cache.scent + ((a*n + b)*scent_dimension));
+            }
+            cache.computed_time = time;
+        }
+
+        /* check whether the agents in this patch moved or turned */
+        const array<agent_state*>& patch_agents = patch.data.agents;
+        bool agents_changed = (cache.agent_positions.length != patch_agents.length);
+        if (!cache.agent_positions.ensure_capacity(patch_agents.length)
+         || !cache.agent_directions.ensure_capacity(patch_agents.length))
+            return false;
+        for (unsigned int i = 0; i < patch_agents.length; i++) {
+            if (i < cache.agent_positions.length && cache.agent_positions[i] == patch_agents[i]->current_position
+             && cache.agent_directions[i] == patch_agents[i]->current_direction)
+                continue;
+            agents_changed = true;
+            cache.agent_positions[i] = patch_agents[i]->current_position;
+            cache.agent_directions[i] = patch_agents[i]->current_direction;
+        }
+        cache.agent_positions.length = patch_agents.length;
+        cache.agent_directions.length = patch_agents.length;
+
+        if (scent_changed || agents_changed)
+            cache.modified_time = time;
+        return true;
+    }
+
     inline void free_helper() {
-        for (auto entry : requested_moves)
+        for (auto entry : map_cache)
             core::free(entry.value);
         for (agent_state* agent : agents) {
             core::free(*agent);
-            core::free(agent);
+            block_pool::release(agent);
         }
     }
 
     template<typename A> friend bool init(simulator<A>&, const simulator_config&, const A&, uint_fast32_t);
-    template<typename A, typename B> friend bool read(simulator<A>&, B&, const A&);
+    template<typename A, typename B> friend bool read(simulator<A>&, B&, const A&, unsigned int, bool);
     template<typename A, typename B> friend bool write(const simulator<A>&, B&);
+    template<typename A, typename B> friend bool read_snapshot(simulator<A>&, const char*, const A&, B, unsigned int, bool);
+    template<typename A, typename B> friend bool write_snapshot(const simulator<A>&, const char*, B, uint64_t);
+    template<typename A, typename B, typename C> friend bool write_snapshot_state(const simulator<A>&, B&, C&);
+    template<typename A, typename B> friend bool checkpoint(checkpointer&, const simulator<A>&, B&);
+    template<typename A, typename B> friend bool read_checkpoint(simulator<A>&,
+            const char*, const char*, uint64_t, const A&, B, unsigned int, bool);
 };
 
 /**
@@ -1594,7 +3509,7 @@ bool init(simulator<SimulatorData>& sim,
         return false;
     } else if (!array_init(sim.agents, 16)) {
         free(sim.data); return false;
-    } else if (!hash_map_init(sim.requested_moves, 32, alloc_position_keys)) {
+    } else if (!array_init(sim.requested_moves, 32)) {
         free(sim.data); free(sim.agents); return false;
     } else if (!init(sim.config, config)) {
         free(sim.data); free(sim.agents);
@@ -1610,9 +3525,82 @@ bool init(simulator<SimulatorData>& sim,
         free(sim.config); free(sim.data);
         free(sim.agents); free(sim.requested_moves);
         free(sim.scent_model); return false;
+    } else if (!init(sim.workers, sim.config.thread_count)) {
+        free(sim.config); free(sim.data);
+        free(sim.agents); free(sim.requested_moves);
+        free(sim.scent_model); free(sim.world); return false;
+    } else if (!array_init(sim.agent_neighborhoods, 64)) {
+        free(sim.config); free(sim.data);
+        free(sim.agents); free(sim.requested_moves);
+        free(sim.scent_model); free(sim.world);
+        free(sim.workers); return false;
+    } else if (!array_init(sim.agent_neighborhood_positions, 64)) {
+        free(sim.config); free(sim.data);
+        free(sim.agents); free(sim.requested_moves);
+        free(sim.scent_model); free(sim.world);
+        free(sim.workers); free(sim.agent_neighborhoods); return false;
+    } else if (!init(sim.agent_pool, sizeof(agent_state), simulator<SimulatorData>::AGENT_POOL_CHUNK_SIZE)) {
+        free(sim.config); free(sim.data);
+        free(sim.agents); free(sim.requested_moves);
+        free(sim.scent_model); free(sim.world);
+        free(sim.workers); free(sim.agent_neighborhoods);
+        free(sim.agent_neighborhood_positions); return false;
+    } else if (!init(sim.observations, sim.config, 16)) {
+        free(sim.config); free(sim.data);
+        free(sim.agents); free(sim.requested_moves);
+        free(sim.scent_model); free(sim.world);
+        free(sim.workers); free(sim.agent_neighborhoods);
+        free(sim.agent_neighborhood_positions);
+        free(sim.agent_pool); return false;
+    } else if (!init(sim.submitted_actions)) {
+        free(sim.config); free(sim.data);
+        free(sim.agents); free(sim.requested_moves);
+        free(sim.scent_model); free(sim.world);
+        free(sim.workers); free(sim.agent_neighborhoods);
+        free(sim.agent_neighborhood_positions);
+        free(sim.agent_pool); free(sim.observations);
+        return false;
+    } else if (!hash_map_init(sim.map_cache, 64, alloc_position_keys)) {
+        free(sim.config); free(sim.data);
+        free(sim.agents); free(sim.requested_moves);
+        free(sim.scent_model); free(sim.world);
+        free(sim.workers); free(sim.agent_neighborhoods);
+        free(sim.agent_neighborhood_positions);
+        free(sim.agent_pool); free(sim.observations);
+        free(sim.submitted_actions); return false;
+    } else if (!init(sim.expiring_items, 64)) {
+        free(sim.config); free(sim.data);
+        free(sim.agents); free(sim.requested_moves);
+        free(sim.scent_model); free(sim.world);
+        free(sim.workers); free(sim.agent_neighborhoods);
+        free(sim.agent_neighborhood_positions);
+        free(sim.agent_pool); free(sim.observations);
+        free(sim.submitted_actions); free(sim.map_cache);
+        return false;
+    } else if (!array_init(sim.kept_positions, 32)) {
+        free(sim.config); free(sim.data);
+        free(sim.agents); free(sim.requested_moves);
+        free(sim.scent_model); free(sim.world);
+        free(sim.workers); free(sim.agent_neighborhoods);
+        free(sim.agent_neighborhood_positions);
+        free(sim.agent_pool); free(sim.observations);
+        free(sim.submitted_actions); free(sim.map_cache);
+        free(sim.expiring_items); return false;
     }
+    sim.world.set_thread_pool(&sim.workers);
     new (&sim.agent_states_lock) std::mutex();
     new (&sim.requested_move_lock) std::mutex();
+    new (&sim.generator) std::thread();
+    new (&sim.generator_lock) std::mutex();
+    new (&sim.generator_cv) std::condition_variable();
+    new (&sim.generator_running) std::atomic_bool(false);
+    sim.generator_lookahead = 0;
+    sim.generator_pending = false;
+    new (&sim.stepper) std::thread();
+    new (&sim.stepper_lock) std::mutex();
+    new (&sim.stepper_cv) std::condition_variable();
+    new (&sim.stepper_running) std::atomic_bool(false);
+    sim.recorder = NULL;
     return true;
 }
 
@@ -1654,55 +3642,141 @@ inline bool write(const agent_state* agent, Stream& out,
     return write(agent_indices.get(agent), out);
 }
 
+/**
+ * Reads the move requests `requests` from `in`, where they are stored as a
+ * map from each requested position to the agents that requested it (the
+ * agent that is already at the position first, followed by the others in the
+ * order of their requests), as `write_move_requests` writes them.
+ */
+template<typename Stream>
+bool read_move_requests(array<move_request>& requests,
+        Stream& in, array<agent_state*>& agents)
+{
+    hash_map<position, array<agent_state*>>& moves =
+            *((hash_map<position, array<agent_state*>>*) alloca(sizeof(hash_map<position, array<agent_state*>>)));
+    default_scribe scribe;
+    if (!read(moves, in, alloc_position_keys, scribe, agents))
+        return false;
+
+    size_t request_count = 0;
+    for (auto entry : moves)
+        request_count += entry.value.length;
+    bool success = array_init(requests, max((size_t) 32, request_count));
+    for (auto entry : moves) {
+        for (unsigned int i = 0; success && i < entry.value.length; i++) {
+            move_request& request = requests[requests.length];
+            request.target = entry.key;
+            request.agent = entry.value[i];
+            request.sequence = (uint32_t) requests.length;
+            request.stays = (entry.value[i]->current_position == entry.key);
+            request.moves = false;
+            requests.length++;
+        }
+        free(entry.value);
+    }
+    free(moves);
+    return success;
+}
+
+/**
+ * Writes the move requests `requests` to `out`, in the format read by
+ * `read_move_requests`.
+ */
+template<typename Stream>
+bool write_move_requests(const array<move_request>& requests, Stream& out,
+        hash_map<const agent_state*, unsigned int>& agent_indices)
+{
+    hash_map<position, array<agent_state*>> moves(32, alloc_position_keys);
+    bool success = true;
+    for (const move_request& request : requests) {
+        bool contains; unsigned int bucket;
+        if (!moves.check_size(alloc_position_keys)) {
+            success = false; break;
+        }
+        array<agent_state*>& agents = moves.get(request.target, contains, bucket);
+        if (!contains) {
+            if (!array_init(agents, 8)) {
+                success = false; break;
+            }
+            moves.table.keys[bucket] = request.target;
+            moves.table.size++;
+        }
+        if (!agents.add(request.agent)) {
+            success = false; break;
+        } else if (request.stays) {
+            core::swap(agents[0], agents.last());
+        }
+    }
+
+    default_scribe scribe;
+    success = success && write(moves, out, scribe, agent_indices);
+    for (auto entry : moves)
+        free(entry.value);
+    return success;
+}
+
 /**
  * Reads the given simulator `sim` from the input stream `in`. The
  * SimulatorData of `sim` is not read from `in`. Rather, it is initialized by
- * the given `data` argument.
+ * the given `data` argument. The options that do not change the behavior of
+ * the environment are not part of the saved configuration, so `sim` uses the
+ * given `thread_count` and `incremental_observations`.
  *
  * \returns `true` if successful; `false` otherwise.
  */
 template<typename SimulatorData, typename Stream>
-bool read(simulator<SimulatorData>& sim, Stream& in, const SimulatorData& data)
+bool read(simulator<SimulatorData>& sim, Stream& in,
+        const SimulatorData& data, unsigned int thread_count,
+        bool incremental_observations)
 {
     if (!init(sim.data, data)) {
         return false;
     } if (!read(sim.config, in)) {
         free(sim.data); return false;
     }
+    sim.config.thread_count = thread_count;
+    sim.config.incremental_observations = incremental_observations;
 
     size_t agent_count = 0;
     if (!read(agent_count, in)
      || !array_init(sim.agents, ((size_t) 1) << (core::log2(agent_count) + 2))) {
         free(sim.data); free(sim.config); return false;
     }
+    if (!init(sim.agent_pool, sizeof(agent_state), simulator<SimulatorData>::AGENT_POOL_CHUNK_SIZE)) {
+        free(sim.data); free(sim.config);
+        free(sim.agents); return false;
+    } else if (!init(sim.observations, sim.config, sim.agents.capacity)) {
+        free(sim.data); free(sim.config);
+        free(sim.agents); free(sim.agent_pool); return false;
+    }
     for (unsigned int i = 0; i < agent_count; i++) {
-        sim.agents[i] = (agent_state*) malloc(sizeof(agent_state));
-        if (sim.agents[i] == NULL || !read(*sim.agents[i], in, sim.config)) {
+        sim.agents[i] = (agent_state*) sim.agent_pool.allocate();
+        if (sim.agents[i] == NULL || !read(*sim.agents[i], in, sim.config,
+                sim.observations.scent_row(i), sim.observations.vision_row(i), sim.observations.items_row(i)))
+        {
             fprintf(stderr, "read ERROR: Insufficient memory for agent_state in simulator.\n");
-            for (unsigned int j = 0; j < i; j++) {
-                free(*sim.agents[j]); free(sim.agents[j]);
-            }
-            if (sim.agents[i] != NULL) free(sim.agents[i]);
+            for (unsigned int j = 0; j < i; j++)
+                free(*sim.agents[j]);
             free(sim.data); free(sim.agents);
+            free(sim.agent_pool); free(sim.observations);
             free(sim.config); return false;
         }
     }
     sim.agents.length = agent_count;
 
     if (!read(sim.world, in, sim.config.item_types.data, (unsigned int) sim.config.item_types.length, sim.agents)) {
-        for (unsigned int j = 0; j < agent_count; j++) {
-            free(*sim.agents[j]); free(sim.agents[j]);
-        }
+        for (unsigned int j = 0; j < agent_count; j++)
+            free(*sim.agents[j]);
         free(sim.data); free(sim.agents);
+        free(sim.agent_pool); free(sim.observations);
         free(sim.config); return false;
     }
 
-    default_scribe scribe;
-    if (!read(sim.requested_moves, in, alloc_position_keys, scribe, sim.agents)) {
-        for (unsigned int j = 0; j < agent_count; j++) {
-            free(*sim.agents[j]); free(sim.agents[j]);
-        }
+    if (!read_move_requests(sim.requested_moves, in, sim.agents)) {
+        for (unsigned int j = 0; j < agent_count; j++)
+            free(*sim.agents[j]);
         free(sim.data); free(sim.agents);
+        free(sim.agent_pool); free(sim.observations);
         free(sim.config); free(sim.world); return false;
     }
 
@@ -1712,17 +3786,106 @@ bool read(simulator<SimulatorData>& sim, Stream& in, const SimulatorData& data)
             (double) sim.config.decay_param, sim.config.patch_size,
             sim.config.deleted_item_lifetime))
     {
-        for (unsigned int j = 0; j < agent_count; j++) {
-            free(*sim.agents[j]); free(sim.agents[j]);
-        }
-        for (auto entry : sim.requested_moves)
-            free(entry.value);
+        for (unsigned int j = 0; j < agent_count; j++)
+            free(*sim.agents[j]);
+        free(sim.data); free(sim.world); free(sim.agents);
+        free(sim.agent_pool); free(sim.observations);
+        free(sim.requested_moves); free(sim.config);
+        return false;
+    }
+
+    if (!init(sim.workers, sim.config.thread_count)) {
+        for (unsigned int j = 0; j < agent_count; j++)
+            free(*sim.agents[j]);
+        free(sim.data); free(sim.world); free(sim.agents);
+        free(sim.agent_pool); free(sim.observations);
+        free(sim.requested_moves); free(sim.config);
+        free(sim.scent_model); return false;
+    } else if (!array_init(sim.agent_neighborhoods, 64)) {
+        for (unsigned int j = 0; j < agent_count; j++)
+            free(*sim.agents[j]);
+        free(sim.data); free(sim.world); free(sim.agents);
+        free(sim.agent_pool); free(sim.observations);
+        free(sim.requested_moves); free(sim.config);
+        free(sim.scent_model); free(sim.workers); return false;
+    } else if (!array_init(sim.agent_neighborhood_positions, 64)) {
+        for (unsigned int j = 0; j < agent_count; j++)
+            free(*sim.agents[j]);
+        free(sim.data); free(sim.world); free(sim.agents);
+        free(sim.agent_pool); free(sim.observations);
+        free(sim.requested_moves); free(sim.config);
+        free(sim.scent_model); free(sim.workers);
+        free(sim.agent_neighborhoods); return false;
+    } else if (!init(sim.submitted_actions)) {
+        for (unsigned int j = 0; j < agent_count; j++)
+            free(*sim.agents[j]);
+        free(sim.data); free(sim.world); free(sim.agents);
+        free(sim.agent_pool); free(sim.observations);
+        free(sim.requested_moves); free(sim.config);
+        free(sim.scent_model); free(sim.workers);
+        free(sim.agent_neighborhoods);
+        free(sim.agent_neighborhood_positions); return false;
+    } else if (!sim.submitted_actions.ensure_capacity(agent_count)) {
+        for (unsigned int j = 0; j < agent_count; j++)
+            free(*sim.agents[j]);
+        free(sim.data); free(sim.world); free(sim.agents);
+        free(sim.agent_pool); free(sim.observations);
+        free(sim.requested_moves); free(sim.config);
+        free(sim.scent_model); free(sim.workers);
+        free(sim.agent_neighborhoods);
+        free(sim.agent_neighborhood_positions);
+        free(sim.submitted_actions); return false;
+    } else if (!hash_map_init(sim.map_cache, 64, alloc_position_keys)) {
+        for (unsigned int j = 0; j < agent_count; j++)
+            free(*sim.agents[j]);
+        free(sim.data); free(sim.world); free(sim.agents);
+        free(sim.agent_pool); free(sim.observations);
+        free(sim.requested_moves); free(sim.config);
+        free(sim.scent_model); free(sim.workers);
+        free(sim.agent_neighborhoods);
+        free(sim.agent_neighborhood_positions);
+        free(sim.submitted_actions); return false;
+    } else if (!init(sim.expiring_items, 64)) {
+        for (unsigned int j = 0; j < agent_count; j++)
+            free(*sim.agents[j]);
         free(sim.data); free(sim.world); free(sim.agents);
+        free(sim.agent_pool); free(sim.observations);
         free(sim.requested_moves); free(sim.config);
+        free(sim.scent_model); free(sim.workers);
+        free(sim.agent_neighborhoods);
+        free(sim.agent_neighborhood_positions);
+        free(sim.submitted_actions); free(sim.map_cache);
         return false;
+    } else if (!array_init(sim.kept_positions, 32)) {
+        for (unsigned int j = 0; j < agent_count; j++)
+            free(*sim.agents[j]);
+        free(sim.data); free(sim.world); free(sim.agents);
+        free(sim.agent_pool); free(sim.observations);
+        free(sim.requested_moves); free(sim.config);
+        free(sim.scent_model); free(sim.workers);
+        free(sim.agent_neighborhoods);
+        free(sim.agent_neighborhood_positions);
+        free(sim.submitted_actions); free(sim.map_cache);
+        free(sim.expiring_items); return false;
     }
+    sim.submitted_actions.agent_count = agent_count;
+    sim.world.set_thread_pool(&sim.workers);
     new (&sim.agent_states_lock) std::mutex();
     new (&sim.requested_move_lock) std::mutex();
+    new (&sim.generator) std::thread();
+    new (&sim.generator_lock) std::mutex();
+    new (&sim.generator_cv) std::condition_variable();
+    new (&sim.generator_running) std::atomic_bool(false);
+    sim.generator_lookahead = 0;
+    sim.generator_pending = false;
+    new (&sim.stepper) std::thread();
+    new (&sim.stepper_lock) std::mutex();
+    new (&sim.stepper_cv) std::condition_variable();
+    new (&sim.stepper_running) std::atomic_bool(false);
+    sim.recorder = NULL;
+    if (!sim.rebuild_expiry_queue()) {
+        free(sim); return false;
+    }
     return true;
 }
 
@@ -1747,13 +3910,374 @@ bool write(const simulator<SimulatorData>& sim, Stream& out)
         if (!write(*sim.agents[i], out, sim.config)) return false;
     }
 
-    default_scribe scribe;
     return write(sim.world, out, agent_indices)
-        && write(sim.requested_moves, out, scribe, agent_indices)
+        && write_move_requests(sim.requested_moves, out, agent_indices)
         && write(sim.time, out)
         && write(sim.acted_agent_count, out);
 }
 
+/**
+ * Writes the state section of a snapshot of `sim` (see `snapshot_header`) to
+ * `out`: the same data as `write(const simulator&, Stream&)`, but without
+ * the patches of the map, followed by the data written by `write_extra(out)`.
+ */
+template<typename SimulatorData, typename Stream, typename ExtraWriter>
+bool write_snapshot_state(const simulator<SimulatorData>& sim, Stream& out, ExtraWriter& write_extra)
+{
+    hash_map<const agent_state*, unsigned int> agent_indices((unsigned int) sim.agents.length * RESIZE_THRESHOLD_INVERSE);
+    if (!write(sim.config, out) || !write(sim.agents.length, out))
+        return false;
+    for (unsigned int i = 0; i < sim.agents.length; i++) {
+        agent_indices.put(sim.agents[i], i);
+        if (!write(*sim.agents[i], out, sim.config)) return false;
+    }
+
+    return write_without_patches(sim.world, out)
+        && write_move_requests(sim.requested_moves, out, agent_indices)
+        && write(sim.time, out)
+        && write(sim.acted_agent_count, out)
+        && write_extra(out);
+}
+
+/**
+ * Writes the given simulator `sim` to a snapshot file at `filepath` (see
+ * `snapshot_header`), whose patches can be loaded on demand by
+ * `read_snapshot`. The state section also contains the data written by
+ * `write_extra(fixed_width_stream<FILE*>&)`, which returns `true` if
+ * successful. The snapshot is first written to a temporary file that is then
+ * renamed to `filepath`, so a snapshot at `filepath` that is mapped by a
+ * simulator is never modified in place. The `generation` is stored in the
+ * header, and is 0 unless the snapshot is the base of a checkpoint.
+ *
+ * **NOTE:** this function assumes the variables in the simulator are not
+ *      modified during writing.
+ *
+ * \returns `true` if successful; `false` otherwise.
+ */
+template<typename SimulatorData, typename ExtraWriter>
+bool write_snapshot(const simulator<SimulatorData>& sim,
+        const char* filepath, ExtraWriter write_extra, uint64_t generation)
+{
+    size_t length = strlen(filepath);
+    char* temp_filepath = (char*) malloc(sizeof(char) * (length + 5));
+    if (temp_filepath == NULL) {
+        fprintf(stderr, "write_snapshot ERROR: Out of memory.\n");
+        return false;
+    }
+    memcpy(temp_filepath, filepath, sizeof(char) * length);
+    memcpy(temp_filepath + length, ".tmp", sizeof(char) * 5);
+
+    FILE* file = open_file(temp_filepath, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "write_snapshot ERROR: Unable to open '%s' for writing. ", temp_filepath);
+        perror(""); free(temp_filepath); return false;
+    }
+
+    /* the header is written last, once the offsets of the sections are known */
+    snapshot_header header;
+    memset(&header, 0, sizeof(header));
+    bool success = (fwrite(&header, sizeof(header), 1, file) == 1);
+
+    fixed_width_stream<FILE*> out(file);
+    success = success && write_snapshot_state(sim, out, write_extra);
+    long state_end = success ? ftell(file) : -1;
+    success = (state_end != -1) && write_snapshot_patches(sim.world, file, (uint64_t) state_end, generation);
+    if (fclose(file) != 0) success = false;
+
+#if defined(_WIN32)
+    remove(filepath);
+#endif
+    if (!success || rename(temp_filepath, filepath) != 0) {
+        fprintf(stderr, "write_snapshot ERROR: Unable to write the snapshot '%s'.\n", filepath);
+        remove(temp_filepath);
+        free(temp_filepath); return false;
+    }
+    free(temp_filepath);
+    return true;
+}
+
+/**
+ * Reads the given simulator `sim` from the snapshot file at `filepath`,
+ * written by `write_snapshot`. Only the state section is read, after which
+ * `read_extra(fixed_width_stream<FILE*>&)` reads the data written by the
+ * corresponding `write_extra`. The file remains mapped into memory, and each
+ * patch is loaded from it when the patch is first accessed. As in `read`, the
+ * SimulatorData of `sim` is initialized by `data`, and `sim` uses the given
+ * `thread_count` and `incremental_observations`.
+ *
+ * \returns `true` if successful; `false` otherwise.
+ */
+template<typename SimulatorData, typename ExtraReader>
+bool read_snapshot(simulator<SimulatorData>& sim, const char* filepath,
+        const SimulatorData& data, ExtraReader read_extra,
+        unsigned int thread_count, bool incremental_observations)
+{
+    mapped_snapshot* snapshot = (mapped_snapshot*) malloc(sizeof(mapped_snapshot));
+    if (snapshot == NULL) {
+        fprintf(stderr, "read_snapshot ERROR: Out of memory.\n");
+        return false;
+    } else if (!init<item>(*snapshot, filepath)) {
+        free(snapshot); return false;
+    }
+
+    FILE* file = open_file(filepath, "rb");
+    if (file == NULL || fseek(file, (long) snapshot->header->state_offset, SEEK_SET) != 0) {
+        fprintf(stderr, "read_snapshot ERROR: Unable to open '%s'.\n", filepath);
+        if (file != NULL) fclose(file);
+        free(*snapshot); free(snapshot); return false;
+    }
+    fixed_width_stream<FILE*> in(file);
+    if (!read(sim, in, data, thread_count, incremental_observations)) {
+        fclose(file); free(*snapshot);
+        free(snapshot); return false;
+    } else if (!read_extra(in)) {
+        fclose(file); free(sim);
+        free(*snapshot); free(snapshot); return false;
+    }
+    fclose(file);
+    sim.world.snapshot = snapshot;
+    if (!sim.rebuild_expiry_queue()) {
+        free(sim); return false;
+    }
+
+    /* the snapshot does not store the agents of each patch, so add every agent to the patch containing it */
+    for (agent_state* agent : sim.agents) {
+        position patch_position;
+        sim.world.world_to_patch_coordinates(agent->current_position, patch_position);
+        patch<patch_data>* patch = sim.world.get_or_make_patch(patch_position);
+        if (patch == NULL || !patch->data.agents.add(agent)) {
+            free(sim); return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Writes an incremental checkpoint of `sim` using the checkpointer `c`. If
+ * `c` has no base yet, a full snapshot is written to `c.base_filepath` (see
+ * `write_snapshot`). Otherwise, the state section and the patches that
+ * changed since the previous checkpoint (due to item creation, collection,
+ * or expiry, or to sampling), including those that were evicted from memory
+ * (see `map.set_memory_budget`), are copied into a delta (see
+ * `checkpoint_delta_header`), which is appended to `c.delta_filepath` by the
+ * writer thread of `c`. Agent moves only change the state section, since
+ * the checkpoint does not store the agents of each patch. The state section
+ * also contains the data written by `write_extra(Stream&)`, which must
+ * accept both `fixed_width_stream<FILE*>` and
+ * `fixed_width_stream<memory_stream>`.
+ *
+ * **NOTE:** this function assumes the variables in the simulator are not
+ *      modified during the call (e.g. it is called from the step callback).
+ *      It returns before the delta is written, so a failure to write it is
+ *      only reported on `stderr`, after which the next checkpoint writes a
+ *      new base.
+ *
+ * \returns `true` if successful; `false` otherwise.
+ */
+template<typename SimulatorData, typename ExtraWriter>
+bool checkpoint(checkpointer& c, const simulator<SimulatorData>& sim, ExtraWriter& write_extra)
+{
+    typedef typename simulator<SimulatorData>::patch_type patch_type;
+
+    /* only the checkpoint versions of the patches are modified */
+    auto& world = const_cast<simulator<SimulatorData>&>(sim).world;
+    if (checkpoint_needs_base(c)) {
+        begin_checkpoint_base(c);
+        if (!write_snapshot(sim, c.base_filepath, write_extra, c.generation)
+         || !end_checkpoint_base(c))
+            return false;
+        for (auto entry : world.patches)
+            entry.value.mark_checkpointed();
+        if (world.evicted != NULL) {
+            for (auto entry : world.evicted->index)
+                entry.value.mark_checkpointed();
+        }
+        return true;
+    }
+
+    /* collect the patches in memory and the evicted patches that changed since the previous checkpoint */
+    array<snapshot_patch_record> records(64);
+    array<patch_type*> dirty(64);
+    array<evicted_patch*> dirty_evicted(16);
+    for (auto entry : world.patches) {
+        if (!entry.value.is_dirty()) continue;
+        if (!dirty.add(&entry.value)
+         || !records.add({entry.key, 0, (uint32_t) entry.value.items.length, entry.value.fixed ? 1u : 0u}))
+        {
+            fprintf(stderr, "checkpoint ERROR: Out of memory.\n");
+            return false;
+        }
+    }
+    if (world.evicted != NULL) {
+        for (auto entry : world.evicted->index) {
+            if (!entry.value.is_dirty()) continue;
+            if (!dirty_evicted.add(&entry.value)
+             || !records.add({entry.key, 0, entry.value.item_count, entry.value.fixed ? 1u : 0u}))
+            {
+                fprintf(stderr, "checkpoint ERROR: Out of memory.\n");
+                return false;
+            }
+        }
+    }
+
+    /* the header is completed once the offsets of the sections are known */
+    static const char zeros[SNAPSHOT_ALIGNMENT] = {0};
+    checkpoint_delta_header header;
+    memset(&header, 0, sizeof(header));
+    memory_stream buffer(1 << 16);
+    fixed_width_stream<memory_stream> out(buffer);
+    if (!buffer.write(&header, sizeof(header)) || !write_snapshot_state(sim, out, write_extra)) {
+        fprintf(stderr, "checkpoint ERROR: Unable to write the state section.\n");
+        return false;
+    }
+    header.state_offset = sizeof(header);
+    header.state_length = buffer.position - sizeof(header);
+    header.index_offset = align_snapshot_offset(buffer.position);
+    header.patch_count = records.length;
+
+    uint64_t offset = header.index_offset + records.length * sizeof(snapshot_patch_record);
+    for (snapshot_patch_record& record : records) {
+        record.item_offset = offset;
+        offset = align_snapshot_offset(offset + (uint64_t) record.item_count * sizeof(item));
+    }
+    bool success = buffer.write(zeros, (unsigned int) (header.index_offset - buffer.position))
+                && buffer.write(records.data, (unsigned int) (sizeof(snapshot_patch_record) * records.length));
+    for (unsigned int i = 0; success && i < dirty.length; i++) {
+        success = buffer.write(dirty[i]->items.data, (unsigned int) (sizeof(item) * dirty[i]->items.length))
+               && buffer.write(zeros, (unsigned int) (align_snapshot_offset(buffer.position) - buffer.position));
+    }
+    array<item> evicted_items(64);
+    for (unsigned int i = 0; success && i < dirty_evicted.length; i++) {
+        success = world.evicted->read_items(*dirty_evicted[i], evicted_items)
+               && buffer.write(evicted_items.data, (unsigned int) (sizeof(item) * evicted_items.length))
+               && buffer.write(zeros, (unsigned int) (align_snapshot_offset(buffer.position) - buffer.position));
+    }
+    uint64_t footer = checkpoint_delta_header::MAGIC ^ sim.time;
+    if (!success || !buffer.write(&footer, sizeof(footer))) {
+        fprintf(stderr, "checkpoint ERROR: Insufficient memory for the delta.\n");
+        return false;
+    }
+    header.magic = checkpoint_delta_header::MAGIC;
+    header.length = buffer.position;
+    header.time = sim.time;
+    header.base_generation = c.generation;
+    memcpy(buffer.buffer, &header, sizeof(header));
+
+    for (patch_type* p : dirty)
+        p->mark_checkpointed();
+    for (evicted_patch* record : dirty_evicted)
+        record->mark_checkpointed();
+
+    /* the writer thread takes ownership of the buffer */
+    char* data = buffer.buffer;
+    buffer.buffer = NULL;
+    return submit_checkpoint_delta(c, data, header.length);
+}
+
+/**
+ * Restores the given simulator `sim` from the checkpoint with the base
+ * snapshot at `base_filepath` and the delta file at `delta_filepath`, as
+ * written by `checkpoint`, up to the last delta whose time is at most
+ * `max_time`. The state section is read from that delta, and the patches
+ * that it and the earlier deltas contain are restored in memory, while the
+ * remaining patches are loaded from the mapped base when they are first
+ * accessed (see `read_snapshot`). Incomplete deltas at the end of the delta
+ * file, e.g. from an interrupted checkpoint, are ignored. If no delta
+ * applies, `sim` is read from the base snapshot alone. As in `read`, the
+ * SimulatorData of `sim` is initialized by `data`,
+ * `read_extra(fixed_width_stream<FILE*>&)` reads the data written by
+ * `write_extra`, and `sim` uses the given `thread_count` and
+ * `incremental_observations`.
+ *
+ * \returns `true` if successful; `false` otherwise.
+ */
+template<typename SimulatorData, typename ExtraReader>
+bool read_checkpoint(simulator<SimulatorData>& sim,
+        const char* base_filepath, const char* delta_filepath,
+        uint64_t max_time, const SimulatorData& data,
+        ExtraReader read_extra, unsigned int thread_count,
+        bool incremental_observations)
+{
+    const char* delta_data; size_t delta_size;
+    if (!map_snapshot_file(delta_filepath, delta_data, delta_size))
+        return read_snapshot(sim, base_filepath, data, read_extra, thread_count, incremental_observations);
+
+    mapped_snapshot* snapshot = (mapped_snapshot*) malloc(sizeof(mapped_snapshot));
+    if (snapshot == NULL) {
+        fprintf(stderr, "read_checkpoint ERROR: Out of memory.\n");
+        unmap_snapshot_file(delta_data, delta_size);
+        return false;
+    } else if (!init<item>(*snapshot, base_filepath)) {
+        free(snapshot); unmap_snapshot_file(delta_data, delta_size);
+        return false;
+    }
+
+    /* only the deltas written after the base apply to it */
+    array<uint64_t> offsets(16);
+    if (!find_checkpoint_deltas<item>(delta_data, delta_size, snapshot->header->generation, max_time, offsets)) {
+        fprintf(stderr, "read_checkpoint ERROR: Out of memory.\n");
+        free(*snapshot); free(snapshot);
+        unmap_snapshot_file(delta_data, delta_size);
+        return false;
+    } else if (offsets.length == 0) {
+        free(*snapshot); free(snapshot);
+        unmap_snapshot_file(delta_data, delta_size);
+        return read_snapshot(sim, base_filepath, data, read_extra, thread_count, incremental_observations);
+    }
+
+    /* read the state section of the last delta */
+    const checkpoint_delta_header* last = (const checkpoint_delta_header*) (delta_data + offsets[offsets.length - 1]);
+    FILE* file = open_file(delta_filepath, "rb");
+    if (file == NULL || fseek(file, (long) (offsets[offsets.length - 1] + last->state_offset), SEEK_SET) != 0) {
+        fprintf(stderr, "read_checkpoint ERROR: Unable to open '%s'.\n", delta_filepath);
+        if (file != NULL) fclose(file);
+        free(*snapshot); free(snapshot);
+        unmap_snapshot_file(delta_data, delta_size);
+        return false;
+    }
+    fixed_width_stream<FILE*> in(file);
+    if (!read(sim, in, data, thread_count, incremental_observations)) {
+        fclose(file); free(*snapshot); free(snapshot);
+        unmap_snapshot_file(delta_data, delta_size);
+        return false;
+    } else if (!read_extra(in)) {
+        fclose(file); free(sim); free(*snapshot); free(snapshot);
+        unmap_snapshot_file(delta_data, delta_size);
+        return false;
+    }
+    fclose(file);
+    sim.world.snapshot = snapshot;
+
+    /* restore the latest version of each patch in the deltas, starting from the last delta */
+    for (unsigned int i = offsets.length; i > 0; i--) {
+        const checkpoint_delta_header& header = *(const checkpoint_delta_header*) (delta_data + offsets[i - 1]);
+        const snapshot_patch_record* records = header.records();
+        for (uint64_t j = 0; j < header.patch_count; j++) {
+            if (sim.world.patches.get(records[j].key) != NULL) continue;
+            const item* items = (const item*) ((const char*) &header + records[j].item_offset);
+            if (!sim.world.restore_patch(records[j].key, items, records[j].item_count, records[j].fixed != 0)) {
+                free(sim); unmap_snapshot_file(delta_data, delta_size);
+                return false;
+            }
+        }
+    }
+    unmap_snapshot_file(delta_data, delta_size);
+    if (!sim.rebuild_expiry_queue()) {
+        free(sim); return false;
+    }
+
+    /* the checkpoint does not store the agents of each patch, so add every agent to the patch containing it */
+    for (agent_state* agent : sim.agents) {
+        position patch_position;
+        sim.world.world_to_patch_coordinates(agent->current_position, patch_position);
+        patch<patch_data>* patch = sim.world.get_or_make_patch(patch_position);
+        if (patch == NULL || !patch->data.agents.add(agent)) {
+            free(sim); return false;
+        }
+    }
+    return true;
+}
+
 } /* namespace nel */
 
 #endif /* NEL_SIMULATOR_H_ */
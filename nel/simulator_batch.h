@@ -0,0 +1,321 @@
+#ifndef NEL_SIMULATOR_BATCH_H_
+#define NEL_SIMULATOR_BATCH_H_
+
+#include "simulator.h"
+
+namespace nel {
+
+using namespace core;
+
+/**
+ * The actions accepted by `simulator_batch::step`. The first three coincide
+ * with the actions of the Gym environment. Movement is by a single cell,
+ * relative to the current direction of the agent.
+ */
+enum class batch_action : uint8_t {
+    MOVE_FORWARD = 0,
+    TURN_LEFT = 1,
+    TURN_RIGHT = 2,
+    MOVE_BACKWARD = 3,
+    MOVE_LEFT = 4,
+    MOVE_RIGHT = 5,
+    TURN_AROUND = 6,
+    COUNT
+};
+
+/**
+ * The SimulatorData of the simulators in a simulator_batch. The batch reads
+ * the observations directly from each simulator, so no per-step state is
+ * needed.
+ */
+struct batch_simulator_data {
+    static inline void free(batch_simulator_data& data) { }
+};
+
+inline bool init(batch_simulator_data& data, const batch_simulator_data& src) {
+    return true;
+}
+
+/* the observations of a batched simulator are gathered by `simulator_batch::step` */
+inline void on_step(const simulator<batch_simulator_data>* sim,
+        const array<agent_state*>& agents, uint64_t time)
+{ }
+
+/**
+ * A batch of independent simulators that are stepped together, for use as a
+ * vectorized environment. Every simulator has the same configuration, a
+ * different seed, and the same number of agents. A step takes one action for
+ * every agent in every simulator, advances all simulators in parallel on the
+ * threads of `workers`, and gathers the observations of all agents into
+ * contiguous arrays indexed by (simulator, agent), which are overwritten in
+ * place by every step.
+ */
+struct simulator_batch
+{
+    simulator_config config;
+    simulator<batch_simulator_data>* simulators;
+    unsigned int simulator_count;
+
+    /* whether `simulators[i]` is initialized (it is not after a failed reset) */
+    bool* live;
+
+    /* the number of agents in each simulator */
+    unsigned int agent_count;
+
+    /* the seed of simulator `i` after `j` resets is `seed + i + j * simulator_count` */
+    uint_fast32_t seed;
+    unsigned int* reset_counts;
+
+    /* the agents of simulator `i` are at `agents[i*agent_count]`, ordered by ID */
+    agent_state** agents;
+
+    thread_pool workers;
+
+    /**
+     * The gathered observations, where the rows of each array are ordered by
+     * simulator and then by agent. `positions` has two elements per agent,
+     * and `moved` indicates whether the last action moved the agent. The
+     * arrays share the allocation `block`, which may be retained to keep
+     * them readable after the batch is freed (see `shared_block`).
+     */
+    int64_t* positions;
+    int64_t* directions;
+    float* scent;
+    float* vision;
+    unsigned int* items;
+    bool* moved;
+    shared_block* block;
+
+    simulator_batch(const simulator_config& conf, unsigned int simulator_count,
+            unsigned int agent_count, uint_fast32_t seed, unsigned int thread_count) :
+        config(conf), workers(thread_count)
+    {
+        if (!init_helper(simulator_count, agent_count, seed))
+            exit(EXIT_FAILURE);
+    }
+
+    ~simulator_batch() { free_helper(); }
+
+    inline unsigned int scent_size() const {
+        return config.scent_dimension;
+    }
+
+    inline unsigned int vision_size() const {
+        return (2*config.vision_range + 1) * (2*config.vision_range + 1) * config.color_dimension;
+    }
+
+    /**
+     * Returns `true` if the given action is permitted by the configuration of
+     * the simulators in this batch.
+     */
+    inline bool is_allowed(unsigned int action) const {
+        switch ((batch_action) action) {
+        case batch_action::MOVE_FORWARD: return config.allowed_movement_directions[(size_t) direction::UP];
+        case batch_action::MOVE_BACKWARD: return config.allowed_movement_directions[(size_t) direction::DOWN];
+        case batch_action::MOVE_LEFT: return config.allowed_movement_directions[(size_t) direction::LEFT];
+        case batch_action::MOVE_RIGHT: return config.allowed_movement_directions[(size_t) direction::RIGHT];
+        case batch_action::TURN_LEFT: return config.allowed_rotations[(size_t) direction::LEFT];
+        case batch_action::TURN_RIGHT: return config.allowed_rotations[(size_t) direction::RIGHT];
+        case batch_action::TURN_AROUND: return config.allowed_rotations[(size_t) direction::DOWN];
+        case batch_action::COUNT: break;
+        }
+        return false;
+    }
+
+    /**
+     * Advances every simulator in this batch by one time step. `actions` has
+     * `simulator_count * agent_count` elements, ordered by simulator and then
+     * by agent, each of which is a `batch_action`. No action is taken if any
+     * of the actions is invalid.
+     *
+     * \returns `true` if successful; `false` if an action is invalid or a
+     *          simulator failed to reset.
+     */
+    bool step(const unsigned int* actions)
+    {
+        for (unsigned int i = 0; i < simulator_count; i++) {
+            if (!live[i]) {
+                fprintf(stderr, "simulator_batch.step ERROR: Simulator %u failed to reset.\n", i);
+                return false;
+            }
+        }
+        for (unsigned int i = 0; i < simulator_count * agent_count; i++) {
+            if (!is_allowed(actions[i])) {
+                fprintf(stderr, "simulator_batch.step ERROR: Action %u is not allowed.\n", actions[i]);
+                return false;
+            }
+        }
+
+        auto step_simulator = [&](unsigned int index, unsigned int thread_id) {
+            simulator<batch_simulator_data>& sim = simulators[index];
+            for (unsigned int j = 0; j < agent_count; j++) {
+                /* the last action of every simulator advances it, on this thread */
+                unsigned int action = actions[index * agent_count + j];
+                switch ((batch_action) action) {
+                case batch_action::MOVE_FORWARD: sim.move(j, direction::UP, 1); break;
+                case batch_action::MOVE_BACKWARD: sim.move(j, direction::DOWN, 1); break;
+                case batch_action::MOVE_LEFT: sim.move(j, direction::LEFT, 1); break;
+                case batch_action::MOVE_RIGHT: sim.move(j, direction::RIGHT, 1); break;
+                case batch_action::TURN_LEFT: sim.turn(j, direction::LEFT); break;
+                case batch_action::TURN_RIGHT: sim.turn(j, direction::RIGHT); break;
+                case batch_action::TURN_AROUND: sim.turn(j, direction::DOWN); break;
+                case batch_action::COUNT: break;
+                }
+            }
+            gather(index, true);
+        };
+        workers.run(simulator_count, step_simulator);
+        return true;
+    }
+
+    /**
+     * Replaces the simulator at `index` with a new simulator with a new seed,
+     * and gathers the observations of its new agents.
+     *
+     * \returns `true` if successful; `false` otherwise, in which case the
+     *          batch cannot be stepped until the reset of `index` is
+     *          retried successfully. The batch can still be freed.
+     */
+    bool reset(unsigned int index) {
+        if (live[index]) {
+            core::free(simulators[index]);
+            live[index] = false;
+        }
+        reset_counts[index]++;
+        return init_simulator(index);
+    }
+
+    static inline void free(simulator_batch& batch) {
+        batch.free_helper();
+        core::free(batch.config);
+        core::free(batch.workers);
+    }
+
+private:
+    inline bool init_simulator(unsigned int index)
+    {
+        batch_simulator_data data;
+        uint_fast32_t simulator_seed = seed + index + reset_counts[index] * simulator_count;
+        if (!init(simulators[index], config, data, simulator_seed)) {
+            fprintf(stderr, "simulator_batch.init_simulator ERROR: Unable to initialize simulator.\n");
+            return false;
+        }
+        for (unsigned int j = 0; j < agent_count; j++) {
+            pair<uint64_t, agent_state*> new_agent = simulators[index].add_agent();
+            if (new_agent.key == UINT64_MAX) {
+                fprintf(stderr, "simulator_batch.init_simulator ERROR: Unable to add agent.\n");
+                core::free(simulators[index]); return false;
+            }
+            agents[index * agent_count + j] = new_agent.value;
+        }
+        live[index] = true;
+        gather(index, false);
+        return true;
+    }
+
+    /* copies the observations of simulator `index` into the gathered arrays */
+    inline void gather(unsigned int index, bool compare_positions)
+    {
+        const agent_observation_buffers& observations = simulators[index].get_observations();
+        size_t offset = (size_t) index * agent_count;
+        memcpy(scent + offset * scent_size(), observations.scent, sizeof(float) * agent_count * scent_size());
+        memcpy(vision + offset * vision_size(), observations.vision, sizeof(float) * agent_count * vision_size());
+        memcpy(items + offset * config.item_types.length, observations.items,
+                sizeof(unsigned int) * agent_count * config.item_types.length);
+        for (unsigned int j = 0; j < agent_count; j++) {
+            const agent_state& agent = *agents[offset + j];
+            int64_t* position = positions + 2 * (offset + j);
+            moved[offset + j] = compare_positions
+                    && (position[0] != agent.current_position.x || position[1] != agent.current_position.y);
+            position[0] = agent.current_position.x;
+            position[1] = agent.current_position.y;
+            directions[offset + j] = (int64_t) agent.current_direction;
+        }
+    }
+
+    inline bool init_helper(unsigned int new_simulator_count,
+            unsigned int new_agent_count, uint_fast32_t new_seed)
+    {
+        /* the simulators are stepped in parallel, so each one uses a single thread */
+        config.thread_count = 1;
+        simulator_count = new_simulator_count;
+        agent_count = new_agent_count;
+        seed = new_seed;
+
+        size_t total = (size_t) simulator_count * agent_count;
+        simulators = (simulator<batch_simulator_data>*) malloc(sizeof(simulator<batch_simulator_data>) * simulator_count);
+        live = (bool*) calloc(simulator_count, sizeof(bool));
+        reset_counts = (unsigned int*) calloc(simulator_count, sizeof(unsigned int));
+        agents = (agent_state**) malloc(sizeof(agent_state*) * max((size_t) 1, total));
+        /* the gathered arrays are packed into one block in order of decreasing alignment */
+        block = allocate_shared_block(sizeof(int64_t) * 3 * total
+                + sizeof(float) * total * (scent_size() + vision_size())
+                + sizeof(unsigned int) * total * config.item_types.length
+                + sizeof(bool) * total);
+        if (block != NULL) {
+            positions = (int64_t*) block->data();
+            directions = positions + 2 * total;
+            scent = (float*) (directions + total);
+            vision = scent + total * scent_size();
+            items = (unsigned int*) (vision + total * vision_size());
+            moved = (bool*) (items + total * config.item_types.length);
+            memset(positions, 0, sizeof(int64_t) * 2 * total);
+        }
+        if (simulators == NULL || live == NULL || reset_counts == NULL || agents == NULL || block == NULL) {
+            fprintf(stderr, "simulator_batch.init_helper ERROR: Out of memory.\n");
+            free_buffers(); return false;
+        }
+
+        for (unsigned int i = 0; i < simulator_count; i++) {
+            if (!init_simulator(i)) {
+                for (unsigned int j = 0; j < i; j++)
+                    core::free(simulators[j]);
+                free_buffers(); return false;
+            }
+        }
+        return true;
+    }
+
+    inline void free_buffers() {
+        if (simulators != NULL) core::free(simulators);
+        if (live != NULL) core::free(live);
+        if (reset_counts != NULL) core::free(reset_counts);
+        if (agents != NULL) core::free(agents);
+        if (block != NULL) release(block);
+    }
+
+    inline void free_helper() {
+        for (unsigned int i = 0; i < simulator_count; i++)
+            if (live[i]) core::free(simulators[i]);
+        free_buffers();
+    }
+
+    friend bool init(simulator_batch&, const simulator_config&,
+            unsigned int, unsigned int, uint_fast32_t, unsigned int);
+};
+
+/**
+ * Initializes the given simulator_batch `batch` with `simulator_count`
+ * simulators with the given `config`, each containing `agent_count` agents.
+ * The simulators are stepped in parallel using `thread_count` threads.
+ *
+ * \returns `true` if successful; `false` otherwise.
+ */
+inline bool init(simulator_batch& batch, const simulator_config& config,
+        unsigned int simulator_count, unsigned int agent_count,
+        uint_fast32_t seed, unsigned int thread_count)
+{
+    if (!init(batch.config, config)) {
+        return false;
+    } else if (!init(batch.workers, thread_count)) {
+        free(batch.config); return false;
+    } else if (!batch.init_helper(simulator_count, agent_count, seed)) {
+        free(batch.config); free(batch.workers);
+        return false;
+    }
+    return true;
+}
+
+} /* namespace nel */
+
+#endif /* NEL_SIMULATOR_BATCH_H_ */
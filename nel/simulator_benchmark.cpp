@@ -0,0 +1,483 @@
+/**
+ * Benchmarks of the hot paths of the simulator: Gibbs sampling, patch
+ * fixing, agent state updates, simulation steps, map retrieval, the
+ * diffusion model, serialization, and a client/server round trip. The
+ * results are written as a JSON object (to the file given as the first
+ * argument, or to stdout) so that runs can be compared across changes:
+ *
+ *     {"benchmarks": [{"name": ..., "iterations": ..., "items_per_iteration": ...,
+ *       "mean_ns": ..., "min_ns": ..., "max_ns": ..., "items_per_second": ...}, ...]}
+ *
+ * Progress messages are printed to stderr.
+ */
+
+#include "simulator.h"
+#include "mpi.h"
+
+#include <core/timer.h>
+#include <condition_variable>
+#include <random>
+#include <signal.h>
+
+using namespace core;
+using namespace nel;
+
+inline void set_interaction_args(
+		item_properties* item_types, unsigned int first_item_type,
+		unsigned int second_item_type, interaction_function interaction,
+		std::initializer_list<float> args)
+{
+	item_types[first_item_type].interaction_fns[second_item_type] = interaction;
+	item_types[first_item_type].interaction_fn_arg_counts[second_item_type] = (unsigned int) args.size();
+	item_types[first_item_type].interaction_fn_args[second_item_type] = (float*) malloc(max((size_t) 1, sizeof(float) * args.size()));
+
+	unsigned int counter = 0;
+	for (auto i = args.begin(); i != args.end(); i++) {
+		item_types[first_item_type].interaction_fn_args[second_item_type][counter] = *i;
+		counter++;
+	}
+}
+
+/* the same three item types as in `simulator_test.cpp` */
+void init_benchmark_config(simulator_config& config)
+{
+	config.max_steps_per_movement = 1;
+	config.scent_dimension = 3;
+	config.color_dimension = 3;
+	config.vision_range = 10;
+	for (unsigned int i = 0; i < (size_t) direction::COUNT; i++)
+		config.allowed_movement_directions[i] = true;
+	for (unsigned int i = 0; i < (size_t) direction::COUNT; i++)
+		config.allowed_rotations[i] = true;
+	config.patch_size = 32;
+	config.gibbs_iterations = 10;
+	config.agent_color = (float*) calloc(config.color_dimension, sizeof(float));
+	config.agent_color[2] = 1.0f;
+	config.collision_policy = movement_conflict_policy::FIRST_COME_FIRST_SERVED;
+	config.decay_param = 0.5f;
+	config.diffusion_param = 0.12f;
+	config.deleted_item_lifetime = 2000;
+
+	unsigned int item_type_count = 3;
+	const char* names[] = { "banana", "onion", "jellybean" };
+	const float intensities[] = { -5.0f, -5.4f, -5.0f };
+	config.item_types.ensure_capacity(item_type_count);
+	for (unsigned int i = 0; i < item_type_count; i++) {
+		item_properties& type = config.item_types[i];
+		type.name = names[i];
+		type.scent = (float*) calloc(config.scent_dimension, sizeof(float));
+		type.color = (float*) calloc(config.color_dimension, sizeof(float));
+		type.required_item_counts = (unsigned int*) calloc(item_type_count, sizeof(unsigned int));
+		type.required_item_costs = (unsigned int*) calloc(item_type_count, sizeof(unsigned int));
+		type.blocks_movement = false;
+		type.intensity_fn = constant_intensity_fn;
+		type.intensity_fn_arg_count = 1;
+		type.intensity_fn_args = (float*) malloc(sizeof(float) * 1);
+		type.intensity_fn_args[0] = intensities[i];
+		type.interaction_fns = (interaction_function*) malloc(sizeof(interaction_function) * item_type_count);
+		type.interaction_fn_args = (float**) malloc(sizeof(float*) * item_type_count);
+		type.interaction_fn_arg_counts = (unsigned int*) malloc(sizeof(unsigned int) * item_type_count);
+	}
+	config.item_types[0].scent[1] = 1.0f;
+	config.item_types[0].color[1] = 1.0f;
+	config.item_types[0].required_item_counts[0] = 1;
+	config.item_types[1].scent[0] = 1.0f;
+	config.item_types[1].color[0] = 1.0f;
+	config.item_types[1].required_item_counts[1] = 1;
+	config.item_types[2].scent[2] = 1.0f;
+	config.item_types[2].color[2] = 1.0f;
+	config.item_types.length = item_type_count;
+
+	set_interaction_args(config.item_types.data, 0, 0, piecewise_box_interaction_fn, {10.0f, 200.0f, 0.0f, -6.0f});
+	set_interaction_args(config.item_types.data, 0, 1, piecewise_box_interaction_fn, {200.0f, 0.0f, -6.0f, -6.0f});
+	set_interaction_args(config.item_types.data, 0, 2, piecewise_box_interaction_fn, {10.0f, 200.0f, 2.0f, -100.0f});
+	set_interaction_args(config.item_types.data, 1, 0, zero_interaction_fn, {});
+	set_interaction_args(config.item_types.data, 1, 1, zero_interaction_fn, {});
+	set_interaction_args(config.item_types.data, 1, 2, piecewise_box_interaction_fn, {200.0f, 0.0f, -100.0f, -100.0f});
+	set_interaction_args(config.item_types.data, 2, 0, piecewise_box_interaction_fn, {10.0f, 200.0f, 2.0f, -100.0f});
+	set_interaction_args(config.item_types.data, 2, 1, piecewise_box_interaction_fn, {200.0f, 0.0f, -100.0f, -100.0f});
+	set_interaction_args(config.item_types.data, 2, 2, piecewise_box_interaction_fn, {10.0f, 200.0f, 0.0f, -6.0f});
+}
+
+struct benchmark_result {
+	char name[64];
+	unsigned int iterations;
+	unsigned int items_per_iteration;
+	double mean_ns;
+	double min_ns;
+	double max_ns;
+
+	static inline void move(const benchmark_result& src, benchmark_result& dst) {
+		dst = src;
+	}
+};
+
+/**
+ * Calls `run_iteration(i)` for every `i` in `[0, iterations)`, timing each
+ * call, and adds the statistics to `results`. `items_per_iteration` is the
+ * number of units of work (e.g. patches or agents) processed by each
+ * iteration, from which the throughput is computed.
+ *
+ * \returns `true` if every iteration returned `true`; `false` otherwise.
+ */
+template<typename RunIteration>
+bool run_benchmark(array<benchmark_result>& results, const char* name,
+		unsigned int iterations, unsigned int items_per_iteration,
+		RunIteration run_iteration)
+{
+	if (!results.ensure_capacity(results.length + 1)) {
+		fprintf(stderr, "run_benchmark ERROR: Out of memory.\n");
+		return false;
+	}
+	benchmark_result& result = results[results.length];
+	snprintf(result.name, sizeof(result.name), "%s", name);
+	result.iterations = iterations;
+	result.items_per_iteration = items_per_iteration;
+	result.min_ns = 0.0; result.max_ns = 0.0;
+
+	timer stopwatch;
+	double total = 0.0;
+	for (unsigned int i = 0; i < iterations; i++) {
+		stopwatch.start();
+		if (!run_iteration(i)) {
+			fprintf(stderr, "run_benchmark ERROR: Iteration %u of '%s' failed.\n", i, name);
+			return false;
+		}
+		double elapsed = (double) stopwatch.nanoseconds();
+		total += elapsed;
+		if (i == 0 || elapsed < result.min_ns) result.min_ns = elapsed;
+		if (i == 0 || elapsed > result.max_ns) result.max_ns = elapsed;
+	}
+	result.mean_ns = (iterations == 0) ? 0.0 : (total / iterations);
+	results.length++;
+
+	fprintf(stderr, "%-32s %10.0lf ns/iteration (%u iterations)\n", name, result.mean_ns, iterations);
+	return true;
+}
+
+bool write_results(const array<benchmark_result>& results,
+		const simulator_config& config, FILE* out)
+{
+	fprintf(out, "{\n  \"patch_size\": %u,\n  \"gibbs_iterations\": %u,\n  \"benchmarks\": [",
+			config.patch_size, config.gibbs_iterations);
+	for (unsigned int i = 0; i < results.length; i++) {
+		const benchmark_result& result = results[i];
+		double items_per_second = (result.mean_ns == 0.0) ? 0.0 : (result.items_per_iteration * 1.0e9 / result.mean_ns);
+		fprintf(out, "%s\n    {\"name\": \"%s\", \"iterations\": %u, \"items_per_iteration\": %u,"
+				" \"mean_ns\": %.1lf, \"min_ns\": %.1lf, \"max_ns\": %.1lf, \"items_per_second\": %.3lf}",
+				(i == 0) ? "" : ",", result.name, result.iterations, result.items_per_iteration,
+				result.mean_ns, result.min_ns, result.max_ns, items_per_second);
+	}
+	fprintf(out, "\n  ]\n}\n");
+	return !ferror(out);
+}
+
+/* one sweep of Gibbs sampling over a new patch, which is never fixed */
+bool benchmark_gibbs_sampling(array<benchmark_result>& results, const simulator_config& config)
+{
+	const unsigned int n = config.patch_size;
+	map<patch_data, item_properties> world(n, config.gibbs_iterations,
+			config.item_types.data, (unsigned int) config.item_types.length, 0);
+	gibbs_field_cache<item_properties> cache(config.item_types.data, (unsigned int) config.item_types.length, n);
+	std::minstd_rand rng(0);
+
+	position patch_position(0, 0);
+	world.get_or_make_patch(patch_position);
+	gibbs_field<map<patch_data, item_properties>> field(world, cache, &patch_position, 1, n);
+	return run_benchmark(results, "gibbs_field.sample", 200, 1, [&](unsigned int i) {
+		field.sample(rng);
+		return true;
+	});
+}
+
+/* fixes patches in a new row of the map, so that each call creates and samples new patches */
+bool benchmark_fix_patches(array<benchmark_result>& results, const simulator_config& config)
+{
+	map<patch_data, item_properties> world(config.patch_size, config.gibbs_iterations,
+			config.item_types.data, (unsigned int) config.item_types.length, 0);
+	if (!run_benchmark(results, "map.fix_patch", 50, 1, [&](unsigned int i) {
+			world.fix_patch(position(4 * (int64_t) i, 0));
+			return true;
+		}))
+		return false;
+
+	/* `pregenerate` samples the patches in batches */
+	return run_benchmark(results, "map.pregenerate/4x4", 5, 16, [&](unsigned int i) {
+		int64_t offset = 8 * (int64_t) (i + 1) * config.patch_size;
+		world.pregenerate(position(0, offset), position(4 * config.patch_size - 1, offset + 4 * config.patch_size - 1));
+		return true;
+	});
+}
+
+bool benchmark_update_state(array<benchmark_result>& results, const simulator_config& config)
+{
+	simulator<empty_data>& sim = *((simulator<empty_data>*) alloca(sizeof(simulator<empty_data>)));
+	if (!init(sim, config, empty_data())) {
+		fprintf(stderr, "benchmark_update_state ERROR: Unable to initialize simulator.\n");
+		return false;
+	}
+	diffusion<double> scent_model;
+	if (!init(scent_model, (double) config.diffusion_param,
+			(double) config.decay_param, config.patch_size, config.deleted_item_lifetime))
+	{
+		fprintf(stderr, "benchmark_update_state ERROR: Unable to initialize scent model.\n");
+		free(sim); return false;
+	}
+
+	pair<uint64_t, agent_state*> new_agent = sim.add_agent();
+	if (new_agent.value == NULL) {
+		fprintf(stderr, "benchmark_update_state ERROR: Unable to add agent.\n");
+		free(scent_model); free(sim); return false;
+	}
+	patch<patch_data>* neighborhood[4]; position patch_positions[4];
+	sim.get_world().get_fixed_neighborhood(new_agent.value->current_position, neighborhood, patch_positions);
+	bool success = run_benchmark(results, "agent_state.update_state", 1000, 1, [&](unsigned int i) {
+		new_agent.value->update_state(neighborhood, scent_model, config, sim.time);
+		return true;
+	});
+	free(scent_model); free(sim);
+	return success;
+}
+
+/* moves every agent forward once per step, so that the step includes movement, collection, and observation updates */
+bool benchmark_step(array<benchmark_result>& results,
+		const simulator_config& config, unsigned int agent_count)
+{
+	simulator<empty_data>& sim = *((simulator<empty_data>*) alloca(sizeof(simulator<empty_data>)));
+	if (!init(sim, config, empty_data())) {
+		fprintf(stderr, "benchmark_step ERROR: Unable to initialize simulator.\n");
+		return false;
+	}
+
+	/* place the agents on a grid, so that they do not collide */
+	constexpr unsigned int row_length = 32;
+	for (unsigned int i = 0; i < agent_count; i++) {
+		position initial_position(3 * (int64_t) (i % row_length), 3 * (int64_t) (i / row_length));
+		if (sim.add_agent(initial_position, direction::UP, NULL).value == NULL) {
+			fprintf(stderr, "benchmark_step ERROR: Unable to add agent %u.\n", i);
+			free(sim); return false;
+		}
+	}
+
+	char name[64];
+	snprintf(name, sizeof(name), "simulator.step/agents=%u", agent_count);
+	unsigned int iterations = max(10u, 1000u / agent_count);
+	bool success = run_benchmark(results, name, iterations, agent_count, [&](unsigned int i) {
+		uint64_t time = sim.time;
+		for (unsigned int j = 0; j < agent_count; j++)
+			if (!sim.move(j, direction::UP, 1)) return false;
+		return sim.time == time + 1;
+	});
+	free(sim);
+	return success;
+}
+
+bool benchmark_get_map(array<benchmark_result>& results, const simulator_config& config)
+{
+	simulator<empty_data>& sim = *((simulator<empty_data>*) alloca(sizeof(simulator<empty_data>)));
+	if (!init(sim, config, empty_data())) {
+		fprintf(stderr, "benchmark_get_map ERROR: Unable to initialize simulator.\n");
+		return false;
+	}
+
+	static const unsigned int region_sizes[] = { 32, 128, 512 };
+	for (unsigned int region_size : region_sizes) {
+		position bottom_left(-(int64_t) region_size / 2, -(int64_t) region_size / 2);
+		position top_right = bottom_left + position(region_size - 1, region_size - 1);
+		sim.get_world().pregenerate(bottom_left, top_right);
+
+		char name[64];
+		snprintf(name, sizeof(name), "simulator.get_map/%ux%u", region_size, region_size);
+		unsigned int patch_count = (region_size + config.patch_size - 1) / config.patch_size + 1;
+		if (!run_benchmark(results, name, 20, patch_count * patch_count, [&](unsigned int i) {
+				hash_map<position, patch_state> patches(32);
+				bool success = sim.get_map(bottom_left, top_right, patches);
+				for (auto entry : patches)
+					free(entry.value);
+				return success;
+			}))
+		{
+			free(sim); return false;
+		}
+	}
+	free(sim);
+	return true;
+}
+
+bool benchmark_diffusion(array<benchmark_result>& results, const simulator_config& config)
+{
+	return run_benchmark(results, "diffusion.init", 5, 1, [&](unsigned int i) {
+		diffusion<double> scent_model;
+		if (!init(scent_model, (double) config.diffusion_param,
+				(double) config.decay_param, config.patch_size, config.deleted_item_lifetime))
+			return false;
+		free(scent_model);
+		return true;
+	});
+}
+
+bool benchmark_serialization(array<benchmark_result>& results, const simulator_config& config)
+{
+	simulator<empty_data>& sim = *((simulator<empty_data>*) alloca(sizeof(simulator<empty_data>)));
+	if (!init(sim, config, empty_data())) {
+		fprintf(stderr, "benchmark_serialization ERROR: Unable to initialize simulator.\n");
+		return false;
+	}
+	for (unsigned int i = 0; i < 100; i++) {
+		if (sim.add_agent(position(3 * (int64_t) i, 0), direction::UP, NULL).value == NULL) {
+			fprintf(stderr, "benchmark_serialization ERROR: Unable to add agent %u.\n", i);
+			free(sim); return false;
+		}
+	}
+	sim.get_world().pregenerate(position(-128, -128), position(127, 127));
+
+	memory_stream buffer(1 << 20);
+	bool success = run_benchmark(results, "simulator.write", 20, 1, [&](unsigned int i) {
+		buffer.position = 0;
+		fixed_width_stream<memory_stream> out(buffer);
+		return write(sim, out);
+	});
+	unsigned int length = buffer.position;
+	free(sim);
+	if (!success) {
+		free(buffer);
+		return false;
+	}
+
+	success = run_benchmark(results, "simulator.read", 20, 1, [&](unsigned int i) {
+		memory_stream in_buffer(buffer.buffer, length);
+		fixed_width_stream<memory_stream> in(in_buffer);
+		simulator<empty_data>& copy = *((simulator<empty_data>*) alloca(sizeof(simulator<empty_data>)));
+		if (!read(copy, in, empty_data(), config.thread_count, config.incremental_observations)) return false;
+		free(copy);
+		return true;
+	});
+	free(buffer);
+	return success;
+}
+
+struct benchmark_client_data {
+	bool waiting_for_server;
+	hash_map<position, patch_state>* map;
+};
+
+std::mutex client_lock;
+std::condition_variable client_cv;
+
+inline void notify_client(client<benchmark_client_data>& c) {
+	std::unique_lock<std::mutex> lck(client_lock);
+	c.data.waiting_for_server = false;
+	client_cv.notify_one();
+}
+
+void on_add_agent(client<benchmark_client_data>& c, uint64_t agent_id, const agent_state& state) { notify_client(c); }
+void on_move(client<benchmark_client_data>& c, uint64_t agent_id, bool request_success) { notify_client(c); }
+void on_turn(client<benchmark_client_data>& c, uint64_t agent_id, bool request_success) { notify_client(c); }
+
+void on_batch_actions(client<benchmark_client_data>& c, const uint64_t* agent_ids,
+		const bool* request_success, unsigned int action_count)
+{
+	notify_client(c);
+}
+
+void on_get_map(client<benchmark_client_data>& c, hash_map<position, patch_state>* map) {
+	std::unique_lock<std::mutex> lck(client_lock);
+	c.data.waiting_for_server = false;
+	c.data.map = map;
+	client_cv.notify_one();
+}
+
+void on_get_stats(client<benchmark_client_data>& c, stats_snapshot* stats) {
+	if (stats != NULL) free(stats);
+	notify_client(c);
+}
+
+void on_step(client<benchmark_client_data>& c,
+		const array<uint64_t>& agent_ids,
+		const agent_state* agent_states)
+{ }
+
+void on_lost_connection(client<benchmark_client_data>& c) {
+	fprintf(stderr, "on_lost_connection ERROR: The benchmark client lost its connection to the server.\n");
+	std::unique_lock<std::mutex> lck(client_lock);
+	c.client_running = false;
+	client_cv.notify_one();
+}
+
+/* the simulators in this program do not use the step callback */
+void on_step(const simulator<empty_data>* sim,
+		const array<agent_state*>& agents, uint64_t time)
+{ }
+
+/* sends `get_map` requests for a single patch, which measures the latency of a request and its response */
+bool benchmark_mpi(array<benchmark_result>& results, const simulator_config& config)
+{
+	simulator<empty_data> sim(config, empty_data());
+	sim.get_world().fix_patch(position(0, 0));
+
+	async_server server;
+	if (!init_server(server, sim, 54370, 16, 1)) {
+		fprintf(stderr, "benchmark_mpi ERROR: init_server returned false.\n");
+		return false;
+	}
+
+	client<benchmark_client_data> c;
+	if (init_client(c, "localhost", "54370", NULL, NULL, 0) == UINT64_MAX) {
+		fprintf(stderr, "benchmark_mpi ERROR: Unable to initialize client.\n");
+		stop_server(server); return false;
+	}
+
+	position top_right(config.patch_size - 1, config.patch_size - 1);
+	bool success = run_benchmark(results, "mpi.get_map_round_trip", 200, 1, [&](unsigned int i) {
+		c.data.waiting_for_server = true;
+		c.data.map = NULL;
+		if (!send_get_map(c, position(0, 0), top_right))
+			return false;
+
+		std::unique_lock<std::mutex> lck(client_lock);
+		while (c.data.waiting_for_server && c.client_running) client_cv.wait(lck);
+		if (c.data.map == NULL) return false;
+		for (auto entry : *c.data.map)
+			free(entry.value);
+		free(*c.data.map);
+		free(c.data.map);
+		return true;
+	});
+	stop_client(c);
+	stop_server(server);
+	return success;
+}
+
+int main(int argc, const char** argv)
+{
+#if !defined(_WIN32)
+	signal(SIGPIPE, SIG_IGN);
+#endif
+	simulator_config config;
+	init_benchmark_config(config);
+
+	array<benchmark_result> results(16);
+	bool success = benchmark_gibbs_sampling(results, config)
+		&& benchmark_fix_patches(results, config)
+		&& benchmark_update_state(results, config)
+		&& benchmark_step(results, config, 1)
+		&& benchmark_step(results, config, 100)
+		&& benchmark_step(results, config, 1000)
+		&& benchmark_get_map(results, config)
+		&& benchmark_diffusion(results, config)
+		&& benchmark_serialization(results, config)
+		&& benchmark_mpi(results, config);
+
+	FILE* out = stdout;
+	if (argc > 1) {
+		out = open_file(argv[1], "w");
+		if (out == NULL) {
+			fprintf(stderr, "ERROR: Unable to open '%s' for writing.\n", argv[1]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (!write_results(results, config, out))
+		success = false;
+	if (out != stdout) fclose(out);
+	return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
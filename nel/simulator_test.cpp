@@ -1,6 +1,7 @@
 #define _USE_MATH_DEFINES
 #include "simulator.h"
 #include "mpi.h"
+#include "shard.h"
 
 #include <core/timer.h>
 #include <cmath>
@@ -47,8 +48,16 @@ FILE* out = stderr;
 async_server server;
 
 //#define MULTITHREADED
+//#define USE_STEPPER
 //#define USE_MPI
+//#define TEST_BATCH_ACTIONS
+//#define TEST_SHARED_MEMORY
+//#define USE_SHARDS
+//#define TEST_STEP_ENCODING
 //#define TEST_SERIALIZATION
+//#define TEST_SNAPSHOT
+//#define TEST_EVICTION
+//#define TEST_MOVE_RESOLUTION
 //#define TEST_SERVER_CONNECTION_LOSS
 //#define TEST_CLIENT_CONNECTION_LOSS
 
@@ -131,13 +140,17 @@ void run_agent(simulator<empty_data>& sim, unsigned int id,
 	}
 }
 
+/* the number of steps whose time was not one more than that of the previous step */
+std::atomic_uint out_of_order_steps(0);
+
 void on_step(const simulator<empty_data>* sim,
 		const array<agent_state*>& agents, uint64_t time)
 {
 	sim_time++;
+	if (time != sim_time) out_of_order_steps++;
 
 	/* get agent states */
-	for (unsigned int i = 0; i < agents.length; i++)
+	for (unsigned int i = 0; i < agents.length && i < agent_count; i++)
 		agent_positions[i] = agents[i]->current_position;
 
 #if defined(USE_MPI)
@@ -203,7 +216,7 @@ bool test_singlethreaded(const simulator_config& config)
 			free(sim);
 			file = open_file(filename, "rb");
 			fixed_width_stream<FILE*> in(file);
-			if (!read(sim, in, empty_data())) {
+			if (!read(sim, in, empty_data(), config.thread_count, config.incremental_observations)) {
 				fprintf(stderr, "ERROR: read failed.\n");
 				free(sim); return false;
 			}
@@ -258,10 +271,292 @@ bool test_multithreaded(const simulator_config& config)
 	return true;
 }
 
+/* submits `max_time` actions for every agent from its own thread, while the simulator steps on its own thread */
+bool test_stepper(const simulator_config& config)
+{
+	constexpr unsigned int thread_count = 8;
+	simulator<empty_data> sim(config, empty_data());
+
+	/* the agents walk up in separate columns, so they never collide */
+	for (unsigned int i = 0; i < thread_count; i++) {
+		if (sim.add_agent(position(2 * (int64_t) i, 0), direction::UP, NULL).key == UINT64_MAX) {
+			fprintf(out, "test_stepper ERROR: Unable to add new agent.\n");
+			return false;
+		}
+	}
+	if (!sim.start_stepper()) {
+		fprintf(out, "test_stepper ERROR: Unable to start the stepper.\n");
+		return false;
+	}
+
+	/* an agent may only submit its action for the next step once its previous action was taken */
+	std::atomic_uint move_count(0);
+	std::thread threads[thread_count];
+	for (unsigned int i = 0; i < thread_count; i++) {
+		threads[i] = std::thread([&,i]() {
+			unsigned int submitted = 0;
+			while (submitted < max_time) {
+				if (sim.move(i, direction::UP, 1)) {
+					submitted++; move_count++;
+				} else {
+					std::this_thread::yield();
+				}
+			}
+		});
+	}
+	for (unsigned int i = 0; i < thread_count; i++) {
+		try {
+			threads[i].join();
+		} catch (...) { }
+	}
+
+	/* wait for the last step, which may still be running */
+	timer stopwatch;
+	while (sim_time < max_time && stopwatch.milliseconds() < 10000)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	sim.stop_stepper();
+
+	bool success = true;
+	if (sim_time != max_time || sim.time != max_time) {
+		fprintf(out, "test_stepper ERROR: Expected %u steps, but the step callback was invoked %u times and the simulator is at time %llu.\n",
+				max_time, sim_time, (unsigned long long) sim.time);
+		success = false;
+	}
+	if (out_of_order_steps != 0) {
+		fprintf(out, "test_stepper ERROR: %u steps were taken out of order.\n", out_of_order_steps.load());
+		success = false;
+	}
+	agent_state* agents[thread_count];
+	uint64_t agent_ids[thread_count];
+	for (unsigned int i = 0; i < thread_count; i++)
+		agent_ids[i] = i;
+	sim.get_agent_states(agents, agent_ids, thread_count);
+	for (unsigned int i = 0; i < thread_count; i++) {
+		const agent_state& agent = *agents[i];
+		if (agent.current_position != position(2 * (int64_t) i, max_time)) {
+			fprintf(out, "test_stepper ERROR: Agent %u is at ", i);
+			print(agent.current_position, out); fprintf(out, " rather than at ");
+			print(position(2 * (int64_t) i, max_time), out); print(".\n", out);
+			success = false;
+		}
+	}
+	if (success)
+		fprintf(out, "The stepper took each of the %u steps exactly once, with %u moves submitted from %u threads.\n",
+				max_time, move_count.load(), thread_count);
+	return success;
+}
+
+/* encodes a compact step response with `encoder`, and decodes it with `decoder` as the client would */
+bool transfer_step(step_codec& encoder, step_codec& decoder,
+		const array<uint64_t>& agent_ids, const array<agent_state*>& agents,
+		const simulator_config& config, uint64_t extra_data)
+{
+	if (!encode_step(encoder, message_type::COMPACT_STEP_RESPONSE, agent_ids, agents, config)
+	 || !put_step_extra_data(encoder, extra_data))
+	{
+		fprintf(out, "transfer_step ERROR: Unable to encode the step.\n");
+		return false;
+	}
+
+	/* the payload and the extra data must account for the whole message */
+	byte_reader in = {encoder.message.data, encoder.message.length, 0};
+	uint64_t type; uint8_t flags;
+	unsigned int payload_size, wire_size, extra_size;
+	if (!in.get(type) || !in.get(flags) || !in.get(payload_size) || !in.get(wire_size) || !in.get(extra_size)
+	 || type != (uint64_t) message_type::COMPACT_STEP_RESPONSE || in.position != step_codec::HEADER_SIZE
+	 || extra_size != sizeof(extra_data) || wire_size + extra_size != in.length - in.position)
+	{
+		fprintf(out, "transfer_step ERROR: The header of the step response is malformed.\n");
+		return false;
+	}
+	uint64_t received_extra_data;
+	memcpy(&received_extra_data, encoder.message.data + in.position + wire_size, sizeof(received_extra_data));
+	if (received_extra_data != extra_data) {
+		fprintf(out, "transfer_step ERROR: The extra data was not sent after the payload.\n");
+		return false;
+	}
+
+	if (!decoder.payload.ensure_capacity(payload_size)) return false;
+	if (flags & step_codec::COMPRESSED) {
+#if defined(NEL_USE_LZ4)
+		if (LZ4_decompress_safe(encoder.message.data + in.position, decoder.payload.data,
+				(int) wire_size, (int) payload_size) != (int) payload_size)
+		{
+			fprintf(out, "transfer_step ERROR: LZ4 decompression failed.\n");
+			return false;
+		}
+#endif
+	} else {
+		memcpy(decoder.payload.data, encoder.message.data + in.position, payload_size);
+	}
+	decoder.payload.length = payload_size;
+	return decode_step(decoder, config);
+}
+
+/* checks that `decoder` holds the states of the given agents, with the vision encoded in `format` */
+bool check_decoded_step(const step_codec& decoder,
+		const array<uint64_t>& agent_ids, const array<agent_state*>& agents,
+		const simulator_config& config, vision_format format)
+{
+	const unsigned int vision_size = (2*config.vision_range + 1) * (2*config.vision_range + 1) * config.color_dimension;
+	if (decoder.agent_ids.length != agent_ids.length) {
+		fprintf(out, "check_decoded_step ERROR: Expected %zu agents, but decoded %zu.\n",
+				agent_ids.length, decoder.agent_ids.length);
+		return false;
+	}
+	for (size_t i = 0; i < agent_ids.length; i++) {
+		const agent_state& agent = *agents[(size_t) agent_ids[i]];
+		const compact_agent_state& state = decoder.states[i];
+		if (decoder.agent_ids[i] != agent_ids[i]
+		 || state.current_position != agent.current_position
+		 || state.current_direction != agent.current_direction
+		 || state.agent_acted != agent.agent_acted
+		 || state.requested_position != agent.requested_position
+		 || state.requested_direction != agent.requested_direction
+		 || memcmp(state.scent, agent.current_scent, sizeof(float) * config.scent_dimension) != 0
+		 || memcmp(state.items, agent.collected_items, sizeof(unsigned int) * config.item_types.length) != 0)
+		{
+			fprintf(out, "check_decoded_step ERROR: The decoded state of agent %zu differs.\n", i);
+			return false;
+		}
+
+		/* the decoded vision is exact up to the quantization of `format` */
+		const float tolerance = (format == vision_format::UINT8) ? (0.5f / 255 + 1.0e-6f) : 0.0f;
+		for (unsigned int j = 0; j < vision_size; j++) {
+			float value = agent.current_vision[j];
+			float decoded = decode_vision_element(state.vision[j], format);
+			if (state.vision[j] != encode_vision_element(value, format)) {
+				fprintf(out, "check_decoded_step ERROR: Element %u of the vision of agent %zu differs.\n", j, i);
+				return false;
+			} else if (format == vision_format::FLOAT16) {
+				if (fabsf(decoded - value) > fabsf(value) / 2048 + 1.0e-7f) {
+					fprintf(out, "check_decoded_step ERROR: Element %u of the vision of agent %zu was decoded as %f rather than %f.\n", j, i, decoded, value);
+					return false;
+				}
+			} else if (fabsf(decoded - ((format == vision_format::UINT8) ? min(max(value, 0.0f), 1.0f) : value)) > tolerance) {
+				fprintf(out, "check_decoded_step ERROR: Element %u of the vision of agent %zu was decoded as %f rather than %f.\n", j, i, decoded, value);
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+/* checks that every half-precision float (other than NaN) survives the conversion to float and back, and the rounding of floats to half precision */
+bool test_float_to_half()
+{
+	bool success = true;
+	for (uint32_t half = 0; half <= UINT16_MAX; half++) {
+		bool is_nan = ((half & 0x7C00) == 0x7C00) && ((half & 0x3FF) != 0);
+		if (is_nan) {
+			if (!std::isnan(half_to_float((uint16_t) half))) {
+				fprintf(out, "test_float_to_half ERROR: 0x%04x was not converted to NaN.\n", half);
+				success = false;
+			}
+		} else if (float_to_half(half_to_float((uint16_t) half)) != half) {
+			fprintf(out, "test_float_to_half ERROR: 0x%04x was converted to %g and back to 0x%04x.\n",
+					half, half_to_float((uint16_t) half), float_to_half(half_to_float((uint16_t) half)));
+			success = false;
+		}
+	}
+
+	/* values between two half-precision floats are rounded to the nearest, with ties to even */
+	struct { float value; uint16_t expected; } cases[] = {
+		{1.0f + ldexpf(1.0f, -11), 0x3C00},
+		{1.0f + 3 * ldexpf(1.0f, -11), 0x3C02},
+		{65519.0f, 0x7BFF},
+		{65520.0f, 0x7C00},
+		{-1.0e10f, 0xFC00},
+		{ldexpf(1.0f, -25), 0x0000},
+		{1.5f * ldexpf(1.0f, -25), 0x0001},
+		{ldexpf(1.0f, -14) - ldexpf(1.0f, -26), 0x0400}
+	};
+	for (const auto& test_case : cases) {
+		if (float_to_half(test_case.value) != test_case.expected) {
+			fprintf(out, "test_float_to_half ERROR: %g was converted to 0x%04x rather than 0x%04x.\n",
+					test_case.value, float_to_half(test_case.value), test_case.expected);
+			success = false;
+		}
+	}
+	if (!std::isnan(half_to_float(float_to_half(NAN)))) {
+		fprintf(out, "test_float_to_half ERROR: NaN was not converted to NaN.\n");
+		success = false;
+	}
+	return success;
+}
+
+/* checks that compact step responses decode to the states of the agents, as they move through the world */
+bool test_step_encoding(const simulator_config& config)
+{
+	constexpr unsigned int encoded_agent_count = 4;
+	bool success = test_float_to_half();
+
+	simulator<empty_data> sim(config, empty_data());
+	array<uint64_t> agent_ids(encoded_agent_count);
+	array<agent_state*> agents(encoded_agent_count);
+	for (unsigned int i = 0; i < encoded_agent_count; i++) {
+		pair<uint64_t, agent_state*> new_agent = sim.add_agent(position(2 * (int64_t) i, 0), direction::UP, NULL);
+		if (new_agent.key == UINT64_MAX) {
+			fprintf(out, "test_step_encoding ERROR: Unable to add new agent.\n");
+			return false;
+		}
+		agent_ids[agent_ids.length++] = new_agent.key;
+	}
+	sim.get_agent_states(agents.data, agent_ids.data, encoded_agent_count);
+	agents.length = encoded_agent_count;
+
+	const vision_format formats[] = {vision_format::FLOAT32, vision_format::FLOAT16, vision_format::UINT8};
+	step_codec encoders[3], decoders[3];
+	for (unsigned int k = 0; k < 3; k++) {
+		encoders[k].encoding = {true, formats[k], false};
+		decoders[k].encoding = encoders[k].encoding;
+	}
+
+	/* the first step is a keyframe, and the following ones are deltas (the agents turn every few steps) */
+	for (unsigned int t = 0; success && t < max_time; t++) {
+		for (unsigned int k = 0; success && k < 3; k++) {
+			if (!transfer_step(encoders[k], decoders[k], agent_ids, agents, config, t)
+			 || !check_decoded_step(decoders[k], agent_ids, agents, config, formats[k]))
+			{
+				fprintf(out, "test_step_encoding ERROR: The step at time %u was not transferred in format %u.\n", t, (unsigned int) formats[k]);
+				success = false;
+			}
+		}
+		/* the agents move forward in lockstep, so they never collide */
+		for (unsigned int i = 0; success && i < encoded_agent_count; i++) {
+			if (!((t % 5 == 4) ? sim.turn(agent_ids[i], direction::LEFT) : sim.move(agent_ids[i], direction::UP, 1))) {
+				fprintf(out, "test_step_encoding ERROR: Unable to move agent %u.\n", i);
+				success = false;
+			}
+		}
+	}
+
+	/* a delta cannot be decoded without the previous states, after which the client requests a keyframe */
+	if (success) {
+		decoders[0].reset();
+		if (transfer_step(encoders[0], decoders[0], agent_ids, agents, config, max_time)) {
+			fprintf(out, "test_step_encoding ERROR: A delta was decoded without the previous states.\n");
+			success = false;
+		}
+		encoders[0].reset();
+		if (!transfer_step(encoders[0], decoders[0], agent_ids, agents, config, max_time)
+		 || !check_decoded_step(decoders[0], agent_ids, agents, config, formats[0]))
+		{
+			fprintf(out, "test_step_encoding ERROR: The keyframe after the resync was not decoded.\n");
+			success = false;
+		}
+	}
+
+	if (success)
+		fprintf(out, "The compact step responses of %u steps were decoded in every vision format.\n", max_time);
+	return success;
+}
+
 struct client_data {
 	unsigned int index;
 	uint64_t agent_id;
 	const hash_map<position, patch_state>* map;
+	stats_snapshot* stats;
 
 	bool action_result, waiting_for_step;
 	position pos;
@@ -292,6 +587,16 @@ void on_turn(client<client_data>& c, uint64_t agent_id, bool request_success) {
 	conditions[id].notify_one();
 }
 
+void on_batch_actions(client<client_data>& c, const uint64_t* agent_ids,
+		const bool* request_success, unsigned int action_count)
+{
+	unsigned int id = c.data.index;
+	std::unique_lock<std::mutex> lck(locks[id]);
+	waiting_for_server[id] = false;
+	c.data.action_result = (action_count == 1 && request_success[0]);
+	conditions[id].notify_one();
+}
+
 void on_get_map(client<client_data>& c, const hash_map<position, patch_state>* map) {
 	unsigned int id = c.data.index;
 	std::unique_lock<std::mutex> lck(locks[id]);
@@ -300,6 +605,14 @@ void on_get_map(client<client_data>& c, const hash_map<position, patch_state>* m
 	conditions[id].notify_one();
 }
 
+void on_get_stats(client<client_data>& c, stats_snapshot* stats) {
+	unsigned int id = c.data.index;
+	std::unique_lock<std::mutex> lck(locks[id]);
+	waiting_for_server[id] = false;
+	c.data.stats = stats;
+	conditions[id].notify_one();
+}
+
 void on_step(client<client_data>& c,
 		const array<uint64_t>& agent_ids,
 		const agent_state* agent_states)
@@ -468,10 +781,719 @@ bool test_mpi(const simulator_config& config)
 			client_threads[i].join();
 		} catch (...) { }
 	}
+
+	/* request the server statistics from a new client (the counters are only nonzero if NEL_ENABLE_STATS is defined) */
+	client<client_data> stats_client;
+	stats_client.data.index = 0;
+	stats_client.data.stats = NULL;
+	waiting_for_server[0] = true;
+	if (init_client(stats_client, "localhost", "54353", NULL, NULL, 0) == UINT64_MAX) {
+		fprintf(out, "ERROR: Unable to initialize the statistics client.\n");
+	} else if (!send_get_stats(stats_client)) {
+		fprintf(out, "ERROR: Unable to send get_stats request.\n");
+		stop_client(stats_client);
+	} else {
+		wait_for_server(conditions[0], locks[0], waiting_for_server[0], stats_client.client_running);
+		const stats_snapshot* stats = stats_client.data.stats;
+		if (stats == NULL) {
+			fprintf(out, "ERROR: Server returned failure for get_stats request.\n");
+		} else if (stats->enabled) {
+			const histogram_snapshot& total = stats->step_phases[(size_t) step_phase::TOTAL];
+			fprintf(out, "Server statistics: %llu steps (mean %lf ms), %llu patches generated, %llu bytes of step responses sent.\n",
+					(unsigned long long) total.count, (total.count == 0) ? 0.0 : (total.total_ns / 1.0e6 / total.count),
+					(unsigned long long) stats->patches_generated,
+					(unsigned long long) stats->bytes_sent[(size_t) message_type::STEP_RESPONSE]);
+		}
+		if (stats != NULL) free(stats_client.data.stats);
+		stop_client(stats_client);
+	}
 	cleanup_mpi(clients);
 	return true;
 }
 
+bool test_batch_actions(const simulator_config& config)
+{
+	simulator<empty_data> sim(config, empty_data());
+	if (!init_server(server, sim, 54353, 16, 4)) {
+		fprintf(out, "ERROR: init_server returned false.\n");
+		return false;
+	}
+
+	client<client_data> c;
+	c.data.index = 0;
+	if (init_client(c, "localhost", "54353", NULL, NULL, 0) == UINT64_MAX) {
+		fprintf(out, "ERROR: Unable to initialize client.\n");
+		stop_server(server); return false;
+	}
+	waiting_for_server[0] = true;
+	if (!send_add_agent(c)) {
+		fprintf(out, "ERROR: Unable to send add_agent request.\n");
+		cleanup_mpi(&c, 1); return false;
+	}
+	wait_for_server(conditions[0], locks[0], waiting_for_server[0], c.client_running);
+	if (c.data.agent_id == UINT64_MAX) {
+		fprintf(out, "ERROR: Server returned failure for add_agent request.\n");
+		cleanup_mpi(&c, 1); return false;
+	}
+	position start = agent_positions[0];
+
+	/* the server should drop a batch whose action count exceeds the actions
+	   in the message, and one with more actions than there are agents,
+	   without responding to either */
+	agent_action actions[] = {
+		{c.data.agent_id, action_type::MOVE, direction::UP, 1},
+		{c.data.agent_id, action_type::TURN, direction::LEFT, 0}
+	};
+	memory_stream mem_stream = memory_stream(sizeof(message_type) + sizeof(unsigned int) + SERIALIZED_ACTION_SIZE);
+	fixed_width_stream<memory_stream> frame_out(mem_stream);
+	if (!write(message_type::BATCH_ACTIONS, frame_out) || !write((unsigned int) UINT_MAX, frame_out)
+	 || !write(actions[0], frame_out) || !send_frame(c.connection, mem_stream.buffer, mem_stream.position)
+	 || !send_batch_actions(c, actions, 2))
+	{
+		fprintf(out, "ERROR: Unable to send the invalid batch_actions requests.\n");
+		cleanup_mpi(&c, 1); return false;
+	}
+
+	/* the next valid batch should be the first to get a response */
+	waiting_for_server[0] = true;
+	c.data.waiting_for_step = true;
+	if (!send_batch_actions(c, actions, 1)) {
+		fprintf(out, "ERROR: Unable to send batch_actions request.\n");
+		cleanup_mpi(&c, 1); return false;
+	}
+	wait_for_server(conditions[0], locks[0], waiting_for_server[0], c.client_running);
+	if (!c.client_running || !c.data.action_result) {
+		fprintf(out, "ERROR: The server did not accept the valid batch_actions request.\n");
+		cleanup_mpi(&c, 1); return false;
+	}
+	wait_for_server(conditions[0], locks[0], c.data.waiting_for_step, c.client_running);
+	if (!c.client_running || agent_positions[0] == start) {
+		fprintf(out, "ERROR: The batched move was not applied.\n");
+		cleanup_mpi(&c, 1); return false;
+	}
+	cleanup_mpi(&c, 1);
+	fprintf(out, "The server rejected the invalid batches and applied the valid one.\n");
+	return true;
+}
+
+#if defined(__linux__)
+bool test_shared_ring()
+{
+	/* a small ring, so that the producer wraps around it many times and waits for the consumer */
+	constexpr unsigned int entry_count = 10000;
+	shared_ring<shared_response, 8>& ring = *((shared_ring<shared_response, 8>*) alloca(sizeof(shared_ring<shared_response, 8>)));
+	new (&ring.head) std::atomic<uint32_t>(0);
+	new (&ring.tail) std::atomic<uint32_t>(0);
+	new (&ring.waiting) std::atomic<uint32_t>(0);
+
+	shared_response entry;
+	if (pop(ring, entry, 10)) {
+		fprintf(out, "test_shared_ring ERROR: An entry was removed from an empty ring.\n");
+		return false;
+	}
+
+	std::atomic_bool producer_success(true);
+	std::thread producer([&]() {
+		for (unsigned int i = 0; i < entry_count; i++) {
+			shared_response response = {(uint64_t) message_type::MOVE_RESPONSE, i, (uint64_t) i % 2};
+			if (!push(ring, response)) {
+				producer_success = false;
+				return;
+			}
+		}
+	});
+	bool success = true;
+	for (unsigned int i = 0; i < entry_count; i++) {
+		if (!pop(ring, entry, 1000)) {
+			fprintf(out, "test_shared_ring ERROR: Timed out waiting for entry %u.\n", i);
+			success = false; break;
+		} else if (entry.agent_id != i || entry.result != i % 2) {
+			fprintf(out, "test_shared_ring ERROR: Entry %u was received out of order.\n", i);
+			success = false; break;
+		}
+	}
+	producer.join();
+	if (!producer_success) {
+		fprintf(out, "test_shared_ring ERROR: The producer timed out on a ring that was being consumed.\n");
+		success = false;
+	}
+
+	/* a full ring should time out rather than overwrite unconsumed entries */
+	for (unsigned int i = 0; success && i < 8; i++)
+		success = push(ring, entry, 10);
+	if (success && push(ring, entry, 10)) {
+		fprintf(out, "test_shared_ring ERROR: An entry was added to a full ring.\n");
+		success = false;
+	}
+	return success;
+}
+
+bool test_shared_memory(const simulator_config& config)
+{
+	constexpr unsigned int shared_agent_count = 4;
+	if (!test_shared_ring()) return false;
+
+	simulator<empty_data> sim(config, empty_data());
+	array<uint64_t> agent_ids(shared_agent_count);
+	array<agent_state*> agents(shared_agent_count);
+	for (unsigned int i = 0; i < shared_agent_count; i++) {
+		pair<uint64_t, agent_state*> new_agent = sim.add_agent(position(2 * (int64_t) i, 0), direction::UP, NULL);
+		if (new_agent.key == UINT64_MAX) {
+			fprintf(out, "test_shared_memory ERROR: Unable to add new agent.\n");
+			return false;
+		}
+		agent_ids[agent_ids.length++] = new_agent.key;
+	}
+
+	/* the client should refuse a region that it cannot validate */
+	shared_memory_connection& invalid = *((shared_memory_connection*) alloca(sizeof(shared_memory_connection)));
+	shared_memory_client& c = *((shared_memory_client*) alloca(sizeof(shared_memory_client)));
+	if (!init(invalid, config, shared_agent_count)) {
+		fprintf(out, "test_shared_memory ERROR: Unable to create shared memory region.\n");
+		return false;
+	}
+	invalid.region->magic = 0;
+	bool mapped = init(c, invalid.name, config);
+	free(invalid);
+	if (mapped) {
+		fprintf(out, "test_shared_memory ERROR: The client mapped a region with an invalid header.\n");
+		free(c); return false;
+	}
+
+	shared_memory_connection& connection = *((shared_memory_connection*) alloca(sizeof(shared_memory_connection)));
+	if (!init(connection, config, shared_agent_count)) {
+		fprintf(out, "test_shared_memory ERROR: Unable to create shared memory region.\n");
+		return false;
+	} else if (!init(c, connection.name, config)) {
+		fprintf(out, "test_shared_memory ERROR: Unable to map shared memory region.\n");
+		free(connection); return false;
+	}
+	start<message_type>(connection, sim);
+
+	/* the actions of the client are applied by the server and acknowledged through the response ring */
+	bool success = true;
+	shared_response response;
+	for (unsigned int i = 0; success && i < shared_agent_count; i++) {
+		shared_action action = {(uint64_t) message_type::TURN, agent_ids[i], (uint32_t) direction::LEFT, 0};
+		if (!c.push_action(action) || !pop(c.region->responses, response, 1000)) {
+			fprintf(out, "test_shared_memory ERROR: The turn of agent %u was not acknowledged.\n", i);
+			success = false;
+		} else if (response.type != (uint64_t) message_type::TURN_RESPONSE || response.agent_id != agent_ids[i] || !response.result) {
+			fprintf(out, "test_shared_memory ERROR: The turn of agent %u was not applied.\n", i);
+			success = false;
+		}
+	}
+
+	/* the step written by the server should be read in place by the client */
+	const unsigned int vision_size = (2*config.vision_range + 1) * (2*config.vision_range + 1) * config.color_dimension;
+	uint64_t time = 0;
+	if (success) {
+		sim.get_agent_states(agents.data, agent_ids.data, shared_agent_count);
+		agents.length = shared_agent_count;
+		if (!send_shared_step<message_type>(connection, agent_ids, agents, config, sim.time)
+		 || !pop(c.region->responses, response, 1000) || response.type != (uint64_t) message_type::STEP_RESPONSE)
+		{
+			fprintf(out, "test_shared_memory ERROR: The step was not sent through shared memory.\n");
+			success = false;
+		} else {
+			read_shared_step(c);
+			if (!c.read_extra(time) || time != sim.time) {
+				fprintf(out, "test_shared_memory ERROR: The extra data of the step is incorrect.\n");
+				success = false;
+			}
+		}
+	}
+	for (unsigned int i = 0; success && i < shared_agent_count; i++) {
+		const agent_state& expected = *agents[i];
+		const agent_state& actual = c.agents[i];
+		if (c.agent_ids.length != shared_agent_count || c.agent_ids[i] != agent_ids[i]
+		 || actual.current_position != expected.current_position || actual.current_direction != expected.current_direction
+		 || memcmp(actual.current_scent, expected.current_scent, sizeof(float) * config.scent_dimension) != 0
+		 || memcmp(actual.current_vision, expected.current_vision, sizeof(float) * vision_size) != 0
+		 || memcmp(actual.collected_items, expected.collected_items, sizeof(unsigned int) * config.item_types.length) != 0)
+		{
+			fprintf(out, "test_shared_memory ERROR: The state of agent %u differs from the server.\n", i);
+			success = false;
+		}
+	}
+
+	/* the server should fall back to TCP when the agents do not fit in the region */
+	if (success) {
+		agent_ids.add(agent_ids[0]);
+		if (send_shared_step<message_type>(connection, agent_ids, agents, config, sim.time)) {
+			fprintf(out, "test_shared_memory ERROR: More agents were sent than fit in the region.\n");
+			success = false;
+		}
+	}
+	free(connection);
+	free(c);
+	if (success)
+		fprintf(out, "The actions and steps of %u agents were exchanged through shared memory.\n", shared_agent_count);
+	return success;
+}
+#endif
+
+/* the state of an agent just before the synchronization in which it may
+   migrate, which its new shard compares against once it arrives */
+struct migration_record {
+	position current_position;
+	direction current_direction;
+	unsigned int* collected_items;
+};
+
+/* indexed by the shard that added the agent (the agent with global ID `i` was added by shard `i % 2`) */
+migration_record migration_records[2];
+std::mutex migration_lock;
+
+/* runs shard `index` of a world split at the patch x-coordinate 1, with one
+   agent that starts at `agent_position` and walks in `agent_direction` */
+bool run_shard(const simulator_config& config, unsigned int index,
+		position agent_position, direction agent_direction)
+{
+	static const int64_t boundaries[] = {1};
+	static const char* addresses[] = {"localhost", "localhost"};
+	static const char* ports[] = {"54360", "54361"};
+	const unsigned int item_type_count = (unsigned int) config.item_types.length;
+
+	simulator<empty_data> sim(config, empty_data());
+	auto get_agent = [&]() {
+		agent_state* agent; uint64_t local_id = 0;
+		sim.get_agent_states(&agent, &local_id, 1);
+		return agent;
+	};
+	shard<empty_data>& s = *((shard<empty_data>*) alloca(sizeof(shard<empty_data>)));
+	if (!init(s, sim, boundaries, 2, index, default_halo_radius(config))) {
+		fprintf(out, "ERROR: Unable to initialize shard %u.\n", index);
+		return false;
+	} else if (!start_shard(s, (uint16_t) (54360 + index), addresses, ports, 2)) {
+		fprintf(out, "ERROR: Unable to start shard %u.\n", index);
+		free(s); return false;
+	}
+
+	uint64_t agent_id = add_agent(s, agent_position, agent_direction);
+	bool success = (agent_id != UINT64_MAX);
+	if (success) {
+		/* give the agent some items, so that we can check that they migrate with it */
+		agent_state* agent = get_agent();
+		for (unsigned int i = 0; i < item_type_count; i++)
+			agent->collected_items[i] = 10 * (index + 1) + i;
+	}
+	for (unsigned int t = 0; success && t < max_time; t++) {
+		for (uint64_t i = 0; i < s.global_ids.length; i++)
+			sim.move(i, direction::UP, 1);
+
+		uint64_t resident_id = UINT64_MAX;
+		if (s.global_ids.length == 1) {
+			resident_id = s.global_ids[0];
+			const agent_state* agent = get_agent();
+			migration_record& record = migration_records[resident_id % 2];
+			std::unique_lock<std::mutex> lock(migration_lock);
+			record.current_position = agent->current_position;
+			record.current_direction = agent->current_direction;
+			memcpy(record.collected_items, agent->collected_items, sizeof(unsigned int) * item_type_count);
+		}
+		success = synchronize(s);
+
+		/* an agent that just arrived should be in the same state as when it left its previous shard */
+		if (success && s.global_ids.length == 1 && s.global_ids[0] != resident_id) {
+			const agent_state* agent = get_agent();
+			const migration_record& record = migration_records[s.global_ids[0] % 2];
+			std::unique_lock<std::mutex> lock(migration_lock);
+			if (agent->current_position != record.current_position
+			 || agent->current_direction != record.current_direction
+			 || memcmp(agent->collected_items, record.collected_items, sizeof(unsigned int) * item_type_count) != 0)
+			{
+				fprintf(out, "ERROR: The agent that migrated to shard %u did not keep its state.\n", index);
+				success = false;
+			}
+		}
+	}
+
+	/* the agents cross the boundary in opposite directions, so they should have swapped shards */
+	if (success && (s.global_ids.length != 1 || s.global_ids[0] == agent_id)) {
+		fprintf(out, "ERROR: The agent of shard %u did not migrate.\n", index);
+		success = false;
+	}
+	stop_shard(s); free(s);
+	return success;
+}
+
+bool test_shards(const simulator_config& config)
+{
+	for (unsigned int i = 0; i < 2; i++) {
+		migration_records[i].collected_items = (unsigned int*) calloc(config.item_types.length, sizeof(unsigned int));
+		if (migration_records[i].collected_items == NULL) {
+			fprintf(out, "ERROR: Out of memory.\n");
+			if (i > 0) free(migration_records[0].collected_items);
+			return false;
+		}
+	}
+
+	bool results[2];
+	std::thread shards[2];
+	shards[0] = std::thread([&]() { results[0] = run_shard(config, 0, position(16, 0), direction::RIGHT); });
+	shards[1] = std::thread([&]() { results[1] = run_shard(config, 1, position(48, 4), direction::LEFT); });
+	for (unsigned int i = 0; i < 2; i++) {
+		try {
+			shards[i].join();
+		} catch (...) { }
+	}
+	for (unsigned int i = 0; i < 2; i++)
+		free(migration_records[i].collected_items);
+	if (!results[0] || !results[1]) return false;
+	fprintf(out, "Both agents migrated across the shard boundary with their items.\n");
+	return true;
+}
+
+inline bool contains_item(const array<item>& items, const item& query) {
+	for (const item& i : items)
+		if (i.item_type == query.item_type && i.location == query.location
+		 && i.creation_time == query.creation_time && i.deletion_time == query.deletion_time)
+			return true;
+	return false;
+}
+
+/* checks that `first` and `second` have the same time, agents, and items within the given bounding box */
+bool check_same_state(const char* test_name,
+		simulator<empty_data>& first, simulator<empty_data>& second,
+		const simulator_config& config, position bottom_left, position top_right)
+{
+	if (first.time != second.time) {
+		fprintf(out, "%s ERROR: The simulators are at times %llu and %llu.\n", test_name,
+				(unsigned long long) first.time, (unsigned long long) second.time);
+		return false;
+	}
+
+	unsigned int count = (unsigned int) first.get_agent_count();
+	if (second.get_agent_count() != count) {
+		fprintf(out, "%s ERROR: The simulators have different numbers of agents.\n", test_name);
+		return false;
+	}
+	const unsigned int vision_size = (2*config.vision_range + 1) * (2*config.vision_range + 1) * config.color_dimension;
+	for (uint64_t id = 0; id < count; id++) {
+		agent_state* a; agent_state* b;
+		first.get_agent_states(&a, &id, 1);
+		second.get_agent_states(&b, &id, 1);
+		if (a->current_position != b->current_position || a->current_direction != b->current_direction
+		 || memcmp(a->current_scent, b->current_scent, sizeof(float) * config.scent_dimension) != 0
+		 || memcmp(a->current_vision, b->current_vision, sizeof(float) * vision_size) != 0
+		 || memcmp(a->collected_items, b->collected_items, sizeof(unsigned int) * config.item_types.length) != 0)
+		{
+			fprintf(out, "%s ERROR: The states of agent %llu differ.\n", test_name, (unsigned long long) id);
+			return false;
+		}
+	}
+
+	array<item> first_items(1024), second_items(1024);
+	if (!first.get_world().get_items(bottom_left, top_right, first_items)
+	 || !second.get_world().get_items(bottom_left, top_right, second_items))
+	{
+		fprintf(out, "%s ERROR: Unable to get the items of the map.\n", test_name);
+		return false;
+	} else if (first_items.length != second_items.length) {
+		fprintf(out, "%s ERROR: The maps contain %zu and %zu items.\n", test_name, first_items.length, second_items.length);
+		return false;
+	}
+	/* the patches may be visited in a different order, so each item is looked up */
+	for (const item& i : first_items) {
+		if (!contains_item(second_items, i)) {
+			fprintf(out, "%s ERROR: An item at ", test_name);
+			print(i.location, out); fprintf(out, " is missing.\n");
+			return false;
+		}
+	}
+	return true;
+}
+
+/* moves every agent of `sim` up by one cell, which completes a step, since the agents are in different columns */
+bool step_agents_up(simulator<empty_data>& sim) {
+	unsigned int count = (unsigned int) sim.get_agent_count();
+	for (unsigned int i = 0; i < count; i++)
+		if (!sim.move(i, direction::UP, 1)) return false;
+	return true;
+}
+
+bool test_snapshot(const simulator_config& config)
+{
+	constexpr unsigned int snapshot_agent_count = 4;
+	constexpr uint64_t extra_value = 0x12345678;
+	const position bottom_left(-64, -64), top_right(63, 63);
+
+	simulator<empty_data> sim(config, empty_data());
+	for (unsigned int i = 0; i < snapshot_agent_count; i++) {
+		if (sim.add_agent(position(3 * (int64_t) i, 0), direction::UP, NULL).key == UINT64_MAX) {
+			fprintf(out, "test_snapshot ERROR: Unable to add new agent.\n");
+			return false;
+		}
+	}
+	bool success = sim.pregenerate(bottom_left, top_right);
+	for (unsigned int t = 0; success && t < 10; t++)
+		success = step_agents_up(sim);
+	if (!success) {
+		fprintf(out, "test_snapshot ERROR: Unable to prepare the simulator.\n");
+		return false;
+	}
+
+	auto write_extra = [&](fixed_width_stream<FILE*>& out) { return write(extra_value, out); };
+	auto read_extra = [&](fixed_width_stream<FILE*>& in) {
+		uint64_t value;
+		return read(value, in) && value == extra_value;
+	};
+	if (!write_snapshot(sim, "simulator_snapshot", write_extra, 0)) {
+		fprintf(out, "test_snapshot ERROR: write_snapshot failed.\n");
+		return false;
+	} else if (!is_snapshot("simulator_snapshot")) {
+		fprintf(out, "test_snapshot ERROR: is_snapshot does not recognize the snapshot.\n");
+		remove("simulator_snapshot"); return false;
+	}
+
+	simulator<empty_data>& copy = *((simulator<empty_data>*) alloca(sizeof(simulator<empty_data>)));
+	if (!read_snapshot(copy, "simulator_snapshot", empty_data(), read_extra, config.thread_count, config.incremental_observations)) {
+		fprintf(out, "test_snapshot ERROR: read_snapshot failed.\n");
+		remove("simulator_snapshot"); return false;
+	}
+
+	/* the patches are loaded from the mapped file as they are accessed, and
+	   the two simulators should continue to agree as the agents move */
+	success = check_same_state("test_snapshot", sim, copy, config, bottom_left, top_right);
+	for (unsigned int t = 0; success && t < 10; t++) {
+		success = step_agents_up(sim) && step_agents_up(copy)
+			   && check_same_state("test_snapshot", sim, copy, config, bottom_left, top_right);
+	}
+	free(copy);
+	remove("simulator_snapshot");
+	if (success)
+		fprintf(out, "The simulator read from the snapshot is identical to the original.\n");
+	return success;
+}
+
+/* fills `items` with `count` distinct items, starting at `first` */
+inline void make_items(array<item>& items, unsigned int first, unsigned int count) {
+	items.length = 0;
+	for (unsigned int i = first; i < first + count; i++)
+		items[items.length++] = {i % 3, position((int64_t) i, -(int64_t) i), i, 2 * (uint64_t) i};
+}
+
+bool test_eviction_store()
+{
+	constexpr unsigned int small_count = 10;
+	const unsigned int large_count = (unsigned int) (eviction_store<item>::MIN_COMPACTION_LENGTH / sizeof(item)) + 1;
+	eviction_store<item>& store = *((eviction_store<item>*) alloca(sizeof(eviction_store<item>)));
+	if (!init(store, "simulator_eviction_store")) {
+		fprintf(out, "test_eviction_store ERROR: Unable to create the eviction store.\n");
+		return false;
+	}
+
+	/* the large patch is more than half of the file, so the store is compacted once it is loaded back */
+	array<item> items(large_count), loaded(small_count);
+	evicted_patch record;
+	memset(&record, 0, sizeof(record));
+	make_items(items, 0, large_count);
+	bool success = store.put(position(0, 0), items.data, large_count, record);
+	make_items(items, large_count, small_count);
+	success = success && store.put(position(1, 0), items.data, small_count, record);
+	make_items(items, large_count + small_count, small_count);
+	success = success && store.put(position(2, 0), items.data, small_count, record);
+	if (!success || !store.erase(position(0, 0))) {
+		fprintf(out, "test_eviction_store ERROR: Unable to evict and reload the patches.\n");
+		free(store); return false;
+	} else if (store.find(position(0, 0)) != NULL || store.garbage != 0
+			|| store.length != 2 * small_count * sizeof(item))
+	{
+		fprintf(out, "test_eviction_store ERROR: The garbage was not collected.\n");
+		free(store); return false;
+	}
+
+	/* the remaining patches should be read from their new offsets */
+	for (unsigned int i = 1; success && i < 3; i++) {
+		const evicted_patch* remaining = store.find(position(i, 0));
+		make_items(items, large_count + (i - 1) * small_count, small_count);
+		if (remaining == NULL || !store.read_items(*remaining, loaded)
+		 || loaded.length != small_count || memcmp(loaded.data, items.data, sizeof(item) * small_count) != 0)
+		{
+			fprintf(out, "test_eviction_store ERROR: The items of patch %u changed during compaction.\n", i);
+			success = false;
+		}
+	}
+	free(store);
+	return success;
+}
+
+bool test_eviction(const simulator_config& config)
+{
+	constexpr unsigned int evicting_agent_count = 4;
+	constexpr unsigned int walk_length = 256;
+	const position bottom_left(-64, -64), top_right(64, walk_length + 64);
+	if (!test_eviction_store()) return false;
+
+	/* the simulators are sampled with the same seed, so they generate the same world */
+	simulator<empty_data> sim(config, empty_data(), 0);
+	simulator<empty_data> evicting(config, empty_data(), 0);
+	if (!evicting.set_memory_budget(1, "simulator_eviction")) {
+		fprintf(out, "test_eviction ERROR: Unable to set the memory budget.\n");
+		return false;
+	}
+	for (unsigned int i = 0; i < evicting_agent_count; i++) {
+		if (sim.add_agent(position(3 * (int64_t) i, 0), direction::UP, NULL).key == UINT64_MAX
+		 || evicting.add_agent(position(3 * (int64_t) i, 0), direction::UP, NULL).key == UINT64_MAX)
+		{
+			fprintf(out, "test_eviction ERROR: Unable to add new agent.\n");
+			return false;
+		}
+	}
+
+	/* the agents walk away from the origin, so the patches behind them are
+	   evicted, and then walk back, so that those patches are reloaded */
+	bool success = true;
+	for (unsigned int t = 0; success && t < 2 * walk_length; t++) {
+		direction dir = (t < walk_length) ? direction::UP : direction::DOWN;
+		for (unsigned int i = 0; success && i < evicting_agent_count; i++)
+			success = sim.move(i, dir, 1) && evicting.move(i, dir, 1);
+		if (!success) {
+			fprintf(out, "test_eviction ERROR: Unable to move the agents at time %u.\n", t);
+		} else if (t + 1 == walk_length && evicting.get_world().evicted->index.table.size == 0) {
+			fprintf(out, "test_eviction ERROR: No patches were evicted.\n");
+			success = false;
+		} else if (t % 64 == 63) {
+			success = check_same_state("test_eviction", sim, evicting, config, bottom_left, top_right);
+		}
+	}
+	if (success)
+		fprintf(out, "The world with evicted patches is identical to the one kept in memory.\n");
+	return success;
+}
+
+/* returns `true` if a live item at `location` in the world of `sim` blocks movement */
+bool is_blocked(simulator<empty_data>& sim, const simulator_config& config, const position& location)
+{
+	array<item> items(4);
+	sim.get_world().get_items(location, location, items);
+	for (const item& i : items)
+		if (i.deletion_time == 0 && config.item_types[i.item_type].blocks_movement) return true;
+	return false;
+}
+
+/* resolves the moves of the agents to their `targets` (requested in the
+   given `order`) with the map from each target to its requesting agents
+   that the simulator used before it sorted the requests into a flat array,
+   and stores the resulting positions in `expected` */
+void resolve_moves_with_hash_map(simulator<empty_data>& sim, const simulator_config& config,
+		const position* current, const position* targets, const unsigned int* order,
+		unsigned int count, position* expected)
+{
+	hash_map<position, array<unsigned int>> requested_moves(32, alloc_position_keys);
+	for (unsigned int k = 0; k < count; k++) {
+		unsigned int i = order[k];
+		bool contains; unsigned int bucket;
+		requested_moves.check_size(alloc_position_keys);
+		array<unsigned int>& agents = requested_moves.get(targets[i], contains, bucket);
+		if (!contains) {
+			array_init(agents, 8);
+			requested_moves.table.keys[bucket] = targets[i];
+			requested_moves.table.size++;
+		}
+		agents.add(i);
+		if (current[i] == targets[i])
+			core::swap(agents[0], agents.last());
+	}
+
+	/* the first agent requesting each target moves there, unless an item blocks it */
+	array<position> occupied_positions(16);
+	for (auto entry : requested_moves) {
+		array<unsigned int>& conflicts = entry.value;
+		if (is_blocked(sim, config, entry.key)) {
+			occupied_positions.add(current[conflicts[0]]);
+			conflicts[0] = UINT_MAX;
+		}
+		for (unsigned int i = 1; i < conflicts.length; i++)
+			occupied_positions.add(current[conflicts[i]]);
+	}
+
+	/* agents that do not move keep their cells, so no agent can move there */
+	bool contains;
+	while (occupied_positions.length > 0) {
+		array<unsigned int>& conflicts = requested_moves.get(occupied_positions.pop(), contains);
+		if (!contains || conflicts[0] == UINT_MAX) continue;
+		for (unsigned int i = 0; i < conflicts.length; i++)
+			occupied_positions.add(current[conflicts[i]]);
+		conflicts[0] = UINT_MAX;
+	}
+
+	for (unsigned int i = 0; i < count; i++)
+		expected[i] = (requested_moves.get(targets[i])[0] == i) ? targets[i] : current[i];
+	for (auto entry : requested_moves)
+		free(entry.value);
+}
+
+bool test_move_resolution(const simulator_config& config)
+{
+	constexpr unsigned int crowd_width = 4, crowd_height = 3;
+	constexpr unsigned int crowd_size = crowd_width * crowd_height;
+	constexpr unsigned int step_count = 1000;
+	const direction directions[] = {direction::UP, direction::DOWN, direction::LEFT, direction::RIGHT};
+
+	/* one of the item types blocks movement, so that the blocked chains are resolved as well */
+	simulator_config resolution_config(config);
+	resolution_config.collision_policy = movement_conflict_policy::FIRST_COME_FIRST_SERVED;
+	resolution_config.item_types[2].blocks_movement = true;
+	simulator<empty_data> sim(resolution_config, empty_data(), 0);
+
+	/* the agents start next to each other, so that many of their moves conflict */
+	agent_state* agents[crowd_size];
+	for (unsigned int i = 0; i < crowd_size; i++) {
+		pair<uint64_t, agent_state*> new_agent = sim.add_agent(
+				position((int64_t) (i % crowd_width), (int64_t) (i / crowd_width)), direction::UP, NULL);
+		if (new_agent.key == UINT64_MAX) {
+			fprintf(out, "test_move_resolution ERROR: Unable to add new agent.\n");
+			return false;
+		}
+		agents[i] = new_agent.value;
+	}
+
+	std::minstd_rand rng(0);
+	unsigned int order[crowd_size];
+	position current[crowd_size], targets[crowd_size], expected[crowd_size];
+	unsigned int moved_count = 0, kept_count = 0;
+	for (unsigned int t = 0; t < step_count; t++) {
+		/* the agents act in a random order, and one in four turns in place instead of moving */
+		for (unsigned int i = 0; i < crowd_size; i++) {
+			order[i] = i;
+			current[i] = agents[i]->current_position;
+		}
+		for (unsigned int i = crowd_size - 1; i > 0; i--)
+			core::swap(order[i], order[rng() % (i + 1)]);
+		for (unsigned int k = 0; k < crowd_size; k++) {
+			unsigned int i = order[k];
+			bool success = (rng() % 4 == 0)
+					? sim.turn(i, direction::LEFT)
+					: sim.move(i, directions[rng() % 4], 1);
+			if (!success) {
+				fprintf(out, "test_move_resolution ERROR: Unable to move agent %u at time %u.\n", i, t);
+				return false;
+			}
+		}
+
+		/* the step has been taken, and each agent still holds its requested position */
+		for (unsigned int i = 0; i < crowd_size; i++)
+			targets[i] = agents[i]->requested_position;
+		resolve_moves_with_hash_map(sim, resolution_config, current, targets, order, crowd_size, expected);
+		for (unsigned int i = 0; i < crowd_size; i++) {
+			if (agents[i]->current_position != expected[i]) {
+				fprintf(out, "test_move_resolution ERROR: Agent %u moved to ", i);
+				print(agents[i]->current_position, out); fprintf(out, " at time %u, but should be at ", t);
+				print(expected[i], out); print(".\n", out);
+				return false;
+			}
+			if (current[i] == targets[i]) continue;
+			else if (expected[i] == targets[i]) moved_count++;
+			else kept_count++;
+		}
+	}
+	fprintf(out, "The flat move resolution agreed with the hash_map resolution for %u steps (%u moves, %u blocked).\n",
+			step_count, moved_count, kept_count);
+	return true;
+}
+
 int main(int argc, const char** argv)
 {
 #if !defined(_WIN32)
@@ -560,8 +1582,24 @@ int main(int argc, const char** argv)
 
 #if defined(USE_MPI)
 	test_mpi(config);
+#elif defined(TEST_BATCH_ACTIONS)
+	test_batch_actions(config);
+#elif defined(TEST_SHARED_MEMORY) && defined(__linux__)
+	test_shared_memory(config);
+#elif defined(USE_SHARDS)
+	test_shards(config);
 #elif defined(MULTITHREADED)
 	test_multithreaded(config);
+#elif defined(USE_STEPPER)
+	test_stepper(config);
+#elif defined(TEST_STEP_ENCODING)
+	test_step_encoding(config);
+#elif defined(TEST_SNAPSHOT)
+	test_snapshot(config);
+#elif defined(TEST_EVICTION)
+	test_eviction(config);
+#elif defined(TEST_MOVE_RESOLUTION)
+	test_move_resolution(config);
 #else
 	test_singlethreaded(config);
 #endif
@@ -0,0 +1,281 @@
+#ifndef NEL_SNAPSHOT_H_
+#define NEL_SNAPSHOT_H_
+
+#include <core/io.h>
+#include <core/utility.h>
+#include <stdio.h>
+#include <stdint.h>
+#include "position.h"
+
+#if !defined(_WIN32)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace nel {
+
+using namespace core;
+
+/**
+ * The header at the beginning of a snapshot file. A snapshot contains the
+ * same state as the stream written by `write(const simulator&, Stream&)`,
+ * but the patches of the map are stored separately from the remaining
+ * state, so that they can be accessed at random once the file is mapped
+ * into memory:
+ *
+ *  1. The header.
+ *  2. The state section, which is read with the usual stream functions
+ *     (it contains the map without any patches).
+ *  3. The patch index, an array of `patch_count` `snapshot_patch_record`
+ *     structures sorted by position.
+ *  4. The items of each patch, as contiguous arrays of `item` structures,
+ *     each of which begins at a multiple of `SNAPSHOT_ALIGNMENT` bytes.
+ *
+ * The index and the items are stored in the native layout of this machine,
+ * so snapshots should not be moved across architectures. `item_size` is used
+ * to detect mismatches.
+ */
+struct snapshot_header {
+	static constexpr uint64_t MAGIC = 0x31504E53204C454Eull; /* "NEL SNP1" */
+
+	uint64_t magic;
+	uint32_t item_size;
+	uint32_t record_size;
+	uint64_t state_offset;
+	uint64_t state_length;
+	uint64_t index_offset;
+	uint64_t patch_count;
+
+	/* identifies the base of an incremental checkpoint (see `checkpointer`), or 0 */
+	uint64_t generation;
+};
+
+struct snapshot_patch_record {
+	position key;
+
+	/* the offset of the items of this patch from the beginning of the file */
+	uint64_t item_offset;
+	uint32_t item_count;
+	uint32_t fixed;
+
+	inline bool operator < (const snapshot_patch_record& other) const {
+		return key < other.key;
+	}
+
+	static inline void move(const snapshot_patch_record& src, snapshot_patch_record& dst) {
+		dst = src;
+	}
+
+	static inline void swap(snapshot_patch_record& first, snapshot_patch_record& second) {
+		snapshot_patch_record temp = first;
+		first = second;
+		second = temp;
+	}
+};
+
+constexpr uint64_t SNAPSHOT_ALIGNMENT = 8;
+
+inline uint64_t align_snapshot_offset(uint64_t offset) {
+	return (offset + SNAPSHOT_ALIGNMENT - 1) & ~(SNAPSHOT_ALIGNMENT - 1);
+}
+
+/**
+ * Maps the file at `filepath` into memory as read-only (on Windows, the file
+ * is read into memory instead), storing its contents and size in `data` and
+ * `size`. The mapping is released by `unmap_snapshot_file`.
+ *
+ * \returns `true` if successful; `false` if the file could not be opened, or
+ *          if it is empty.
+ */
+inline bool map_snapshot_file(const char* filepath, const char*& data, size_t& size)
+{
+#if defined(_WIN32)
+	FILE* file = open_file(filepath, "rb");
+	if (file == NULL) return false;
+	fseek(file, 0, SEEK_END);
+	long length = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	char* contents = (length <= 0) ? NULL : (char*) malloc((size_t) length);
+	if (contents == NULL || fread(contents, 1, (size_t) length, file) != (size_t) length) {
+		if (contents != NULL) core::free(contents);
+		fclose(file); return false;
+	}
+	fclose(file);
+	data = contents;
+	size = (size_t) length;
+#else
+	int fd = open(filepath, O_RDONLY);
+	struct stat status;
+	if (fd == -1 || fstat(fd, &status) != 0) {
+		if (fd != -1) ::close(fd);
+		return false;
+	}
+	size = (size_t) status.st_size;
+	void* contents = (size == 0) ? MAP_FAILED : mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (contents == MAP_FAILED) return false;
+	data = (const char*) contents;
+#endif
+	return true;
+}
+
+inline void unmap_snapshot_file(const char* data, size_t size) {
+#if defined(_WIN32)
+	core::free((void*) data);
+#else
+	munmap((void*) data, size);
+#endif
+}
+
+/**
+ * A snapshot file that is mapped into memory (on Windows, it is read into
+ * memory instead). The patches are looked up with a binary search on the
+ * mapped index, so no per-patch state is constructed until the patch is
+ * accessed. The mapping is read-only, and the file must not be modified
+ * while it is mapped (it may, however, be deleted or replaced by renaming
+ * another file over it).
+ */
+struct mapped_snapshot {
+	const char* data;
+	size_t size;
+	const snapshot_header* header;
+	const snapshot_patch_record* records;
+
+	/* returns the record of the patch at `key`, or NULL if the snapshot does not contain it */
+	inline const snapshot_patch_record* find(const position& key) const {
+		size_t low = 0, high = (size_t) header->patch_count;
+		while (low < high) {
+			size_t middle = low + (high - low) / 2;
+			if (records[middle].key < key) low = middle + 1;
+			else if (key < records[middle].key) high = middle;
+			else return &records[middle];
+		}
+		return NULL;
+	}
+
+	static inline void free(mapped_snapshot& snapshot) {
+		unmap_snapshot_file(snapshot.data, snapshot.size);
+	}
+};
+
+/**
+ * Maps the snapshot file at `filepath` into memory, and checks that its
+ * header and index are consistent with the size of the file and with the
+ * layout of `Item`.
+ *
+ * \returns `true` if successful; `false` otherwise.
+ */
+template<typename Item>
+bool init(mapped_snapshot& snapshot, const char* filepath)
+{
+	if (!map_snapshot_file(filepath, snapshot.data, snapshot.size)) {
+		fprintf(stderr, "init ERROR: Unable to map snapshot '%s'.\n", filepath);
+		return false;
+	}
+
+	snapshot.header = (const snapshot_header*) snapshot.data;
+	const snapshot_header& header = *snapshot.header;
+	if (snapshot.size < sizeof(snapshot_header)) {
+		fprintf(stderr, "init ERROR: '%s' is not a valid snapshot.\n", filepath);
+		mapped_snapshot::free(snapshot); return false;
+	} else if (header.magic != snapshot_header::MAGIC
+	 || header.item_size != sizeof(Item) || header.record_size != sizeof(snapshot_patch_record)
+	 || header.state_offset + header.state_length > snapshot.size
+	 || header.index_offset % SNAPSHOT_ALIGNMENT != 0
+	 || header.index_offset + header.patch_count * sizeof(snapshot_patch_record) > snapshot.size)
+	{
+		fprintf(stderr, "init ERROR: '%s' is not a valid snapshot for this build.\n", filepath);
+		mapped_snapshot::free(snapshot); return false;
+	}
+	snapshot.records = (const snapshot_patch_record*) (snapshot.data + header.index_offset);
+	for (uint64_t i = 0; i < header.patch_count; i++) {
+		const snapshot_patch_record& record = snapshot.records[i];
+		if (record.item_offset % SNAPSHOT_ALIGNMENT != 0
+		 || record.item_offset + (uint64_t) record.item_count * sizeof(Item) > snapshot.size
+		 || (i > 0 && !(snapshot.records[i - 1].key < record.key)))
+		{
+			fprintf(stderr, "init ERROR: The patch index of snapshot '%s' is corrupt.\n", filepath);
+			mapped_snapshot::free(snapshot); return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * Returns `true` if the file at `filepath` begins with the header of a
+ * snapshot, rather than being in the stream format of
+ * `write(const simulator&, Stream&)`.
+ */
+inline bool is_snapshot(const char* filepath) {
+	FILE* file = open_file(filepath, "rb");
+	if (file == NULL) return false;
+	uint64_t magic;
+	bool result = (fread(&magic, sizeof(magic), 1, file) == 1 && magic == snapshot_header::MAGIC);
+	fclose(file);
+	return result;
+}
+
+/* writes `length` zero bytes to `out`, to pad the next section to `SNAPSHOT_ALIGNMENT` */
+inline bool write_snapshot_padding(FILE* out, uint64_t length) {
+	static const char zeros[SNAPSHOT_ALIGNMENT] = {0};
+	return length == 0 || fwrite(zeros, 1, (size_t) length, out) == length;
+}
+
+/**
+ * Writes the patch index `records`, which must be sorted by position, and
+ * the items of the patches to the snapshot file `out`, after its state
+ * section, which begins right after the header and ends at the offset
+ * `state_end`. The items of `records[i]` are given by `get_items(i)`, which
+ * returns a pointer to them that must remain valid until the next call (or
+ * NULL if they could not be retrieved), and is called once for each record,
+ * in order. The `item_offset` of each record is overwritten with the offset
+ * of its items in `out`. The header, with the given `generation`, is
+ * written last, at the beginning of the file. The items of each patch are
+ * written with a single `fwrite`.
+ *
+ * \returns `true` if successful; `false` otherwise.
+ */
+template<typename Item, typename ItemSource>
+bool write_snapshot_index(FILE* out, uint64_t state_end,
+		snapshot_patch_record* records, size_t record_count,
+		ItemSource& get_items, uint64_t generation = 0)
+{
+	uint64_t index_offset = align_snapshot_offset(state_end);
+	uint64_t offset = index_offset + record_count * sizeof(snapshot_patch_record);
+	for (size_t i = 0; i < record_count; i++) {
+		records[i].item_offset = offset;
+		offset = align_snapshot_offset(offset + (uint64_t) records[i].item_count * sizeof(Item));
+	}
+	if (!write_snapshot_padding(out, index_offset - state_end)
+	 || fwrite(records, sizeof(snapshot_patch_record), record_count, out) != record_count)
+		return false;
+
+	offset = index_offset + record_count * sizeof(snapshot_patch_record);
+	for (size_t i = 0; i < record_count; i++) {
+		uint64_t end = offset + (uint64_t) records[i].item_count * sizeof(Item);
+		const Item* items = get_items(i);
+		if (items == NULL
+		 || fwrite(items, sizeof(Item), records[i].item_count, out) != records[i].item_count
+		 || !write_snapshot_padding(out, align_snapshot_offset(end) - end))
+			return false;
+		offset = align_snapshot_offset(end);
+	}
+
+	snapshot_header header;
+	header.magic = snapshot_header::MAGIC;
+	header.item_size = (uint32_t) sizeof(Item);
+	header.record_size = (uint32_t) sizeof(snapshot_patch_record);
+	header.state_offset = sizeof(snapshot_header);
+	header.state_length = state_end - sizeof(snapshot_header);
+	header.index_offset = index_offset;
+	header.patch_count = record_count;
+	header.generation = generation;
+	return fseek(out, 0, SEEK_SET) == 0
+		&& fwrite(&header, sizeof(header), 1, out) == 1;
+}
+
+} /* namespace nel */
+
+#endif /* NEL_SNAPSHOT_H_ */
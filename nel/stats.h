@@ -0,0 +1,270 @@
+#ifndef NEL_STATS_H_
+#define NEL_STATS_H_
+
+#include <core/io.h>
+#include <atomic>
+#include <chrono>
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * The instrumentation of the simulator and the server is only compiled in if
+ * `NEL_ENABLE_STATS` is defined. Otherwise, the statements wrapped in
+ * `NEL_STATS` are removed, and `GET_STATS` requests are answered with an
+ * empty `stats_snapshot` whose `enabled` field is `false`.
+ */
+#if defined(NEL_ENABLE_STATS)
+#define NEL_STATS(...) __VA_ARGS__
+#else
+#define NEL_STATS(...)
+#endif
+
+namespace nel {
+
+using namespace core;
+
+/** The phases of `simulator::step` that are timed separately. */
+enum class step_phase : uint8_t {
+	RESOLVE_MOVES = 0,
+	MOVE_AGENTS,
+	REMOVE_EXPIRED_ITEMS,
+	UPDATE_OBSERVATIONS,
+	EVICT_PATCHES,
+	STEP_CALLBACK,
+	TOTAL,
+	COUNT
+};
+
+inline const char* step_phase_name(step_phase phase) {
+	switch (phase) {
+	case step_phase::RESOLVE_MOVES:        return "resolve_moves";
+	case step_phase::MOVE_AGENTS:          return "move_agents";
+	case step_phase::REMOVE_EXPIRED_ITEMS: return "remove_expired_items";
+	case step_phase::UPDATE_OBSERVATIONS:  return "update_observations";
+	case step_phase::EVICT_PATCHES:        return "evict_patches";
+	case step_phase::STEP_CALLBACK:        return "step_callback";
+	case step_phase::TOTAL:                return "total";
+	case step_phase::COUNT:                break;
+	}
+	return NULL;
+}
+
+/* the number of message types whose sent bytes are counted (see `message_type` in mpi.h) */
+constexpr unsigned int STATS_MESSAGE_TYPE_CAPACITY = 16;
+
+constexpr unsigned int HISTOGRAM_BUCKET_COUNT = 32;
+
+/**
+ * Returns the exclusive upper bound, in nanoseconds, of the durations counted
+ * in bucket `bucket` of a `latency_histogram`. Bucket 0 counts the durations
+ * below 1024 nanoseconds, and each following bucket doubles the bound. The
+ * last bucket also counts every longer duration.
+ */
+inline uint64_t histogram_bucket_bound(unsigned int bucket) {
+	return (uint64_t) 1024 << bucket;
+}
+
+inline unsigned int histogram_bucket(uint64_t nanoseconds) {
+	unsigned int bucket = 0;
+	nanoseconds >>= 10;
+	while (nanoseconds > 0 && bucket + 1 < HISTOGRAM_BUCKET_COUNT) {
+		nanoseconds >>= 1;
+		bucket++;
+	}
+	return bucket;
+}
+
+/** A copy of a `latency_histogram` at some point in time. */
+struct histogram_snapshot {
+	uint64_t count;
+	uint64_t total_ns;
+	uint64_t max_ns;
+	uint64_t buckets[HISTOGRAM_BUCKET_COUNT];
+};
+
+/**
+ * A histogram of durations with logarithmically-spaced buckets (see
+ * `histogram_bucket_bound`). It may be updated and read concurrently.
+ */
+struct latency_histogram {
+	std::atomic<uint64_t> count;
+	std::atomic<uint64_t> total_ns;
+	std::atomic<uint64_t> max_ns;
+	std::atomic<uint64_t> buckets[HISTOGRAM_BUCKET_COUNT];
+
+	inline void record(uint64_t nanoseconds) {
+		buckets[histogram_bucket(nanoseconds)].fetch_add(1, std::memory_order_relaxed);
+		count.fetch_add(1, std::memory_order_relaxed);
+		total_ns.fetch_add(nanoseconds, std::memory_order_relaxed);
+		uint64_t old_max = max_ns.load(std::memory_order_relaxed);
+		while (nanoseconds > old_max && !max_ns.compare_exchange_weak(old_max, nanoseconds, std::memory_order_relaxed)) { }
+	}
+
+	inline void get(histogram_snapshot& snapshot) const {
+		snapshot.count = count.load(std::memory_order_relaxed);
+		snapshot.total_ns = total_ns.load(std::memory_order_relaxed);
+		snapshot.max_ns = max_ns.load(std::memory_order_relaxed);
+		for (unsigned int i = 0; i < HISTOGRAM_BUCKET_COUNT; i++)
+			snapshot.buckets[i] = buckets[i].load(std::memory_order_relaxed);
+	}
+};
+
+/**
+ * A copy of the counters in `simulator_stats`, which is sent in response to
+ * a `GET_STATS` request. `bytes_sent[t]` is the number of bytes in the
+ * messages of type `t` sent by the server (excluding those sent over the
+ * shared-memory transport).
+ */
+struct stats_snapshot {
+	bool enabled;
+	histogram_snapshot step_phases[(size_t) step_phase::COUNT];
+	histogram_snapshot fix_patches;
+	uint64_t patches_generated;
+	uint64_t gibbs_iterations;
+	uint64_t messages_sent[STATS_MESSAGE_TYPE_CAPACITY];
+	uint64_t bytes_sent[STATS_MESSAGE_TYPE_CAPACITY];
+	uint64_t event_queue_depth;
+	uint64_t max_event_queue_depth;
+};
+
+template<typename Stream>
+inline bool read(histogram_snapshot& snapshot, Stream& in) {
+	return read(snapshot.count, in)
+		&& read(snapshot.total_ns, in)
+		&& read(snapshot.max_ns, in)
+		&& read(snapshot.buckets, in, HISTOGRAM_BUCKET_COUNT);
+}
+
+template<typename Stream>
+inline bool write(const histogram_snapshot& snapshot, Stream& out) {
+	return write(snapshot.count, out)
+		&& write(snapshot.total_ns, out)
+		&& write(snapshot.max_ns, out)
+		&& write(snapshot.buckets, out, HISTOGRAM_BUCKET_COUNT);
+}
+
+template<typename Stream>
+bool read(stats_snapshot& snapshot, Stream& in) {
+	if (!read(snapshot.enabled, in)) return false;
+	for (unsigned int i = 0; i < (size_t) step_phase::COUNT; i++)
+		if (!read(snapshot.step_phases[i], in)) return false;
+	return read(snapshot.fix_patches, in)
+		&& read(snapshot.patches_generated, in)
+		&& read(snapshot.gibbs_iterations, in)
+		&& read(snapshot.messages_sent, in, STATS_MESSAGE_TYPE_CAPACITY)
+		&& read(snapshot.bytes_sent, in, STATS_MESSAGE_TYPE_CAPACITY)
+		&& read(snapshot.event_queue_depth, in)
+		&& read(snapshot.max_event_queue_depth, in);
+}
+
+template<typename Stream>
+bool write(const stats_snapshot& snapshot, Stream& out) {
+	if (!write(snapshot.enabled, out)) return false;
+	for (unsigned int i = 0; i < (size_t) step_phase::COUNT; i++)
+		if (!write(snapshot.step_phases[i], out)) return false;
+	return write(snapshot.fix_patches, out)
+		&& write(snapshot.patches_generated, out)
+		&& write(snapshot.gibbs_iterations, out)
+		&& write(snapshot.messages_sent, out, STATS_MESSAGE_TYPE_CAPACITY)
+		&& write(snapshot.bytes_sent, out, STATS_MESSAGE_TYPE_CAPACITY)
+		&& write(snapshot.event_queue_depth, out)
+		&& write(snapshot.max_event_queue_depth, out);
+}
+
+/**
+ * The counters of the instrumented hot paths. There is a single instance per
+ * process (see `get_stats`), so if a process runs several simulators, their
+ * counters are combined. The counters are only updated if `NEL_ENABLE_STATS`
+ * is defined, and they use relaxed atomic operations, so that they may be
+ * read while the simulator is running.
+ */
+struct simulator_stats {
+	latency_histogram step_phases[(size_t) step_phase::COUNT];
+	latency_histogram fix_patches;
+	std::atomic<uint64_t> patches_generated;
+	std::atomic<uint64_t> gibbs_iterations;
+	std::atomic<uint64_t> messages_sent[STATS_MESSAGE_TYPE_CAPACITY];
+	std::atomic<uint64_t> bytes_sent[STATS_MESSAGE_TYPE_CAPACITY];
+	std::atomic<uint64_t> event_queue_depth;
+	std::atomic<uint64_t> max_event_queue_depth;
+
+	inline void record_phase(step_phase phase, uint64_t nanoseconds) {
+		step_phases[(size_t) phase].record(nanoseconds);
+	}
+
+	/* records the generation of `patch_count` patches with `iterations` sweeps of Gibbs sampling, which took `nanoseconds` */
+	inline void record_generation(uint64_t patch_count, uint64_t iterations, uint64_t nanoseconds) {
+		patches_generated.fetch_add(patch_count, std::memory_order_relaxed);
+		gibbs_iterations.fetch_add(iterations, std::memory_order_relaxed);
+		fix_patches.record(nanoseconds);
+	}
+
+	inline void record_message(uint64_t type, uint64_t length) {
+		if (type >= STATS_MESSAGE_TYPE_CAPACITY) return;
+		messages_sent[type].fetch_add(1, std::memory_order_relaxed);
+		bytes_sent[type].fetch_add(length, std::memory_order_relaxed);
+	}
+
+	inline void record_queue_depth(uint64_t depth) {
+		event_queue_depth.store(depth, std::memory_order_relaxed);
+		uint64_t old_max = max_event_queue_depth.load(std::memory_order_relaxed);
+		while (depth > old_max && !max_event_queue_depth.compare_exchange_weak(old_max, depth, std::memory_order_relaxed)) { }
+	}
+
+	void get(stats_snapshot& snapshot) const {
+		snapshot.enabled = true;
+		for (unsigned int i = 0; i < (size_t) step_phase::COUNT; i++)
+			step_phases[i].get(snapshot.step_phases[i]);
+		fix_patches.get(snapshot.fix_patches);
+		snapshot.patches_generated = patches_generated.load(std::memory_order_relaxed);
+		snapshot.gibbs_iterations = gibbs_iterations.load(std::memory_order_relaxed);
+		for (unsigned int i = 0; i < STATS_MESSAGE_TYPE_CAPACITY; i++) {
+			snapshot.messages_sent[i] = messages_sent[i].load(std::memory_order_relaxed);
+			snapshot.bytes_sent[i] = bytes_sent[i].load(std::memory_order_relaxed);
+		}
+		snapshot.event_queue_depth = event_queue_depth.load(std::memory_order_relaxed);
+		snapshot.max_event_queue_depth = max_event_queue_depth.load(std::memory_order_relaxed);
+	}
+};
+
+/* NOTE: the instance has static storage duration, so its counters start at zero */
+inline simulator_stats& get_stats() {
+	static simulator_stats stats;
+	return stats;
+}
+
+/**
+ * Stores the current counters in `snapshot`, or zeros with `enabled` set to
+ * `false` if the instrumentation is not compiled in.
+ */
+inline void get_stats(stats_snapshot& snapshot) {
+#if defined(NEL_ENABLE_STATS)
+	get_stats().get(snapshot);
+#else
+	memset(&snapshot, 0, sizeof(snapshot));
+	snapshot.enabled = false;
+#endif
+}
+
+/** Measures the time elapsed since it was constructed or since the last call to `lap`. */
+struct stats_stopwatch {
+	std::chrono::steady_clock::time_point start_time;
+
+	stats_stopwatch() : start_time(std::chrono::steady_clock::now()) { }
+
+	inline uint64_t nanoseconds() const {
+		return (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(
+				std::chrono::steady_clock::now() - start_time).count();
+	}
+
+	inline uint64_t lap() {
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		uint64_t elapsed = (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(now - start_time).count();
+		start_time = now;
+		return elapsed;
+	}
+};
+
+} /* namespace nel */
+
+#endif /* NEL_STATS_H_ */
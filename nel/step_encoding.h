@@ -0,0 +1,717 @@
+#ifndef NEL_STEP_ENCODING_H_
+#define NEL_STEP_ENCODING_H_
+
+#include "simulator.h"
+
+#if defined(NEL_USE_LZ4)
+#include <lz4.h>
+#endif
+
+namespace nel {
+
+using namespace core;
+
+/**
+ * The formats in which the elements of the vision of each agent are sent in a
+ * compact step response. `UINT8` assumes that the vision elements (colors)
+ * lie in [0, 1], and clamps them otherwise.
+ */
+enum class vision_format : uint8_t {
+	FLOAT32 = 0,
+	FLOAT16 = 1,
+	UINT8 = 2
+};
+
+/**
+ * The wire mode of the step responses sent to a client, which the client
+ * sends to the server when it connects (see `init_client` in mpi.h). If
+ * `compact` is `false`, the server sends the full state of every agent in a
+ * `STEP_RESPONSE`. Otherwise, it sends a `COMPACT_STEP_RESPONSE` that only
+ * contains the fields of each agent that changed since the previous step,
+ * with the vision sent as a sparse delta or a dense grid in the given
+ * `vision` format. If `compress` is `true` and the server was built with
+ * `NEL_USE_LZ4`, the payload is compressed with LZ4. A client that was built
+ * without `NEL_USE_LZ4` may not request compression.
+ */
+struct step_encoding {
+	bool compact;
+	vision_format vision;
+	bool compress;
+};
+
+template<typename Stream>
+inline bool read(step_encoding& encoding, Stream& in) {
+	uint8_t vision;
+	if (!read(encoding.compact, in) || !read(vision, in) || !read(encoding.compress, in))
+		return false;
+	encoding.vision = (vision_format) vision;
+	return true;
+}
+
+template<typename Stream>
+inline bool write(const step_encoding& encoding, Stream& out) {
+	return write(encoding.compact, out)
+		&& write((uint8_t) encoding.vision, out)
+		&& write(encoding.compress, out);
+}
+
+/* the number of bytes used to send each vision element in the given format */
+inline unsigned int element_size(vision_format format) {
+	switch (format) {
+	case vision_format::FLOAT32: return 4;
+	case vision_format::FLOAT16: return 2;
+	case vision_format::UINT8:   return 1;
+	}
+	return 0;
+}
+
+/* converts `value` to the bits of the nearest IEEE 754 half-precision float */
+inline uint16_t float_to_half(float value) {
+	uint32_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	uint32_t sign = (bits >> 16) & 0x8000;
+	int32_t exponent = (int32_t) ((bits >> 23) & 0xFF) - 127 + 15;
+	uint32_t mantissa = bits & 0x7FFFFF;
+
+	if (((bits >> 23) & 0xFF) == 0xFF) {
+		/* infinity or NaN */
+		return (uint16_t) (sign | 0x7C00 | (mantissa != 0 ? 0x200 : 0));
+	} else if (exponent >= 31) {
+		return (uint16_t) (sign | 0x7C00);
+	} else if (exponent <= 0) {
+		/* subnormal or zero */
+		if (exponent < -10) return (uint16_t) sign;
+		mantissa |= 0x800000;
+		uint32_t shift = (uint32_t) (14 - exponent);
+		uint32_t half = mantissa >> shift;
+		uint32_t remainder = mantissa & ((1u << shift) - 1);
+		uint32_t halfway = 1u << (shift - 1);
+		if (remainder > halfway || (remainder == halfway && (half & 1)))
+			half++;
+		return (uint16_t) (sign | half);
+	}
+
+	uint32_t half = sign | ((uint32_t) exponent << 10) | (mantissa >> 13);
+	uint32_t remainder = mantissa & 0x1FFF;
+	if (remainder > 0x1000 || (remainder == 0x1000 && (half & 1)))
+		half++; /* this correctly carries into the exponent */
+	return (uint16_t) half;
+}
+
+/* converts the bits of an IEEE 754 half-precision float to a float */
+inline float half_to_float(uint16_t half) {
+	uint32_t sign = (uint32_t) (half & 0x8000) << 16;
+	uint32_t exponent = (half >> 10) & 0x1F;
+	uint32_t mantissa = half & 0x3FF;
+
+	uint32_t bits;
+	if (exponent == 0x1F) {
+		bits = sign | 0x7F800000 | (mantissa << 13);
+	} else if (exponent != 0) {
+		bits = sign | ((exponent - 15 + 127) << 23) | (mantissa << 13);
+	} else if (mantissa == 0) {
+		bits = sign;
+	} else {
+		/* normalize the subnormal value */
+		exponent = 127 - 15 + 1;
+		while ((mantissa & 0x400) == 0) {
+			mantissa <<= 1;
+			exponent--;
+		}
+		bits = sign | (exponent << 23) | ((mantissa & 0x3FF) << 13);
+	}
+	float value;
+	memcpy(&value, &bits, sizeof(value));
+	return value;
+}
+
+inline uint32_t encode_vision_element(float value, vision_format format) {
+	switch (format) {
+	case vision_format::FLOAT32:
+		uint32_t bits;
+		memcpy(&bits, &value, sizeof(bits));
+		return bits;
+	case vision_format::FLOAT16:
+		return float_to_half(value);
+	case vision_format::UINT8:
+		return (uint32_t) (min(max(value, 0.0f), 1.0f) * 255.0f + 0.5f);
+	}
+	return 0;
+}
+
+inline float decode_vision_element(uint32_t element, vision_format format) {
+	switch (format) {
+	case vision_format::FLOAT32:
+		float value;
+		memcpy(&value, &element, sizeof(value));
+		return value;
+	case vision_format::FLOAT16:
+		return half_to_float((uint16_t) element);
+	case vision_format::UINT8:
+		return element / 255.0f;
+	}
+	return 0.0f;
+}
+
+/**
+ * A growable byte buffer that is reused across steps, so that encoding a
+ * step response does not allocate once the buffer is large enough. Its
+ * capacity is at most `MAX_CAPACITY` bytes.
+ */
+struct byte_buffer {
+	static constexpr size_t MAX_CAPACITY = ((size_t) 1) << 31;
+
+	char* data;
+	unsigned int length;
+	unsigned int capacity;
+
+	byte_buffer(unsigned int initial_capacity) {
+		if (!init_helper(initial_capacity))
+			exit(EXIT_FAILURE);
+	}
+
+	~byte_buffer() { core::free(data); }
+
+	inline bool ensure_capacity(size_t new_capacity) {
+		if (new_capacity <= capacity) return true;
+		if (new_capacity > MAX_CAPACITY) {
+			fprintf(stderr, "byte_buffer.ensure_capacity ERROR: Requested capacity exceeds MAX_CAPACITY.\n");
+			return false;
+		}
+		size_t next_capacity = max((size_t) 1, (size_t) capacity);
+		while (next_capacity < new_capacity)
+			next_capacity *= 2;
+		char* new_data = (char*) realloc(data, next_capacity);
+		if (new_data == NULL) {
+			fprintf(stderr, "byte_buffer.ensure_capacity ERROR: Out of memory.\n");
+			return false;
+		}
+		data = new_data;
+		capacity = (unsigned int) next_capacity;
+		return true;
+	}
+
+	inline bool put(const void* src, unsigned int bytes) {
+		if (!ensure_capacity((size_t) length + bytes)) return false;
+		memcpy(data + length, src, bytes);
+		length += bytes;
+		return true;
+	}
+
+	template<typename T>
+	inline bool put(const T& value) {
+		return put(&value, sizeof(T));
+	}
+
+	/* writes the lowest `bytes` bytes of `value` (host byte order) */
+	inline bool put_element(uint32_t value, unsigned int bytes) {
+		switch (bytes) {
+		case 1: return put((uint8_t) value);
+		case 2: return put((uint16_t) value);
+		default: return put(value);
+		}
+	}
+
+	static inline void move(const byte_buffer& src, byte_buffer& dst) {
+		dst.data = src.data;
+		dst.length = src.length;
+		dst.capacity = src.capacity;
+	}
+
+	static inline void free(byte_buffer& buffer) {
+		core::free(buffer.data);
+	}
+
+private:
+	inline bool init_helper(unsigned int initial_capacity) {
+		length = 0;
+		capacity = max(1u, initial_capacity);
+		data = (char*) malloc(capacity);
+		if (data == NULL) {
+			fprintf(stderr, "byte_buffer.init_helper ERROR: Out of memory.\n");
+			return false;
+		}
+		return true;
+	}
+
+	friend bool init(byte_buffer&, unsigned int);
+};
+
+inline bool init(byte_buffer& buffer, unsigned int initial_capacity) {
+	return buffer.init_helper(initial_capacity);
+}
+
+/* reads values from a byte array, failing instead of reading past its end */
+struct byte_reader {
+	const char* data;
+	unsigned int length;
+	unsigned int position;
+
+	inline bool get(void* dst, unsigned int bytes) {
+		if (bytes > length - position) return false;
+		memcpy(dst, data + position, bytes);
+		position += bytes;
+		return true;
+	}
+
+	template<typename T>
+	inline bool get(T& value) {
+		return get(&value, sizeof(T));
+	}
+
+	inline bool get_element(uint32_t& value, unsigned int bytes) {
+		uint8_t byte; uint16_t half;
+		switch (bytes) {
+		case 1: if (!get(byte)) return false; value = byte; return true;
+		case 2: if (!get(half)) return false; value = half; return true;
+		default: return get(value);
+		}
+	}
+};
+
+/**
+ * The state of an agent as last sent in a compact step response, which is
+ * kept by both ends of the connection. The vision is stored in its encoded
+ * form, so that the server only resends elements whose encoding changed, and
+ * quantization errors do not accumulate.
+ */
+struct compact_agent_state {
+	position current_position;
+	direction current_direction;
+	bool agent_acted;
+	position requested_position;
+	direction requested_direction;
+
+	/* a single allocation containing the scent, vision, and collected items */
+	float* scent;
+	uint32_t* vision;
+	unsigned int* items;
+
+	static inline void free(compact_agent_state& state) {
+		core::free(state.scent);
+	}
+};
+
+inline bool init(compact_agent_state& state, const simulator_config& config) {
+	unsigned int vision_size = (2*config.vision_range + 1) * (2*config.vision_range + 1) * config.color_dimension;
+	state.scent = (float*) malloc(max((size_t) 1, sizeof(float) * config.scent_dimension
+			+ sizeof(uint32_t) * vision_size + sizeof(unsigned int) * config.item_types.length));
+	if (state.scent == NULL) {
+		fprintf(stderr, "init ERROR: Insufficient memory for compact_agent_state.\n");
+		return false;
+	}
+	state.vision = (uint32_t*) (state.scent + config.scent_dimension);
+	state.items = (unsigned int*) (state.vision + vision_size);
+	return true;
+}
+
+/**
+ * The encoder (on the server) or decoder (on the client) of the compact step
+ * responses of one connection. Both ends keep the states of the agents from
+ * the previous step, in the order in which their IDs appear in the response.
+ * If the ID at some index differs from the previous step (or the encoder was
+ * reset), the server sends every field of that agent. The server resets its
+ * encoder if a response could not be sent, and if the client requests it
+ * with a `RESYNC_STEPS` message after failing to decode a response, so that
+ * the next response is a keyframe.
+ */
+struct step_codec {
+	/* the bits of the field mask that precedes each agent in the payload */
+	static constexpr uint8_t POSITION = 1 << 0;
+	static constexpr uint8_t DIRECTION = 1 << 1;
+	static constexpr uint8_t ACTION = 1 << 2;
+	static constexpr uint8_t SCENT = 1 << 3;
+	static constexpr uint8_t VISION = 1 << 4;
+	static constexpr uint8_t ITEMS = 1 << 5;
+	static constexpr uint8_t ALL_FIELDS = (1 << 6) - 1;
+
+	/* the ways in which the vision field is sent */
+	static constexpr uint8_t DENSE_VISION = 0;
+	static constexpr uint8_t SPARSE_VISION = 1;
+
+	/* the bits of the header flags */
+	static constexpr uint8_t COMPRESSED = 1 << 0;
+
+	/* the header of each message is its type, the flags, and the sizes of the payload (before
+	   and after compression) and of the extra data that follows the payload */
+	static constexpr unsigned int WIRE_SIZE_OFFSET = sizeof(uint64_t) + sizeof(uint8_t) + sizeof(unsigned int);
+	static constexpr unsigned int EXTRA_SIZE_OFFSET = WIRE_SIZE_OFFSET + sizeof(unsigned int);
+	static constexpr unsigned int HEADER_SIZE = EXTRA_SIZE_OFFSET + sizeof(unsigned int);
+
+	step_encoding encoding;
+	array<uint64_t> agent_ids;
+	array<compact_agent_state> states;
+
+	/* the encoded payload, the message as sent (or received), and the encoded vision of one agent */
+	byte_buffer payload;
+	byte_buffer message;
+	array<uint32_t> vision_scratch;
+
+	step_codec() : agent_ids(8), states(8), payload(1024), message(1024), vision_scratch(64) {
+		encoding = {false, vision_format::FLOAT32, false};
+	}
+
+	~step_codec() { free_states(); }
+
+	/* forgets the previous states, so that the next step is sent in full */
+	inline void reset() {
+		free_states();
+		agent_ids.clear();
+		states.clear();
+	}
+
+	/* forgets the previous states beyond the first `length` agents */
+	inline void truncate(size_t length) {
+		for (size_t i = length; i < states.length; i++)
+			core::free(states[i]);
+		if (length < states.length) {
+			states.length = length;
+			agent_ids.length = length;
+		}
+	}
+
+	static inline void move(const step_codec& src, step_codec& dst) {
+		dst.encoding = src.encoding;
+		core::move(src.agent_ids, dst.agent_ids);
+		core::move(src.states, dst.states);
+		byte_buffer::move(src.payload, dst.payload);
+		byte_buffer::move(src.message, dst.message);
+		core::move(src.vision_scratch, dst.vision_scratch);
+	}
+
+	static inline void free(step_codec& codec) {
+		codec.free_states();
+		core::free(codec.agent_ids);
+		core::free(codec.states);
+		core::free(codec.payload);
+		core::free(codec.message);
+		core::free(codec.vision_scratch);
+	}
+
+private:
+	inline void free_states() {
+		for (compact_agent_state& state : states)
+			core::free(state);
+	}
+};
+
+inline bool init(step_codec& codec) {
+	codec.encoding = {false, vision_format::FLOAT32, false};
+	if (!array_init(codec.agent_ids, 8)) {
+		return false;
+	} else if (!array_init(codec.states, 8)) {
+		free(codec.agent_ids); return false;
+	} else if (!init(codec.payload, 1024)) {
+		free(codec.agent_ids); free(codec.states); return false;
+	} else if (!init(codec.message, 1024)) {
+		free(codec.agent_ids); free(codec.states);
+		free(codec.payload); return false;
+	} else if (!array_init(codec.vision_scratch, 64)) {
+		free(codec.agent_ids); free(codec.states);
+		free(codec.payload); free(codec.message); return false;
+	}
+	return true;
+}
+
+/**
+ * Appends the given `extra_data` to `out`. Unlike `write_extra_data` in
+ * mpi.h, only fundamental types are supported.
+ */
+inline bool put_extra_data(byte_buffer& out) {
+	return true;
+}
+
+template<typename Data, typename... ExtraData,
+	typename std::enable_if<std::is_fundamental<typename std::decay<Data>::type>::value>::type* = nullptr>
+inline bool put_extra_data(byte_buffer& out, Data&& data, ExtraData&&... extra_data) {
+	return out.put((typename std::decay<Data>::type) data)
+		&& put_extra_data(out, std::forward<ExtraData>(extra_data)...);
+}
+
+/**
+ * Appends the given `extra_data` to the message encoded by `encode_step` in
+ * `codec.message`, and records its size in the header, so that a client that
+ * fails to decode the step still consumes the whole message.
+ */
+template<typename... ExtraData>
+inline bool put_step_extra_data(step_codec& codec, ExtraData&&... extra_data) {
+	unsigned int start = codec.message.length;
+	if (!put_extra_data(codec.message, std::forward<ExtraData>(extra_data)...))
+		return false;
+	unsigned int extra_size = codec.message.length - start;
+	memcpy(codec.message.data + step_codec::EXTRA_SIZE_OFFSET, &extra_size, sizeof(extra_size));
+	return true;
+}
+
+/**
+ * Encodes the states of the given agents (whose IDs are in `agent_ids`) as
+ * a compact step response in `codec.message`, including the message type
+ * `type`. Any extra data should then be appended with `put_step_extra_data`.
+ * The previous states in `codec` are updated, so if the message is then not
+ * delivered, `codec` must be reset.
+ *
+ * \returns `true` if successful; `false` otherwise, in which case `codec`
+ *          is reset.
+ */
+template<typename MessageType>
+bool encode_step(step_codec& codec, MessageType type,
+		const array<uint64_t>& agent_ids, const array<agent_state*>& agents,
+		const simulator_config& config)
+{
+	const vision_format format = codec.encoding.vision;
+	const unsigned int width = element_size(format);
+	const unsigned int vision_size = (2*config.vision_range + 1) * (2*config.vision_range + 1) * config.color_dimension;
+	const unsigned int item_count = (unsigned int) config.item_types.length;
+
+	byte_buffer& out = codec.payload;
+	out.length = 0;
+	if (!codec.vision_scratch.ensure_capacity(vision_size)
+	 || !codec.agent_ids.ensure_capacity(agent_ids.length)
+	 || !codec.states.ensure_capacity(agent_ids.length)
+	 || !out.put((uint8_t) format) || !out.put((unsigned int) agent_ids.length))
+	{
+		codec.reset(); return false;
+	}
+
+	for (size_t i = 0; i < agent_ids.length; i++) {
+		const agent_state& agent = *agents[(size_t) agent_ids[i]];
+		bool has_previous = (i < codec.agent_ids.length && codec.agent_ids[i] == agent_ids[i]);
+		if (!has_previous) {
+			if (i == codec.states.length) {
+				if (!init(codec.states[i], config)) {
+					codec.reset(); return false;
+				}
+				codec.states.length++;
+				codec.agent_ids.length++;
+			}
+			codec.agent_ids[i] = agent_ids[i];
+		}
+		compact_agent_state& previous = codec.states[i];
+
+		uint32_t* vision = codec.vision_scratch.data;
+		unsigned int changed_elements = 0;
+		for (unsigned int j = 0; j < vision_size; j++) {
+			vision[j] = encode_vision_element(agent.current_vision[j], format);
+			if (has_previous && vision[j] != previous.vision[j]) changed_elements++;
+		}
+
+		uint8_t mask = step_codec::ALL_FIELDS;
+		if (has_previous) {
+			mask = 0;
+			if (agent.current_position != previous.current_position) mask |= step_codec::POSITION;
+			if (agent.current_direction != previous.current_direction) mask |= step_codec::DIRECTION;
+			if (agent.agent_acted != previous.agent_acted
+			 || agent.requested_position != previous.requested_position
+			 || agent.requested_direction != previous.requested_direction)
+				mask |= step_codec::ACTION;
+			if (memcmp(agent.current_scent, previous.scent, sizeof(float) * config.scent_dimension) != 0)
+				mask |= step_codec::SCENT;
+			if (changed_elements > 0) mask |= step_codec::VISION;
+			if (memcmp(agent.collected_items, previous.items, sizeof(unsigned int) * item_count) != 0)
+				mask |= step_codec::ITEMS;
+		}
+
+		bool success = out.put(agent_ids[i]) && out.put(mask);
+		if (mask & step_codec::POSITION)
+			success &= out.put(agent.current_position.x) && out.put(agent.current_position.y);
+		if (mask & step_codec::DIRECTION)
+			success &= out.put((uint8_t) agent.current_direction);
+		if (mask & step_codec::ACTION) {
+			success &= out.put(agent.agent_acted)
+					&& out.put(agent.requested_position.x) && out.put(agent.requested_position.y)
+					&& out.put((uint8_t) agent.requested_direction);
+		}
+		if (mask & step_codec::SCENT)
+			success &= out.put(agent.current_scent, sizeof(float) * config.scent_dimension);
+		if (mask & step_codec::VISION) {
+			if (has_previous && (size_t) changed_elements * (sizeof(unsigned int) + width) < (size_t) vision_size * width) {
+				success &= out.put((uint8_t) step_codec::SPARSE_VISION) && out.put(changed_elements);
+				for (unsigned int j = 0; success && j < vision_size; j++) {
+					if (vision[j] != previous.vision[j])
+						success &= out.put(j) && out.put_element(vision[j], width);
+				}
+			} else {
+				success &= out.put((uint8_t) step_codec::DENSE_VISION);
+				for (unsigned int j = 0; success && j < vision_size; j++)
+					success &= out.put_element(vision[j], width);
+			}
+		}
+		if (mask & step_codec::ITEMS)
+			success &= out.put(agent.collected_items, sizeof(unsigned int) * item_count);
+		if (!success) {
+			codec.reset(); return false;
+		}
+
+		previous.current_position = agent.current_position;
+		previous.current_direction = agent.current_direction;
+		previous.agent_acted = agent.agent_acted;
+		previous.requested_position = agent.requested_position;
+		previous.requested_direction = agent.requested_direction;
+		memcpy(previous.scent, agent.current_scent, sizeof(float) * config.scent_dimension);
+		memcpy(previous.vision, vision, sizeof(uint32_t) * vision_size);
+		memcpy(previous.items, agent.collected_items, sizeof(unsigned int) * item_count);
+	}
+
+	codec.truncate(agent_ids.length);
+
+	/* write the header, followed by the (possibly compressed) payload */
+	byte_buffer& message = codec.message;
+	message.length = 0;
+	uint8_t flags = 0;
+#if defined(NEL_USE_LZ4)
+	if (codec.encoding.compress) flags |= step_codec::COMPRESSED;
+#endif
+	/* the compressed size and the size of the extra data are written once they are known */
+	if (!message.put((uint64_t) type) || !message.put(flags) || !message.put(out.length)
+	 || !message.put(out.length) || !message.put(0u)) {
+		codec.reset(); return false;
+	}
+
+	if (flags & step_codec::COMPRESSED) {
+#if defined(NEL_USE_LZ4)
+		int bound = LZ4_compressBound((int) out.length);
+		if (bound <= 0 || !message.ensure_capacity((size_t) step_codec::HEADER_SIZE + bound)) {
+			codec.reset(); return false;
+		}
+		int compressed_size = LZ4_compress_default(out.data,
+				message.data + step_codec::HEADER_SIZE, (int) out.length, bound);
+		if (compressed_size <= 0) {
+			fprintf(stderr, "encode_step ERROR: LZ4 compression failed.\n");
+			codec.reset(); return false;
+		}
+		unsigned int wire_size = (unsigned int) compressed_size;
+		memcpy(message.data + step_codec::WIRE_SIZE_OFFSET, &wire_size, sizeof(wire_size));
+		message.length = step_codec::HEADER_SIZE + wire_size;
+#endif
+	} else if (!message.put(out.data, out.length)) {
+		codec.reset(); return false;
+	}
+	return true;
+}
+
+/* decodes one agent of a compact step response from `in` into `state` */
+inline bool decode_agent(byte_reader& in, compact_agent_state& state,
+		uint8_t mask, vision_format format, const simulator_config& config)
+{
+	const unsigned int width = element_size(format);
+	const unsigned int vision_size = (2*config.vision_range + 1) * (2*config.vision_range + 1) * config.color_dimension;
+	uint8_t dir;
+	if ((mask & step_codec::POSITION)
+	 && (!in.get(state.current_position.x) || !in.get(state.current_position.y)))
+		return false;
+	if (mask & step_codec::DIRECTION) {
+		if (!in.get(dir)) return false;
+		state.current_direction = (direction) dir;
+	}
+	if (mask & step_codec::ACTION) {
+		if (!in.get(state.agent_acted)
+		 || !in.get(state.requested_position.x) || !in.get(state.requested_position.y)
+		 || !in.get(dir))
+			return false;
+		state.requested_direction = (direction) dir;
+	}
+	if ((mask & step_codec::SCENT) && !in.get(state.scent, sizeof(float) * config.scent_dimension))
+		return false;
+	if (mask & step_codec::VISION) {
+		uint8_t layout;
+		if (!in.get(layout)) return false;
+		if (layout == step_codec::SPARSE_VISION) {
+			unsigned int changed_elements, index;
+			if (!in.get(changed_elements)) return false;
+			for (unsigned int j = 0; j < changed_elements; j++) {
+				if (!in.get(index) || index >= vision_size
+				 || !in.get_element(state.vision[index], width))
+					return false;
+			}
+		} else {
+			for (unsigned int j = 0; j < vision_size; j++)
+				if (!in.get_element(state.vision[j], width)) return false;
+		}
+	}
+	if ((mask & step_codec::ITEMS)
+	 && !in.get(state.items, sizeof(unsigned int) * (unsigned int) config.item_types.length))
+		return false;
+	return true;
+}
+
+/**
+ * Initializes the agent_state `agent` (which owns its buffers) with the
+ * given compact_agent_state `state`, decoding its vision from `format`.
+ */
+inline bool init(agent_state& agent, const compact_agent_state& state,
+		vision_format format, const simulator_config& config)
+{
+	const unsigned int vision_size = (2*config.vision_range + 1) * (2*config.vision_range + 1) * config.color_dimension;
+	if (!init_observation_buffers(agent, config, NULL, NULL, NULL)) {
+		return false;
+	} else if (!init_observation_cache(agent, config)) {
+		free_observation_buffers(agent);
+		return false;
+	}
+	new (&agent.lock) std::mutex();
+
+	agent.current_position = state.current_position;
+	agent.current_direction = state.current_direction;
+	agent.agent_acted = state.agent_acted;
+	agent.requested_position = state.requested_position;
+	agent.requested_direction = state.requested_direction;
+	memcpy(agent.current_scent, state.scent, sizeof(float) * config.scent_dimension);
+	for (unsigned int j = 0; j < vision_size; j++)
+		agent.current_vision[j] = decode_vision_element(state.vision[j], format);
+	memcpy(agent.collected_items, state.items, sizeof(unsigned int) * config.item_types.length);
+	return true;
+}
+
+/**
+ * Decodes the payload of a compact step response in `codec.payload`,
+ * updating the previous states in `codec`. On success, `codec.agent_ids`
+ * contains the IDs of the agents in the response, and `codec.states` their
+ * states.
+ *
+ * \returns `true` if successful; `false` otherwise, in which case `codec`
+ *          is reset.
+ */
+inline bool decode_step(step_codec& codec, const simulator_config& config)
+{
+	byte_reader in = {codec.payload.data, codec.payload.length, 0};
+	uint8_t format; unsigned int agent_count;
+	if (!in.get(format) || !in.get(agent_count)
+	 || agent_count > (in.length - in.position) / (sizeof(uint64_t) + sizeof(uint8_t))
+	 || !codec.agent_ids.ensure_capacity(agent_count)
+	 || !codec.states.ensure_capacity(agent_count))
+	{
+		codec.reset(); return false;
+	}
+	codec.encoding.vision = (vision_format) format;
+
+	for (unsigned int i = 0; i < agent_count; i++) {
+		uint64_t agent_id; uint8_t mask;
+		if (!in.get(agent_id) || !in.get(mask)) {
+			codec.reset(); return false;
+		}
+		bool has_previous = (i < codec.agent_ids.length && codec.agent_ids[i] == agent_id);
+		if (!has_previous) {
+			if (mask != step_codec::ALL_FIELDS) {
+				fprintf(stderr, "decode_step ERROR: Received a delta for an agent without a previous state.\n");
+				codec.reset(); return false;
+			} else if (i == codec.states.length) {
+				if (!init(codec.states[i], config)) {
+					codec.reset(); return false;
+				}
+				codec.states.length++;
+				codec.agent_ids.length++;
+			}
+			codec.agent_ids[i] = agent_id;
+		}
+		if (!decode_agent(in, codec.states[i], mask, (vision_format) format, config)) {
+			fprintf(stderr, "decode_step ERROR: Malformed compact step response.\n");
+			codec.reset(); return false;
+		}
+	}
+	codec.truncate(agent_count);
+	return true;
+}
+
+} /* namespace nel */
+
+#endif /* NEL_STEP_ENCODING_H_ */
@@ -0,0 +1,195 @@
+#ifndef NEL_THREAD_POOL_H_
+#define NEL_THREAD_POOL_H_
+
+#include <core/core.h>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+namespace nel {
+
+using namespace core;
+
+/**
+ * A fixed-size pool of worker threads that executes data-parallel loops. A
+ * pool with `thread_count` threads dispatches `thread_count - 1` workers, and
+ * the thread that calls `run` participates in the work as well. Each task is
+ * given its index and the ID of the thread executing it, which is in
+ * `[0, thread_count)`, so that callers can maintain per-thread scratch space.
+ *
+ * Concurrent calls to `run` are serialized. `run` must not be called from
+ * within a task.
+ */
+struct thread_pool
+{
+	std::thread* workers;
+	unsigned int worker_count;
+
+	std::mutex run_lock;
+	std::mutex lock;
+	std::condition_variable start_cv;
+	std::condition_variable finish_cv;
+	uint64_t generation;
+	unsigned int busy_workers;
+	bool running;
+
+	/* the loop currently being executed */
+	void (*task)(void*, unsigned int, unsigned int);
+	void* task_data;
+	unsigned int task_count;
+	std::atomic_uint next_task;
+
+	thread_pool(unsigned int thread_count) {
+		if (!init_helper(thread_count))
+			exit(EXIT_FAILURE);
+	}
+
+	~thread_pool() { free_helper(); }
+
+	/**
+	 * Returns the number of threads (including the calling thread) that
+	 * execute the tasks given to `run`.
+	 */
+	inline unsigned int thread_count() const {
+		return worker_count + 1;
+	}
+
+	/**
+	 * Invokes `function(task_index, thread_id)` for every task index in
+	 * `[0, count)`, distributing the tasks across the threads in this pool.
+	 * This function returns once every task has completed.
+	 */
+	template<typename Function>
+	inline void run(unsigned int count, Function& function)
+	{
+		if (worker_count == 0 || count <= 1) {
+			for (unsigned int i = 0; i < count; i++)
+				function(i, 0);
+			return;
+		}
+
+		std::unique_lock<std::mutex> run_lck(run_lock);
+		std::unique_lock<std::mutex> lck(lock);
+		task = run_task<Function>;
+		task_data = (void*) &function;
+		task_count = count;
+		next_task = 0;
+		busy_workers = worker_count;
+		generation++;
+		start_cv.notify_all();
+		lck.unlock();
+
+		process_tasks(worker_count);
+
+		lck.lock();
+		while (busy_workers > 0)
+			finish_cv.wait(lck);
+	}
+
+	static inline void free(thread_pool& pool) {
+		pool.free_helper();
+		pool.run_lock.~mutex();
+		pool.lock.~mutex();
+		pool.start_cv.~condition_variable();
+		pool.finish_cv.~condition_variable();
+	}
+
+private:
+	template<typename Function>
+	static void run_task(void* data, unsigned int task_index, unsigned int thread_id) {
+		(*((Function*) data))(task_index, thread_id);
+	}
+
+	inline void process_tasks(unsigned int thread_id) {
+		while (true) {
+			unsigned int index = next_task++;
+			if (index >= task_count) return;
+			task(task_data, index, thread_id);
+		}
+	}
+
+	void run_worker(unsigned int thread_id) {
+		uint64_t last_generation = 0;
+		while (true) {
+			std::unique_lock<std::mutex> lck(lock);
+			while (running && generation == last_generation)
+				start_cv.wait(lck);
+			if (!running) return;
+			last_generation = generation;
+			lck.unlock();
+
+			process_tasks(thread_id);
+
+			lck.lock();
+			if (--busy_workers == 0)
+				finish_cv.notify_one();
+		}
+	}
+
+	inline bool init_helper(unsigned int thread_count) {
+		worker_count = (thread_count == 0) ? 0 : (thread_count - 1);
+		generation = 0;
+		busy_workers = 0;
+		running = true;
+		task_count = 0;
+		if (worker_count == 0) {
+			workers = NULL;
+			return true;
+		}
+
+		workers = (std::thread*) malloc(sizeof(std::thread) * worker_count);
+		if (workers == NULL) {
+			fprintf(stderr, "thread_pool.init_helper ERROR: Insufficient memory for workers.\n");
+			return false;
+		}
+		for (unsigned int i = 0; i < worker_count; i++)
+			new (&workers[i]) std::thread(&thread_pool::run_worker, this, i);
+		return true;
+	}
+
+	inline void free_helper() {
+		if (workers == NULL) return;
+		std::unique_lock<std::mutex> lck(lock);
+		running = false;
+		start_cv.notify_all();
+		lck.unlock();
+
+		for (unsigned int i = 0; i < worker_count; i++) {
+			if (workers[i].joinable()) {
+				try {
+					workers[i].join();
+				} catch (...) { }
+			}
+			workers[i].~thread();
+		}
+		core::free(workers);
+		workers = NULL;
+	}
+
+	friend bool init(thread_pool&, unsigned int);
+};
+
+/**
+ * Initializes the given thread_pool `pool` with `thread_count` threads
+ * (including the thread that calls `thread_pool.run`).
+ */
+inline bool init(thread_pool& pool, unsigned int thread_count) {
+	new (&pool.run_lock) std::mutex();
+	new (&pool.lock) std::mutex();
+	new (&pool.start_cv) std::condition_variable();
+	new (&pool.finish_cv) std::condition_variable();
+	new (&pool.next_task) std::atomic_uint(0);
+	if (!pool.init_helper(thread_count)) {
+		pool.run_lock.~mutex();
+		pool.lock.~mutex();
+		pool.start_cv.~condition_variable();
+		pool.finish_cv.~condition_variable();
+		return false;
+	}
+	return true;
+}
+
+} /* namespace nel */
+
+#endif /* NEL_THREAD_POOL_H_ */
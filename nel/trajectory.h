@@ -0,0 +1,592 @@
+#ifndef NEL_TRAJECTORY_H_
+#define NEL_TRAJECTORY_H_
+
+#include <core/array.h>
+#include <core/io.h>
+#include <core/utility.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+#include "position.h"
+#include "snapshot.h"
+
+#if defined(NEL_USE_LZ4)
+#include <lz4.h>
+#endif
+
+namespace nel {
+
+using namespace core;
+
+/**
+ * The header at the beginning of a trajectory file, which records the
+ * history of a simulator step by step (see `trajectory_recorder`). The
+ * header is followed by a sequence of chunks, each of which begins with a
+ * `trajectory_chunk_header` and covers a fixed number of consecutive steps
+ * (the last chunk may be shorter). A file whose writer was interrupted ends
+ * with an incomplete chunk, which is detected by comparing its `length` with
+ * the size of the file.
+ */
+struct trajectory_header {
+	static constexpr uint64_t MAGIC = 0x314A5254204C454Eull; /* "NEL TRJ1" */
+
+	uint64_t magic;
+
+	/* the number of item types, which is the number of `COLLECTED_ITEMS` elements per agent */
+	uint32_t item_type_count;
+
+	/* the number of columns in each chunk */
+	uint32_t column_count;
+};
+
+/**
+ * The columns of each chunk of a trajectory file, and the type of their
+ * elements. The step columns have an element for each step in the chunk.
+ * The agent columns have an element for each agent in each step, in order
+ * of time and then of agent ID, except `COLLECTED_ITEMS`, which has
+ * `item_type_count` elements for each agent in each step. The action of an
+ * agent is the direction and displacement that it requested in that step,
+ * or `NO_ACTION` if it did not act. The event columns have an element for
+ * each item that was created or collected, in the order in which they were
+ * recorded.
+ */
+enum class trajectory_column : uint32_t {
+	STEP_TIME = 0,      /* uint64 */
+	STEP_AGENT_COUNT,   /* uint32 */
+	AGENT_ID,           /* uint64 */
+	AGENT_X,            /* int64 */
+	AGENT_Y,            /* int64 */
+	AGENT_DIRECTION,    /* uint8 */
+	ACTION_DIRECTION,   /* uint8 */
+	ACTION_DX,          /* int32 */
+	ACTION_DY,          /* int32 */
+	COLLECTED_ITEMS,    /* uint32 */
+	EVENT_TIME,         /* uint64 */
+	EVENT_KIND,         /* uint8 (see `trajectory_event`) */
+	EVENT_ITEM_TYPE,    /* uint32 */
+	EVENT_X,            /* int64 */
+	EVENT_Y,            /* int64 */
+	COUNT
+};
+
+inline unsigned int trajectory_element_size(trajectory_column column) {
+	switch (column) {
+	case trajectory_column::STEP_TIME:        return sizeof(uint64_t);
+	case trajectory_column::STEP_AGENT_COUNT: return sizeof(uint32_t);
+	case trajectory_column::AGENT_ID:         return sizeof(uint64_t);
+	case trajectory_column::AGENT_X:          return sizeof(int64_t);
+	case trajectory_column::AGENT_Y:          return sizeof(int64_t);
+	case trajectory_column::AGENT_DIRECTION:  return sizeof(uint8_t);
+	case trajectory_column::ACTION_DIRECTION: return sizeof(uint8_t);
+	case trajectory_column::ACTION_DX:        return sizeof(int32_t);
+	case trajectory_column::ACTION_DY:        return sizeof(int32_t);
+	case trajectory_column::COLLECTED_ITEMS:  return sizeof(uint32_t);
+	case trajectory_column::EVENT_TIME:       return sizeof(uint64_t);
+	case trajectory_column::EVENT_KIND:       return sizeof(uint8_t);
+	case trajectory_column::EVENT_ITEM_TYPE:  return sizeof(uint32_t);
+	case trajectory_column::EVENT_X:          return sizeof(int64_t);
+	case trajectory_column::EVENT_Y:          return sizeof(int64_t);
+	case trajectory_column::COUNT:            break;
+	}
+	return 0;
+}
+
+/**
+ * The kinds of item events. An item is `CREATED` when the patch containing
+ * it is fixed (or, for the patches that were already fixed, when recording
+ * starts), and `COLLECTED` when an agent collects it.
+ */
+enum class trajectory_event : uint8_t {
+	CREATED = 0,
+	COLLECTED = 1
+};
+
+/**
+ * The encodings of the columns in a trajectory file. `RAW` columns are
+ * stored as arrays in the native layout of this machine, so they can be
+ * used directly once the file is mapped into memory. `LZ4` columns are
+ * compressed as a single LZ4 block.
+ */
+enum class trajectory_codec : uint8_t {
+	RAW = 0,
+	LZ4 = 1
+};
+
+/**
+ * Describes a column in a chunk of a trajectory file. The column contains
+ * `element_count` elements of `element_size` bytes, stored in
+ * `stored_length` bytes that begin at `offset` bytes from the beginning of
+ * the chunk, which is a multiple of `SNAPSHOT_ALIGNMENT`.
+ */
+struct trajectory_column_record {
+	uint32_t column;
+	uint8_t codec;
+	uint8_t element_size;
+	uint16_t reserved;
+	uint64_t element_count;
+	uint64_t offset;
+	uint64_t stored_length;
+};
+
+/**
+ * The header at the beginning of each chunk of a trajectory file, which is
+ * followed by `column_count` `trajectory_column_record` structures and
+ * then by the contents of the columns.
+ */
+struct trajectory_chunk_header {
+	static constexpr uint64_t MAGIC = 0x314B4843204C454Eull; /* "NEL CHK1" */
+
+	uint64_t magic;
+
+	/* the length of this chunk in bytes, including the header, which is a multiple of `SNAPSHOT_ALIGNMENT` */
+	uint64_t length;
+
+	/* the number of elements in the agent columns (other than `COLLECTED_ITEMS`) and the event columns */
+	uint64_t agent_row_count;
+	uint64_t event_count;
+
+	uint32_t step_count;
+	uint32_t column_count;
+};
+
+/* a growable array of the bytes in a column of a chunk that is being recorded */
+struct trajectory_column_buffer {
+	char* data;
+	size_t length;
+	size_t capacity;
+
+	inline bool ensure_capacity(size_t new_capacity) {
+		if (new_capacity <= capacity) return true;
+		size_t next_capacity = max((size_t) 1, capacity);
+		while (next_capacity < new_capacity)
+			next_capacity *= 2;
+		char* new_data = (char*) realloc(data, next_capacity);
+		if (new_data == NULL) {
+			fprintf(stderr, "trajectory_column_buffer.ensure_capacity ERROR: Out of memory.\n");
+			return false;
+		}
+		data = new_data;
+		capacity = next_capacity;
+		return true;
+	}
+
+	inline bool append(const void* src, size_t bytes) {
+		if (!ensure_capacity(length + bytes)) return false;
+		memcpy(data + length, src, bytes);
+		length += bytes;
+		return true;
+	}
+
+	template<typename T>
+	inline bool append(const T& value) {
+		return append(&value, sizeof(T));
+	}
+
+	static inline void free(trajectory_column_buffer& buffer) {
+		core::free(buffer.data);
+	}
+};
+
+inline bool init(trajectory_column_buffer& buffer, size_t initial_capacity) {
+	buffer.length = 0;
+	buffer.capacity = initial_capacity;
+	buffer.data = (char*) malloc(max((size_t) 1, initial_capacity));
+	if (buffer.data == NULL) {
+		fprintf(stderr, "init ERROR: Insufficient memory for trajectory_column_buffer.data.\n");
+		return false;
+	}
+	return true;
+}
+
+/* the columns of a chunk that is being recorded, or that is waiting to be written */
+struct trajectory_chunk {
+	uint32_t step_count;
+	uint64_t agent_row_count;
+	uint64_t event_count;
+	trajectory_column_buffer columns[(size_t) trajectory_column::COUNT];
+
+	inline trajectory_column_buffer& operator [] (trajectory_column column) {
+		return columns[(size_t) column];
+	}
+
+	inline bool empty() const {
+		return step_count == 0 && event_count == 0;
+	}
+
+	static inline void free(trajectory_chunk& chunk) {
+		for (unsigned int i = 0; i < (size_t) trajectory_column::COUNT; i++)
+			core::free(chunk.columns[i]);
+	}
+};
+
+inline bool init(trajectory_chunk& chunk) {
+	chunk.step_count = 0;
+	chunk.agent_row_count = 0;
+	chunk.event_count = 0;
+	for (unsigned int i = 0; i < (size_t) trajectory_column::COUNT; i++) {
+		if (!init(chunk.columns[i], 256)) {
+			for (unsigned int j = 0; j < i; j++)
+				core::free(chunk.columns[j]);
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * Writes `chunk` to the trajectory file `out`, compressing each column with
+ * LZ4 if `compress` is `true`, the library was built with `NEL_USE_LZ4`, and
+ * the compressed column is smaller.
+ *
+ * \returns `true` if successful; `false` otherwise.
+ */
+inline bool write_trajectory_chunk(trajectory_chunk& chunk, FILE* out, bool compress)
+{
+	constexpr unsigned int column_count = (unsigned int) trajectory_column::COUNT;
+	trajectory_column_record records[column_count];
+	char* compressed[column_count];
+	for (unsigned int i = 0; i < column_count; i++)
+		compressed[i] = NULL;
+	auto free_compressed = [&]() {
+		for (unsigned int i = 0; i < column_count; i++)
+			if (compressed[i] != NULL) core::free(compressed[i]);
+	};
+
+	uint64_t offset = align_snapshot_offset(sizeof(trajectory_chunk_header) + sizeof(records));
+	for (unsigned int i = 0; i < column_count; i++) {
+		const trajectory_column_buffer& column = chunk.columns[i];
+		trajectory_column_record& record = records[i];
+		record.column = i;
+		record.codec = (uint8_t) trajectory_codec::RAW;
+		record.element_size = (uint8_t) trajectory_element_size((trajectory_column) i);
+		record.reserved = 0;
+		record.element_count = column.length / record.element_size;
+		record.offset = offset;
+		record.stored_length = column.length;
+#if defined(NEL_USE_LZ4)
+		if (compress && column.length > 0 && column.length <= (size_t) INT_MAX) {
+			int bound = LZ4_compressBound((int) column.length);
+			compressed[i] = (char*) malloc((size_t) bound);
+			if (compressed[i] == NULL) {
+				fprintf(stderr, "write ERROR: Insufficient memory for compressed trajectory column.\n");
+				free_compressed(); return false;
+			}
+			int compressed_size = LZ4_compress_default(column.data, compressed[i], (int) column.length, bound);
+			if (compressed_size > 0 && (size_t) compressed_size < column.length) {
+				record.codec = (uint8_t) trajectory_codec::LZ4;
+				record.stored_length = (uint64_t) compressed_size;
+			} else {
+				core::free(compressed[i]);
+				compressed[i] = NULL;
+			}
+		}
+#endif
+		offset = align_snapshot_offset(offset + record.stored_length);
+	}
+
+	trajectory_chunk_header header;
+	header.magic = trajectory_chunk_header::MAGIC;
+	header.length = offset;
+	header.agent_row_count = chunk.agent_row_count;
+	header.event_count = chunk.event_count;
+	header.step_count = chunk.step_count;
+	header.column_count = column_count;
+	uint64_t position = sizeof(header) + sizeof(records);
+	if (fwrite(&header, sizeof(header), 1, out) != 1
+	 || fwrite(records, sizeof(trajectory_column_record), column_count, out) != column_count)
+	{
+		free_compressed(); return false;
+	}
+	for (unsigned int i = 0; i < column_count; i++) {
+		const char* data = (compressed[i] != NULL) ? compressed[i] : chunk.columns[i].data;
+		if (!write_snapshot_padding(out, records[i].offset - position)
+		 || fwrite(data, 1, (size_t) records[i].stored_length, out) != records[i].stored_length)
+		{
+			free_compressed(); return false;
+		}
+		position = records[i].offset + records[i].stored_length;
+	}
+	free_compressed();
+	return write_snapshot_padding(out, offset - position) && fflush(out) == 0;
+}
+
+/**
+ * Records the history of a simulator into a trajectory file (see
+ * `trajectory_header`). The simulator appends the state of its agents after
+ * every step, along with their actions and the item events, to the columns
+ * of the current chunk. Once the chunk contains `chunk_steps` steps, it is
+ * passed to a background thread, which compresses and writes it, so the
+ * simulator is only blocked while the columns are appended. At most
+ * `MAX_PENDING_CHUNKS` chunks are buffered at a time; further chunks wait
+ * for the background thread to catch up.
+ */
+struct trajectory_recorder
+{
+	static constexpr unsigned int MAX_PENDING_CHUNKS = 4;
+
+	/* the value of `ACTION_DIRECTION` for an agent that did not act in a step */
+	static constexpr uint8_t NO_ACTION = UINT8_MAX;
+
+	/* the action of an agent in the current step, which is recorded before the step clears it */
+	struct action {
+		uint8_t direction;
+		int32_t dx, dy;
+	};
+
+	FILE* out;
+	unsigned int item_type_count;
+	unsigned int chunk_steps;
+	bool compress;
+
+	/* the chunk that is being recorded, which is only accessed by the simulator */
+	trajectory_chunk* current;
+
+	/* the actions of the agents in the current step, indexed by agent ID (see `set_action`) */
+	array<action> actions;
+
+	/* the positions of the patches fixed since the last step, whose items are recorded as created (see `map::fixed_patch_log`) */
+	array<position> fixed_patches;
+
+	/* the chunks that were not yet written, in order, protected by `lock` */
+	array<trajectory_chunk*> pending;
+
+	/* set if a chunk could not be written, after which the remaining chunks are discarded, protected by `lock` */
+	bool failed;
+
+	bool running;
+	std::thread writer;
+	std::mutex lock;
+	std::condition_variable pending_cv;
+	std::condition_variable done_cv;
+
+	/* resets the actions of the `agent_count` agents of the simulator before they are set for the current step */
+	inline bool clear_actions(size_t agent_count) {
+		if (!actions.ensure_capacity(agent_count)) return false;
+		for (size_t i = 0; i < agent_count; i++)
+			actions[i] = {NO_ACTION, 0, 0};
+		actions.length = agent_count;
+		return true;
+	}
+
+	inline void set_action(uint64_t agent_id, uint8_t direction, const position& displacement) {
+		actions[(size_t) agent_id] = {direction, (int32_t) displacement.x, (int32_t) displacement.y};
+	}
+
+	/**
+	 * Appends the state of the agent with ID `agent_id` after the current
+	 * step, along with its action (see `set_action`). `collected_items` has
+	 * an element for each item type.
+	 */
+	inline bool record_agent(uint64_t agent_id, const position& location,
+			uint8_t direction, const unsigned int* collected_items)
+	{
+		trajectory_chunk& chunk = *current;
+		const action& a = actions[(size_t) agent_id];
+		if (!chunk[trajectory_column::AGENT_ID].append(agent_id)
+		 || !chunk[trajectory_column::AGENT_X].append(location.x)
+		 || !chunk[trajectory_column::AGENT_Y].append(location.y)
+		 || !chunk[trajectory_column::AGENT_DIRECTION].append(direction)
+		 || !chunk[trajectory_column::ACTION_DIRECTION].append(a.direction)
+		 || !chunk[trajectory_column::ACTION_DX].append(a.dx)
+		 || !chunk[trajectory_column::ACTION_DY].append(a.dy))
+			return false;
+		for (unsigned int i = 0; i < item_type_count; i++)
+			if (!chunk[trajectory_column::COLLECTED_ITEMS].append((uint32_t) collected_items[i])) return false;
+		chunk.agent_row_count++;
+		return true;
+	}
+
+	inline bool record_event(uint64_t time, trajectory_event kind,
+			unsigned int item_type, const position& location)
+	{
+		trajectory_chunk& chunk = *current;
+		if (!chunk[trajectory_column::EVENT_TIME].append(time)
+		 || !chunk[trajectory_column::EVENT_KIND].append((uint8_t) kind)
+		 || !chunk[trajectory_column::EVENT_ITEM_TYPE].append((uint32_t) item_type)
+		 || !chunk[trajectory_column::EVENT_X].append(location.x)
+		 || !chunk[trajectory_column::EVENT_Y].append(location.y))
+			return false;
+		chunk.event_count++;
+		return true;
+	}
+
+	/**
+	 * Completes the step at `time`, for which `agent_count` agents were
+	 * recorded, and passes the current chunk to the writer thread if it is
+	 * full.
+	 */
+	inline bool end_step(uint64_t time, uint32_t agent_count) {
+		trajectory_chunk& chunk = *current;
+		if (!chunk[trajectory_column::STEP_TIME].append(time)
+		 || !chunk[trajectory_column::STEP_AGENT_COUNT].append(agent_count))
+			return false;
+		chunk.step_count++;
+		if (chunk.step_count >= chunk_steps)
+			return submit_chunk();
+		return true;
+	}
+
+	/**
+	 * Passes the current chunk, if it is not empty, to the writer thread and
+	 * starts a new one. If too many chunks are buffered, this function waits
+	 * for the writer thread to catch up.
+	 */
+	bool submit_chunk() {
+		if (current->empty()) return true;
+		trajectory_chunk* next = (trajectory_chunk*) malloc(sizeof(trajectory_chunk));
+		if (next == NULL || !init(*next)) {
+			fprintf(stderr, "trajectory_recorder.submit_chunk ERROR: Insufficient memory for the next chunk.\n");
+			if (next != NULL) core::free(next);
+			return false;
+		}
+
+		std::unique_lock<std::mutex> lck(lock);
+		while (pending.length >= MAX_PENDING_CHUNKS)
+			done_cv.wait(lck);
+		if (!pending.add(current)) {
+			fprintf(stderr, "trajectory_recorder.submit_chunk ERROR: Out of memory.\n");
+			core::free(*next); core::free(next);
+			return false;
+		}
+		current = next;
+		pending_cv.notify_one();
+		return true;
+	}
+
+	/* writes the remaining chunks, including the one being recorded, and closes the file */
+	static inline void free(trajectory_recorder& recorder) {
+		recorder.submit_chunk();
+		recorder.free_helper();
+		core::free(recorder.actions);
+		core::free(recorder.fixed_patches);
+		core::free(recorder.pending);
+		recorder.writer.~thread();
+		recorder.lock.~mutex();
+		recorder.pending_cv.~condition_variable();
+		recorder.done_cv.~condition_variable();
+	}
+
+private:
+	void run_writer() {
+		while (true) {
+			std::unique_lock<std::mutex> lck(lock);
+			while (running && pending.length == 0)
+				pending_cv.wait(lck);
+			if (pending.length == 0) return;
+			trajectory_chunk* next = pending[0];
+			bool discard = failed;
+			lck.unlock();
+
+			bool success = discard || write_trajectory_chunk(*next, out, compress);
+			if (!success)
+				fprintf(stderr, "trajectory_recorder.run_writer ERROR: Unable to write a chunk of the trajectory.\n");
+			core::free(*next);
+			core::free(next);
+
+			lck.lock();
+			if (!success) failed = true;
+			for (unsigned int i = 1; i < pending.length; i++)
+				pending[i - 1] = pending[i];
+			pending.length--;
+			done_cv.notify_all();
+		}
+	}
+
+	inline void free_helper() {
+		/* the writer thread writes the pending chunks before it returns */
+		std::unique_lock<std::mutex> lck(lock);
+		running = false;
+		pending_cv.notify_all();
+		lck.unlock();
+		if (writer.joinable()) {
+			try {
+				writer.join();
+			} catch (...) { }
+		}
+		for (trajectory_chunk* chunk : pending) {
+			core::free(*chunk);
+			core::free(chunk);
+		}
+		core::free(*current);
+		core::free(current);
+		fclose(out);
+	}
+
+	friend inline bool init(trajectory_recorder&, const char*, unsigned int, unsigned int, bool);
+};
+
+/**
+ * Initializes the trajectory recorder `recorder`, which creates (or
+ * overwrites) the trajectory file at `filepath`, writes its header, and
+ * starts the writer thread. Each chunk of the file contains `chunk_steps`
+ * steps, and its columns are compressed with LZ4 if `compress` is `true`
+ * and the library was built with `NEL_USE_LZ4`.
+ *
+ * \returns `true` if successful; `false` otherwise.
+ */
+inline bool init(trajectory_recorder& recorder, const char* filepath,
+		unsigned int item_type_count, unsigned int chunk_steps, bool compress)
+{
+	if (chunk_steps == 0) {
+		fprintf(stderr, "init ERROR: The number of steps in each trajectory chunk must be positive.\n");
+		return false;
+	}
+	recorder.out = open_file(filepath, "wb");
+	if (recorder.out == NULL) {
+		fprintf(stderr, "init ERROR: Unable to open '%s' for writing. ", filepath);
+		perror(""); return false;
+	}
+
+	trajectory_header header;
+	header.magic = trajectory_header::MAGIC;
+	header.item_type_count = item_type_count;
+	header.column_count = (uint32_t) trajectory_column::COUNT;
+	if (fwrite(&header, sizeof(header), 1, recorder.out) != 1 || fflush(recorder.out) != 0) {
+		fprintf(stderr, "init ERROR: Unable to write the header of '%s'.\n", filepath);
+		fclose(recorder.out); return false;
+	}
+
+	recorder.current = (trajectory_chunk*) malloc(sizeof(trajectory_chunk));
+	if (recorder.current == NULL || !init(*recorder.current)) {
+		fprintf(stderr, "init ERROR: Insufficient memory for trajectory_recorder.current.\n");
+		if (recorder.current != NULL) free(recorder.current);
+		fclose(recorder.out); return false;
+	} else if (!array_init(recorder.actions, 16)) {
+		free(*recorder.current); free(recorder.current);
+		fclose(recorder.out); return false;
+	} else if (!array_init(recorder.fixed_patches, 16)) {
+		free(*recorder.current); free(recorder.current);
+		free(recorder.actions); fclose(recorder.out); return false;
+	} else if (!array_init(recorder.pending, trajectory_recorder::MAX_PENDING_CHUNKS + 1)) {
+		free(*recorder.current); free(recorder.current);
+		free(recorder.actions); free(recorder.fixed_patches);
+		fclose(recorder.out); return false;
+	}
+	recorder.item_type_count = item_type_count;
+	recorder.chunk_steps = chunk_steps;
+	recorder.compress = compress;
+	recorder.failed = false;
+	recorder.running = true;
+	new (&recorder.lock) std::mutex();
+	new (&recorder.pending_cv) std::condition_variable();
+	new (&recorder.done_cv) std::condition_variable();
+	try {
+		new (&recorder.writer) std::thread(&trajectory_recorder::run_writer, &recorder);
+	} catch (...) {
+		fprintf(stderr, "init ERROR: Unable to start the trajectory writer thread.\n");
+		free(*recorder.current); free(recorder.current);
+		free(recorder.actions); free(recorder.fixed_patches);
+		free(recorder.pending); recorder.lock.~mutex();
+		recorder.pending_cv.~condition_variable();
+		recorder.done_cv.~condition_variable();
+		fclose(recorder.out); return false;
+	}
+	return true;
+}
+
+} /* namespace nel */
+
+#endif /* NEL_TRAJECTORY_H_ */